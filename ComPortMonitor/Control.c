@@ -7,8 +7,14 @@
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, CreateControlDevice)
 #pragma alloc_text (PAGE, ControlDevice_EvtDeviceFileCreate)
+#pragma alloc_text (PAGE, ControlDevice_EvtFileCleanup)
 #pragma alloc_text (PAGE, ControlDevice_EvtFileClose)
+#pragma alloc_text (PAGE, ControlDevice_MapEventsRing)
+#pragma alloc_text (PAGE, ControlDevice_UnmapEventsRing)
+#pragma alloc_text (PAGE, ControlDevice_ProcessNotify)
 #pragma alloc_text (PAGE, ControlDevice_EvtIoDeviceControl)
+#pragma alloc_text (PAGE, ControlDevice_SetFilter)
+#pragma alloc_text (PAGE, ControlDevice_SetPatterns)
 #endif
 
 WDFDEVICE ControlDevice = NULL;
@@ -34,35 +40,38 @@ NTSTATUS CreateControlDevice(_In_ WDFDRIVER Driver, _In_ PWDFDEVICE_INIT DeviceI
 		WdfDeviceInitSetExclusive(DeviceInit, FALSE);
 		status = WdfDeviceInitAssignName(DeviceInit, &ntDeviceName);
 		if (!NT_SUCCESS(status))
-			return status;
+			__leave;
 
 		WdfDeviceInitAssignSDDLString(DeviceInit, &SDDL_DEVOBJ_SYS_ALL_ADM_RWX_WORLD_RWX_RES_RWX);
 		if (!NT_SUCCESS(status))
-			return status;
+			__leave;
 
-		WDF_FILEOBJECT_CONFIG_INIT(&config, ControlDevice_EvtDeviceFileCreate, ControlDevice_EvtFileClose, WDF_NO_EVENT_CALLBACK);
+		WDF_FILEOBJECT_CONFIG_INIT(&config, ControlDevice_EvtDeviceFileCreate, ControlDevice_EvtFileClose, ControlDevice_EvtFileCleanup);
 		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attr, FILEOBJECT_CONTEXT);
+		attr.EvtDestroyCallback = ControlDevice_EvtFileDestroy;
 		WdfDeviceInitSetFileObjectConfig(DeviceInit, &config, &attr);
 
+		//
+		// The capture ring is mapped into the address space of the caller,
+		// so that request has to be handled in the caller's context.
+		//
+		WdfDeviceInitSetIoInCallerContextCallback(DeviceInit, ControlDevice_EvtIoInCallerContext);
+
 		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attr, CONTROL_DEVICE_CONTEXT);
 		attr.EvtCleanupCallback = ControlDevice_EvtCleanupCallback;
 		status = WdfDeviceCreate(&DeviceInit, &attr, &control);
 		if (!NT_SUCCESS(status))
-			return status;
+			__leave;
 
 		context = ControlDeviceGetContext(control);
 
-		WDF_OBJECT_ATTRIBUTES_INIT(&attr);
-		attr.ParentObject = control;
-		status = WdfCollectionCreate(&attr, &context->FileObjects);
-		if (!NT_SUCCESS(status))
-			return status;
+		InitializeListHead(&context->FileObjects);
 
 		WDF_OBJECT_ATTRIBUTES_INIT(&attr);
-		attr.ParentObject = context->FileObjects;
+		attr.ParentObject = control;
 		status = WdfWaitLockCreate(&attr, &context->FileObjectsLock);
 		if (!NT_SUCCESS(status))
-			return status;
+			__leave;
 
 		//
 		// Create a device interface so that applications can find and talk
@@ -74,21 +83,20 @@ NTSTATUS CreateControlDevice(_In_ WDFDRIVER Driver, _In_ PWDFDEVICE_INIT DeviceI
 
 		status = WdfDeviceCreateSymbolicLink(control, &symbolicLinkName);
 		if (!NT_SUCCESS(status))
-			return status;
+			__leave;
 
 		WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(&queueConfig, WdfIoQueueDispatchSequential);
 		queueConfig.EvtIoRead = ControlDevice_EvtIoRead;
 		queueConfig.EvtIoDeviceControl = ControlDevice_EvtIoDeviceControl;
 		status = WdfIoQueueCreate(control, &queueConfig, WDF_NO_OBJECT_ATTRIBUTES, &queue);
 		if (!NT_SUCCESS(status))
-			return status;
+			__leave;
 
 		ControlDevice = control;
 
 		WdfControlFinishInitializing(control);
 
 		KdPrint(("ControlDevice Create end\n"));
-		return status;
 	}
 	__finally
 	{
@@ -101,6 +109,7 @@ NTSTATUS CreateControlDevice(_In_ WDFDRIVER Driver, _In_ PWDFDEVICE_INIT DeviceI
 				WdfObjectDelete(control);
 		}
 	}
+	return status;
 }
 
 VOID ControlDevice_EvtDeviceFileCreate(
@@ -110,38 +119,86 @@ VOID ControlDevice_EvtDeviceFileCreate(
 )
 {
 	WDF_IO_QUEUE_CONFIG qconfig;
+	WDF_TIMER_CONFIG timerConfig;
 	PFILEOBJECT_CONTEXT fileContext;
 	PCONTROL_DEVICE_CONTEXT controlContext;
 	WDF_OBJECT_ATTRIBUTES attr;
+	PHYSICAL_ADDRESS lowAddress, highAddress, skipBytes;
+	PVOID buffer;
 	NTSTATUS status = STATUS_CANCELLED;
 
 	KdBreakPoint();
 	__try
 	{
 		fileContext = FileObjectGetContext(FileObject);
+		fileContext->DevicePosition = NOT_FOUND;
+		InitializeListHead(&fileContext->Link);
 
 		WDF_OBJECT_ATTRIBUTES_INIT(&attr);
 		attr.ParentObject = FileObject;
 		WDF_IO_QUEUE_CONFIG_INIT(&qconfig, WdfIoQueueDispatchManual);
 		status = WdfIoQueueCreate(Device, &qconfig, &attr, &fileContext->Queue);
 		if (!NT_SUCCESS(status))
-			return;
+			__leave;
 
 		WDF_OBJECT_ATTRIBUTES_INIT(&attr);
 		attr.ParentObject = FileObject;
-		status = WdfCollectionCreate(&attr, &fileContext->Events);
+		WDF_IO_QUEUE_CONFIG_INIT(&qconfig, WdfIoQueueDispatchManual);
+		status = WdfIoQueueCreate(Device, &qconfig, &attr, &fileContext->DirectQueue);
 		if (!NT_SUCCESS(status))
-			return;
+			__leave;
+
+		//
+		// The deadline of the direct buffers takes EventsLock, the timer
+		// runs at passive level.
+		//
+		WDF_TIMER_CONFIG_INIT(&timerConfig, ControlDevice_EvtDirectTimer);
+		WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+		attr.ParentObject = FileObject;
+		attr.ExecutionLevel = WdfExecutionLevelPassive;
+		status = WdfTimerCreate(&timerConfig, &attr, &fileContext->DirectTimer);
+		if (!NT_SUCCESS(status))
+			__leave;
+
+		//
+		// The ring may be mapped into the client, IOCTL_CPM_MAP_EVENTS_RING,
+		// so it gets zeroed pages of its own rather than pool memory that
+		// shares its pages with other allocations.
+		//
+		lowAddress.QuadPart = 0;
+		highAddress.QuadPart = -1;
+		skipBytes.QuadPart = 0;
+		fileContext->EventsMdl = MmAllocatePagesForMdlEx(lowAddress, highAddress, skipBytes, EVENTS_RING_SIZE, MmCached,
+			MM_ALLOCATE_FULLY_REQUIRED);
+		if (fileContext->EventsMdl == NULL)
+		{
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			__leave;
+		}
+		buffer = MmGetSystemAddressForMdlSafe(fileContext->EventsMdl, NormalPagePriority | MdlMappingNoExecute);
+		if (buffer == NULL)
+		{
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			__leave;
+		}
+
+		RingInitialize(&fileContext->Events, buffer, EVENTS_RING_SIZE);
 
 		WDF_OBJECT_ATTRIBUTES_INIT(&attr);
-		attr.ParentObject = fileContext->Events;
+		attr.ParentObject = FileObject;
 		status = WdfWaitLockCreate(&attr, &fileContext->EventsLock);
 		if (!NT_SUCCESS(status))
-			return;
+			__leave;
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+		attr.ParentObject = FileObject;
+		status = WdfCollectionCreate(&attr, &fileContext->Attachments);
+		if (!NT_SUCCESS(status))
+			__leave;
 
 		controlContext = ControlDeviceGetContext(ControlDevice);
 		WdfWaitLockAcquire(controlContext->FileObjectsLock, NULL);
-		status = WdfCollectionAdd(controlContext->FileObjects, FileObject);
+		InsertTailList(&controlContext->FileObjects, &fileContext->Link);
 		WdfWaitLockRelease(controlContext->FileObjectsLock);
 	}
 	__finally
@@ -150,41 +207,57 @@ VOID ControlDevice_EvtDeviceFileCreate(
 	}
 }
 
+VOID ControlDevice_EvtFileCleanup(
+	_In_ WDFFILEOBJECT FileObject
+)
+{
+	PFILEOBJECT_CONTEXT context;
+
+	PAGED_CODE();
+
+	context = FileObjectGetContext(FileObject);
+
+	//
+	// The parked reads and direct buffers are the client's, they are done
+	// with before the handle goes away, not when the file object does.
+	//
+	if (context->Queue != NULL)
+		WdfIoQueuePurgeSynchronously(context->Queue);
+	if (context->DirectQueue != NULL)
+		WdfIoQueuePurgeSynchronously(context->DirectQueue);
+	if (context->EventsLock == NULL)
+		return;
+
+	WdfWaitLockAcquire(context->EventsLock, NULL);
+	ControlDevice_UnmapEventsRing(context);
+	WdfWaitLockRelease(context->EventsLock);
+}
+
 VOID ControlDevice_EvtFileClose(
 	_In_ WDFFILEOBJECT FileObject
 )
 {
 	PCONTROL_DEVICE_CONTEXT controlContext;
-	PDEVICE_CONTEXT devContext;
-	ULONG i, j, ci, cj;
+	PFILEOBJECT_CONTEXT fileContext;
+	WDFDEVICE device;
 
 	controlContext = ControlDeviceGetContext(ControlDevice);
+	fileContext = FileObjectGetContext(FileObject);
 
 	WdfWaitLockAcquire(FilteringDevicesLock, NULL);
 	__try
 	{
-		ci = WdfCollectionGetCount(FilteringDevices);
-		for (i = 0; i < ci; i++)
+		//
+		// Only the devices this file object is attached to are visited.
+		//
+		while (fileContext->Attachments != NULL &&
+			(device = WdfCollectionGetFirstItem(fileContext->Attachments)) != NULL)
 		{
-			devContext = DeviceGetContext(WdfCollectionGetItem(FilteringDevices, i));
-			WdfWaitLockAcquire(devContext->ListenersLock, NULL);
-			__try
-			{
-				cj = WdfCollectionGetCount(devContext->Listeners);
-				for (j = 0; j < cj; j++)
-					if (WdfCollectionGetItem(devContext->Listeners, j) == FileObject)
-					{
-						WdfCollectionRemove(devContext->Listeners, FileObject);
-						break;
-					}
-			}
-			__finally
-			{
-				WdfWaitLockRelease(devContext->ListenersLock);
-			}
+			ComPortMonitor_UpdateListeners(device, FileObject, NULL);
+			WdfCollectionRemove(fileContext->Attachments, device);
 		}
 		WdfWaitLockAcquire(controlContext->FileObjectsLock, NULL);
-		WdfCollectionRemove(controlContext->FileObjects, FileObject);
+		RemoveEntryList(&fileContext->Link);
 		WdfWaitLockRelease(controlContext->FileObjectsLock);
 	}
 	__finally
@@ -193,6 +266,30 @@ VOID ControlDevice_EvtFileClose(
 	}
 }
 
+VOID ControlDevice_EvtFileDestroy(_In_ WDFOBJECT Object)
+/*++
+
+Routine Description:
+
+    Frees the pages of the capture ring once the file object is gone and
+    no device delivers to it any more. The user view was removed on
+    cleanup.
+
+--*/
+{
+	PFILEOBJECT_CONTEXT context;
+
+	context = FileObjectGetContext(Object);
+	if (context->EventsMdl == NULL)
+		return;
+
+	if (context->Events.Header != NULL)
+		MmUnmapLockedPages(context->Events.Header, context->EventsMdl);
+	MmFreePagesFromMdl(context->EventsMdl);
+	ExFreePool(context->EventsMdl);
+	context->EventsMdl = NULL;
+}
+
 VOID ControlDevice_EvtIoRead(
 	_In_ WDFQUEUE   Queue,
 	_In_ WDFREQUEST Request,
@@ -202,7 +299,7 @@ VOID ControlDevice_EvtIoRead(
 	NTSTATUS status = STATUS_UNSUCCESSFUL;
 	PFILEOBJECT_CONTEXT context;
 	PMEMORY_CONTEXT memContext;
-	WDFMEMORY data, output;
+	WDFMEMORY output;
 	ULONG written = 0;
 	UNREFERENCED_PARAMETER(Queue);
 	UNREFERENCED_PARAMETER(Length);
@@ -212,24 +309,27 @@ VOID ControlDevice_EvtIoRead(
 		WdfWaitLockAcquire(context->EventsLock, NULL);
 		__try
 		{
-			data = WdfCollectionGetFirstItem(context->Events);
-			if (data == NULL)
+			if (context->EventsUserMapping != NULL)
+			{
+				status = STATUS_INVALID_DEVICE_STATE;
+				__leave;
+			}
+			memContext = RingPeek(&context->Events, NULL);
+			if (memContext == NULL)
 			{
 				status = STATUS_NO_MORE_ENTRIES;
-				return;
+				__leave;
 			}
-			memContext = MemoryGetContext(data);
 			status = WdfRequestRetrieveOutputMemory(Request, &output);
 			if (!NT_SUCCESS(status))
-				return;
+				__leave;
 
-			status = WdfMemoryCopyFromBuffer(output, 0, WdfMemoryGetBuffer(data, NULL), memContext->BufferSize);
+			status = WdfMemoryCopyFromBuffer(output, 0, memContext + 1, memContext->BufferSize);
 			if (!NT_SUCCESS(status))
-				return;
+				__leave;
 
 			written = memContext->BufferSize;
-			WdfCollectionRemove(context->Events, data);
-			WdfObjectDelete(data);
+			RingConsume(&context->Events);
 		}
 		__finally
 		{
@@ -260,11 +360,17 @@ VOID ControlDevice_EvtIoDeviceControl(
 	ANSI_STRING ansi;
 	PMEMORY_CONTEXT memContext;
 	PCONTROL_DEVICE_CONTEXT ctrlContext;
-	PDEVICE_CONTEXT devContext;
-	DEVICE_INFO devinfo;
+	WDFDEVICE device;
+	PDEVICE_INFO info;
 	PDEVICE_OBJECT nextlower;
-	ULONG written = 0, i, ci, j, cj;
-	BOOLEAN flag = FALSE;
+	LARGE_INTEGER frequency;
+	ATTACH_INFO attach;
+	PCOALESCE_CONFIG coalesce;
+	PRECORDER_CONFIG recorder;
+	PULONG deviceNumber;
+	PBATCH_HEADER batch;
+	size_t length;
+	ULONG written = 0;
 	UNREFERENCED_PARAMETER(Queue);
 	UNREFERENCED_PARAMETER(OutputBufferLength);
 
@@ -280,29 +386,22 @@ VOID ControlDevice_EvtIoDeviceControl(
 		__try
 		{
 			if (IoControlCode == IOCTL_CPM_GET_DEVICE_FIRST)
-				context->DevicePosition = WdfCollectionGetFirstItem(FilteringDevices);
+				device = ComPortMonitor_NextDevice(NOT_FOUND);
 			else
+				device = ComPortMonitor_NextDevice(context->DevicePosition);
+			if (device != NULL)
 			{
-				if (context->DevicePosition != NULL)
-				{
-					intvar = WdfCollectionFindItemIndex(FilteringDevices, context->DevicePosition);
-					if (intvar != NOT_FOUND)
-						context->DevicePosition = WdfCollectionGetItem(FilteringDevices, intvar + 1);
-				}
-				else
-					context->DevicePosition = WdfCollectionGetFirstItem(FilteringDevices);
-			}
-			if (context->DevicePosition != NULL)
-			{
-				status = WdfRequestRetrieveOutputMemory(Request, &output);
+				context->DevicePosition = DeviceGetContext(device)->Number;
+				status = WdfRequestRetrieveOutputBuffer(Request, offsetof(DEVICE_INFO, DeviceName) + 1, &info, &length);
 				if (!NT_SUCCESS(status))
 					break;
 
-				devinfo.DeviceNumber = DeviceGetContext(context->DevicePosition)->Number;
-				nextlower = WdfDeviceWdmGetAttachedDevice(context->DevicePosition);
-				status = WdfMemoryCreate(WDF_NO_OBJECT_ATTRIBUTES, PagedPool, 0, DEVICEINFO_BUFSIZE, &buffer, &buf_ptr);
+				nextlower = WdfDeviceWdmGetAttachedDevice(device);
+				status = WdfMemoryCreateFromLookaside(NameLookaside, &buffer);
 				if (!NT_SUCCESS(status))
 					break;
+
+				buf_ptr = WdfMemoryGetBuffer(buffer, NULL);
 				__try
 				{
 					do
@@ -319,23 +418,19 @@ VOID ControlDevice_EvtIoDeviceControl(
 					if (!NT_SUCCESS(status))
 						break;
 
-					status = RtlUnicodeStringToAnsiString(&ansi, &buf_ptr->Name, TRUE);
+					//
+					// The name is converted straight into the output, a
+					// conversion that allocates would hit the pool per call.
+					//
+					ansi.Buffer = &info->DeviceName;
+					ansi.Length = 0;
+					ansi.MaximumLength = (USHORT)min(length - offsetof(DEVICE_INFO, DeviceName), MAXUSHORT);
+					status = RtlUnicodeStringToAnsiString(&ansi, &buf_ptr->Name, FALSE);
 					if (!NT_SUCCESS(status))
 						break;
-					__try
-					{
-						status = WdfMemoryCopyFromBuffer(output, 0, &devinfo, sizeof(devinfo));
-						if (NT_SUCCESS(status))
-						{
-							status = WdfMemoryCopyFromBuffer(output, offsetof(DEVICE_INFO, DeviceName), ansi.Buffer, ansi.Length + 1);
-							if (NT_SUCCESS(status))
-								written = offsetof(DEVICE_INFO, DeviceName) + ansi.Length + 1;
-						}
-					}
-					__finally
-					{
-						RtlFreeAnsiString(&ansi);
-					}
+
+					info->DeviceNumber = context->DevicePosition;
+					written = offsetof(DEVICE_INFO, DeviceName) + ansi.Length + 1;
 				}
 				__finally
 				{
@@ -352,7 +447,15 @@ VOID ControlDevice_EvtIoDeviceControl(
 		break;
 	case IOCTL_CPM_ATTACH_TO_DEVICE:
 	case IOCTL_CPM_DETACH_FROM_DEVICE:
-		if (InputBufferLength < sizeof(intvar))
+	case IOCTL_CPM_ATTACH_EX:
+		//
+		// The plain attach takes just the device number and asks for the
+		// records clients of it have always received.
+		//
+		attach.EventMask = ATTACH_EVENTS_BASELINE;
+		attach.SnapLength = ATTACH_SNAP_ALL;
+		intvar = IoControlCode == IOCTL_CPM_ATTACH_EX ? sizeof(attach) : sizeof(attach.DeviceNumber);
+		if (InputBufferLength < intvar)
 		{
 			status = STATUS_INFO_LENGTH_MISMATCH;
 			break;
@@ -361,97 +464,1253 @@ VOID ControlDevice_EvtIoDeviceControl(
 		if (!NT_SUCCESS(status))
 			break;
 
-		status = WdfMemoryCopyToBuffer(input, 0, &intvar, sizeof(intvar));
+		status = WdfMemoryCopyToBuffer(input, 0, &attach, intvar);
 		if (!NT_SUCCESS(status))
 			break;
 
-		status = STATUS_DEVICE_DOES_NOT_EXIST;
-
 		WdfWaitLockAcquire(FilteringDevicesLock, NULL);
-		ci = WdfCollectionGetCount(FilteringDevices);
-		for (i = 0; i < ci; i++)
+		__try
 		{
-			devContext = DeviceGetContext(WdfCollectionGetItem(FilteringDevices, i));
-			if (devContext->Number == intvar)
+			device = ComPortMonitor_FindDevice(attach.DeviceNumber);
+			if (device == NULL)
 			{
-				WdfWaitLockAcquire(devContext->ListenersLock, NULL);
-				__try
-				{
-					cj = WdfCollectionGetCount(devContext->Listeners);
-					for (j = 0; j < cj; j++)
-						if (WdfCollectionGetItem(devContext->Listeners, j) == fileObject)
-						{
-							if (IoControlCode == IOCTL_CPM_DETACH_FROM_DEVICE)
-							{
-								WdfCollectionRemoveItem(devContext->Listeners, j);
-								status = STATUS_SUCCESS;
-							}
-							else
-								flag = TRUE;
-							break;
-						}
-					if (IoControlCode == IOCTL_CPM_ATTACH_TO_DEVICE)
-					{
-						if (flag)
-							status = STATUS_ALREADY_REGISTERED;
-						else
-							status = WdfCollectionAdd(devContext->Listeners, fileObject);
-						break;
-					}
-				}
-				__finally
+				status = STATUS_DEVICE_DOES_NOT_EXIST;
+				break;
+			}
+			if (IoControlCode != IOCTL_CPM_DETACH_FROM_DEVICE)
+			{
+				status = ComPortMonitor_UpdateListeners(device, fileObject, &attach);
+				if (NT_SUCCESS(status))
 				{
-					WdfWaitLockRelease(devContext->ListenersLock);
+					status = WdfCollectionAdd(context->Attachments, device);
+					if (!NT_SUCCESS(status))
+						ComPortMonitor_UpdateListeners(device, fileObject, NULL);
 				}
 			}
+			else
+			{
+				status = ComPortMonitor_UpdateListeners(device, fileObject, NULL);
+				if (NT_SUCCESS(status))
+					WdfCollectionRemove(context->Attachments, device);
+			}
+		}
+		__finally
+		{
+			WdfWaitLockRelease(FilteringDevicesLock);
 		}
-		WdfWaitLockRelease(FilteringDevicesLock);
 		break;
 	case IOCTL_CPM_GET_DATA_INFO:
 		WdfWaitLockAcquire(context->EventsLock, NULL);
 		__try
 		{
-			buffer = WdfCollectionGetFirstItem(context->Events);
-			if (buffer != NULL)
+			//
+			// A mapped ring has a single consumer, the client. The request
+			// only waits for records committed since the last one
+			// completed, the driver does not look into the ring.
+			//
+			if (context->EventsUserMapping != NULL)
 			{
-				memContext = MemoryGetContext(buffer);
-				status = WdfRequestRetrieveOutputMemory(Request, &output);
-				if (NT_SUCCESS(status))
+				if (context->SignaledHead != context->Events.Head)
 				{
-					status = WdfMemoryCopyFromBuffer(output, 0, memContext, sizeof(*memContext));
-					written = sizeof(*memContext);
-					if (memContext->BufferSize == 0)
-					{
-						WdfCollectionRemove(context->Events, buffer);
-						WdfObjectDelete(buffer);
-					}
+					context->SignaledHead = context->Events.Head;
+					status = STATUS_SUCCESS;
+				}
+				else
+				{
+					status = WdfRequestForwardToIoQueue(Request, context->Queue);
+					if (NT_SUCCESS(status))
+						status = STATUS_PENDING;
 				}
+				__leave;
 			}
+
+			memContext = RingPeek(&context->Events, NULL);
+			if (memContext != NULL)
+				status = ControlDevice_GetDataInfo(context, Request, memContext, &written);
 			else
 			{
 				status = WdfRequestForwardToIoQueue(Request, context->Queue);
-				return;
+				if (NT_SUCCESS(status))
+					status = STATUS_PENDING;
+			}
+		}
+		__finally
+		{
+			WdfWaitLockRelease(context->EventsLock);
+		}
+		break;
+	case IOCTL_CPM_READ_BATCH:
+	case IOCTL_CPM_READ_PCAPNG:
+		WdfWaitLockAcquire(context->EventsLock, NULL);
+		__try
+		{
+			if (context->EventsUserMapping != NULL)
+				status = STATUS_INVALID_DEVICE_STATE;
+			else if (RingIsEmpty(&context->Events))
+			{
+				status = WdfRequestForwardToIoQueue(Request, context->Queue);
+				if (NT_SUCCESS(status))
+					status = STATUS_PENDING;
+			}
+			else if (IoControlCode == IOCTL_CPM_READ_PCAPNG)
+			{
+				//
+				// With only records pcapng has no block for in the ring
+				// the request waits for data.
+				//
+				status = ControlDevice_ReadPcapng(context, Request, &written);
+				if (NT_SUCCESS(status) && written == 0)
+				{
+					status = WdfRequestForwardToIoQueue(Request, context->Queue);
+					if (NT_SUCCESS(status))
+						status = STATUS_PENDING;
+				}
 			}
+			else
+				status = ControlDevice_ReadBatch(context, Request, &written);
 		}
 		__finally
 		{
 			WdfWaitLockRelease(context->EventsLock);
 		}
 		break;
+	case IOCTL_CPM_READ_DIRECT:
+		status = ControlDevice_ReadDirect(context, Request, &written);
+		break;
+	case IOCTL_CPM_GET_TIMESTAMP_FREQUENCY:
+		status = WdfRequestRetrieveOutputMemory(Request, &output);
+		if (!NT_SUCCESS(status))
+			break;
+
+		KeQueryPerformanceCounter(&frequency);
+		status = WdfMemoryCopyFromBuffer(output, 0, &frequency, sizeof(frequency));
+		if (NT_SUCCESS(status))
+			written = sizeof(frequency);
+		break;
+	case IOCTL_CPM_GET_STATS:
+		status = ControlDevice_GetStats(Request, &written);
+		break;
+	case IOCTL_CPM_SET_FILTER:
+		status = ControlDevice_SetFilter(fileObject, Request, InputBufferLength);
+		break;
+	case IOCTL_CPM_SET_QUOTA:
+		status = ControlDevice_SetQuota(context, Request);
+		break;
+	case IOCTL_CPM_SET_PATTERNS:
+		status = ControlDevice_SetPatterns(Request, InputBufferLength);
+		break;
+	case IOCTL_CPM_SET_COALESCING:
+		status = WdfRequestRetrieveInputBuffer(Request, sizeof(*coalesce), &coalesce, NULL);
+		if (!NT_SUCCESS(status))
+			break;
+
+		WdfWaitLockAcquire(FilteringDevicesLock, NULL);
+		device = ComPortMonitor_FindDevice(coalesce->DeviceNumber);
+		if (device != NULL)
+			ComPortMonitor_SetCoalescing(device, coalesce);
+		else
+			status = STATUS_DEVICE_DOES_NOT_EXIST;
+		WdfWaitLockRelease(FilteringDevicesLock);
+		break;
+	case IOCTL_CPM_SET_RECORDER:
+		status = WdfRequestRetrieveInputBuffer(Request, sizeof(*recorder), &recorder, NULL);
+		if (!NT_SUCCESS(status))
+			break;
+
+		WdfWaitLockAcquire(FilteringDevicesLock, NULL);
+		device = ComPortMonitor_FindDevice(recorder->DeviceNumber);
+		if (device != NULL)
+			status = ComPortMonitor_SetRecorder(device, recorder);
+		else
+			status = STATUS_DEVICE_DOES_NOT_EXIST;
+		WdfWaitLockRelease(FilteringDevicesLock);
+		break;
+	case IOCTL_CPM_DUMP_RECORDER:
+		status = WdfRequestRetrieveInputBuffer(Request, sizeof(*deviceNumber), &deviceNumber, NULL);
+		if (!NT_SUCCESS(status))
+			break;
+
+		//
+		// METHOD_BUFFERED shares one system buffer between input and
+		// output, take the device number before the output overwrites it.
+		//
+		intvar = *deviceNumber;
+		status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*batch), &batch, &length);
+		if (!NT_SUCCESS(status))
+			break;
+
+		WdfWaitLockAcquire(FilteringDevicesLock, NULL);
+		device = ComPortMonitor_FindDevice(intvar);
+		if (device != NULL)
+			status = ComPortMonitor_DumpRecorder(device, batch, length, &written);
+		else
+			status = STATUS_DEVICE_DOES_NOT_EXIST;
+		WdfWaitLockRelease(FilteringDevicesLock);
+		break;
 	default:
 		status = STATUS_NOT_SUPPORTED;
 	}
-	WdfRequestCompleteWithInformation(Request, status, written);
+
+	//
+	// A request parked in a queue of the file object is completed when
+	// records arrive.
+	//
+	if (status != STATUS_PENDING)
+		WdfRequestCompleteWithInformation(Request, status, written);
+}
+
+NTSTATUS ControlDevice_ReadBatch(_In_ PFILEOBJECT_CONTEXT Context, _In_ WDFREQUEST Request, _Out_ PULONG Written)
+/*++
+
+Routine Description:
+
+    Moves as many records as fit from the capture ring into the output
+    buffer of IOCTL_CPM_READ_BATCH. Called with EventsLock held.
+
+--*/
+{
+	NTSTATUS status;
+	PBATCH_HEADER batch;
+	PMEMORY_CONTEXT memContext;
+	PUCHAR record;
+	size_t length;
+	ULONG offset, size;
+
+	*Written = 0;
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*batch), &batch, &length);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	if (length > MAXULONG)
+		length = MAXULONG;
+
+	batch->RecordCount = 0;
+	offset = sizeof(*batch);
+	while ((memContext = RingPeek(&Context->Events, NULL)) != NULL)
+	{
+		size = BATCH_RECORD_SIZE(memContext->BufferSize);
+		if (size > length - offset)
+		{
+			if (batch->RecordCount != 0)
+				break;
+
+			batch->BytesUsed = sizeof(*batch) + size;
+			*Written = sizeof(*batch);
+			return STATUS_BUFFER_OVERFLOW;
+		}
+
+		record = (PUCHAR)batch + offset;
+		memcpy(record, memContext, sizeof(*memContext) + memContext->BufferSize);
+		RtlZeroMemory(record + sizeof(*memContext) + memContext->BufferSize, size - sizeof(*memContext) - memContext->BufferSize);
+		offset += size;
+		batch->RecordCount++;
+		RingConsume(&Context->Events);
+	}
+	batch->BytesUsed = offset;
+	*Written = offset;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS ControlDevice_SetFilter(_In_ WDFFILEOBJECT FileObject, _In_ WDFREQUEST Request, _In_ size_t InputBufferLength)
+/*++
+
+Routine Description:
+
+    Sets the capture filter program of the file object for
+    IOCTL_CPM_SET_FILTER, an empty input buffer removes it. The program is
+    verified here once, so running it needs no checks but the loads.
+
+--*/
+{
+	NTSTATUS status;
+	PFILEOBJECT_CONTEXT context;
+	WDF_OBJECT_ATTRIBUTES attr;
+	WDFMEMORY memory = NULL, old;
+	PFILTER_INSN program = NULL, input;
+	WDFDEVICE device;
+	ULONG i;
+
+	PAGED_CODE();
+
+	if (InputBufferLength != 0)
+	{
+		if (InputBufferLength % sizeof(FILTER_INSN) != 0 || InputBufferLength > FILTER_MAX_INSNS * sizeof(FILTER_INSN))
+			return STATUS_INVALID_PARAMETER;
+
+		status = WdfRequestRetrieveInputBuffer(Request, InputBufferLength, &input, NULL);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+		attr.ParentObject = FileObject;
+		status = WdfMemoryCreate(&attr, NonPagedPool, 0, InputBufferLength, &memory, &program);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		//
+		// Verify the copy, the input buffer may still change under us.
+		//
+		RtlCopyMemory(program, input, InputBufferLength);
+		if (!FilterVerify(program, (ULONG)(InputBufferLength / sizeof(FILTER_INSN))))
+		{
+			WdfObjectDelete(memory);
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
+
+	context = FileObjectGetContext(FileObject);
+	WdfWaitLockAcquire(context->EventsLock, NULL);
+	old = context->FilterMemory;
+	context->FilterMemory = memory;
+	context->Filter = program;
+	WdfWaitLockRelease(context->EventsLock);
+
+	//
+	// The program may look past the snap length, the devices the file
+	// object is attached to capture whole payloads while it is set.
+	//
+	WdfWaitLockAcquire(FilteringDevicesLock, NULL);
+	for (i = 0; context->Attachments != NULL && i < WdfCollectionGetCount(context->Attachments); i++)
+	{
+		device = WdfCollectionGetItem(context->Attachments, i);
+		ComPortMonitor_RefreshCapture(device);
+	}
+	WdfWaitLockRelease(FilteringDevicesLock);
+
+	//
+	// The notify path runs the program with EventsLock held, so the old
+	// one is no longer in use.
+	//
+	if (old != NULL)
+		WdfObjectDelete(old);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS ControlDevice_SetPatterns(_In_ WDFREQUEST Request, _In_ size_t InputBufferLength)
+/*++
+
+Routine Description:
+
+    Compiles the patterns of IOCTL_CPM_SET_PATTERNS and hands them to all
+    filtered ports, an empty input buffer removes them. Each device takes
+    the new patterns with its DrainLock held and starts matching afresh,
+    once all have, nothing runs the old ones any more.
+
+--*/
+{
+	NTSTATUS status;
+	WDFMEMORY memory = NULL, old;
+	PMATCH_AUTOMATON automaton = NULL;
+	PDEVICE_CONTEXT devContext;
+	PLIST_ENTRY entry;
+	PVOID input, buffer;
+	ULONG size;
+
+	PAGED_CODE();
+
+	if (InputBufferLength != 0)
+	{
+		if (InputBufferLength > MAXULONG)
+			return STATUS_INVALID_PARAMETER;
+
+		status = WdfRequestRetrieveInputBuffer(Request, InputBufferLength, &input, NULL);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		size = MatchSize(input, (ULONG)InputBufferLength);
+		if (size == 0 || size > MATCH_MAX_SIZE)
+			return STATUS_INVALID_PARAMETER;
+
+		status = WdfMemoryCreate(WDF_NO_OBJECT_ATTRIBUTES, NonPagedPool, 0, size, &memory, &buffer);
+		if (!NT_SUCCESS(status))
+			return status;
+
+		automaton = MatchCompile(buffer, size, input, (ULONG)InputBufferLength);
+		if (automaton == NULL)
+		{
+			WdfObjectDelete(memory);
+			return STATUS_INVALID_PARAMETER;
+		}
+	}
+
+	WdfWaitLockAcquire(FilteringDevicesLock, NULL);
+	old = PatternsMemory;
+	PatternsMemory = memory;
+	Patterns = automaton;
+	for (entry = FilteringDevices.Flink; entry != &FilteringDevices; entry = entry->Flink)
+	{
+		devContext = CONTAINING_RECORD(entry, DEVICE_CONTEXT, Link);
+		WdfWaitLockAcquire(devContext->DrainLock, NULL);
+		devContext->Patterns = automaton;
+		RtlZeroMemory(devContext->MatchState, sizeof(devContext->MatchState));
+		RtlZeroMemory(devContext->MatchOffset, sizeof(devContext->MatchOffset));
+		WdfWaitLockRelease(devContext->DrainLock);
+	}
+	WdfWaitLockRelease(FilteringDevicesLock);
+
+	if (old != NULL)
+		WdfObjectDelete(old);
+	return STATUS_SUCCESS;
 }
 
-ULONG WdfCollectionFindItemIndex(WDFCOLLECTION Collection, WDFOBJECT Item)
+NTSTATUS ControlDevice_GetStats(_In_ WDFREQUEST Request, _Out_ PULONG Written)
+/*++
+
+Routine Description:
+
+    Returns the counters of all filtered ports for IOCTL_CPM_GET_STATS.
+    Only FilteringDevicesListLock is held, which keeps the devices alive
+    without waiting for attaches and detaches in progress, the listener
+    and capture locks are left alone.
+
+--*/
 {
-	ULONG index, count;
-	count = WdfCollectionGetCount(Collection);
-	for (index = 0; index < count; index++)
-		if (WdfCollectionGetItem(Collection, index) == Item)
-			return index;
-	return NOT_FOUND;
+	NTSTATUS status;
+	PSTATS_HEADER stats;
+	PPORT_STATS port;
+	PLIST_ENTRY entry;
+	size_t length;
+	ULONG count;
+
+	*Written = 0;
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*stats), &stats, &length);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	WdfWaitLockAcquire(FilteringDevicesListLock, NULL);
+	__try
+	{
+		count = 0;
+		for (entry = FilteringDevices.Flink; entry != &FilteringDevices; entry = entry->Flink)
+			count++;
+
+		stats->PortCount = count;
+		stats->BytesUsed = sizeof(*stats) + count * sizeof(*port);
+		if (stats->BytesUsed > length)
+		{
+			*Written = sizeof(*stats);
+			status = STATUS_BUFFER_OVERFLOW;
+			__leave;
+		}
+
+		port = (PPORT_STATS)(stats + 1);
+		for (entry = FilteringDevices.Flink; entry != &FilteringDevices; entry = entry->Flink)
+			ComPortMonitor_GetStats(WdfObjectContextGetObject(CONTAINING_RECORD(entry, DEVICE_CONTEXT, Link)), port++);
+
+		*Written = stats->BytesUsed;
+	}
+	__finally
+	{
+		WdfWaitLockRelease(FilteringDevicesListLock);
+	}
+	return status;
+}
+
+NTSTATUS ControlDevice_ReadPcapng(_In_ PFILEOBJECT_CONTEXT Context, _In_ WDFREQUEST Request, _Out_ PULONG Written)
+/*++
+
+Routine Description:
+
+    Moves as many read and write records as fit from the capture ring
+    into the output buffer of IOCTL_CPM_READ_PCAPNG, as pcapng enhanced
+    packet blocks. Other records are skipped, the losses reported by loss
+    records go to the drop count of the next packet. A record too long
+    for an empty buffer is cut to fit. Called with EventsLock held.
+
+--*/
+{
+	NTSTATUS status;
+	PUCHAR buffer;
+	PMEMORY_CONTEXT memContext;
+	LARGE_INTEGER frequency;
+	size_t length;
+	ULONG offset = 0, size;
+
+	*Written = 0;
+	status = WdfRequestRetrieveOutputBuffer(Request, PCAPNG_PACKET_OVERHEAD, &buffer, &length);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	if (length > MAXULONG)
+		length = MAXULONG;
+
+	KeQueryPerformanceCounter(&frequency);
+	while ((memContext = RingPeek(&Context->Events, NULL)) != NULL)
+	{
+		if (memContext->DeviceNumber == LOSS_RECORD_DEVICE && memContext->MajorFunctionCode == LOSS_RECORD_FUNCTION)
+			Context->PcapngDrops += ((PLOSS_INFO)(memContext + 1))->Records;
+		else if (memContext->MajorFunctionCode == IRP_MJ_READ || memContext->MajorFunctionCode == IRP_MJ_WRITE)
+		{
+			if (offset != 0 && PCAPNG_PACKET_SIZE(memContext->BufferSize) > length - offset)
+				break;
+
+			size = PcapngPacket(buffer + offset, (ULONG)length - offset, memContext, memContext + 1,
+				PcapngTimestamp(memContext->Timestamp, frequency.QuadPart), Context->PcapngDrops);
+			if (size == 0)
+				break;
+
+			offset += size;
+			Context->PcapngDrops = 0;
+		}
+		RingConsume(&Context->Events);
+	}
+	*Written = offset;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS ControlDevice_GetDataInfo(_In_ PFILEOBJECT_CONTEXT Context, _In_ WDFREQUEST Request, _In_ PMEMORY_CONTEXT MemContext, _Out_ PULONG Written)
+/*++
+
+Routine Description:
+
+    Returns the header of the oldest record for IOCTL_CPM_GET_DATA_INFO,
+    truncated to the output buffer so that clients built against an older
+    MEMORY_CONTEXT get the layout they expect. Called with EventsLock held.
+
+--*/
+{
+	NTSTATUS status;
+	PVOID buffer;
+	size_t length;
+
+	*Written = 0;
+	status = WdfRequestRetrieveOutputBuffer(Request, MEMORY_CONTEXT_VERSION_1_SIZE, &buffer, &length);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	if (length > sizeof(*MemContext))
+		length = sizeof(*MemContext);
+
+	memcpy(buffer, MemContext, length);
+	*Written = (ULONG)length;
+	if (MemContext->BufferSize == 0 && Context->EventsUserMapping == NULL)
+		RingConsume(&Context->Events);
+	return STATUS_SUCCESS;
+}
+
+VOID ControlDevice_CompletePendingRequest(_In_ PFILEOBJECT_CONTEXT Context)
+/*++
+
+Routine Description:
+
+    Completes the request waiting in the file object's queue for new
+    records, if there is one, or else moves the records to the pending
+    direct buffers. While the ring is mapped the request only learns that
+    there are new records. Called with EventsLock held after a record was
+    committed to the capture ring.
+
+--*/
+{
+	NTSTATUS status;
+	WDFREQUEST request;
+	WDF_REQUEST_PARAMETERS params;
+	PMEMORY_CONTEXT memContext;
+	ULONG written = 0;
+
+	if (Context->EventsUserMapping != NULL)
+	{
+		if (Context->SignaledHead != Context->Events.Head &&
+			NT_SUCCESS(WdfIoQueueRetrieveNextRequest(Context->Queue, &request)))
+		{
+			Context->SignaledHead = Context->Events.Head;
+			WdfRequestCompleteWithInformation(request, STATUS_SUCCESS, 0);
+		}
+		return;
+	}
+
+	memContext = RingPeek(&Context->Events, NULL);
+	if (memContext == NULL)
+		return;
+
+	status = WdfIoQueueRetrieveNextRequest(Context->Queue, &request);
+	if (!NT_SUCCESS(status))
+	{
+		ControlDevice_DrainToDirect(Context);
+		return;
+	}
+
+	WDF_REQUEST_PARAMETERS_INIT(&params);
+	WdfRequestGetParameters(request, &params);
+	if (params.Parameters.DeviceIoControl.IoControlCode == IOCTL_CPM_READ_BATCH)
+		status = ControlDevice_ReadBatch(Context, request, &written);
+	else if (params.Parameters.DeviceIoControl.IoControlCode == IOCTL_CPM_READ_PCAPNG)
+	{
+		//
+		// A pcapng reader is not woken up for records it gets no block
+		// for, it goes back to the head of the queue.
+		//
+		status = ControlDevice_ReadPcapng(Context, request, &written);
+		if (NT_SUCCESS(status) && written == 0 && NT_SUCCESS(WdfRequestRequeue(request)))
+			return;
+	}
+	else
+		status = ControlDevice_GetDataInfo(Context, request, memContext, &written);
+	WdfRequestCompleteWithInformation(request, status, written);
+}
+
+NTSTATUS ControlDevice_SetQuota(_In_ PFILEOBJECT_CONTEXT Context, _In_ WDFREQUEST Request)
+/*++
+
+Routine Description:
+
+    Sets the budget of the capture ring for IOCTL_CPM_SET_QUOTA. Setting
+    it again resumes a capture stopped by QUOTA_POLICY_STOP.
+
+--*/
+{
+	NTSTATUS status;
+	PEVENTS_QUOTA quota;
+
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(*quota), &quota, NULL);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	if (quota->Policy < QUOTA_POLICY_DROP_NEWEST || quota->Policy > QUOTA_POLICY_STOP)
+		return STATUS_INVALID_PARAMETER;
+
+	WdfWaitLockAcquire(Context->EventsLock, NULL);
+	__try
+	{
+		if (quota->Policy == QUOTA_POLICY_DROP_OLDEST && Context->EventsUserMapping != NULL)
+		{
+			status = STATUS_INVALID_DEVICE_STATE;
+			__leave;
+		}
+
+		Context->Quota = *quota;
+		Context->Stopped = FALSE;
+	}
+	__finally
+	{
+		WdfWaitLockRelease(Context->EventsLock);
+	}
+	return status;
+}
+
+PMEMORY_CONTEXT ControlDevice_ReserveEvent(_In_ PFILEOBJECT_CONTEXT Context, _In_ ULONG BufferSize)
+/*++
+
+Routine Description:
+
+    Reserves a record with BufferSize bytes of payload in the capture ring
+    of the file object, within its quota. A pending loss record goes in
+    first, so the client sees the loss where it happened. Called with
+    EventsLock held, the caller fills the record and commits it.
+
+Return Value:
+
+    Pointer to the record, NULL if the record is lost. The loss is
+    counted here.
+
+--*/
+{
+	PMEMORY_CONTEXT memContext;
+	ULONG posted = 0, records;
+
+	for (;;)
+	{
+		//
+		// A loss record that found no room is posted again after the
+		// next drop.
+		//
+		if (!Context->Stopped && ControlDevice_WithinQuota(Context, BufferSize, Context->Loss.Records != 0))
+		{
+			if (Context->Loss.Records != 0 && ControlDevice_PostLoss(Context))
+				posted++;
+			if (Context->Loss.Records == 0)
+			{
+				memContext = RingReserve(&Context->Events, sizeof(*memContext) + BufferSize);
+				if (memContext != NULL)
+					return memContext;
+			}
+		}
+
+		//
+		// Once only the loss records posted here are left, dropping them
+		// would only make room for posting them again.
+		//
+		RingUsed(&Context->Events, &records);
+		if (posted != 0 && records <= posted)
+			break;
+		if (Context->Quota.Policy != QUOTA_POLICY_DROP_OLDEST || !ControlDevice_DropOldest(Context))
+			break;
+	}
+
+	//
+	// Without a quota the loss is only counted in the totals, clients that
+	// never asked for loss records do not get them.
+	//
+	if (Context->Quota.Policy != 0)
+	{
+		Context->Loss.Records++;
+		Context->Loss.Bytes += BufferSize;
+	}
+	Context->Loss.TotalRecords++;
+	Context->Loss.TotalBytes += BufferSize;
+	if (Context->Quota.Policy == QUOTA_POLICY_STOP && !Context->Stopped)
+	{
+		Context->Stopped = TRUE;
+		ControlDevice_PostLoss(Context);
+	}
+	return NULL;
+}
+
+BOOLEAN ControlDevice_WithinQuota(_In_ PFILEOBJECT_CONTEXT Context, _In_ ULONG BufferSize, _In_ BOOLEAN Loss)
+/*++
+
+Routine Description:
+
+    Checks that a record with BufferSize bytes of payload, preceded by a
+    loss record if Loss is set, fits into the quota of the file object
+    and into its ring. The padding the ring puts in front of a record
+    that does not fit before the end of its buffer counts against the
+    quota as well, so a loss record that passes here is never left
+    without room for the record after it.
+
+--*/
+{
+	ULONG used, records, size = 0;
+
+	used = RingUsed(&Context->Events, &records);
+	if (Loss)
+	{
+		records++;
+		size = RingReserveSize(&Context->Events, 0, sizeof(MEMORY_CONTEXT) + sizeof(LOSS_INFO));
+	}
+	if (Context->Quota.MaxRecords != 0 && records >= Context->Quota.MaxRecords)
+		return FALSE;
+
+	size += RingReserveSize(&Context->Events, size, sizeof(MEMORY_CONTEXT) + BufferSize);
+	if (Context->Quota.MaxBytes != 0 && (used >= Context->Quota.MaxBytes || size > Context->Quota.MaxBytes - used))
+		return FALSE;
+	if (used >= Context->Events.Capacity || size > Context->Events.Capacity - used)
+		return FALSE;
+	return TRUE;
+}
+
+BOOLEAN ControlDevice_DropOldest(_In_ PFILEOBJECT_CONTEXT Context)
+/*++
+
+Routine Description:
+
+    Makes room for a new record by dropping the oldest one. The counts of
+    a dropped loss record are carried over to the next one.
+
+Return Value:
+
+    FALSE if the ring is empty.
+
+--*/
+{
+	PMEMORY_CONTEXT memContext;
+	PLOSS_INFO loss;
+
+	memContext = RingPeek(&Context->Events, NULL);
+	if (memContext == NULL)
+		return FALSE;
+
+	if (memContext->DeviceNumber == LOSS_RECORD_DEVICE && memContext->MajorFunctionCode == LOSS_RECORD_FUNCTION)
+	{
+		loss = (PLOSS_INFO)(memContext + 1);
+		Context->Loss.Records += loss->Records;
+		Context->Loss.Bytes += loss->Bytes;
+	}
+	else
+	{
+		Context->Loss.Records++;
+		Context->Loss.Bytes += memContext->BufferSize;
+		Context->Loss.TotalRecords++;
+		Context->Loss.TotalBytes += memContext->BufferSize;
+	}
+	RingConsume(&Context->Events);
+	return TRUE;
+}
+
+BOOLEAN ControlDevice_PostLoss(_In_ PFILEOBJECT_CONTEXT Context)
+/*++
+
+Routine Description:
+
+    Appends a loss record with the counts accumulated since the previous
+    one, if there is room for it.
+
+Return Value:
+
+    FALSE if the ring is full, the counts are kept for the next try.
+
+--*/
+{
+	PMEMORY_CONTEXT memContext;
+	PLOSS_INFO loss;
+
+	memContext = RingReserve(&Context->Events, sizeof(*memContext) + sizeof(*loss));
+	if (memContext == NULL)
+		return FALSE;
+
+	RtlZeroMemory(memContext, sizeof(*memContext));
+	memContext->DeviceNumber = LOSS_RECORD_DEVICE;
+	memContext->BufferSize = sizeof(*loss);
+	memContext->MajorFunctionCode = LOSS_RECORD_FUNCTION;
+	memContext->HeaderSize = sizeof(*memContext);
+	memContext->Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+	memContext->LastTimestamp = memContext->Timestamp;
+	loss = (PLOSS_INFO)(memContext + 1);
+	*loss = Context->Loss;
+	loss->Flags = Context->Stopped ? LOSS_FLAG_STOPPED : 0;
+	loss->Reserved = 0;
+	RingCommit(&Context->Events);
+
+	Context->Loss.Records = 0;
+	Context->Loss.Bytes = 0;
+	ControlDevice_CompletePendingRequest(Context);
+	return TRUE;
+}
+
+NTSTATUS ControlDevice_ReadDirect(_In_ PFILEOBJECT_CONTEXT Context, _In_ WDFREQUEST Request, _Out_ PULONG Written)
+/*++
+
+Routine Description:
+
+    Handles IOCTL_CPM_READ_DIRECT. Records already in the capture ring
+    are returned at once, otherwise the request joins DirectQueue where
+    ComPortMonitor_EvtNotifyListeners fills it.
+
+Return Value:
+
+    STATUS_PENDING if the request was queued, the caller completes it
+    with any other status.
+
+--*/
+{
+	NTSTATUS status;
+	WDF_OBJECT_ATTRIBUTES attr;
+	PREAD_DIRECT_CONFIG config;
+	PDIRECT_REQUEST_CONTEXT direct;
+	PBATCH_HEADER batch;
+	size_t length;
+
+	*Written = 0;
+	status = WdfRequestRetrieveInputBuffer(Request, sizeof(*config), &config, NULL);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*batch), &batch, &length);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attr, DIRECT_REQUEST_CONTEXT);
+	status = WdfObjectAllocateContext(Request, &attr, &direct);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	direct->Batch = batch;
+	direct->Length = length > MAXULONG ? MAXULONG : (ULONG)length;
+	direct->Latency = config->Latency;
+	direct->BytesUsed = sizeof(*batch);
+	direct->RecordCount = 0;
+
+	WdfWaitLockAcquire(Context->EventsLock, NULL);
+	__try
+	{
+		if (Context->EventsUserMapping != NULL)
+		{
+			status = STATUS_INVALID_DEVICE_STATE;
+			__leave;
+		}
+		if (!RingIsEmpty(&Context->Events))
+		{
+			status = ControlDevice_ReadBatch(Context, Request, Written);
+			__leave;
+		}
+
+		status = WdfRequestForwardToIoQueue(Request, Context->DirectQueue);
+		if (NT_SUCCESS(status))
+			status = STATUS_PENDING;
+	}
+	__finally
+	{
+		WdfWaitLockRelease(Context->EventsLock);
+	}
+	return status;
+}
+
+PMEMORY_CONTEXT ControlDevice_ReserveDirect(_In_ PFILEOBJECT_CONTEXT Context, _In_ ULONG BufferSize, _Out_ WDFREQUEST *Request)
+/*++
+
+Routine Description:
+
+    Reserves a record with BufferSize bytes of payload in the oldest
+    pending direct buffer, bypassing the capture ring. Records waiting in
+    the ring and pending loss counts go first, so the record is refused
+    until the ring has drained. A mapped ring keeps every record. Called
+    with EventsLock held, the caller fills the record and commits it with
+    ControlDevice_CommitDirect.
+
+Return Value:
+
+    Pointer to the record in the locked buffer, NULL if the record has
+    to take the ring.
+
+--*/
+{
+	*Request = NULL;
+	if (Context->EventsUserMapping != NULL || Context->Stopped || Context->Loss.Records != 0 || !RingIsEmpty(&Context->Events))
+		return NULL;
+
+	return ControlDevice_NextDirect(Context, BufferSize, Request);
+}
+
+PMEMORY_CONTEXT ControlDevice_NextDirect(_In_ PFILEOBJECT_CONTEXT Context, _In_ ULONG BufferSize, _Out_ WDFREQUEST *Request)
+/*++
+
+Routine Description:
+
+    Takes the oldest pending direct buffer with room for a record with
+    BufferSize bytes of payload. Buffers without room are completed on
+    the way. Called with EventsLock held.
+
+--*/
+{
+	WDFREQUEST request;
+	PDIRECT_REQUEST_CONTEXT direct;
+	ULONG size;
+
+	*Request = NULL;
+	size = BATCH_RECORD_SIZE(BufferSize);
+	while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(Context->DirectQueue, &request)))
+	{
+		direct = DirectRequestGetContext(request);
+		if (size <= direct->Length - direct->BytesUsed)
+		{
+			*Request = request;
+			return (PMEMORY_CONTEXT)((PUCHAR)direct->Batch + direct->BytesUsed);
+		}
+		ControlDevice_CompleteDirect(request, size);
+	}
+	return NULL;
+}
+
+VOID ControlDevice_CommitDirect(_In_ PFILEOBJECT_CONTEXT Context, _In_ WDFREQUEST Request, _In_ ULONG BufferSize)
+/*++
+
+Routine Description:
+
+    Accounts for the record written at the end of a direct buffer. The
+    first record starts the deadline of the buffer. The buffer completes
+    once another record could not fit, otherwise it goes back to the head
+    of DirectQueue, where it can still be cancelled. Called with
+    EventsLock held.
+
+--*/
+{
+	PDIRECT_REQUEST_CONTEXT direct;
+	PUCHAR record;
+	ULONG size;
+
+	direct = DirectRequestGetContext(Request);
+	size = BATCH_RECORD_SIZE(BufferSize);
+	record = (PUCHAR)direct->Batch + direct->BytesUsed;
+	RtlZeroMemory(record + sizeof(MEMORY_CONTEXT) + BufferSize, size - sizeof(MEMORY_CONTEXT) - BufferSize);
+	direct->BytesUsed += size;
+	if (direct->RecordCount++ == 0)
+		WdfTimerStart(Context->DirectTimer, WDF_REL_TIMEOUT_IN_US(direct->Latency));
+
+	if (direct->Length - direct->BytesUsed < BATCH_RECORD_SIZE(0) || !NT_SUCCESS(WdfRequestRequeue(Request)))
+		ControlDevice_CompleteDirect(Request, 0);
+}
+
+VOID ControlDevice_CompleteDirect(_In_ WDFREQUEST Request, _In_ ULONG Required)
+/*++
+
+Routine Description:
+
+    Completes a direct buffer with the records written into it, writing
+    its header. A buffer too small for even the record of Required bytes
+    completes as IOCTL_CPM_READ_BATCH does, with STATUS_BUFFER_OVERFLOW.
+
+--*/
+{
+	PDIRECT_REQUEST_CONTEXT direct;
+
+	direct = DirectRequestGetContext(Request);
+	direct->Batch->RecordCount = direct->RecordCount;
+	if (direct->RecordCount == 0 && Required != 0)
+	{
+		direct->Batch->BytesUsed = sizeof(BATCH_HEADER) + Required;
+		WdfRequestCompleteWithInformation(Request, STATUS_BUFFER_OVERFLOW, sizeof(BATCH_HEADER));
+	}
+	else
+	{
+		direct->Batch->BytesUsed = direct->BytesUsed;
+		WdfRequestCompleteWithInformation(Request, STATUS_SUCCESS, direct->BytesUsed);
+	}
+}
+
+VOID ControlDevice_DrainToDirect(_In_ PFILEOBJECT_CONTEXT Context)
+/*++
+
+Routine Description:
+
+    Moves the records of the capture ring to the pending direct buffers,
+    until either runs out. Records only wait in the ring while no buffer
+    was pending, so this is not the hot path. Called with EventsLock held.
+
+--*/
+{
+	PMEMORY_CONTEXT memContext, record;
+	WDFREQUEST request;
+	ULONG bufferSize;
+
+	if (Context->EventsUserMapping != NULL)
+		return;
+
+	while ((memContext = RingPeek(&Context->Events, NULL)) != NULL)
+	{
+		bufferSize = memContext->BufferSize;
+		record = ControlDevice_NextDirect(Context, bufferSize, &request);
+		if (record == NULL)
+			return;
+
+		memcpy(record, memContext, sizeof(*memContext) + bufferSize);
+		RingConsume(&Context->Events);
+		ControlDevice_CommitDirect(Context, request, bufferSize);
+	}
+}
+
+VOID ControlDevice_EvtDirectTimer(
+	_In_ WDFTIMER Timer
+)
+/*++
+
+Routine Description:
+
+    Completes the oldest direct buffer once its deadline has passed. The
+    buffer the timer was started for may have filled up in the meantime,
+    the next one is then completed early or left alone if empty.
+
+--*/
+{
+	PFILEOBJECT_CONTEXT context;
+	WDFREQUEST request;
+
+	context = FileObjectGetContext(WdfTimerGetParentObject(Timer));
+	WdfWaitLockAcquire(context->EventsLock, NULL);
+	if (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(context->DirectQueue, &request)))
+	{
+		if (DirectRequestGetContext(request)->RecordCount != 0 || !NT_SUCCESS(WdfRequestRequeue(request)))
+			ControlDevice_CompleteDirect(request, 0);
+	}
+	WdfWaitLockRelease(context->EventsLock);
+}
+
+VOID ControlDevice_EvtIoInCallerContext(
+	_In_ WDFDEVICE	Device,
+	_In_ WDFREQUEST	Request
+)
+{
+	NTSTATUS status;
+	WDF_REQUEST_PARAMETERS params;
+	ULONG written = 0;
+
+	WDF_REQUEST_PARAMETERS_INIT(&params);
+	WdfRequestGetParameters(Request, &params);
+	if (params.Type != WdfRequestTypeDeviceControl ||
+		params.Parameters.DeviceIoControl.IoControlCode != IOCTL_CPM_MAP_EVENTS_RING)
+	{
+		status = WdfDeviceEnqueueRequest(Device, Request);
+		if (!NT_SUCCESS(status))
+			WdfRequestComplete(Request, status);
+		return;
+	}
+
+	status = ControlDevice_MapEventsRing(Request, &written);
+	WdfRequestCompleteWithInformation(Request, status, written);
+}
+
+NTSTATUS ControlDevice_MapEventsRing(_In_ WDFREQUEST Request, _Out_ PULONG Written)
+/*++
+
+Routine Description:
+
+    Maps the capture ring of the file object into the calling process.
+    The client consumes records directly from the mapping by advancing
+    RING_HEADER::Tail, the driver keeps its own copy of the producer
+    state and never trusts the shared header.
+
+--*/
+{
+	NTSTATUS status;
+	PFILEOBJECT_CONTEXT context;
+	PEVENTS_RING_MAPPING mapping;
+	WDF_REQUEST_PARAMETERS params;
+	WDFREQUEST found, previous = NULL, request;
+	PVOID address;
+
+	PAGED_CODE();
+
+	*Written = 0;
+	if (WdfRequestGetRequestorMode(Request) != UserMode)
+		return STATUS_INVALID_DEVICE_REQUEST;
+
+	status = WdfRequestRetrieveOutputBuffer(Request, sizeof(*mapping), &mapping, NULL);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	context = FileObjectGetContext(WdfRequestGetFileObject(Request));
+	WdfWaitLockAcquire(context->EventsLock, NULL);
+	__try
+	{
+		if (context->EventsUserMapping != NULL)
+		{
+			status = STATUS_ALREADY_REGISTERED;
+			__leave;
+		}
+		if (context->Quota.Policy == QUOTA_POLICY_DROP_OLDEST)
+		{
+			status = STATUS_INVALID_DEVICE_STATE;
+			__leave;
+		}
+
+		//
+		// The view covers the whole pages of the ring, the bytes past its
+		// end are zeroed and belong to nothing else.
+		//
+		__try
+		{
+			address = MmMapLockedPagesSpecifyCache(context->EventsMdl, UserMode, MmCached, NULL, FALSE,
+				NormalPagePriority | MdlMappingNoExecute);
+		}
+		__except (EXCEPTION_EXECUTE_HANDLER)
+		{
+			address = NULL;
+		}
+		if (address == NULL)
+		{
+			status = STATUS_INSUFFICIENT_RESOURCES;
+			__leave;
+		}
+
+		context->SignaledHead = context->Events.Header->Tail;
+		context->EventsUserMapping = address;
+		context->EventsProcess = PsGetCurrentProcess();
+		ObReferenceObject(context->EventsProcess);
+
+		//
+		// Readers parked before the mapping would consume the ring behind
+		// the client's back, they are failed as new ones are.
+		//
+		for (;;)
+		{
+			WDF_REQUEST_PARAMETERS_INIT(&params);
+			status = WdfIoQueueFindRequest(context->Queue, previous, NULL, &params, &found);
+			if (previous != NULL)
+				WdfObjectDereference(previous);
+			previous = NULL;
+			if (!NT_SUCCESS(status))
+				break;
+
+			if (params.Parameters.DeviceIoControl.IoControlCode != IOCTL_CPM_READ_BATCH &&
+				params.Parameters.DeviceIoControl.IoControlCode != IOCTL_CPM_READ_PCAPNG)
+			{
+				previous = found;
+				continue;
+			}
+			status = WdfIoQueueRetrieveFoundRequest(context->Queue, found, &request);
+			WdfObjectDereference(found);
+			if (NT_SUCCESS(status))
+				WdfRequestComplete(request, STATUS_INVALID_DEVICE_STATE);
+		}
+		while (NT_SUCCESS(WdfIoQueueRetrieveNextRequest(context->DirectQueue, &request)))
+			ControlDevice_CompleteDirect(request, 0);
+
+		mapping->Address = (ULONG64)(ULONG_PTR)address;
+		mapping->Size = EVENTS_RING_SIZE;
+		mapping->Reserved = 0;
+		*Written = sizeof(*mapping);
+		status = STATUS_SUCCESS;
+	}
+	__finally
+	{
+		WdfWaitLockRelease(context->EventsLock);
+	}
+	return status;
+}
+
+VOID ControlDevice_UnmapEventsRing(_In_ PFILEOBJECT_CONTEXT Context)
+/*++
+
+Routine Description:
+
+    Removes the user view of the capture ring, if there is one, and takes
+    the ring back. What the client left in the shared header is not
+    trusted, the records it did not consume are discarded. Called with
+    EventsLock held.
+
+--*/
+{
+	KAPC_STATE apcState;
+
+	PAGED_CODE();
+
+	if (Context->EventsUserMapping == NULL)
+		return;
+
+	//
+	// The user view has to be removed in the process it was created in,
+	// the last handle may be closed from another one.
+	//
+	if (PsGetCurrentProcess() == Context->EventsProcess)
+		MmUnmapLockedPages(Context->EventsUserMapping, Context->EventsMdl);
+	else
+	{
+		KeStackAttachProcess(Context->EventsProcess, &apcState);
+		MmUnmapLockedPages(Context->EventsUserMapping, Context->EventsMdl);
+		KeUnstackDetachProcess(&apcState);
+	}
+	ObDereferenceObject(Context->EventsProcess);
+	Context->EventsProcess = NULL;
+	Context->EventsUserMapping = NULL;
+	RingDiscard(&Context->Events);
+}
+
+VOID ControlDevice_ProcessNotify(_In_ HANDLE ParentId, _In_ HANDLE ProcessId, _In_ BOOLEAN Create)
+/*++
+
+Routine Description:
+
+    Releases the ring mappings of a process that exits. A handle
+    duplicated into another process keeps the file object, and so the
+    mapping, alive past the process the view belongs to.
+
+--*/
+{
+	PCONTROL_DEVICE_CONTEXT controlContext;
+	PFILEOBJECT_CONTEXT context;
+	PLIST_ENTRY entry;
+
+	UNREFERENCED_PARAMETER(ParentId);
+
+	PAGED_CODE();
+
+	if (Create)
+		return;
+
+	WdfWaitLockAcquire(ControlDeviceLock, NULL);
+	if (ControlDevice != NULL)
+	{
+		controlContext = ControlDeviceGetContext(ControlDevice);
+		WdfWaitLockAcquire(controlContext->FileObjectsLock, NULL);
+		for (entry = controlContext->FileObjects.Flink; entry != &controlContext->FileObjects; entry = entry->Flink)
+		{
+			context = CONTAINING_RECORD(entry, FILEOBJECT_CONTEXT, Link);
+			WdfWaitLockAcquire(context->EventsLock, NULL);
+			if (context->EventsProcess != NULL && PsGetProcessId(context->EventsProcess) == ProcessId)
+				ControlDevice_UnmapEventsRing(context);
+			WdfWaitLockRelease(context->EventsLock);
+		}
+		WdfWaitLockRelease(controlContext->FileObjectsLock);
+	}
+	WdfWaitLockRelease(ControlDeviceLock);
 }
 
 VOID ControlDevice_EvtCleanupCallback(_In_ WDFOBJECT Object)
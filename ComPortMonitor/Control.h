@@ -3,6 +3,9 @@
 #include <ntdef.h>
 #include <wdfobject.h>
 #include <wdftypes.h>
+#include "Ring.h"
+#include "Filter.h"
+#include "Pcapng.h"
 
 EXTERN_C_START
 
@@ -12,7 +15,7 @@ EXTERN_C_START
 //
 typedef struct _CONTROL_DEVICE_CONTEXT
 {
-	WDFCOLLECTION FileObjects;
+	LIST_ENTRY FileObjects;
 	WDFWAITLOCK FileObjectsLock;
 
 } CONTROL_DEVICE_CONTEXT, *PCONTROL_DEVICE_CONTEXT;
@@ -27,24 +30,45 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(CONTROL_DEVICE_CONTEXT, ControlDeviceGetConte
 typedef struct _FILEOBJECT_CONTEXT
 {
 	WDFQUEUE Queue;
-	WDFCOLLECTION Events;
+	PMDL EventsMdl;
+	RING Events;
 	WDFWAITLOCK EventsLock;
-	WDFDEVICE DevicePosition;
+	PVOID EventsUserMapping;
+	PEPROCESS EventsProcess;
+	ULONG SignaledHead;
+	ULONG DevicePosition;
+	WDFCOLLECTION Attachments;
+	WDFMEMORY FilterMemory;
+	PFILTER_INSN Filter;
+	EVENTS_QUOTA Quota;
+	BOOLEAN Stopped;
+	LOSS_INFO Loss;
+	ULONG64 PcapngDrops;
+	WDFQUEUE DirectQueue;
+	WDFTIMER DirectTimer;
+	LIST_ENTRY Link;
 
 } FILEOBJECT_CONTEXT, *PFILEOBJECT_CONTEXT;
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(FILEOBJECT_CONTEXT, FileObjectGetContext)
 
-typedef struct _MEMORY_CONTEXT
+//
+// IOCTL_CPM_READ_DIRECT request waiting in DirectQueue. Batch is the
+// system address of the locked output buffer. The client can still
+// write to it, so what has been written so far is only counted here and
+// the header of the batch is written once, on completion.
+//
+typedef struct _DIRECT_REQUEST_CONTEXT
 {
-	ULONG DeviceNumber;
-	ULONG BufferSize;
-	BYTE MajorFunctionCode;
-	BYTE MinorFunctionCode;
-	ULONG OutputDataOffset;
-} MEMORY_CONTEXT, *PMEMORY_CONTEXT;
+	PBATCH_HEADER Batch;
+	ULONG Length;
+	ULONG Latency;
+	ULONG BytesUsed;
+	ULONG RecordCount;
 
-WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(MEMORY_CONTEXT, MemoryGetContext)
+} DIRECT_REQUEST_CONTEXT, *PDIRECT_REQUEST_CONTEXT;
+
+WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DIRECT_REQUEST_CONTEXT, DirectRequestGetContext)
 
 typedef struct _DEVICE_INFO
 {
@@ -58,6 +82,7 @@ WDFWAITLOCK ControlDeviceLock;
 #define NTDEVICE_NAME_STRING	L"\\Device\\ComPortMonitor"
 #define SYMBOLIC_NAME_STRING	L"\\DosDevices\\Global\\ComPortMonitor"
 #define DEVICEINFO_BUFSIZE 1024 + sizeof(DEVICE_INFO)
+#define EVENTS_RING_SIZE RING_BUFFER_SIZE(1024 * 1024)
 
 #define IOCTL_CPM_BASE 0x800
 #define IOCTL_CPM_GET_DEVICE_FIRST			CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 1, METHOD_BUFFERED, FILE_ANY_ACCESS)
@@ -66,6 +91,19 @@ WDFWAITLOCK ControlDeviceLock;
 #define IOCTL_CPM_DETACH_FROM_DEVICE		CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 4, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_CPM_GET_DATA_INFO				CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 5, METHOD_BUFFERED, FILE_ANY_ACCESS)
 #define IOCTL_CPM_GET_DEVICE_PROCESS_ID		CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 6, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CPM_MAP_EVENTS_RING			CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 7, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CPM_READ_BATCH				CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 8, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CPM_GET_TIMESTAMP_FREQUENCY	CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 9, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CPM_GET_STATS					CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 10, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CPM_SET_FILTER				CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 11, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CPM_ATTACH_EX					CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 12, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CPM_SET_QUOTA					CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 13, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CPM_SET_COALESCING			CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 14, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CPM_READ_PCAPNG				CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 15, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CPM_SET_PATTERNS				CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 16, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CPM_SET_RECORDER				CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 17, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CPM_DUMP_RECORDER				CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 18, METHOD_BUFFERED, FILE_ANY_ACCESS)
+#define IOCTL_CPM_READ_DIRECT				CTL_CODE(FILE_DEVICE_UNKNOWN, IOCTL_CPM_BASE + 19, METHOD_OUT_DIRECT, FILE_ANY_ACCESS)
 
 #define NOT_FOUND (ULONG)-1
 
@@ -75,11 +113,35 @@ WDFWAITLOCK ControlDeviceLock;
 NTSTATUS CreateControlDevice(_In_ WDFDRIVER Driver, _In_ PWDFDEVICE_INIT DeviceInit);
 
 EVT_WDF_DEVICE_FILE_CREATE ControlDevice_EvtDeviceFileCreate;
+EVT_WDF_FILE_CLEANUP ControlDevice_EvtFileCleanup;
 EVT_WDF_FILE_CLOSE ControlDevice_EvtFileClose;
+EVT_WDF_OBJECT_CONTEXT_DESTROY ControlDevice_EvtFileDestroy;
+EVT_WDF_IO_IN_CALLER_CONTEXT ControlDevice_EvtIoInCallerContext;
 EVT_WDF_IO_QUEUE_IO_READ ControlDevice_EvtIoRead;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL ControlDevice_EvtIoDeviceControl;
 EVT_WDF_OBJECT_CONTEXT_CLEANUP ControlDevice_EvtCleanupCallback;
-
-ULONG WdfCollectionFindItemIndex(WDFCOLLECTION Collection, WDFOBJECT Item);
+EVT_WDF_TIMER ControlDevice_EvtDirectTimer;
+
+NTSTATUS ControlDevice_MapEventsRing(_In_ WDFREQUEST Request, _Out_ PULONG Written);
+VOID ControlDevice_UnmapEventsRing(_In_ PFILEOBJECT_CONTEXT Context);
+VOID ControlDevice_ProcessNotify(_In_ HANDLE ParentId, _In_ HANDLE ProcessId, _In_ BOOLEAN Create);
+NTSTATUS ControlDevice_ReadBatch(_In_ PFILEOBJECT_CONTEXT Context, _In_ WDFREQUEST Request, _Out_ PULONG Written);
+NTSTATUS ControlDevice_ReadPcapng(_In_ PFILEOBJECT_CONTEXT Context, _In_ WDFREQUEST Request, _Out_ PULONG Written);
+NTSTATUS ControlDevice_SetFilter(_In_ WDFFILEOBJECT FileObject, _In_ WDFREQUEST Request, _In_ size_t InputBufferLength);
+NTSTATUS ControlDevice_SetPatterns(_In_ WDFREQUEST Request, _In_ size_t InputBufferLength);
+NTSTATUS ControlDevice_GetStats(_In_ WDFREQUEST Request, _Out_ PULONG Written);
+NTSTATUS ControlDevice_GetDataInfo(_In_ PFILEOBJECT_CONTEXT Context, _In_ WDFREQUEST Request, _In_ PMEMORY_CONTEXT MemContext, _Out_ PULONG Written);
+VOID ControlDevice_CompletePendingRequest(_In_ PFILEOBJECT_CONTEXT Context);
+NTSTATUS ControlDevice_SetQuota(_In_ PFILEOBJECT_CONTEXT Context, _In_ WDFREQUEST Request);
+PMEMORY_CONTEXT ControlDevice_ReserveEvent(_In_ PFILEOBJECT_CONTEXT Context, _In_ ULONG BufferSize);
+BOOLEAN ControlDevice_WithinQuota(_In_ PFILEOBJECT_CONTEXT Context, _In_ ULONG BufferSize, _In_ BOOLEAN Loss);
+BOOLEAN ControlDevice_DropOldest(_In_ PFILEOBJECT_CONTEXT Context);
+BOOLEAN ControlDevice_PostLoss(_In_ PFILEOBJECT_CONTEXT Context);
+NTSTATUS ControlDevice_ReadDirect(_In_ PFILEOBJECT_CONTEXT Context, _In_ WDFREQUEST Request, _Out_ PULONG Written);
+PMEMORY_CONTEXT ControlDevice_ReserveDirect(_In_ PFILEOBJECT_CONTEXT Context, _In_ ULONG BufferSize, _Out_ WDFREQUEST *Request);
+PMEMORY_CONTEXT ControlDevice_NextDirect(_In_ PFILEOBJECT_CONTEXT Context, _In_ ULONG BufferSize, _Out_ WDFREQUEST *Request);
+VOID ControlDevice_CommitDirect(_In_ PFILEOBJECT_CONTEXT Context, _In_ WDFREQUEST Request, _In_ ULONG BufferSize);
+VOID ControlDevice_CompleteDirect(_In_ WDFREQUEST Request, _In_ ULONG Required);
+VOID ControlDevice_DrainToDirect(_In_ PFILEOBJECT_CONTEXT Context);
 
 EXTERN_C_END
\ No newline at end of file
@@ -21,8 +21,52 @@ Environment:
 
 #ifdef ALLOC_PRAGMA
 #pragma alloc_text (PAGE, ComPortMonitorCreateDevice)
+#pragma alloc_text (PAGE, ComPortMonitor_UpdateListeners)
+#pragma alloc_text (PAGE, ComPortMonitor_RefreshCapture)
+#pragma alloc_text (PAGE, ComPortMonitor_SetRecorder)
+#pragma alloc_text (PAGE, ComPortMonitor_DumpRecorder)
 #endif
 
+static VOID ComPortMonitor_UpdateCapture(_In_ PDEVICE_CONTEXT DevContext, _In_opt_ PLISTENER_SET Listeners)
+/*++
+
+Routine Description:
+
+    Sets what the device has to capture. EventMask is the union of the
+    masks of the listeners, the data if any of them wants matches, which
+    are found in the data, and everything while the recorder records.
+    SnapLength is the longest snap length of the listeners. The payload
+    is kept whole while the recorder records, for matches and for a
+    listener with a filter, as the program may look past its snap length.
+    A frozen recorder takes nothing, the device drops back to what the
+    listeners want. Called with ListenersLock held.
+
+--*/
+{
+	ULONG i, mask = 0, snap = 0;
+
+	for (i = 0; Listeners != NULL && i < Listeners->Count; i++)
+	{
+		mask |= Listeners->Items[i].EventMask;
+		if (FileObjectGetContext(Listeners->Items[i].FileObject)->Filter != NULL)
+			snap = ATTACH_SNAP_ALL;
+		else if (Listeners->Items[i].SnapLength > snap)
+			snap = Listeners->Items[i].SnapLength;
+	}
+	if (mask & ATTACH_EVENT_MATCH)
+	{
+		mask |= ATTACH_EVENT_READ | ATTACH_EVENT_WRITE;
+		snap = ATTACH_SNAP_ALL;
+	}
+	if (DevContext->RecorderMemory != NULL && !DevContext->Recorder.Frozen)
+	{
+		mask = ATTACH_EVENTS_ALL;
+		snap = ATTACH_SNAP_ALL;
+	}
+	InterlockedExchange(&DevContext->SnapLength, (LONG)snap);
+	InterlockedExchange(&DevContext->EventMask, (LONG)mask);
+}
+
 
 NTSTATUS
 ComPortMonitorCreateDevice(
@@ -77,60 +121,388 @@ Return Value:
 	//
 	deviceContext = DeviceGetContext(device);
 	deviceContext->Number = NextDeviceNumber++;
+	deviceContext->ModemStatus = MODEM_STATUS_UNKNOWN;
+	InitializeListHead(&deviceContext->Link);
+	InitializeListHead(&deviceContext->HashLink);
 	//
 	// Initialize the context.
 	//
 	WDF_OBJECT_ATTRIBUTES_INIT(&attr);
 	attr.ParentObject = device;
-	status = WdfCollectionCreate(&attr, &deviceContext->Listeners);
+	status = WdfWaitLockCreate(&attr, &deviceContext->ListenersLock);
 	if (!NT_SUCCESS(status))
 		return status;
 
+	//
+	// One copy of the counters per processor that can ever be present.
+	//
+	deviceContext->CountersCount = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
 	WDF_OBJECT_ATTRIBUTES_INIT(&attr);
-	attr.ParentObject = deviceContext->Listeners;
-	status = WdfWaitLockCreate(&attr, &deviceContext->ListenersLock);
+	attr.ParentObject = device;
+	status = WdfMemoryCreate(&attr, NonPagedPool, 0, deviceContext->CountersCount * sizeof(DEVICE_COUNTERS), &deviceContext->CountersMemory, &deviceContext->Counters);
 	if (!NT_SUCCESS(status))
 		return status;
 
-	WdfWaitLockAcquire(FilteringDevicesLock, NULL);
-	status = WdfCollectionAdd(FilteringDevices, device);
-	WdfWaitLockRelease(FilteringDevicesLock);
+	RtlZeroMemory(deviceContext->Counters, deviceContext->CountersCount * sizeof(DEVICE_COUNTERS));
 
+	status = ComPortMonitorCaptureInitialize(device);
 	if (!NT_SUCCESS(status))
 		return status;
 
+	//
+	// Numbers only grow, so appending keeps FilteringDevices ordered.
+	//
+	WdfWaitLockAcquire(FilteringDevicesLock, NULL);
+	deviceContext->Patterns = Patterns;
+	WdfWaitLockAcquire(FilteringDevicesListLock, NULL);
+	InsertTailList(&FilteringDevices, &deviceContext->Link);
+	WdfWaitLockRelease(FilteringDevicesListLock);
+	InsertTailList(&FilteringDevicesHash[deviceContext->Number % FILTERING_DEVICES_HASH_SIZE], &deviceContext->HashLink);
+	WdfWaitLockRelease(FilteringDevicesLock);
+
 	//
 	// Initialize the I/O Package and any Queues
 	//
 	return ComPortMonitorQueueInitialize(device);
 }
 
+WDFDEVICE ComPortMonitor_FindDevice(_In_ ULONG Number)
+/*++
+
+Routine Description:
+
+    Looks the filtering device up by its number. Called with
+    FilteringDevicesLock held.
+
+--*/
+{
+	PLIST_ENTRY head, entry;
+	PDEVICE_CONTEXT devContext;
+
+	head = &FilteringDevicesHash[Number % FILTERING_DEVICES_HASH_SIZE];
+	for (entry = head->Flink; entry != head; entry = entry->Flink)
+	{
+		devContext = CONTAINING_RECORD(entry, DEVICE_CONTEXT, HashLink);
+		if (devContext->Number == Number)
+			return WdfObjectContextGetObject(devContext);
+	}
+	return NULL;
+}
+
+WDFDEVICE ComPortMonitor_NextDevice(_In_ ULONG Number)
+/*++
+
+Routine Description:
+
+    Returns the filtering device following the one with the given number,
+    or the first one if Number is NOT_FOUND. If that device is gone, the
+    search continues from the next number still in use. Called with
+    FilteringDevicesLock held.
+
+--*/
+{
+	PLIST_ENTRY entry;
+	WDFDEVICE device;
+	ULONG i;
+
+	if (Number == NOT_FOUND)
+		entry = FilteringDevices.Flink;
+	else
+	{
+		device = ComPortMonitor_FindDevice(Number);
+		if (device == NULL)
+		{
+			for (i = Number + 1; i < NextDeviceNumber; i++)
+				if ((device = ComPortMonitor_FindDevice(i)) != NULL)
+					return device;
+			return NULL;
+		}
+		entry = DeviceGetContext(device)->Link.Flink;
+	}
+
+	if (entry == &FilteringDevices)
+		return NULL;
+
+	return WdfObjectContextGetObject(CONTAINING_RECORD(entry, DEVICE_CONTEXT, Link));
+}
+
+VOID ComPortMonitor_GetStats(_In_ WDFDEVICE Device, _Out_ PPORT_STATS Stats)
+/*++
+
+Routine Description:
+
+    Sums the per-processor counters of the device up. The counters keep
+    changing meanwhile, so the totals are a close snapshot, not an exact
+    one. Takes no lock, the caller keeps the device alive.
+
+--*/
+{
+	PDEVICE_CONTEXT devContext;
+	PDEVICE_COUNTERS counters;
+	ULONG i, j;
+
+	devContext = DeviceGetContext(Device);
+	RtlZeroMemory(Stats, sizeof(*Stats));
+	Stats->DeviceNumber = devContext->Number;
+	for (i = 0; i < devContext->CountersCount; i++)
+	{
+		counters = &devContext->Counters[i];
+		Stats->BytesRead += ReadNoFence64(&counters->BytesRead);
+		Stats->BytesWritten += ReadNoFence64(&counters->BytesWritten);
+		Stats->SendFailures += ReadNoFence64(&counters->SendFailures);
+		Stats->CaptureDrops += ReadNoFence64(&counters->CaptureDrops);
+		Stats->DeliveryDrops += ReadNoFence64(&counters->DeliveryDrops);
+		for (j = 0; j < PORT_STATS_MAJOR_FUNCTIONS; j++)
+			Stats->Requests[j] += ReadNoFence64(&counters->Requests[j]);
+	}
+}
+
+NTSTATUS ComPortMonitor_UpdateListeners(_In_ WDFDEVICE Device, _In_ WDFFILEOBJECT FileObject, _In_opt_ PATTACH_INFO Attach)
+/*++
+
+Routine Description:
+
+    Publishes a new listener set of the device with FileObject added, or
+    removed if Attach is NULL. EventMask and SnapLength of the device are
+    recomputed from the set, so records and bytes nobody asked for are
+    not even captured, see ComPortMonitor_UpdateCapture.
+
+    The notify path reads the set without any lock, it only runs inside
+    the drain loop of the device with DrainLock held. Once the new set is
+    published, acquiring DrainLock once is the grace period: no reader
+    can still hold the previous set after that and it is released.
+
+Return Value:
+
+    STATUS_ALREADY_REGISTERED if the file object is already attached,
+    STATUS_NOT_FOUND if it is not attached and has to be removed.
+
+--*/
+{
+	NTSTATUS status;
+	PDEVICE_CONTEXT devContext;
+	PLISTENER_SET oldSet, newSet = NULL;
+	WDF_OBJECT_ATTRIBUTES attr;
+	WDFMEMORY mem;
+	ULONG i, count, found = NOT_FOUND;
+
+	PAGED_CODE();
+
+	devContext = DeviceGetContext(Device);
+	WdfWaitLockAcquire(devContext->ListenersLock, NULL);
+	__try
+	{
+		oldSet = devContext->Listeners;
+		count = oldSet != NULL ? oldSet->Count : 0;
+		for (i = 0; i < count; i++)
+			if (oldSet->Items[i].FileObject == FileObject)
+			{
+				found = i;
+				break;
+			}
+
+		if (Attach != NULL && found != NOT_FOUND)
+		{
+			status = STATUS_ALREADY_REGISTERED;
+			__leave;
+		}
+		if (Attach == NULL && found == NOT_FOUND)
+		{
+			status = STATUS_NOT_FOUND;
+			__leave;
+		}
+
+		count = Attach != NULL ? count + 1 : count - 1;
+		if (count != 0)
+		{
+			if (count <= LISTENER_SET_SMALL)
+				status = WdfMemoryCreateFromLookaside(ListenerSetLookaside, &mem);
+			else
+			{
+				WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+				attr.ParentObject = Device;
+				status = WdfMemoryCreate(&attr, PagedPool, 0, LISTENER_SET_SIZE(count), &mem, NULL);
+			}
+			if (!NT_SUCCESS(status))
+				__leave;
+
+			newSet = WdfMemoryGetBuffer(mem, NULL);
+
+			newSet->Memory = mem;
+			newSet->Count = 0;
+			for (i = 0; oldSet != NULL && i < oldSet->Count; i++)
+				if (i != found)
+					newSet->Items[newSet->Count++] = oldSet->Items[i];
+			if (Attach != NULL)
+			{
+				newSet->Items[newSet->Count].FileObject = FileObject;
+				newSet->Items[newSet->Count].EventMask = Attach->EventMask;
+				newSet->Items[newSet->Count].SnapLength = Attach->SnapLength;
+				newSet->Count++;
+			}
+		}
+
+		InterlockedExchangePointer((PVOID volatile *)&devContext->Listeners, newSet);
+		ComPortMonitor_UpdateCapture(devContext, newSet);
+
+		//
+		// A new listener gets the modem status of the next poll even if
+		// it did not change.
+		//
+		if (Attach != NULL)
+			InterlockedExchange(&devContext->ModemStatus, MODEM_STATUS_UNKNOWN);
+
+		if (oldSet != NULL)
+		{
+			WdfWaitLockAcquire(devContext->DrainLock, NULL);
+			WdfWaitLockRelease(devContext->DrainLock);
+			WdfObjectDelete(oldSet->Memory);
+		}
+		status = STATUS_SUCCESS;
+	}
+	__finally
+	{
+		WdfWaitLockRelease(devContext->ListenersLock);
+	}
+	return status;
+}
+
+VOID ComPortMonitor_RefreshCapture(_In_ WDFDEVICE Device)
+/*++
+
+Routine Description:
+
+    Recomputes what the device captures after the filter of one of its
+    listeners was set or removed, or its recorder was frozen.
+
+--*/
+{
+	PDEVICE_CONTEXT devContext;
+
+	PAGED_CODE();
+
+	devContext = DeviceGetContext(Device);
+	WdfWaitLockAcquire(devContext->ListenersLock, NULL);
+	ComPortMonitor_UpdateCapture(devContext, devContext->Listeners);
+	WdfWaitLockRelease(devContext->ListenersLock);
+}
+
+NTSTATUS ComPortMonitor_SetRecorder(_In_ WDFDEVICE Device, _In_ PRECORDER_CONFIG Config)
+/*++
+
+Routine Description:
+
+    Applies IOCTL_CPM_SET_RECORDER to the device. The buffer is allocated
+    here once, the drain loop only copies into it. The drain loop uses
+    the recorder with DrainLock held, so it is swapped under that lock.
+
+--*/
+{
+	NTSTATUS status;
+	PDEVICE_CONTEXT devContext;
+	WDF_OBJECT_ATTRIBUTES attr;
+	WDFMEMORY memory = NULL, old;
+	PVOID buffer = NULL;
+
+	PAGED_CODE();
+
+	if (Config->Size > RECORDER_MAX_SIZE)
+		return STATUS_INVALID_PARAMETER;
+
+	if (Config->Size != 0)
+	{
+		WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+		attr.ParentObject = Device;
+		status = WdfMemoryCreate(&attr, NonPagedPool, 0, Config->Size, &memory, &buffer);
+		if (!NT_SUCCESS(status))
+			return status;
+	}
+
+	devContext = DeviceGetContext(Device);
+	WdfWaitLockAcquire(devContext->ListenersLock, NULL);
+	WdfWaitLockAcquire(devContext->DrainLock, NULL);
+	old = devContext->RecorderMemory;
+	devContext->RecorderMemory = memory;
+	RecorderInitialize(&devContext->Recorder, buffer, Config->Size);
+	WdfWaitLockRelease(devContext->DrainLock);
+	ComPortMonitor_UpdateCapture(devContext, devContext->Listeners);
+	WdfWaitLockRelease(devContext->ListenersLock);
+
+	if (old != NULL)
+		WdfObjectDelete(old);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS ComPortMonitor_DumpRecorder(_In_ WDFDEVICE Device, _Out_ PBATCH_HEADER Batch, _In_ size_t Length, _Out_ PULONG Written)
+/*++
+
+Routine Description:
+
+    Freezes the recorder of the device and copies its records out for
+    IOCTL_CPM_DUMP_RECORDER.
+
+--*/
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	PDEVICE_CONTEXT devContext;
+	BOOLEAN frozen = FALSE;
+
+	PAGED_CODE();
+
+	*Written = 0;
+	devContext = DeviceGetContext(Device);
+	WdfWaitLockAcquire(devContext->DrainLock, NULL);
+	__try
+	{
+		if (devContext->RecorderMemory == NULL)
+		{
+			status = STATUS_INVALID_DEVICE_STATE;
+			__leave;
+		}
+
+		frozen = !devContext->Recorder.Frozen;
+		devContext->Recorder.Frozen = TRUE;
+		*Written = RecorderDump(&devContext->Recorder, Batch, Length > MAXULONG ? MAXULONG : (ULONG)Length);
+		if (*Written == 0)
+		{
+			Batch->RecordCount = 0;
+			Batch->BytesUsed = RecorderDumpSize(&devContext->Recorder);
+			*Written = sizeof(*Batch);
+			status = STATUS_BUFFER_OVERFLOW;
+		}
+	}
+	__finally
+	{
+		WdfWaitLockRelease(devContext->DrainLock);
+	}
+
+	if (frozen)
+		ComPortMonitor_RefreshCapture(Device);
+	return status;
+}
+
 VOID ComPortMonitor_EvtDeviceFileCreate(
 	_In_ WDFDEVICE		Device,
 	_In_ WDFREQUEST		Request,
 	_In_ WDFFILEOBJECT	FileObject
 )
 {
-	WDFMEMORY mem;
-	PULONG buf;
 	MEMORY_CONTEXT context;
 	WDF_REQUEST_PARAMETERS params;
 	ULONG processId;
 	UNREFERENCED_PARAMETER(FileObject);
-	if (NT_SUCCESS(WdfMemoryCreate(WDF_NO_OBJECT_ATTRIBUTES, PagedPool, 0, sizeof(*buf), &mem, &buf)))
-	{
-		WDF_REQUEST_PARAMETERS_INIT(&params);
-		WdfRequestGetParameters(Request, &params);
-		memset(&context, 0, sizeof(context));
-		context.BufferSize = sizeof(processId);
-		context.MajorFunctionCode = params.Type;
-		context.MinorFunctionCode = params.MinorFunction;
-		context.OutputDataOffset = 0;
-		processId = IoGetRequestorProcessId(WdfRequestWdmGetIrp(Request));
-		*buf = processId;
-		ComPortMonitor_EvtNotifyListeners(Device, mem, &context);
-		WdfObjectDelete(mem);
-	}
+
+	COUNT_EVENT(DeviceGetContext(Device), Requests[IRP_MJ_CREATE], 1);
+	WDF_REQUEST_PARAMETERS_INIT(&params);
+	WdfRequestGetParameters(Request, &params);
+	memset(&context, 0, sizeof(context));
+	context.Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+	context.BufferSize = sizeof(processId);
+	context.MajorFunctionCode = params.Type;
+	context.MinorFunctionCode = params.MinorFunction;
+	context.OutputDataOffset = 0;
+	processId = IoGetRequestorProcessId(WdfRequestWdmGetIrp(Request));
+	ComPortMonitor_CaptureEvent(Device, &context, &processId);
 	ComPortMonitor_ForwardRequest(Request, Device);
 }
 
@@ -138,53 +510,53 @@ VOID ComPortMonitor_EvtFileClose(
 	_In_ WDFFILEOBJECT FileObject
 )
 {
-	WDFMEMORY mem;
-	PCHAR buf;
 	MEMORY_CONTEXT context;
 
-	if (NT_SUCCESS(WdfMemoryCreate(WDF_NO_OBJECT_ATTRIBUTES, PagedPool, 0, sizeof(*buf), &mem, &buf)))
-	{
-		memset(&context, 0, sizeof(context));
-		context.MajorFunctionCode = IRP_MJ_CLOSE;
-		ComPortMonitor_EvtNotifyListeners(WdfFileObjectGetDevice(FileObject), mem, &context);
-		WdfObjectDelete(mem);
-	}
+	COUNT_EVENT(DeviceGetContext(WdfFileObjectGetDevice(FileObject)), Requests[IRP_MJ_CLOSE], 1);
+	memset(&context, 0, sizeof(context));
+	context.Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+	context.MajorFunctionCode = IRP_MJ_CLOSE;
+	ComPortMonitor_CaptureEvent(WdfFileObjectGetDevice(FileObject), &context, NULL);
 }
 
 VOID ComPortMonitorEvtCleanupCallback(_In_ WDFOBJECT Object)
 {
-	PCONTROL_DEVICE_CONTEXT ctrlContext;
-	WDFFILEOBJECT file;
-	PFILEOBJECT_CONTEXT fileContext;
-	ULONG i, c, pos;
+	PDEVICE_CONTEXT devContext;
+	PLISTENER_SET listeners;
+	ULONG i;
 
 	KdPrint(("FilterDevice cleanup start\n"));
+	devContext = DeviceGetContext(Object);
 	WdfWaitLockAcquire(FilteringDevicesLock, NULL);
 	__try
 	{
-		if (ControlDevice != NULL)
+		WdfWaitLockAcquire(FilteringDevicesListLock, NULL);
+		RemoveEntryList(&devContext->Link);
+		WdfWaitLockRelease(FilteringDevicesListLock);
+		RemoveEntryList(&devContext->HashLink);
+		InitializeListHead(&devContext->Link);
+		InitializeListHead(&devContext->HashLink);
+
+		//
+		// Listener sets only change with FilteringDevicesLock held, drop the
+		// device from the attachments of the file objects still listening.
+		//
+		listeners = devContext->Listeners;
+		for (i = 0; listeners != NULL && i < listeners->Count; i++)
+			WdfCollectionRemove(FileObjectGetContext(listeners->Items[i].FileObject)->Attachments, Object);
+
+		//
+		// Small sets belong to the lookaside list, not to the device. The
+		// drain loop may still hold the set, acquiring DrainLock once is
+		// the grace period, as in ComPortMonitor_UpdateListeners.
+		//
+		devContext->Listeners = NULL;
+		if (listeners != NULL)
 		{
-			ctrlContext = ControlDeviceGetContext(ControlDevice);
-			WdfWaitLockAcquire(ctrlContext->FileObjectsLock, NULL);
-			__try
-			{
-				c = WdfCollectionGetCount(ctrlContext->FileObjects);
-				for (i = 0; i < c; i++)
-				{
-					file = WdfCollectionGetItem(ctrlContext->FileObjects, i);
-					if (file != NULL && (fileContext = FileObjectGetContext(file))->DevicePosition == Object)
-					{
-						pos = WdfCollectionFindItemIndex(FilteringDevices, fileContext->DevicePosition);
-						fileContext->DevicePosition = pos > 0 ? WdfCollectionGetItem(FilteringDevices, pos - 1) : NULL;
-					}
-				}
-			}
-			__finally
-			{
-				WdfWaitLockRelease(ctrlContext->FileObjectsLock);
-			}
+			WdfWaitLockAcquire(devContext->DrainLock, NULL);
+			WdfWaitLockRelease(devContext->DrainLock);
+			WdfObjectDelete(listeners->Memory);
 		}
-		WdfCollectionRemove(FilteringDevices, Object);
 	}
 	__finally
 	{
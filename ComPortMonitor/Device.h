@@ -15,21 +15,118 @@ Environment:
 --*/
 
 #include "public.h"
+#include "Ring.h"
+#include "Match.h"
+#include "Recorder.h"
 
 EXTERN_C_START
 
+//
+// A file object listening to a device and what it asked to receive, see
+// ATTACH_INFO.
+//
+typedef struct _LISTENER
+{
+	WDFFILEOBJECT FileObject;
+	ULONG EventMask;
+	ULONG SnapLength;
+
+} LISTENER, *PLISTENER;
+
+//
+// Immutable snapshot of the file objects listening to a device. A new
+// snapshot is published on every attach and detach.
+//
+typedef struct _LISTENER_SET
+{
+	WDFMEMORY Memory;
+	ULONG Count;
+	LISTENER Items[ANYSIZE_ARRAY];
+
+} LISTENER_SET, *PLISTENER_SET;
+
+#define LISTENER_SET_SIZE(Count)	(FIELD_OFFSET(LISTENER_SET, Items) + (Count) * sizeof(LISTENER))
+#define LISTENER_SET_SMALL			8
+
+//
+// Counters of the device updated by one processor. Every processor has
+// its own cache aligned copy, IOCTL_CPM_GET_STATS sums them up.
+//
+typedef struct DECLSPEC_CACHEALIGN _DEVICE_COUNTERS
+{
+	LONG64 BytesRead;
+	LONG64 BytesWritten;
+	LONG64 SendFailures;
+	LONG64 CaptureDrops;
+	LONG64 DeliveryDrops;
+	LONG64 Requests[PORT_STATS_MAJOR_FUNCTIONS];
+
+} DEVICE_COUNTERS, *PDEVICE_COUNTERS;
+
+C_ASSERT(IRP_MJ_MAXIMUM_FUNCTION < PORT_STATS_MAJOR_FUNCTIONS);
+
 //
 // The device context performs the same job as
 // a WDM device extension in the driver frameworks
 //
 typedef struct _DEVICE_CONTEXT
 {
-	WDFCOLLECTION Listeners;
+	PLISTENER_SET volatile Listeners;
+	volatile LONG EventMask;
+	volatile LONG SnapLength;
+	volatile LONG ModemStatus;
 	WDFWAITLOCK ListenersLock;
 	ULONG Number;
+	LIST_ENTRY Link;
+	LIST_ENTRY HashLink;
+	WDFMEMORY CaptureMemory;
+	RING Capture;
+	WDFSPINLOCK CaptureLock;
+	WDFWAITLOCK DrainLock;
+	WDFWORKITEM CaptureWorkItem;
+	WDFMEMORY CoalesceMemory;
+	PMEMORY_CONTEXT Coalesced;
+	BOOLEAN CoalescePending;
+	ULONG CoalesceMaxBytes;
+	ULONG CoalesceIdleGap;
+	LONGLONG CoalesceIdleTicks;
+	WDFTIMER CoalesceTimer;
+	WDFMEMORY CountersMemory;
+	PDEVICE_COUNTERS Counters;
+	ULONG CountersCount;
+	PMATCH_AUTOMATON Patterns;
+	USHORT MatchState[2];
+	ULONG64 MatchOffset[2];
+	WDFMEMORY RecorderMemory;
+	RECORDER Recorder;
 
 } DEVICE_CONTEXT, *PDEVICE_CONTEXT;
 
+//
+// Adds Value to a counter of the device. The copy of the current
+// processor is updated, an interlocked add there costs no more than an
+// uncontended increment and stays correct if the thread is preempted.
+//
+#define COUNT_EVENT(DevContext, Counter, Value) \
+	InterlockedExchangeAddNoFence64(&(DevContext)->Counters[KeGetCurrentProcessorNumberEx(NULL)].Counter, (LONG64)(Value))
+
+//
+// The capture ring holds what a port produces while the work item waits
+// for a worker thread. Once it is filled past the high-water mark, a
+// capture at PASSIVE_LEVEL drains it in line instead, on the thread of the
+// request, so a writer that outruns the work item is slowed down rather
+// than its records dropped. Captures at DISPATCH_LEVEL, read completions
+// from the DPC of the serial driver, can only drop.
+//
+#define CAPTURE_RING_SIZE RING_BUFFER_SIZE(256 * 1024)
+#define CAPTURE_RING_HIGH_WATER (192 * 1024)
+
+//
+// ModemStatus before the first IOCTL_SERIAL_GET_MODEMSTATUS is reported,
+// no combination of the SERIAL_*_STATE bits.
+//
+#define MODEM_STATUS_UNKNOWN	(-1)
+
 //
 // This macro will generate an inline function called DeviceGetContext
 // which will be used to get a pointer to the device context memory
@@ -41,6 +138,13 @@ WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(DEVICE_CONTEXT, DeviceGetContext)
 // Function to initialize the device and its callbacks
 //
 NTSTATUS ComPortMonitorCreateDevice(_Inout_ PWDFDEVICE_INIT DeviceInit);
+WDFDEVICE ComPortMonitor_FindDevice(_In_ ULONG Number);
+WDFDEVICE ComPortMonitor_NextDevice(_In_ ULONG Number);
+NTSTATUS ComPortMonitor_UpdateListeners(_In_ WDFDEVICE Device, _In_ WDFFILEOBJECT FileObject, _In_opt_ PATTACH_INFO Attach);
+VOID ComPortMonitor_RefreshCapture(_In_ WDFDEVICE Device);
+VOID ComPortMonitor_GetStats(_In_ WDFDEVICE Device, _Out_ PPORT_STATS Stats);
+NTSTATUS ComPortMonitor_SetRecorder(_In_ WDFDEVICE Device, _In_ PRECORDER_CONFIG Config);
+NTSTATUS ComPortMonitor_DumpRecorder(_In_ WDFDEVICE Device, _Out_ PBATCH_HEADER Batch, _In_ size_t Length, _Out_ PULONG Written);
 EVT_WDF_DEVICE_FILE_CREATE ComPortMonitor_EvtDeviceFileCreate;
 EVT_WDF_FILE_CLOSE ComPortMonitor_EvtFileClose;
 EVT_WDF_OBJECT_CONTEXT_CLEANUP ComPortMonitorEvtCleanupCallback;
@@ -24,9 +24,16 @@ Environment:
 #pragma alloc_text (PAGE, ComPortMonitorEvtDriverContextCleanup)
 #endif
 
-WDFCOLLECTION FilteringDevices = NULL;
+LIST_ENTRY FilteringDevices;
+LIST_ENTRY FilteringDevicesHash[FILTERING_DEVICES_HASH_SIZE];
 WDFWAITLOCK FilteringDevicesLock = NULL;
+WDFWAITLOCK FilteringDevicesListLock = NULL;
 ULONG NextDeviceNumber = 0;
+WDFMEMORY PatternsMemory = NULL;
+PMATCH_AUTOMATON Patterns = NULL;
+WDFLOOKASIDE NameLookaside = NULL;
+WDFLOOKASIDE ListenerSetLookaside = NULL;
+BOOLEAN ProcessNotifyRegistered = FALSE;
 
 NTSTATUS
 DriverEntry(
@@ -63,6 +70,7 @@ Return Value:
     NTSTATUS status;
     WDF_OBJECT_ATTRIBUTES attributes;
 	WDFDRIVER drv;
+	ULONG i;
 
     //
     // Register a cleanup callback so that we can call WPP_CLEANUP when
@@ -77,15 +85,36 @@ Return Value:
 	if (!NT_SUCCESS(status))
 		return status;
 
-	status = WdfCollectionCreate(WDF_NO_OBJECT_ATTRIBUTES, &FilteringDevices);
+	InitializeListHead(&FilteringDevices);
+	for (i = 0; i < FILTERING_DEVICES_HASH_SIZE; i++)
+		InitializeListHead(&FilteringDevicesHash[i]);
+
+	status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &FilteringDevicesLock);
 	if (!NT_SUCCESS(status))
 		return status;
 
-	status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &FilteringDevicesLock);
+	status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &FilteringDevicesListLock);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	status = WdfLookasideListCreate(WDF_NO_OBJECT_ATTRIBUTES, DEVICEINFO_BUFSIZE, PagedPool, WDF_NO_OBJECT_ATTRIBUTES, 0, &NameLookaside);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	status = WdfLookasideListCreate(WDF_NO_OBJECT_ATTRIBUTES, LISTENER_SET_SIZE(LISTENER_SET_SMALL), PagedPool, WDF_NO_OBJECT_ATTRIBUTES, 0, &ListenerSetLookaside);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	status = WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &ControlDeviceLock);
 	if (!NT_SUCCESS(status))
 		return status;
 
-	return WdfWaitLockCreate(WDF_NO_OBJECT_ATTRIBUTES, &ControlDeviceLock);
+	status = PsSetCreateProcessNotifyRoutine(ControlDevice_ProcessNotify, FALSE);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	ProcessNotifyRegistered = TRUE;
+	return STATUS_SUCCESS;
 }
 
 NTSTATUS
@@ -170,4 +199,7 @@ Return Value:
     UNREFERENCED_PARAMETER(DriverObject);
 
     PAGED_CODE ();
+
+	if (ProcessNotifyRegistered)
+		PsSetCreateProcessNotifyRoutine(ControlDevice_ProcessNotify, TRUE);
 }
@@ -31,10 +31,46 @@ EXTERN_C_START
 // WDFDRIVER Events
 //
 
-WDFCOLLECTION FilteringDevices;
+#define FILTERING_DEVICES_HASH_SIZE 64
+
+//
+// Filtering devices in the order of their numbers, and the same devices
+// hashed by number.
+//
+LIST_ENTRY FilteringDevices;
+LIST_ENTRY FilteringDevicesHash[FILTERING_DEVICES_HASH_SIZE];
 WDFWAITLOCK FilteringDevicesLock;
 ULONG NextDeviceNumber;
 
+//
+// Also held, inside FilteringDevicesLock, while devices join or leave
+// FilteringDevices. It is never held across anything else, so walking
+// the list with it alone never waits behind an attach or a detach.
+//
+WDFWAITLOCK FilteringDevicesListLock;
+
+//
+// Patterns of IOCTL_CPM_SET_PATTERNS. Every device holds the same pointer,
+// swapped with FilteringDevicesLock and the device's DrainLock held.
+//
+WDFMEMORY PatternsMemory;
+PMATCH_AUTOMATON Patterns;
+
+//
+// Buffers allocated over and over outside the capture path: the names
+// queried for IOCTL_CPM_GET_DEVICE_FIRST/NEXT and the listener sets of
+// up to LISTENER_SET_SMALL listeners published on every attach and
+// detach.
+//
+WDFLOOKASIDE NameLookaside;
+WDFLOOKASIDE ListenerSetLookaside;
+
+//
+// Set once ControlDevice_ProcessNotify is registered, see
+// ControlDevice_UnmapEventsRing.
+//
+BOOLEAN ProcessNotifyRegistered;
+
 DRIVER_INITIALIZE DriverEntry;
 EVT_WDF_DRIVER_DEVICE_ADD ComPortMonitorEvtDeviceAdd;
 EVT_WDF_OBJECT_CONTEXT_CLEANUP ComPortMonitorEvtDriverContextCleanup;
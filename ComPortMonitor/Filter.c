@@ -0,0 +1,154 @@
+/*++
+
+Module Name:
+
+    filter.c
+
+Abstract:
+
+    This file contains the capture filter interpreter.
+
+    FilterRun trusts the program it is given: opcodes, jump targets and
+    shift counts are checked by FilterVerify beforehand, only the loads
+    are checked against the payload at run time.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "Filter.h"
+
+BOOLEAN FilterVerify(const FILTER_INSN *Program, ULONG Count)
+/*++
+
+Routine Description:
+
+    Checks that the program has a known opcode in every instruction, that
+    all jumps land inside the program and that it ends with a return.
+
+Return Value:
+
+    TRUE if the program can be run by FilterRun.
+
+--*/
+{
+	ULONG pc, left;
+
+	if (Count == 0 || Count > FILTER_MAX_INSNS)
+		return FALSE;
+
+	for (pc = 0; pc < Count; pc++)
+	{
+		left = Count - pc - 1;
+		switch (Program[pc].Code)
+		{
+		case FILTER_LD_BYTE:
+		case FILTER_LD_HALF:
+		case FILTER_LD_WORD:
+		case FILTER_LD_LEN:
+		case FILTER_LD_MAJOR:
+		case FILTER_LD_IMM:
+		case FILTER_AND:
+		case FILTER_RET:
+		case FILTER_RET_A:
+			break;
+		case FILTER_RSH:
+			if (Program[pc].K >= 32)
+				return FALSE;
+			break;
+		case FILTER_JA:
+			if (Program[pc].K >= left)
+				return FALSE;
+			break;
+		case FILTER_JEQ:
+		case FILTER_JGT:
+		case FILTER_JGE:
+		case FILTER_JSET:
+			if (Program[pc].Jt >= left || Program[pc].Jf >= left)
+				return FALSE;
+			break;
+		default:
+			return FALSE;
+		}
+	}
+
+	return Program[Count - 1].Code == FILTER_RET || Program[Count - 1].Code == FILTER_RET_A;
+}
+
+ULONG FilterRun(const FILTER_INSN *Program, BYTE MajorFunctionCode, const UCHAR *Payload, ULONG Length)
+/*++
+
+Routine Description:
+
+    Runs a verified program against a record.
+
+Return Value:
+
+    Number of payload bytes to deliver, 0 if the record is dropped.
+
+--*/
+{
+	const FILTER_INSN *insn;
+	ULONG a = 0;
+
+	for (insn = Program; ; insn++)
+	{
+		switch (insn->Code)
+		{
+		case FILTER_LD_BYTE:
+			if (insn->K >= Length)
+				return 0;
+			a = Payload[insn->K];
+			break;
+		case FILTER_LD_HALF:
+			if (insn->K >= Length || Length - insn->K < 2)
+				return 0;
+			a = (ULONG)Payload[insn->K] << 8 | Payload[insn->K + 1];
+			break;
+		case FILTER_LD_WORD:
+			if (insn->K >= Length || Length - insn->K < 4)
+				return 0;
+			a = (ULONG)Payload[insn->K] << 24 | (ULONG)Payload[insn->K + 1] << 16 |
+				(ULONG)Payload[insn->K + 2] << 8 | Payload[insn->K + 3];
+			break;
+		case FILTER_LD_LEN:
+			a = Length;
+			break;
+		case FILTER_LD_MAJOR:
+			a = MajorFunctionCode;
+			break;
+		case FILTER_LD_IMM:
+			a = insn->K;
+			break;
+		case FILTER_AND:
+			a &= insn->K;
+			break;
+		case FILTER_RSH:
+			a >>= insn->K;
+			break;
+		case FILTER_JA:
+			insn += insn->K;
+			break;
+		case FILTER_JEQ:
+			insn += (a == insn->K) ? insn->Jt : insn->Jf;
+			break;
+		case FILTER_JGT:
+			insn += (a > insn->K) ? insn->Jt : insn->Jf;
+			break;
+		case FILTER_JGE:
+			insn += (a >= insn->K) ? insn->Jt : insn->Jf;
+			break;
+		case FILTER_JSET:
+			insn += (a & insn->K) ? insn->Jt : insn->Jf;
+			break;
+		case FILTER_RET:
+			return insn->K;
+		case FILTER_RET_A:
+			return a;
+		default:
+			return 0;
+		}
+	}
+}
@@ -0,0 +1,35 @@
+/*++
+
+Module Name:
+
+    filter.h
+
+Abstract:
+
+    This file contains the capture filter definitions.
+
+    A filter program is checked once by FilterVerify when a listener sets
+    it and then run by FilterRun on every record. The instruction set is
+    defined in public.h. Like the ring, the module does not depend on the
+    framework and can be built outside of Windows.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+#include "Ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+BOOLEAN FilterVerify(const FILTER_INSN *Program, ULONG Count);
+ULONG FilterRun(const FILTER_INSN *Program, BYTE MajorFunctionCode, const UCHAR *Payload, ULONG Length);
+
+#ifdef __cplusplus
+}
+#endif
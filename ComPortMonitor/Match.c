@@ -0,0 +1,258 @@
+/*++
+
+Module Name:
+
+    match.c
+
+Abstract:
+
+    This file contains the multi-pattern matcher.
+
+    States are numbered in the order the trie is built, state 0 being the
+    root. A pattern number stored in a state is biased by one, 0 meaning
+    none; no pattern ends in the root since patterns are never empty. A
+    transition into a state that ends any pattern has MATCH_REPORT set,
+    so the run only looks further for the bytes that end a match.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include <string.h>
+#include "Match.h"
+
+#define MATCH_NEXT(Automaton)		((PUSHORT)((PMATCH_AUTOMATON)(Automaton) + 1))
+#define MATCH_OUTPUT(Automaton)		(MATCH_NEXT(Automaton) + (Automaton)->StateCount * (Automaton)->ClassCount)
+#define MATCH_LINK(Automaton)		(MATCH_OUTPUT(Automaton) + (Automaton)->StateCount)
+#define MATCH_PATTERN_FLAGS(Automaton)	(MATCH_LINK(Automaton) + (Automaton)->StateCount)
+#define MATCH_DUPLICATE(Automaton)	(MATCH_PATTERN_FLAGS(Automaton) + (Automaton)->PatternCount)
+#define MATCH_REPORT				0x8000	// above any state, see MATCH_MAX_STATES
+#define MATCH_SCRATCH(States, Classes, Count)	(sizeof(MATCH_AUTOMATON) + ((States) * (Classes) + 4 * (States) + 2 * (Count)) * sizeof(USHORT))
+
+static BOOLEAN MatchScan(const VOID *Patterns, ULONG Length, PULONG Count, PULONG States, PULONG Classes)
+/*++
+
+Routine Description:
+
+    Checks the pattern list and counts the patterns, the states the trie
+    needs at most and the distinct bytes of the patterns plus one.
+
+--*/
+{
+	const UCHAR *entry = (const UCHAR *)Patterns;
+	UCHAR seen[256];
+	USHORT patternLength, flags;
+	ULONG offset, i;
+
+	memset(seen, 0, sizeof(seen));
+	*Count = 0;
+	*States = 1;
+	*Classes = 1;
+	for (offset = 0; offset < Length; offset += MATCH_PATTERN_SIZE(patternLength))
+	{
+		if (Length - offset < 4)
+			return FALSE;
+		memcpy(&patternLength, entry + offset, sizeof(patternLength));
+		memcpy(&flags, entry + offset + 2, sizeof(flags));
+		if (patternLength == 0 || (flags & ~MATCH_FLAG_FREEZE) != 0 || MATCH_PATTERN_SIZE(patternLength) > Length - offset)
+			return FALSE;
+
+		*States += patternLength;
+		if (*States > MATCH_MAX_STATES || ++*Count > MATCH_MAX_STATES)
+			return FALSE;
+		for (i = 0; i < patternLength; i++)
+		{
+			if (!seen[entry[offset + 4 + i]])
+			{
+				seen[entry[offset + 4 + i]] = 1;
+				++*Classes;
+			}
+		}
+	}
+	return *Count != 0;
+}
+
+ULONG MatchSize(const VOID *Patterns, ULONG Length)
+/*++
+
+Return Value:
+
+    Size of the buffer MatchCompile needs for the patterns, the room it
+    uses while building included, 0 if the pattern list is not valid.
+
+--*/
+{
+	ULONG count, states, classes;
+
+	if (!MatchScan(Patterns, Length, &count, &states, &classes))
+		return 0;
+
+	return MATCH_SCRATCH(states, classes, count);
+}
+
+PMATCH_AUTOMATON MatchCompile(PVOID Buffer, ULONG BufferSize, const VOID *Patterns, ULONG Length)
+/*++
+
+Routine Description:
+
+    Builds the automaton into the buffer: the trie of the patterns first,
+    then the failure links breadth first, filling in every missing
+    transition from the state the failure link points to.
+
+Return Value:
+
+    The automaton at the start of the buffer, NULL if the pattern list is
+    not valid or the buffer is smaller than MatchSize says.
+
+--*/
+{
+	PMATCH_AUTOMATON automaton = (PMATCH_AUTOMATON)Buffer;
+	const UCHAR *entry = (const UCHAR *)Patterns;
+	PUSHORT next, output, link, flags, duplicate, fail, queue;
+	ULONG count, states, classes, used, offset, pattern, i, c, head, tail;
+	USHORT patternLength, state, target, failure;
+
+	if (!MatchScan(Patterns, Length, &count, &states, &classes) || BufferSize < MATCH_SCRATCH(states, classes, count))
+		return NULL;
+
+	memset(Buffer, 0, MATCH_SCRATCH(states, classes, count));
+	automaton->StateCount = states;
+	automaton->ClassCount = classes;
+	automaton->PatternCount = count;
+	next = MATCH_NEXT(automaton);
+	output = MATCH_OUTPUT(automaton);
+	link = MATCH_LINK(automaton);
+	flags = MATCH_PATTERN_FLAGS(automaton);
+	duplicate = MATCH_DUPLICATE(automaton);
+	fail = duplicate + count;
+	queue = fail + states;
+
+	classes = 1;
+	used = 0;
+	for (offset = 0, pattern = 0; offset < Length; offset += MATCH_PATTERN_SIZE(patternLength), pattern++)
+	{
+		memcpy(&patternLength, entry + offset, sizeof(patternLength));
+		memcpy(&flags[pattern], entry + offset + 2, sizeof(flags[pattern]));
+		state = 0;
+		for (i = 0; i < patternLength; i++)
+		{
+			c = automaton->Classes[entry[offset + 4 + i]];
+			if (c == 0)
+				c = automaton->Classes[entry[offset + 4 + i]] = (USHORT)classes++;
+			if (next[state * automaton->ClassCount + c] == 0)
+				next[state * automaton->ClassCount + c] = (USHORT)++used;
+			state = next[state * automaton->ClassCount + c];
+		}
+		//
+		// The same pattern given twice ends in the same state, the later
+		// IDs hang off the first one.
+		//
+		if (output[state] != 0)
+		{
+			for (i = output[state] - 1; duplicate[i] != 0; i = duplicate[i] - 1)
+				;
+			duplicate[i] = (USHORT)(pattern + 1);
+		}
+		else
+			output[state] = (USHORT)(pattern + 1);
+	}
+
+	//
+	// The root keeps its missing transitions pointing at itself, bytes in
+	// no pattern, class 0, lead back to the root from every state.
+	//
+	head = tail = 0;
+	for (c = 0; c < automaton->ClassCount; c++)
+		if (next[c] != 0)
+			queue[tail++] = next[c];
+
+	while (head < tail)
+	{
+		state = queue[head++];
+		for (c = 0; c < automaton->ClassCount; c++)
+		{
+			target = next[state * automaton->ClassCount + c];
+			failure = next[fail[state] * automaton->ClassCount + c];
+			if (target == 0)
+			{
+				next[state * automaton->ClassCount + c] = failure;
+				continue;
+			}
+			fail[target] = failure;
+			link[target] = output[failure] != 0 ? failure : link[failure];
+			queue[tail++] = target;
+		}
+	}
+
+	automaton->RowOffsets = states * automaton->ClassCount <= MATCH_REPORT;
+	for (i = 0; i < states * automaton->ClassCount; i++)
+	{
+		state = next[i];
+		if (automaton->RowOffsets)
+			next[i] = (USHORT)(state * automaton->ClassCount);
+		if (output[state] != 0 || link[state] != 0)
+			next[i] |= MATCH_REPORT;
+	}
+	return automaton;
+}
+
+static VOID MatchReport(const MATCH_AUTOMATON *Automaton, USHORT State, ULONG Offset, MATCH_CALLBACK *Callback, PVOID Context)
+{
+	const USHORT *output = MATCH_OUTPUT(Automaton), *link = MATCH_LINK(Automaton), *duplicate = MATCH_DUPLICATE(Automaton);
+	ULONG pattern;
+
+	for (State = output[State] != 0 ? State : link[State]; State != 0; State = link[State])
+		for (pattern = output[State]; pattern != 0; pattern = duplicate[pattern - 1])
+			Callback(Context, pattern - 1, Offset);
+}
+
+USHORT MatchRun(const MATCH_AUTOMATON *Automaton, USHORT State, const UCHAR *Data, ULONG Length, MATCH_CALLBACK *Callback, PVOID Context)
+/*++
+
+Routine Description:
+
+    Runs the automaton over a chunk of a stream starting in State and
+    calls back for every pattern ending in the chunk, with the offset
+    just past the end of the match in the chunk.
+
+Return Value:
+
+    The state to continue the stream from.
+
+--*/
+{
+	const USHORT *next = MATCH_NEXT(Automaton);
+	ULONG i, row, classCount = Automaton->ClassCount;
+
+	if (!Automaton->RowOffsets)
+	{
+		for (i = 0; i < Length; i++)
+		{
+			State = next[State * classCount + Automaton->Classes[Data[i]]];
+			if ((State & MATCH_REPORT) == 0)
+				continue;
+
+			State &= ~MATCH_REPORT;
+			MatchReport(Automaton, State, i + 1, Callback, Context);
+		}
+		return State;
+	}
+
+	for (i = 0, row = State * classCount; i < Length; i++)
+	{
+		row = next[row + Automaton->Classes[Data[i]]];
+		if ((row & MATCH_REPORT) == 0)
+			continue;
+
+		row &= ~MATCH_REPORT;
+		MatchReport(Automaton, (USHORT)(row / classCount), i + 1, Callback, Context);
+	}
+	return (USHORT)(row / classCount);
+}
+
+USHORT MatchFlags(const MATCH_AUTOMATON *Automaton, ULONG Pattern)
+{
+	return Pattern < Automaton->PatternCount ? MATCH_PATTERN_FLAGS(Automaton)[Pattern] : 0;
+}
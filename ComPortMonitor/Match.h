@@ -0,0 +1,64 @@
+/*++
+
+Module Name:
+
+    match.h
+
+Abstract:
+
+    This file contains the multi-pattern matcher definitions.
+
+    The patterns of IOCTL_CPM_SET_PATTERNS are compiled by MatchCompile
+    into an Aho-Corasick automaton with every transition filled in, so
+    MatchRun takes one table lookup per byte whatever the number of
+    patterns. Bytes that occur in no pattern share one column of the
+    table. The state of a stream is a single USHORT the caller keeps
+    between chunks, so matches across chunk boundaries are found. In an
+    automaton small enough, the transitions hold the offset of the row
+    of the next state rather than its number, which takes the multiply
+    off the chain of lookups.
+
+    Like the ring, the module does not depend on the framework and can
+    be built outside of Windows.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+#include "Ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Header of the automaton. It is followed by the transitions, StateCount
+// rows of ClassCount entries, then the pattern ending in each state and
+// the next state down the suffix chain that ends a pattern, both
+// StateCount entries, then the flags of each pattern and the next
+// pattern identical to it.
+//
+typedef struct _MATCH_AUTOMATON
+{
+	ULONG StateCount;
+	ULONG ClassCount;
+	ULONG PatternCount;
+	ULONG RowOffsets;	// the transitions hold row offsets
+	USHORT Classes[256];
+
+} MATCH_AUTOMATON, *PMATCH_AUTOMATON;
+
+typedef VOID MATCH_CALLBACK(PVOID Context, ULONG Pattern, ULONG Offset);
+
+ULONG MatchSize(const VOID *Patterns, ULONG Length);
+PMATCH_AUTOMATON MatchCompile(PVOID Buffer, ULONG BufferSize, const VOID *Patterns, ULONG Length);
+USHORT MatchRun(const MATCH_AUTOMATON *Automaton, USHORT State, const UCHAR *Data, ULONG Length, MATCH_CALLBACK *Callback, PVOID Context);
+USHORT MatchFlags(const MATCH_AUTOMATON *Automaton, ULONG Pattern);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,430 @@
+/*++
+
+Module Name:
+
+    pcapng.c
+
+Abstract:
+
+    This file contains the pcapng writer and reader.
+
+    The writer functions fill a caller supplied buffer and return the
+    number of bytes used, 0 if the block does not fit. The reader walks a
+    buffer of blocks one at a time and never reads past a block's length.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include <string.h>
+#include "Pcapng.h"
+
+#define PCAPNG_OPT_ENDOFOPT			0
+#define PCAPNG_OPT_IF_NAME			2
+#define PCAPNG_OPT_IF_DESCRIPTION	3
+#define PCAPNG_OPT_IF_TSRESOL		9
+#define PCAPNG_OPT_IF_TSOFFSET		14
+#define PCAPNG_OPT_EPB_FLAGS		2
+#define PCAPNG_OPT_EPB_DROPCOUNT	4
+
+#define PCAPNG_FLAG_INBOUND			1
+#define PCAPNG_FLAG_OUTBOUND		2
+
+#define PCAPNG_MJ_READ				0x03
+#define PCAPNG_MJ_WRITE				0x04
+
+#define PCAPNG_PAD(Length)			(((Length) + 3) & ~(ULONG)3)
+
+//
+// if_description of an interface, followed by the device number in
+// decimal.
+//
+#define PCAPNG_PORT_PREFIX			"port "
+#define PCAPNG_PORT_PREFIX_LENGTH	(sizeof(PCAPNG_PORT_PREFIX) - 1)
+#define PCAPNG_PORT_LENGTH			(PCAPNG_PORT_PREFIX_LENGTH + 10)
+
+static VOID PcapngPut32(PUCHAR Buffer, ULONG Value)
+{
+	memcpy(Buffer, &Value, sizeof(Value));
+}
+
+static VOID PcapngPut16(PUCHAR Buffer, USHORT Value)
+{
+	memcpy(Buffer, &Value, sizeof(Value));
+}
+
+static ULONG PcapngGet32(const UCHAR *Buffer)
+{
+	ULONG value;
+
+	memcpy(&value, Buffer, sizeof(value));
+	return value;
+}
+
+static USHORT PcapngGet16(const UCHAR *Buffer)
+{
+	USHORT value;
+
+	memcpy(&value, Buffer, sizeof(value));
+	return value;
+}
+
+static PUCHAR PcapngPutOption(PUCHAR Buffer, USHORT Code, const VOID *Value, USHORT Length)
+{
+	PcapngPut16(Buffer, Code);
+	PcapngPut16(Buffer + 2, Length);
+	if (Length != 0)
+		memcpy(Buffer + 4, Value, Length);
+	memset(Buffer + 4 + Length, 0, PCAPNG_PAD(Length) - Length);
+	return Buffer + 4 + PCAPNG_PAD(Length);
+}
+
+ULONG64 PcapngTimestamp(LONGLONG Ticks, LONGLONG Frequency)
+/*++
+
+Routine Description:
+
+    Converts a performance counter value to nanoseconds without
+    overflowing for any uptime.
+
+--*/
+{
+	if (Frequency <= 0 || Ticks < 0)
+		return 0;
+
+	return (ULONG64)(Ticks / Frequency) * 1000000000 + (ULONG64)(Ticks % Frequency) * 1000000000 / (ULONG64)Frequency;
+}
+
+ULONG PcapngSectionHeader(PVOID Buffer, ULONG Length)
+{
+	PUCHAR block = (PUCHAR)Buffer;
+
+	if (Length < 28)
+		return 0;
+
+	PcapngPut32(block, PCAPNG_BLOCK_SECTION_HEADER);
+	PcapngPut32(block + 4, 28);
+	PcapngPut32(block + 8, PCAPNG_BYTE_ORDER_MAGIC);
+	PcapngPut16(block + 12, 1);
+	PcapngPut16(block + 14, 0);
+	PcapngPut32(block + 16, 0xFFFFFFFF);
+	PcapngPut32(block + 20, 0xFFFFFFFF);
+	PcapngPut32(block + 24, 28);
+	return 28;
+}
+
+static ULONG PcapngFormatPort(char *Buffer, ULONG Port)
+{
+	char digits[10];
+	ULONG count = 0, length = PCAPNG_PORT_PREFIX_LENGTH;
+
+	memcpy(Buffer, PCAPNG_PORT_PREFIX, PCAPNG_PORT_PREFIX_LENGTH);
+	do
+	{
+		digits[count++] = (char)('0' + Port % 10);
+		Port /= 10;
+	} while (Port != 0);
+	while (count != 0)
+		Buffer[length++] = digits[--count];
+	return length;
+}
+
+static BOOLEAN PcapngParsePort(const UCHAR *Text, ULONG Length, PULONG Port)
+{
+	ULONG64 value = 0;
+	ULONG i;
+
+	if (Length <= PCAPNG_PORT_PREFIX_LENGTH || Length > PCAPNG_PORT_LENGTH ||
+		memcmp(Text, PCAPNG_PORT_PREFIX, PCAPNG_PORT_PREFIX_LENGTH) != 0)
+		return FALSE;
+
+	for (i = PCAPNG_PORT_PREFIX_LENGTH; i < Length; i++)
+	{
+		if (Text[i] < '0' || Text[i] > '9')
+			return FALSE;
+		value = value * 10 + (Text[i] - '0');
+	}
+	if (value > 0xFFFFFFFF)
+		return FALSE;
+	*Port = (ULONG)value;
+	return TRUE;
+}
+
+ULONG PcapngInterface(PVOID Buffer, ULONG Length, const char *Name, ULONG Port, LONGLONG TimeOffset)
+/*++
+
+Routine Description:
+
+    Writes the interface description block of a port, the device number
+    goes to if_description. Readers add TimeOffset, in seconds, to the
+    timestamps of the interface, clients pass the wall clock time of the
+    counter origin.
+
+--*/
+{
+	PUCHAR block = (PUCHAR)Buffer, option;
+	ULONG nameLength, portLength, size;
+	UCHAR tsresol = PCAPNG_TSRESOL;
+	char port[PCAPNG_PORT_LENGTH];
+
+	nameLength = Name != NULL ? (ULONG)strlen(Name) : 0;
+	if (nameLength > 0xFFFF)
+		return 0;
+
+	portLength = PcapngFormatPort(port, Port);
+	size = 16 + (nameLength != 0 ? 4 + PCAPNG_PAD(nameLength) : 0) + 4 + PCAPNG_PAD(portLength) + 8 + 12 + 4 + 4;
+	if (Length < size)
+		return 0;
+
+	PcapngPut32(block, PCAPNG_BLOCK_INTERFACE);
+	PcapngPut32(block + 4, size);
+	PcapngPut16(block + 8, PCAPNG_LINKTYPE_SERIAL);
+	PcapngPut16(block + 10, 0);
+	PcapngPut32(block + 12, 0);
+	option = block + 16;
+	if (nameLength != 0)
+		option = PcapngPutOption(option, PCAPNG_OPT_IF_NAME, Name, (USHORT)nameLength);
+	option = PcapngPutOption(option, PCAPNG_OPT_IF_DESCRIPTION, port, (USHORT)portLength);
+	option = PcapngPutOption(option, PCAPNG_OPT_IF_TSRESOL, &tsresol, sizeof(tsresol));
+	option = PcapngPutOption(option, PCAPNG_OPT_IF_TSOFFSET, &TimeOffset, sizeof(TimeOffset));
+	option = PcapngPutOption(option, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+	PcapngPut32(option, size);
+	return size;
+}
+
+ULONG PcapngPacket(PVOID Buffer, ULONG Length, const MEMORY_CONTEXT *Record, const VOID *Payload, ULONG64 Timestamp, ULONG64 DropCount)
+/*++
+
+Routine Description:
+
+    Writes the enhanced packet block of a record. The payload is cut to
+    what fits into the buffer, the block keeps the original length.
+    DropCount is the number of records lost before this one. The device
+    number of the record goes to the interface ID field, see
+    PcapngSetInterface.
+
+Return Value:
+
+    Size of the block, 0 if not even the block without payload fits.
+
+--*/
+{
+	PUCHAR block = (PUCHAR)Buffer, option;
+	ULONG fixed, captured, size, flags;
+
+	fixed = 28 + 8 + (DropCount != 0 ? 12 : 0) + 4 + 4;
+	if (Length < fixed)
+		return 0;
+
+	captured = Record->BufferSize;
+	if (captured > ((Length - fixed) & ~(ULONG)3))
+		captured = (Length - fixed) & ~(ULONG)3;
+	size = fixed + PCAPNG_PAD(captured);
+
+	if (Record->MajorFunctionCode == PCAPNG_MJ_READ)
+		flags = PCAPNG_FLAG_INBOUND;
+	else if (Record->MajorFunctionCode == PCAPNG_MJ_WRITE)
+		flags = PCAPNG_FLAG_OUTBOUND;
+	else
+		flags = 0;
+
+	PcapngPut32(block, PCAPNG_BLOCK_ENHANCED_PACKET);
+	PcapngPut32(block + 4, size);
+	PcapngPut32(block + 8, Record->DeviceNumber);
+	PcapngPut32(block + 12, (ULONG)(Timestamp >> 32));
+	PcapngPut32(block + 16, (ULONG)Timestamp);
+	PcapngPut32(block + 20, captured);
+	PcapngPut32(block + 24, Record->BufferSize);
+	if (captured != 0)
+		memcpy(block + 28, Payload, captured);
+	memset(block + 28 + captured, 0, PCAPNG_PAD(captured) - captured);
+	option = block + 28 + PCAPNG_PAD(captured);
+	option = PcapngPutOption(option, PCAPNG_OPT_EPB_FLAGS, &flags, sizeof(flags));
+	if (DropCount != 0)
+		option = PcapngPutOption(option, PCAPNG_OPT_EPB_DROPCOUNT, &DropCount, sizeof(DropCount));
+	option = PcapngPutOption(option, PCAPNG_OPT_ENDOFOPT, NULL, 0);
+	PcapngPut32(option, size);
+	return size;
+}
+
+VOID PcapngSetInterface(PVOID Block, ULONG InterfaceId)
+/*++
+
+Routine Description:
+
+    Replaces the interface ID of an enhanced packet block, for example
+    the device number in a block of IOCTL_CPM_READ_PCAPNG with the ID
+    PcapngInterfaceId mapped it to.
+
+--*/
+{
+	PcapngPut32((PUCHAR)Block + 8, InterfaceId);
+}
+
+VOID PcapngInterfacesInitialize(PPCAPNG_INTERFACES Interfaces)
+{
+	Interfaces->Count = 0;
+	Interfaces->Last = 0;
+}
+
+ULONG PcapngInterfaceId(PPCAPNG_INTERFACES Interfaces, ULONG Port, BOOLEAN *Added)
+/*++
+
+Routine Description:
+
+    Returns the interface ID of a port, the next free one for a port not
+    seen before. Added is then set, the caller writes the interface
+    description block of the port ahead of its first packet.
+
+Return Value:
+
+    PCAPNG_INVALID if the capture already has PCAPNG_MAX_INTERFACES.
+
+--*/
+{
+	ULONG i;
+
+	*Added = FALSE;
+	if (Interfaces->Last < Interfaces->Count && Interfaces->Port[Interfaces->Last] == Port)
+		return Interfaces->Last;
+
+	for (i = 0; i < Interfaces->Count; i++)
+		if (Interfaces->Port[i] == Port)
+			return Interfaces->Last = i;
+
+	if (Interfaces->Count == PCAPNG_MAX_INTERFACES)
+		return PCAPNG_INVALID;
+
+	*Added = TRUE;
+	Interfaces->Port[Interfaces->Count] = Port;
+	return Interfaces->Last = Interfaces->Count++;
+}
+
+VOID PcapngReaderInitialize(PPCAPNG_READER Reader)
+{
+	Reader->InterfaceCount = 0;
+	Reader->Interface = 0;
+	Reader->Fixed = FALSE;
+}
+
+static ULONG64 PcapngToNanoseconds(ULONG64 Timestamp, UCHAR TsResol)
+{
+	ULONG exponent = TsResol & 0x7F;
+
+	if (TsResol & 0x80)
+	{
+		if (exponent > 32)
+			return 0;
+		return (Timestamp >> exponent) * 1000000000 + (((Timestamp & (((ULONG64)1 << exponent) - 1)) * 1000000000) >> exponent);
+	}
+	for (; exponent < 9; exponent++)
+		Timestamp *= 10;
+	for (; exponent > 9; exponent--)
+		Timestamp /= 10;
+	return Timestamp;
+}
+
+ULONG PcapngNextBlock(PPCAPNG_READER Reader, const VOID *Buffer, ULONG Length, PMEMORY_CONTEXT Record, const UCHAR **Payload)
+/*++
+
+Routine Description:
+
+    Parses the block at the start of the buffer. For an enhanced packet
+    block Record receives the record, with the port of the interface as
+    the device number and the timestamp in nanoseconds, and Payload
+    points at the data. For other blocks Record->HeaderSize is 0.
+
+Return Value:
+
+    Size of the block, 0 if the buffer ends before the block does,
+    PCAPNG_INVALID if the data is not a capture this reader understands.
+
+--*/
+{
+	const UCHAR *block = (const UCHAR *)Buffer, *option, *end;
+	ULONG type, size, captured, flags = 0, interfaceId, port;
+	USHORT code, optionLength = 0;
+	UCHAR tsresol;
+
+	memset(Record, 0, sizeof(*Record));
+	*Payload = NULL;
+	if (Length < 12)
+		return 0;
+
+	type = PcapngGet32(block);
+	size = PcapngGet32(block + 4);
+	if (size < 12 || (size & 3) != 0)
+		return PCAPNG_INVALID;
+	if (size > Length)
+		return 0;
+	if (PcapngGet32(block + size - 4) != size)
+		return PCAPNG_INVALID;
+
+	end = block + size - 4;
+	switch (type)
+	{
+	case PCAPNG_BLOCK_SECTION_HEADER:
+		if (size < 28 || PcapngGet32(block + 8) != PCAPNG_BYTE_ORDER_MAGIC || PcapngGet16(block + 12) != 1)
+			return PCAPNG_INVALID;
+		if (!Reader->Fixed)
+			Reader->InterfaceCount = 0;
+		break;
+	case PCAPNG_BLOCK_INTERFACE:
+		if (Reader->Fixed)
+			break;
+		if (size < 20 || Reader->InterfaceCount >= PCAPNG_MAX_INTERFACES)
+			return PCAPNG_INVALID;
+		tsresol = 6;
+		port = Reader->InterfaceCount;
+		for (option = block + 16; end - option >= 4; option += 4 + PCAPNG_PAD(optionLength))
+		{
+			code = PcapngGet16(option);
+			optionLength = PcapngGet16(option + 2);
+			if (code == PCAPNG_OPT_ENDOFOPT || (ULONG)(end - option - 4) < PCAPNG_PAD(optionLength))
+				break;
+			if (code == PCAPNG_OPT_IF_TSRESOL && optionLength >= 1)
+				tsresol = option[4];
+			if (code == PCAPNG_OPT_IF_DESCRIPTION)
+				PcapngParsePort(option + 4, optionLength, &port);
+		}
+		Reader->TsResol[Reader->InterfaceCount] = tsresol;
+		Reader->Port[Reader->InterfaceCount++] = port;
+		break;
+	case PCAPNG_BLOCK_ENHANCED_PACKET:
+		if (size < 32)
+			return PCAPNG_INVALID;
+		interfaceId = PcapngGet32(block + 8);
+		captured = PcapngGet32(block + 20);
+		if (interfaceId >= Reader->InterfaceCount || captured > size - 32)
+			return PCAPNG_INVALID;
+		for (option = block + 28 + PCAPNG_PAD(captured); end - option >= 4; option += 4 + PCAPNG_PAD(optionLength))
+		{
+			code = PcapngGet16(option);
+			optionLength = PcapngGet16(option + 2);
+			if (code == PCAPNG_OPT_ENDOFOPT || (ULONG)(end - option - 4) < PCAPNG_PAD(optionLength))
+				break;
+			if (code == PCAPNG_OPT_EPB_FLAGS && optionLength >= 4)
+				flags = PcapngGet32(option + 4);
+		}
+		Reader->Interface = interfaceId;
+		Record->DeviceNumber = Reader->Port[interfaceId];
+		Record->BufferSize = captured;
+		if ((flags & 3) == PCAPNG_FLAG_INBOUND)
+			Record->MajorFunctionCode = PCAPNG_MJ_READ;
+		else if ((flags & 3) == PCAPNG_FLAG_OUTBOUND)
+		{
+			Record->MajorFunctionCode = PCAPNG_MJ_WRITE;
+			Record->OutputDataOffset = captured;
+		}
+		Record->HeaderSize = sizeof(*Record);
+		Record->Timestamp = (LONGLONG)PcapngToNanoseconds((ULONG64)PcapngGet32(block + 12) << 32 | PcapngGet32(block + 16), Reader->TsResol[interfaceId]);
+		Record->LastTimestamp = Record->Timestamp;
+		*Payload = block + 28;
+		break;
+	default:
+		break;
+	}
+	return size;
+}
@@ -0,0 +1,111 @@
+/*++
+
+Module Name:
+
+    pcapng.h
+
+Abstract:
+
+    This file contains the pcapng definitions.
+
+    A capture is written as one section: a section header block, then an
+    enhanced packet block per read or write record. Interface IDs have to
+    be dense and start at 0, so the client maps the ports to them with
+    PCAPNG_INTERFACES and writes the interface description block of a
+    port in front of its first packet, with the port's
+    DEVICE_INFO::DeviceNumber in if_description. IOCTL_CPM_READ_PCAPNG
+    returns packet blocks with the device number in the interface ID
+    field, the client puts the mapped ID there with PcapngSetInterface
+    before appending them to the file. The reader turns the blocks back
+    into MEMORY_CONTEXT records of the original ports. Like the ring, the
+    module does not depend on the framework and can be built outside of
+    Windows.
+
+    Only the byte order of the machine is written and read.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+#include "Ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PCAPNG_BLOCK_SECTION_HEADER		0x0A0D0D0A
+#define PCAPNG_BLOCK_INTERFACE			0x00000001
+#define PCAPNG_BLOCK_ENHANCED_PACKET	0x00000006
+#define PCAPNG_BYTE_ORDER_MAGIC			0x1A2B3C4D
+
+//
+// No link type is registered for serial port traffic, the user range is
+// the one meant for private encapsulations.
+//
+#define PCAPNG_LINKTYPE_SERIAL			147
+
+//
+// Timestamps are written in nanoseconds, see PcapngTimestamp.
+//
+#define PCAPNG_TSRESOL					9
+
+#define PCAPNG_MAX_INTERFACES			256
+
+//
+// Size of an enhanced packet block with no payload, with both options
+// PcapngPacket writes.
+//
+#define PCAPNG_PACKET_OVERHEAD			(28 + 8 + 12 + 4 + 4)
+#define PCAPNG_PACKET_SIZE(BufferSize)	(PCAPNG_PACKET_OVERHEAD + (((BufferSize) + 3) & ~(ULONG)3))
+
+//
+// Returned by PcapngNextBlock for data that is not a valid capture.
+//
+#define PCAPNG_INVALID					0xFFFFFFFF
+
+//
+// Ports of a capture by interface ID. Last is the ID of the port looked
+// up last, records come in runs of the same port.
+//
+typedef struct _PCAPNG_INTERFACES
+{
+	ULONG Count;
+	ULONG Last;
+	ULONG Port[PCAPNG_MAX_INTERFACES];
+
+} PCAPNG_INTERFACES, *PPCAPNG_INTERFACES;
+
+//
+// Interface is the ID of the last packet block read. Port is the device
+// number found in if_description, the interface ID if there is none.
+// Fixed is set by a caller that filled in the interfaces itself, from an
+// index for example, the section headers and interface descriptions in
+// the data are then skipped.
+//
+typedef struct _PCAPNG_READER
+{
+	ULONG InterfaceCount;
+	ULONG Interface;
+	BOOLEAN Fixed;
+	UCHAR TsResol[PCAPNG_MAX_INTERFACES];
+	ULONG Port[PCAPNG_MAX_INTERFACES];
+
+} PCAPNG_READER, *PPCAPNG_READER;
+
+ULONG64 PcapngTimestamp(LONGLONG Ticks, LONGLONG Frequency);
+ULONG PcapngSectionHeader(PVOID Buffer, ULONG Length);
+ULONG PcapngInterface(PVOID Buffer, ULONG Length, const char *Name, ULONG Port, LONGLONG TimeOffset);
+ULONG PcapngPacket(PVOID Buffer, ULONG Length, const MEMORY_CONTEXT *Record, const VOID *Payload, ULONG64 Timestamp, ULONG64 DropCount);
+VOID PcapngSetInterface(PVOID Block, ULONG InterfaceId);
+VOID PcapngInterfacesInitialize(PPCAPNG_INTERFACES Interfaces);
+ULONG PcapngInterfaceId(PPCAPNG_INTERFACES Interfaces, ULONG Port, BOOLEAN *Added);
+VOID PcapngReaderInitialize(PPCAPNG_READER Reader);
+ULONG PcapngNextBlock(PPCAPNG_READER Reader, const VOID *Buffer, ULONG Length, PMEMORY_CONTEXT Record, const UCHAR **Payload);
+
+#ifdef __cplusplus
+}
+#endif
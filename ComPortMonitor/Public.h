@@ -15,10 +15,395 @@ Environment:
 
 --*/
 
+#pragma once
+
 //
 // Define an Interface Guid so that app can find the device and talk to it.
 //
 
+#ifdef DEFINE_GUID
 DEFINE_GUID (GUID_DEVINTERFACE_ComPortMonitor,
     0x792229cb,0xff25,0x4ce1,0xa2,0xb7,0x37,0xe6,0x13,0x23,0xa0,0x05);
 // {792229cb-ff25-4ce1-a2b7-37e61323a005}
+#endif
+
+//
+// Header of the capture ring. The ring buffer starts with this header,
+// record data follows at DataOffset. Head is advanced by the driver when
+// it publishes records, Tail is advanced by the consumer. Both are
+// free-running byte counters, the position in the data area is the
+// counter modulo Capacity, which is a power of two. TailRecords counts
+// the records consumed, the driver uses it to enforce the record quota
+// of the ring, so consumers advance it together with Tail (RingConsume
+// does).
+//
+typedef struct _RING_HEADER
+{
+	ULONG Capacity;
+	ULONG DataOffset;
+	ULONG Reserved1[14];
+	volatile ULONG Head;
+	ULONG Reserved2[15];
+	volatile ULONG Tail;
+	volatile ULONG TailRecords;
+	ULONG Reserved3[14];
+
+} RING_HEADER, *PRING_HEADER;
+
+//
+// Every record starts at an 8 byte boundary with this header and is
+// RING_RECORD_SIZE(Length) bytes long. A padding record fills the space
+// left at the end of the data area when the next record does not fit,
+// the consumer skips it.
+//
+typedef struct _RING_RECORD
+{
+	ULONG Length;
+	ULONG Flags;
+
+} RING_RECORD, *PRING_RECORD;
+
+#define RING_RECORD_PADDING		0x00000001
+
+#define RING_RECORD_ALIGNMENT	8
+#define RING_RECORD_SIZE(Length) \
+	((sizeof(RING_RECORD) + (Length) + RING_RECORD_ALIGNMENT - 1) & ~(ULONG)(RING_RECORD_ALIGNMENT - 1))
+
+//
+// Body of a capture record: MEMORY_CONTEXT followed by BufferSize bytes
+// of payload. The same structure is returned by IOCTL_CPM_GET_DATA_INFO.
+//
+// HeaderSize takes the former alignment padding and identifies the
+// version of the structure, it is 0 in records of version 1. Fields are
+// only ever appended. IOCTL_CPM_GET_DATA_INFO returns as much of the
+// structure as fits into the output buffer, so clients built against
+// version 1 keep receiving exactly the fields they know.
+//
+// Timestamp is the value of the performance counter taken when the data
+// crossed the filter, in ticks of IOCTL_CPM_GET_TIMESTAMP_FREQUENCY.
+// LastTimestamp is the time of the last chunk merged into the record by
+// IOCTL_CPM_SET_COALESCING, it equals Timestamp for a single chunk.
+//
+typedef struct _MEMORY_CONTEXT
+{
+	ULONG DeviceNumber;
+	ULONG BufferSize;
+	BYTE MajorFunctionCode;
+	BYTE MinorFunctionCode;
+	USHORT HeaderSize;
+	ULONG OutputDataOffset;
+	// Version 2
+	LONGLONG Timestamp;
+	// Version 3
+	LONGLONG LastTimestamp;
+} MEMORY_CONTEXT, *PMEMORY_CONTEXT;
+
+#define MEMORY_CONTEXT_VERSION_1_SIZE	16
+#define MEMORY_CONTEXT_VERSION_2_SIZE	24
+#define MEMORY_CONTEXT_VERSION_3_SIZE	32
+
+//
+// Output of IOCTL_CPM_MAP_EVENTS_RING, the capture ring of the file object
+// as mapped into the calling process. Once the ring is mapped the client
+// is its only consumer: IOCTL_CPM_GET_DATA_INFO completes with no output
+// as soon as records were committed since it last completed, and the
+// readers of the ring fail with STATUS_INVALID_DEVICE_STATE. The mapping
+// goes away with the last handle or with the process that made it.
+//
+typedef struct _EVENTS_RING_MAPPING
+{
+	ULONG64 Address;
+	ULONG Size;
+	ULONG Reserved;
+} EVENTS_RING_MAPPING, *PEVENTS_RING_MAPPING;
+
+//
+// Output of IOCTL_CPM_READ_BATCH. The header is followed by RecordCount
+// records, each one is MEMORY_CONTEXT followed by BufferSize bytes of
+// payload and starts at an 8 byte boundary. BytesUsed includes the
+// header. If the oldest record does not fit into the buffer, the request
+// completes with STATUS_BUFFER_OVERFLOW, RecordCount is 0 and BytesUsed
+// is the buffer size required for that record.
+//
+typedef struct _BATCH_HEADER
+{
+	ULONG RecordCount;
+	ULONG BytesUsed;
+} BATCH_HEADER, *PBATCH_HEADER;
+
+#define BATCH_RECORD_SIZE(BufferSize) \
+	((sizeof(MEMORY_CONTEXT) + (BufferSize) + RING_RECORD_ALIGNMENT - 1) & ~(ULONG)(RING_RECORD_ALIGNMENT - 1))
+
+//
+// Counters of one filtered port as returned by IOCTL_CPM_GET_STATS. The
+// counters start at zero when the filter attaches to the port and are
+// never reset. Requests is indexed by the IRP major function code.
+// BytesWritten counts the requested length of writes passed down, the
+// lower driver may complete them partially. CaptureDrops counts records
+// lost because the capture ring of the port was full, DeliveryDrops
+// counts records lost because the ring of a listener was full.
+//
+#define PORT_STATS_MAJOR_FUNCTIONS	28
+
+typedef struct _PORT_STATS
+{
+	ULONG DeviceNumber;
+	ULONG Reserved;
+	ULONG64 BytesRead;
+	ULONG64 BytesWritten;
+	ULONG64 SendFailures;
+	ULONG64 CaptureDrops;
+	ULONG64 DeliveryDrops;
+	ULONG64 Requests[PORT_STATS_MAJOR_FUNCTIONS];
+} PORT_STATS, *PPORT_STATS;
+
+//
+// Output of IOCTL_CPM_GET_STATS, the header is followed by PortCount
+// PORT_STATS. If the buffer is too small for all ports, the request
+// completes with STATUS_BUFFER_OVERFLOW, only the header is returned and
+// BytesUsed is the buffer size required.
+//
+typedef struct _STATS_HEADER
+{
+	ULONG PortCount;
+	ULONG BytesUsed;
+} STATS_HEADER, *PSTATS_HEADER;
+
+//
+// Input of IOCTL_CPM_ATTACH_EX. EventMask selects the records the
+// listener receives by major function code, reads and writes being the
+// two directions of the data. Payloads longer than SnapLength are
+// truncated to their first SnapLength bytes, 0 delivers headers only.
+// IOCTL_CPM_ATTACH_TO_DEVICE is the same as ATTACH_EVENTS_BASELINE with
+// ATTACH_SNAP_ALL, record types added later are only delivered to the
+// listeners asking for them here.
+//
+typedef struct _ATTACH_INFO
+{
+	ULONG DeviceNumber;
+	ULONG EventMask;
+	ULONG SnapLength;
+} ATTACH_INFO, *PATTACH_INFO;
+
+#define ATTACH_EVENT(MajorFunctionCode)	(1UL << (MajorFunctionCode))
+#define ATTACH_EVENT_CREATE		ATTACH_EVENT(0x00)	// IRP_MJ_CREATE
+#define ATTACH_EVENT_CLOSE		ATTACH_EVENT(0x02)	// IRP_MJ_CLOSE
+#define ATTACH_EVENT_READ		ATTACH_EVENT(0x03)	// IRP_MJ_READ
+#define ATTACH_EVENT_WRITE		ATTACH_EVENT(0x04)	// IRP_MJ_WRITE
+#define ATTACH_EVENT_DEVICE_CONTROL	ATTACH_EVENT(0x0e)	// IRP_MJ_DEVICE_CONTROL, see SERIAL_EVENT
+#define ATTACH_EVENTS_BASELINE	(ATTACH_EVENT_CREATE | ATTACH_EVENT_CLOSE | ATTACH_EVENT_READ | ATTACH_EVENT_WRITE)
+#define ATTACH_EVENTS_ALL		(0xFFFFFFFF & ~ATTACH_EVENT_MATCH)	// matches have to be asked for
+
+#define ATTACH_SNAP_ALL			0xFFFFFFFF
+
+//
+// Payload of a record with MajorFunctionCode IRP_MJ_DEVICE_CONTROL. Only
+// the serial requests that change or report the state of the port are
+// captured, each as one fixed-size record decoded from the request.
+// Status is the completion status of the request, Value depends on Type:
+//
+//	SERIAL_EVENT_BAUD_RATE		baud rate
+//	SERIAL_EVENT_LINE_CONTROL	word length, parity, stop bits as in
+//								SERIAL_LINE_CONTROL (NO_PARITY, STOP_BIT_1...)
+//	SERIAL_EVENT_TIMEOUTS		the five fields of SERIAL_TIMEOUTS
+//	SERIAL_EVENT_HANDFLOW		the four fields of SERIAL_HANDFLOW
+//	SERIAL_EVENT_WAIT_MASK		mask set by IOCTL_SERIAL_SET_WAIT_MASK
+//	SERIAL_EVENT_WAIT_EVENTS	events reported by IOCTL_SERIAL_WAIT_ON_MASK
+//	SERIAL_EVENT_MODEM_STATUS	SERIAL_*_STATE bits of the modem status,
+//								only when they differ from the last ones
+//								reported on the port
+//	SERIAL_EVENT_DTR			1 raised, 0 cleared
+//	SERIAL_EVENT_RTS			1 raised, 0 cleared
+//	SERIAL_EVENT_BREAK			1 on, 0 off
+//	SERIAL_EVENT_PURGE			SERIAL_PURGE_* mask
+//
+typedef struct _SERIAL_EVENT
+{
+	ULONG Type;
+	LONG Status;
+	ULONG IoControlCode;
+	ULONG Value[5];
+} SERIAL_EVENT, *PSERIAL_EVENT;
+
+#define SERIAL_EVENT_BAUD_RATE		1
+#define SERIAL_EVENT_LINE_CONTROL	2
+#define SERIAL_EVENT_TIMEOUTS		3
+#define SERIAL_EVENT_HANDFLOW		4
+#define SERIAL_EVENT_WAIT_MASK		5
+#define SERIAL_EVENT_WAIT_EVENTS	6
+#define SERIAL_EVENT_MODEM_STATUS	7
+#define SERIAL_EVENT_DTR			8
+#define SERIAL_EVENT_RTS			9
+#define SERIAL_EVENT_BREAK			10
+#define SERIAL_EVENT_PURGE			11
+
+//
+// Input of IOCTL_CPM_SET_COALESCING. Consecutive reads, or writes, of the
+// port are merged into one record while the record stays under MaxBytes
+// and no chunk comes later than IdleGap microseconds after the previous
+// one. The setting applies to the port and so to all of its listeners.
+// MaxBytes of 0 turns merging off, it is limited to COALESCE_MAX_BYTES.
+//
+typedef struct _COALESCE_CONFIG
+{
+	ULONG DeviceNumber;
+	ULONG MaxBytes;
+	ULONG IdleGap;
+} COALESCE_CONFIG, *PCOALESCE_CONFIG;
+
+#define COALESCE_MAX_BYTES		4096
+
+//
+// Input of IOCTL_CPM_SET_QUOTA, the budget of the capture ring of the
+// file object. MaxBytes counts ring space including record headers, 0
+// or more than the ring holds means the whole ring. MaxRecords of 0 means
+// no record limit. When a record does not fit, Policy decides what is
+// lost: the new record, the oldest records (not allowed while the ring
+// is mapped, the client owns its tail then) or everything from that
+// point on until the quota is set again.
+//
+typedef struct _EVENTS_QUOTA
+{
+	ULONG MaxBytes;
+	ULONG MaxRecords;
+	ULONG Policy;
+} EVENTS_QUOTA, *PEVENTS_QUOTA;
+
+#define QUOTA_POLICY_DROP_NEWEST	1
+#define QUOTA_POLICY_DROP_OLDEST	2
+#define QUOTA_POLICY_STOP			3
+
+//
+// Once a quota is set, records lost are reported in the stream by a loss
+// record: MEMORY_CONTEXT with MajorFunctionCode LOSS_RECORD_FUNCTION and
+// DeviceNumber LOSS_RECORD_DEVICE, followed by LOSS_INFO. It precedes the
+// first record delivered after the loss. Records and Bytes count what
+// was lost since the previous loss record, Bytes being payload bytes,
+// the totals count everything lost since the file object was opened.
+//
+typedef struct _LOSS_INFO
+{
+	ULONG64 Records;
+	ULONG64 Bytes;
+	ULONG64 TotalRecords;
+	ULONG64 TotalBytes;
+	ULONG Flags;
+	ULONG Reserved;
+} LOSS_INFO, *PLOSS_INFO;
+
+#define LOSS_RECORD_FUNCTION	0xFF
+#define LOSS_RECORD_DEVICE		0xFFFFFFFF
+
+#define LOSS_FLAG_STOPPED		0x00000001
+
+//
+// Capture filter program, input of IOCTL_CPM_SET_FILTER. The program is
+// an array of FILTER_INSN run against every record before it is copied
+// to the listener, modelled after classic BPF. It has an accumulator A
+// and returns the number of payload bytes to deliver, 0 drops the
+// record. Loads read the payload big endian, a load past the end of the
+// payload drops the record. Jumps only go forward, Jt and Jf (or K for
+// FILTER_JA) count the instructions skipped, so every program ends. The
+// last instruction must be a return.
+//
+typedef struct _FILTER_INSN
+{
+	USHORT Code;
+	BYTE Jt;
+	BYTE Jf;
+	ULONG K;
+} FILTER_INSN, *PFILTER_INSN;
+
+#define FILTER_LD_BYTE		0x0001	// A = Payload[K]
+#define FILTER_LD_HALF		0x0002	// A = Payload[K .. K + 1]
+#define FILTER_LD_WORD		0x0003	// A = Payload[K .. K + 3]
+#define FILTER_LD_LEN		0x0004	// A = payload length
+#define FILTER_LD_MAJOR		0x0005	// A = MajorFunctionCode, the direction
+#define FILTER_LD_IMM		0x0006	// A = K
+#define FILTER_AND			0x0010	// A = A & K
+#define FILTER_RSH			0x0011	// A = A >> K, K < 32
+#define FILTER_JA			0x0020	// skip K
+#define FILTER_JEQ			0x0021	// skip A == K ? Jt : Jf
+#define FILTER_JGT			0x0022	// skip A > K ? Jt : Jf
+#define FILTER_JGE			0x0023	// skip A >= K ? Jt : Jf
+#define FILTER_JSET			0x0024	// skip (A & K) != 0 ? Jt : Jf
+#define FILTER_RET			0x0030	// return K
+#define FILTER_RET_A		0x0031	// return A
+
+#define FILTER_MAX_INSNS	256
+
+//
+// Input of IOCTL_CPM_SET_PATTERNS, a sequence of MATCH_PATTERN entries,
+// each MATCH_PATTERN_SIZE(Length) bytes long. The patterns are searched
+// for in the data of every port, in each direction separately and across
+// record boundaries. The index of a pattern in the sequence is its ID.
+// An empty input buffer removes the patterns. Flags is a combination of
+// MATCH_FLAG_* values.
+//
+typedef struct _MATCH_PATTERN
+{
+	USHORT Length;
+	USHORT Flags;
+	UCHAR Data[1];
+} MATCH_PATTERN, *PMATCH_PATTERN;
+
+#define MATCH_PATTERN_SIZE(Length)	((4 + (ULONG)(Length) + 3) & ~(ULONG)3)
+#define MATCH_MAX_STATES		16384	// total length of the patterns, plus 1
+#define MATCH_MAX_SIZE			(4 * 1024 * 1024)
+
+#define MATCH_FLAG_FREEZE		0x0001	// a match freezes the recorder of the port
+
+//
+// A match is delivered to the listeners that asked for ATTACH_EVENT_MATCH
+// by name, ATTACH_EVENTS_ALL leaves it out. It comes as a record of its
+// own: MEMORY_CONTEXT with MajorFunctionCode MATCH_RECORD_FUNCTION and
+// MinorFunctionCode the major function code of the data, IRP_MJ_READ or
+// IRP_MJ_WRITE, followed by MATCH_INFO. Offset counts the bytes of that
+// direction of the port since the patterns were set, up to the end of
+// the match. It follows the record that completed the match.
+//
+typedef struct _MATCH_INFO
+{
+	ULONG Pattern;
+	ULONG Reserved;
+	ULONG64 Offset;
+} MATCH_INFO, *PMATCH_INFO;
+
+#define MATCH_RECORD_FUNCTION	0x1F
+#define ATTACH_EVENT_MATCH		ATTACH_EVENT(MATCH_RECORD_FUNCTION)
+
+//
+// Input of IOCTL_CPM_SET_RECORDER. The port keeps its latest records, up
+// to Size bytes in the layout of IOCTL_CPM_READ_BATCH, in a buffer of its
+// own that nobody has to drain: every kind of record is kept, attached
+// listeners or not, the oldest records making room for new ones. Size is
+// limited to RECORDER_MAX_SIZE, 0 turns the recorder off. Setting the
+// recorder again clears it and starts it anew if it was frozen.
+//
+// IOCTL_CPM_DUMP_RECORDER takes the device number, freezes the recorder
+// and returns everything in it as IOCTL_CPM_READ_BATCH does. A buffer
+// too small for all of it completes with STATUS_BUFFER_OVERFLOW, only
+// the header filled in with the size required. The recorder stays
+// frozen, so the dump can be repeated, until it is set again. A pattern
+// with MATCH_FLAG_FREEZE freezes the recorder of the port it matched on.
+//
+typedef struct _RECORDER_CONFIG
+{
+	ULONG DeviceNumber;
+	ULONG Size;
+} RECORDER_CONFIG, *PRECORDER_CONFIG;
+
+#define RECORDER_MAX_SIZE		(16 * 1024 * 1024)
+
+//
+// Input of IOCTL_CPM_READ_DIRECT. The output buffer, locked down by
+// METHOD_OUT_DIRECT, receives records laid out as by IOCTL_CPM_READ_BATCH.
+// A client keeps many of these requests outstanding: records are written
+// straight into the oldest pending buffer, which completes once it is
+// full or Latency microseconds after its first record. Records waiting
+// in the capture ring complete the request at once, as READ_BATCH does.
+//
+typedef struct _READ_DIRECT_CONFIG
+{
+	ULONG Latency;
+} READ_DIRECT_CONFIG, *PREAD_DIRECT_CONFIG;
@@ -17,12 +17,81 @@ Environment:
 #include "driver.h"
 #include "Control.h"
 #include<wdfstatus.h>
+#include <ntddser.h>
 #include "queue.tmh"
 
 #ifdef ALLOC_PRAGMA
+#pragma alloc_text (PAGE, ComPortMonitorCaptureInitialize)
 #pragma alloc_text (PAGE, ComPortMonitorQueueInitialize)
 #endif
 
+NTSTATUS
+ComPortMonitorCaptureInitialize(
+	_In_ WDFDEVICE Device
+)
+/*++
+
+Routine Description:
+
+    Creates the capture ring of the device and the objects that serialize
+    its producers and its consumer.
+
+--*/
+{
+	NTSTATUS status;
+	WDF_OBJECT_ATTRIBUTES attr;
+	WDF_WORKITEM_CONFIG config;
+	WDF_TIMER_CONFIG timerConfig;
+	PDEVICE_CONTEXT devContext;
+	PVOID buffer;
+
+	PAGED_CODE();
+
+	devContext = DeviceGetContext(Device);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+	attr.ParentObject = Device;
+	status = WdfMemoryCreate(&attr, NonPagedPool, 0, CAPTURE_RING_SIZE, &devContext->CaptureMemory, &buffer);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	RingInitialize(&devContext->Capture, buffer, CAPTURE_RING_SIZE);
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+	attr.ParentObject = Device;
+	status = WdfSpinLockCreate(&attr, &devContext->CaptureLock);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+	attr.ParentObject = Device;
+	status = WdfWaitLockCreate(&attr, &devContext->DrainLock);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	//
+	// The record being merged lives in a buffer of its own until it is
+	// complete, so the consumer of the ring never sees it half done.
+	//
+	WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+	attr.ParentObject = Device;
+	status = WdfMemoryCreate(&attr, NonPagedPool, 0, sizeof(MEMORY_CONTEXT) + COALESCE_MAX_BYTES, &devContext->CoalesceMemory, &devContext->Coalesced);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	WDF_TIMER_CONFIG_INIT(&timerConfig, ComPortMonitorEvtCoalesceTimer);
+	WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+	attr.ParentObject = Device;
+	status = WdfTimerCreate(&timerConfig, &attr, &devContext->CoalesceTimer);
+	if (!NT_SUCCESS(status))
+		return status;
+
+	WDF_WORKITEM_CONFIG_INIT(&config, ComPortMonitorEvtWorkItem);
+	WDF_OBJECT_ATTRIBUTES_INIT(&attr);
+	attr.ParentObject = Device;
+	return WdfWorkItemCreate(&config, &attr, &devContext->CaptureWorkItem);
+}
+
 NTSTATUS
 ComPortMonitorQueueInitialize(
     _In_ WDFDEVICE Device
@@ -78,6 +147,8 @@ VOID ComPortMonitorEvtIoRead(
 	NTSTATUS status;
 	WDFDEVICE device = WdfIoQueueGetDevice(Queue);
 	UNREFERENCED_PARAMETER(Length);
+
+	COUNT_EVENT(DeviceGetContext(device), Requests[IRP_MJ_READ], 1);
 	//
 	// The following funciton essentially copies the content of
 	// current stack location of the underlying IRP to the next one. 
@@ -90,6 +161,7 @@ VOID ComPortMonitorEvtIoRead(
 	{
 		status = WdfRequestGetStatus(Request);
 		KdPrint(("WdfRequestSend failed: 0x%x\n", status));
+		COUNT_EVENT(DeviceGetContext(device), SendFailures, 1);
 		WdfRequestComplete(Request, status);
 	}
 }
@@ -102,47 +174,43 @@ void ComPortMonitorCompletionRoutine(
 )
 {
 	NTSTATUS status;
-	WDF_WORKITEM_CONFIG config;
-	WDF_OBJECT_ATTRIBUTES attr;
-	WDFWORKITEM work;
-	PWORKITEM_CONTEXT context;
-	PVOID buffer;
 	WDF_REQUEST_PARAMETERS params;
 	WDFMEMORY mem;
+	MEMORY_CONTEXT context;
+	PVOID buffer;
+	size_t length;
 	UNREFERENCED_PARAMETER(Target);
 
 	__try
 	{
 		if (!NT_SUCCESS(Params->IoStatus.Status) || Params->IoStatus.Information == 0)
-			return;
+			__leave;
 
-		WDF_WORKITEM_CONFIG_INIT(&config, ComPortMonitorEvtWorkItem);
-		WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attr, WORKITEM_CONTEXT);
-		attr.ParentObject = WdfRequestGetFileObject(Request);
-		status = WdfWorkItemCreate(&config, &attr, &work);
-		if (!NT_SUCCESS(status))
-			return;
+		COUNT_EVENT(DeviceGetContext(Context), BytesRead, Params->IoStatus.Information);
 
-		WDF_OBJECT_ATTRIBUTES_INIT(&attr);
-		attr.ParentObject = work;
-		context = WorkItemGetContext(work);
-		status = WdfMemoryCreate(&attr, NonPagedPool, 0, Params->IoStatus.Information, &context->data, &buffer);
+		status = WdfRequestRetrieveOutputMemory(Request, &mem);
 		if (!NT_SUCCESS(status))
-		{
-			WdfObjectDelete(work);
-			return;
-		}
+			__leave;
+
+		//
+		// Taken before anything else, so the time is when the data
+		// arrived rather than when the record made it through capture.
+		//
+		context.Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+
+		buffer = WdfMemoryGetBuffer(mem, &length);
+		if (length > Params->IoStatus.Information)
+			length = Params->IoStatus.Information;
 
-		WdfRequestRetrieveOutputMemory(Request, &mem);
-		WdfMemoryCopyToBuffer(mem, 0, buffer, Params->IoStatus.Information);
-		context->Device = Context;
-		context->BufferSize = (ULONG)Params->IoStatus.Information;
-		context->OutputDataOffset = 0;
 		WDF_REQUEST_PARAMETERS_INIT(&params);
 		WdfRequestGetParameters(Request, &params);
-		context->MajorFunctionCode = params.Type;
-		context->MinorFunctionCode = params.MinorFunction;
-		WdfWorkItemEnqueue(work);
+		context.DeviceNumber = 0;
+		context.BufferSize = (ULONG)length;
+		context.MajorFunctionCode = params.Type;
+		context.MinorFunctionCode = params.MinorFunction;
+		context.HeaderSize = 0;
+		context.OutputDataOffset = 0;
+		ComPortMonitor_CaptureEvent(Context, &context, buffer);
 	}
 	__finally
 	{
@@ -150,19 +218,298 @@ void ComPortMonitorCompletionRoutine(
 	}
 }
 
+VOID ComPortMonitor_CaptureEvent(WDFDEVICE Device, PMEMORY_CONTEXT IrpInfo, PVOID Buffer)
+/*++
+
+Routine Description:
+
+    Appends a captured chunk to the capture ring of the device and
+    schedules its delivery. Callable at IRQL <= DISPATCH_LEVEL, so read
+    completions capture inline. The listeners are notified in batches
+    from ComPortMonitorEvtWorkItem, the work item is queued at most once
+    no matter how many chunks arrive before it runs. With coalescing set
+    for the port, small reads and writes are merged into one record
+    first, see COALESCE_CONFIG. Past the high-water mark of the ring the
+    caller drains it itself if it can wait, see CAPTURE_RING_HIGH_WATER.
+
+--*/
+{
+	PDEVICE_CONTEXT devContext;
+	PMEMORY_CONTEXT coalesced;
+	BOOLEAN committed = FALSE, merged = FALSE, full;
+
+	devContext = DeviceGetContext(Device);
+	if ((devContext->EventMask & ATTACH_EVENT(IrpInfo->MajorFunctionCode)) == 0)
+		return;
+
+	IrpInfo->LastTimestamp = IrpInfo->Timestamp;
+	WdfSpinLockAcquire(devContext->CaptureLock);
+	coalesced = devContext->Coalesced;
+
+	//
+	// The chunk ends the record being merged if it goes the other way,
+	// comes after the idle gap or does not fit.
+	//
+	if (devContext->CoalescePending &&
+		(IrpInfo->MajorFunctionCode != coalesced->MajorFunctionCode ||
+		IrpInfo->Timestamp - coalesced->LastTimestamp > devContext->CoalesceIdleTicks ||
+		IrpInfo->BufferSize > devContext->CoalesceMaxBytes - coalesced->BufferSize))
+		committed |= ComPortMonitor_FlushCoalesced(devContext);
+
+	//
+	// Only reads with all of their payload output and writes with all of
+	// it input are merged, so the offsets of a merged record add up to 0
+	// for reads and to BufferSize for writes, as for a single chunk.
+	//
+	if (IrpInfo->BufferSize != 0 && IrpInfo->BufferSize < devContext->CoalesceMaxBytes &&
+		((IrpInfo->MajorFunctionCode == IRP_MJ_READ && IrpInfo->OutputDataOffset == 0) ||
+		(IrpInfo->MajorFunctionCode == IRP_MJ_WRITE && IrpInfo->OutputDataOffset == IrpInfo->BufferSize)))
+	{
+		if (!devContext->CoalescePending)
+		{
+			memcpy(coalesced, IrpInfo, sizeof(*coalesced));
+			coalesced->BufferSize = 0;
+			coalesced->OutputDataOffset = 0;
+			devContext->CoalescePending = TRUE;
+		}
+		memcpy((PUCHAR)(coalesced + 1) + coalesced->BufferSize, Buffer, IrpInfo->BufferSize);
+		coalesced->BufferSize += IrpInfo->BufferSize;
+		coalesced->OutputDataOffset += IrpInfo->OutputDataOffset;
+		coalesced->LastTimestamp = IrpInfo->Timestamp;
+		if (coalesced->BufferSize >= devContext->CoalesceMaxBytes)
+			committed |= ComPortMonitor_FlushCoalesced(devContext);
+		else
+			merged = TRUE;
+	}
+	else
+		committed |= ComPortMonitor_CaptureRecord(devContext, IrpInfo, Buffer);
+	full = committed && RingUsed(&devContext->Capture, NULL) >= CAPTURE_RING_HIGH_WATER;
+	WdfSpinLockRelease(devContext->CaptureLock);
+
+	if (merged)
+		WdfTimerStart(devContext->CoalesceTimer, WDF_REL_TIMEOUT_IN_US(devContext->CoalesceIdleGap));
+	if (full && KeGetCurrentIrql() == PASSIVE_LEVEL)
+		ComPortMonitor_DrainCapture(Device);
+	else if (committed)
+		WdfWorkItemEnqueue(devContext->CaptureWorkItem);
+}
+
+BOOLEAN ComPortMonitor_CaptureRecord(PDEVICE_CONTEXT DevContext, PMEMORY_CONTEXT IrpInfo, PVOID Buffer)
+/*++
+
+Routine Description:
+
+    Appends a record to the capture ring of the device, its payload cut
+    to the longest snap length of the listeners. Called with CaptureLock
+    held.
+
+Return Value:
+
+    FALSE if the ring is full and the record is lost.
+
+--*/
+{
+	PMEMORY_CONTEXT memContext;
+	ULONG length = IrpInfo->BufferSize;
+
+	if (length > (ULONG)DevContext->SnapLength)
+		length = (ULONG)DevContext->SnapLength;
+
+	memContext = RingReserve(&DevContext->Capture, sizeof(*memContext) + length);
+	if (memContext == NULL)
+	{
+		COUNT_EVENT(DevContext, CaptureDrops, 1);
+		return FALSE;
+	}
+
+	memcpy(memContext, IrpInfo, sizeof(*memContext));
+	memContext->DeviceNumber = DevContext->Number;
+	memContext->HeaderSize = sizeof(*memContext);
+	memContext->BufferSize = length;
+	if (length != 0)
+		memcpy(memContext + 1, Buffer, length);
+	RingCommit(&DevContext->Capture);
+	return TRUE;
+}
+
+BOOLEAN ComPortMonitor_FlushCoalesced(PDEVICE_CONTEXT DevContext)
+/*++
+
+Routine Description:
+
+    Moves the record being merged to the capture ring. Called with
+    CaptureLock held.
+
+Return Value:
+
+    TRUE if a record was committed to the ring.
+
+--*/
+{
+	if (!DevContext->CoalescePending)
+		return FALSE;
+
+	DevContext->CoalescePending = FALSE;
+	return ComPortMonitor_CaptureRecord(DevContext, DevContext->Coalesced, DevContext->Coalesced + 1);
+}
+
+VOID ComPortMonitorEvtCoalesceTimer(
+	_In_ WDFTIMER Timer
+)
+/*++
+
+Routine Description:
+
+    Ends the record being merged once the port has been idle for the
+    configured gap. The timer only bounds the delivery delay, the merging
+    itself is decided on the timestamps of the chunks.
+
+--*/
+{
+	PDEVICE_CONTEXT devContext;
+	BOOLEAN committed;
+
+	devContext = DeviceGetContext(WdfTimerGetParentObject(Timer));
+	WdfSpinLockAcquire(devContext->CaptureLock);
+	committed = ComPortMonitor_FlushCoalesced(devContext);
+	WdfSpinLockRelease(devContext->CaptureLock);
+
+	if (committed)
+		WdfWorkItemEnqueue(devContext->CaptureWorkItem);
+}
+
+VOID ComPortMonitor_SetCoalescing(WDFDEVICE Device, PCOALESCE_CONFIG Config)
+/*++
+
+Routine Description:
+
+    Applies IOCTL_CPM_SET_COALESCING to the device. The record being
+    merged under the old setting is delivered first.
+
+--*/
+{
+	PDEVICE_CONTEXT devContext;
+	LARGE_INTEGER frequency;
+	BOOLEAN committed;
+
+	KeQueryPerformanceCounter(&frequency);
+	devContext = DeviceGetContext(Device);
+	WdfSpinLockAcquire(devContext->CaptureLock);
+	committed = ComPortMonitor_FlushCoalesced(devContext);
+	devContext->CoalesceMaxBytes = min(Config->MaxBytes, COALESCE_MAX_BYTES);
+	devContext->CoalesceIdleGap = Config->IdleGap;
+	devContext->CoalesceIdleTicks = (LONGLONG)Config->IdleGap * frequency.QuadPart / 1000000;
+	WdfSpinLockRelease(devContext->CaptureLock);
+
+	if (committed)
+		WdfWorkItemEnqueue(devContext->CaptureWorkItem);
+}
+
 VOID ComPortMonitorEvtWorkItem(
 	_In_ WDFWORKITEM WorkItem
 )
 {
-	PWORKITEM_CONTEXT context;
-	MEMORY_CONTEXT mem;
-
-	context = WorkItemGetContext(WorkItem);
-	mem.BufferSize = context->BufferSize;
-	mem.MajorFunctionCode = context->MajorFunctionCode;
-	mem.MinorFunctionCode = context->MinorFunctionCode;
-	mem.OutputDataOffset = context->OutputDataOffset;
-	ComPortMonitor_EvtNotifyListeners(context->Device, context->data, &mem);
+	ComPortMonitor_DrainCapture(WdfWorkItemGetParentObject(WorkItem));
+}
+
+VOID ComPortMonitor_DrainCapture(WDFDEVICE Device)
+/*++
+
+Routine Description:
+
+    Drains the capture ring of the device and hands every record to the
+    listeners and the recorder, then runs the patterns over its data.
+    Called from the work item, or in line from a capture that found the
+    ring filled past its high-water mark. DrainLock keeps a single
+    consumer on the ring. Must be called at PASSIVE_LEVEL.
+
+--*/
+{
+	PDEVICE_CONTEXT devContext;
+	PMEMORY_CONTEXT memContext;
+	BOOLEAN frozen;
+
+	devContext = DeviceGetContext(Device);
+
+	WdfWaitLockAcquire(devContext->DrainLock, NULL);
+	frozen = devContext->Recorder.Frozen;
+	while ((memContext = RingPeek(&devContext->Capture, NULL)) != NULL)
+	{
+		ComPortMonitor_EvtNotifyListeners(Device, memContext, memContext + 1);
+		if (devContext->RecorderMemory != NULL)
+			RecorderAppend(&devContext->Recorder, memContext, memContext + 1);
+		if (devContext->Patterns != NULL)
+			ComPortMonitor_MatchRecord(Device, memContext, memContext + 1);
+		RingConsume(&devContext->Capture);
+	}
+	frozen = !frozen && devContext->Recorder.Frozen;
+	WdfWaitLockRelease(devContext->DrainLock);
+
+	//
+	// A pattern froze the recorder, the records only it took are not
+	// captured any more. ListenersLock comes before DrainLock.
+	//
+	if (frozen)
+		ComPortMonitor_RefreshCapture(Device);
+}
+
+VOID ComPortMonitor_MatchRecord(WDFDEVICE Device, PMEMORY_CONTEXT IrpInfo, PVOID Buffer)
+/*++
+
+Routine Description:
+
+    Runs the patterns over the data of a read or write record, carrying
+    the state of the direction over from the previous record. Called from
+    the drain loop with DrainLock held, which keeps the patterns alive,
+    see ControlDevice_SetPatterns.
+
+--*/
+{
+	PDEVICE_CONTEXT devContext;
+	MATCH_CONTEXT match;
+
+	if (IrpInfo->MajorFunctionCode != IRP_MJ_READ && IrpInfo->MajorFunctionCode != IRP_MJ_WRITE)
+		return;
+
+	devContext = DeviceGetContext(Device);
+	match.Device = Device;
+	match.Record = IrpInfo;
+	match.Direction = IrpInfo->MajorFunctionCode == IRP_MJ_WRITE;
+	devContext->MatchState[match.Direction] = MatchRun(devContext->Patterns, devContext->MatchState[match.Direction], Buffer, IrpInfo->BufferSize, ComPortMonitor_EvtMatch, &match);
+	devContext->MatchOffset[match.Direction] += IrpInfo->BufferSize;
+}
+
+VOID ComPortMonitor_EvtMatch(PVOID Context, ULONG Pattern, ULONG Offset)
+/*++
+
+Routine Description:
+
+    Delivers a match record to the listeners that asked for matches and
+    freezes the recorder of the port if the pattern says so. The record
+    that completed the match is already in the recorder.
+
+--*/
+{
+	PMATCH_CONTEXT match = Context;
+	PDEVICE_CONTEXT devContext;
+	MEMORY_CONTEXT context;
+	MATCH_INFO info;
+
+	devContext = DeviceGetContext(match->Device);
+	memset(&context, 0, sizeof(context));
+	context.Timestamp = match->Record->Timestamp;
+	context.LastTimestamp = match->Record->LastTimestamp;
+	context.BufferSize = sizeof(info);
+	context.MajorFunctionCode = MATCH_RECORD_FUNCTION;
+	context.MinorFunctionCode = match->Record->MajorFunctionCode;
+	context.HeaderSize = sizeof(context);
+	info.Pattern = Pattern;
+	info.Reserved = 0;
+	info.Offset = devContext->MatchOffset[match->Direction] + Offset;
+	ComPortMonitor_EvtNotifyListeners(match->Device, &context, &info);
+
+	if (MatchFlags(devContext->Patterns, Pattern) & MATCH_FLAG_FREEZE)
+		devContext->Recorder.Frozen = TRUE;
 }
 
 VOID ComPortMonitorEvtIoWrite(
@@ -171,20 +518,26 @@ VOID ComPortMonitorEvtIoWrite(
 	_In_ size_t     Length
 )
 {
-	WDFMEMORY mem;
+	PVOID buffer;
 	MEMORY_CONTEXT context;
 	WDF_REQUEST_PARAMETERS params;
+	PDEVICE_CONTEXT devContext;
 
-	if (NT_SUCCESS(WdfRequestRetrieveInputMemory(Request, &mem)))
+	devContext = DeviceGetContext(WdfIoQueueGetDevice(Queue));
+	COUNT_EVENT(devContext, Requests[IRP_MJ_WRITE], 1);
+	COUNT_EVENT(devContext, BytesWritten, Length);
+
+	if (NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request, Length, &buffer, NULL)))
 	{
 		WDF_REQUEST_PARAMETERS_INIT(&params);
 		WdfRequestGetParameters(Request, &params);
 		memset(&context, 0, sizeof(context));
+		context.Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
 		context.BufferSize = (ULONG)Length;
 		context.MajorFunctionCode = params.Type;
 		context.MinorFunctionCode = params.MinorFunction;
 		context.OutputDataOffset = (ULONG)Length;
-		ComPortMonitor_EvtNotifyListeners(WdfIoQueueGetDevice(Queue), mem, &context);
+		ComPortMonitor_CaptureEvent(WdfIoQueueGetDevice(Queue), &context, buffer);
 	}
 	ComPortMonitor_ForwardRequest(Request, WdfIoQueueGetDevice(Queue));
 }
@@ -222,93 +575,307 @@ Return Value:
 
 --*/
 {
-	UNREFERENCED_PARAMETER(Queue);
-	UNREFERENCED_PARAMETER(Request);
+	WDFDEVICE device = WdfIoQueueGetDevice(Queue);
+	PDEVICE_CONTEXT devContext = DeviceGetContext(device);
+	NTSTATUS status;
 	UNREFERENCED_PARAMETER(OutputBufferLength);
 	UNREFERENCED_PARAMETER(InputBufferLength);
-	UNREFERENCED_PARAMETER(IoControlCode);
 
-	ComPortMonitor_ForwardRequest(Request, WdfIoQueueGetDevice(Queue));
+	COUNT_EVENT(devContext, Requests[IRP_MJ_DEVICE_CONTROL], 1);
+
+	//
+	// Only the requests decoded into SERIAL_EVENT take the completion
+	// routine, and only while someone listens for them. Everything else,
+	// status polling included, is sent and forgotten.
+	//
+	if ((devContext->EventMask & ATTACH_EVENT(IRP_MJ_DEVICE_CONTROL)) == 0 || !ComPortMonitor_IsSerialEvent(IoControlCode))
+	{
+		ComPortMonitor_ForwardRequest(Request, device);
+		return;
+	}
+
+	WdfRequestFormatRequestUsingCurrentType(Request);
+	WdfRequestSetCompletionRoutine(Request, ComPortMonitorIoctlCompletionRoutine, device);
+	if (WdfRequestSend(Request, WdfDeviceGetIoTarget(device), WDF_NO_SEND_OPTIONS) == FALSE)
+	{
+		status = WdfRequestGetStatus(Request);
+		KdPrint(("WdfRequestSend failed: 0x%x\n", status));
+		COUNT_EVENT(devContext, SendFailures, 1);
+		WdfRequestComplete(Request, status);
+	}
 }
 
-VOID ComPortMonitor_EvtNotifyListeners(WDFDEVICE EventSource, WDFMEMORY Memory, PMEMORY_CONTEXT IrpInfo)
+BOOLEAN ComPortMonitor_IsSerialEvent(ULONG IoControlCode)
 {
-	NTSTATUS status;
-	ULONG i, ci;
+	switch (IoControlCode)
+	{
+	case IOCTL_SERIAL_SET_BAUD_RATE:
+	case IOCTL_SERIAL_SET_LINE_CONTROL:
+	case IOCTL_SERIAL_SET_TIMEOUTS:
+	case IOCTL_SERIAL_SET_HANDFLOW:
+	case IOCTL_SERIAL_SET_WAIT_MASK:
+	case IOCTL_SERIAL_WAIT_ON_MASK:
+	case IOCTL_SERIAL_GET_MODEMSTATUS:
+	case IOCTL_SERIAL_SET_DTR:
+	case IOCTL_SERIAL_CLR_DTR:
+	case IOCTL_SERIAL_SET_RTS:
+	case IOCTL_SERIAL_CLR_RTS:
+	case IOCTL_SERIAL_SET_BREAK_ON:
+	case IOCTL_SERIAL_SET_BREAK_OFF:
+	case IOCTL_SERIAL_PURGE:
+		return TRUE;
+	default:
+		return FALSE;
+	}
+}
+
+void ComPortMonitorIoctlCompletionRoutine(
+	_In_ WDFREQUEST                     Request,
+	_In_ WDFIOTARGET                    Target,
+	_In_ PWDF_REQUEST_COMPLETION_PARAMS Params,
+	_In_ WDFCONTEXT                     Context
+)
+{
+	MEMORY_CONTEXT context;
+	SERIAL_EVENT event;
+	PDEVICE_CONTEXT devContext;
+	UNREFERENCED_PARAMETER(Target);
+
+	memset(&context, 0, sizeof(context));
+	context.Timestamp = KeQueryPerformanceCounter(NULL).QuadPart;
+	devContext = DeviceGetContext(Context);
+
+	//
+	// Applications poll the modem status in tight loops, only a change of
+	// it is captured.
+	//
+	if (ComPortMonitor_DecodeSerialEvent(Request, Params, &event) &&
+		(event.Type != SERIAL_EVENT_MODEM_STATUS || !NT_SUCCESS(event.Status) ||
+		InterlockedExchange(&devContext->ModemStatus, (LONG)event.Value[0]) != (LONG)event.Value[0]))
+	{
+		context.BufferSize = sizeof(event);
+		context.MajorFunctionCode = IRP_MJ_DEVICE_CONTROL;
+		ComPortMonitor_CaptureEvent(Context, &context, &event);
+	}
+	WdfRequestComplete(Request, Params->IoStatus.Status);
+}
+
+BOOLEAN ComPortMonitor_DecodeSerialEvent(WDFREQUEST Request, PWDF_REQUEST_COMPLETION_PARAMS Params, PSERIAL_EVENT Event)
+/*++
+
+Routine Description:
+
+    Builds the SERIAL_EVENT of a completed serial request. Settings are
+    taken from the input buffer, reported states from the output buffer
+    as far as the lower driver filled it.
+
+    The request is sent formatted with its current type, for which the
+    framework leaves Params->Parameters zeroed: the control code and the
+    buffers come from the request itself, the length of the output from
+    the status block.
+
+Return Value:
+
+    FALSE if the request carries too little data to decode.
+
+--*/
+{
+	WDF_REQUEST_PARAMETERS params;
+	PUCHAR input = NULL, output = NULL;
+	size_t inputLength = 0, outputLength = 0;
+	PSERIAL_LINE_CONTROL lineControl;
+	PSERIAL_TIMEOUTS timeouts;
+	PSERIAL_HANDFLOW handflow;
+
+	WDF_REQUEST_PARAMETERS_INIT(&params);
+	WdfRequestGetParameters(Request, &params);
+	if (params.Parameters.DeviceIoControl.InputBufferLength != 0 &&
+		!NT_SUCCESS(WdfRequestRetrieveInputBuffer(Request, 0, &input, &inputLength)))
+	{
+		input = NULL;
+		inputLength = 0;
+	}
+	if (params.Parameters.DeviceIoControl.OutputBufferLength != 0 && NT_SUCCESS(Params->IoStatus.Status))
+	{
+		if (NT_SUCCESS(WdfRequestRetrieveOutputBuffer(Request, 0, &output, &outputLength)))
+			outputLength = min(outputLength, Params->IoStatus.Information);
+		else
+		{
+			output = NULL;
+			outputLength = 0;
+		}
+	}
+
+	RtlZeroMemory(Event, sizeof(*Event));
+	Event->Status = Params->IoStatus.Status;
+	Event->IoControlCode = params.Parameters.DeviceIoControl.IoControlCode;
+	switch (Event->IoControlCode)
+	{
+	case IOCTL_SERIAL_SET_BAUD_RATE:
+		if (inputLength < sizeof(SERIAL_BAUD_RATE))
+			return FALSE;
+		Event->Type = SERIAL_EVENT_BAUD_RATE;
+		Event->Value[0] = ((PSERIAL_BAUD_RATE)input)->BaudRate;
+		break;
+	case IOCTL_SERIAL_SET_LINE_CONTROL:
+		if (inputLength < sizeof(SERIAL_LINE_CONTROL))
+			return FALSE;
+		lineControl = (PSERIAL_LINE_CONTROL)input;
+		Event->Type = SERIAL_EVENT_LINE_CONTROL;
+		Event->Value[0] = lineControl->WordLength;
+		Event->Value[1] = lineControl->Parity;
+		Event->Value[2] = lineControl->StopBits;
+		break;
+	case IOCTL_SERIAL_SET_TIMEOUTS:
+		if (inputLength < sizeof(SERIAL_TIMEOUTS))
+			return FALSE;
+		timeouts = (PSERIAL_TIMEOUTS)input;
+		Event->Type = SERIAL_EVENT_TIMEOUTS;
+		Event->Value[0] = timeouts->ReadIntervalTimeout;
+		Event->Value[1] = timeouts->ReadTotalTimeoutMultiplier;
+		Event->Value[2] = timeouts->ReadTotalTimeoutConstant;
+		Event->Value[3] = timeouts->WriteTotalTimeoutMultiplier;
+		Event->Value[4] = timeouts->WriteTotalTimeoutConstant;
+		break;
+	case IOCTL_SERIAL_SET_HANDFLOW:
+		if (inputLength < sizeof(SERIAL_HANDFLOW))
+			return FALSE;
+		handflow = (PSERIAL_HANDFLOW)input;
+		Event->Type = SERIAL_EVENT_HANDFLOW;
+		Event->Value[0] = handflow->ControlHandShake;
+		Event->Value[1] = handflow->FlowReplace;
+		Event->Value[2] = (ULONG)handflow->XonLimit;
+		Event->Value[3] = (ULONG)handflow->XoffLimit;
+		break;
+	case IOCTL_SERIAL_SET_WAIT_MASK:
+	case IOCTL_SERIAL_PURGE:
+		if (inputLength < sizeof(ULONG))
+			return FALSE;
+		Event->Type = Event->IoControlCode == IOCTL_SERIAL_PURGE ? SERIAL_EVENT_PURGE : SERIAL_EVENT_WAIT_MASK;
+		Event->Value[0] = *(PULONG)input;
+		break;
+	case IOCTL_SERIAL_WAIT_ON_MASK:
+	case IOCTL_SERIAL_GET_MODEMSTATUS:
+		Event->Type = Event->IoControlCode == IOCTL_SERIAL_WAIT_ON_MASK ? SERIAL_EVENT_WAIT_EVENTS : SERIAL_EVENT_MODEM_STATUS;
+		if (outputLength >= sizeof(ULONG))
+			Event->Value[0] = *(PULONG)output;
+		break;
+	case IOCTL_SERIAL_SET_DTR:
+	case IOCTL_SERIAL_CLR_DTR:
+		Event->Type = SERIAL_EVENT_DTR;
+		Event->Value[0] = Event->IoControlCode == IOCTL_SERIAL_SET_DTR;
+		break;
+	case IOCTL_SERIAL_SET_RTS:
+	case IOCTL_SERIAL_CLR_RTS:
+		Event->Type = SERIAL_EVENT_RTS;
+		Event->Value[0] = Event->IoControlCode == IOCTL_SERIAL_SET_RTS;
+		break;
+	case IOCTL_SERIAL_SET_BREAK_ON:
+	case IOCTL_SERIAL_SET_BREAK_OFF:
+		Event->Type = SERIAL_EVENT_BREAK;
+		Event->Value[0] = Event->IoControlCode == IOCTL_SERIAL_SET_BREAK_ON;
+		break;
+	default:
+		return FALSE;
+	}
+	return TRUE;
+}
+
+VOID ComPortMonitor_EvtNotifyListeners(WDFDEVICE EventSource, PMEMORY_CONTEXT IrpInfo, PVOID Buffer)
+/*++
+
+Routine Description:
+
+    Delivers one captured chunk to every listener attached to the device.
+    The chunk is captured once by the caller, each listener gets its copy
+    built in place in its own capture ring, or in its pending direct
+    buffer, so the cost does not include any allocation per listener.
+
+    Called from the drain loop with DrainLock held. The listener set is an
+    immutable snapshot that stays valid while DrainLock is held, see
+    ComPortMonitor_UpdateListeners, so no shared lock is taken here.
+
+--*/
+{
+	ULONG i, length, accepted;
 	PDEVICE_CONTEXT devContext;
+	PLISTENER_SET listeners;
 	PFILEOBJECT_CONTEXT fileContext;
-	WDFFILEOBJECT fileObject;
 	PMEMORY_CONTEXT memContext;
 	WDFREQUEST request;
-	WDF_OBJECT_ATTRIBUTES attr;
-	WDFMEMORY evtMemory, output;
-	PVOID buffer;
 
-	WdfWaitLockAcquire(ControlDeviceLock, NULL);
-	__try
+	devContext = DeviceGetContext(EventSource);
+	listeners = devContext->Listeners;
+	if (listeners == NULL)
+		return;
+
+	for (i = 0; i < listeners->Count; i++)
 	{
-		if (ControlDevice == NULL)
-			return;
+		if ((listeners->Items[i].EventMask & ATTACH_EVENT(IrpInfo->MajorFunctionCode)) == 0)
+			continue;
 
-		devContext = DeviceGetContext(EventSource);
-		WdfWaitLockAcquire(devContext->ListenersLock, NULL);
+		fileContext = FileObjectGetContext(listeners->Items[i].FileObject);
+		WdfWaitLockAcquire(fileContext->EventsLock, NULL);
 		__try
 		{
-			ci = WdfCollectionGetCount(devContext->Listeners);
-			for (i = 0; i < ci; i++)
+			//
+			// The listener's filter runs first, a record it does not want
+			// costs neither ring space nor a copy. The value it returns
+			// and the snap length limit the payload delivered.
+			//
+			length = IrpInfo->BufferSize;
+			if (fileContext->Filter != NULL)
 			{
-				fileObject = WdfCollectionGetItem(devContext->Listeners, i);
-				fileContext = FileObjectGetContext(fileObject);
-				WdfWaitLockAcquire(fileContext->EventsLock, NULL);
-				__try
-				{
-					WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(&attr, MEMORY_CONTEXT);
-					attr.ParentObject = fileObject;
-					status = WdfMemoryCreate(&attr, PagedPool, 0, IrpInfo->BufferSize == 0 ? 1 : IrpInfo->BufferSize, &evtMemory, &buffer);
-					if (NT_SUCCESS(status))
-					{
-						memContext = MemoryGetContext(evtMemory);
-						memcpy(memContext, IrpInfo, sizeof(*memContext));
-						memContext->DeviceNumber = devContext->Number;
-						WdfMemoryCopyToBuffer(Memory, 0, buffer, IrpInfo->BufferSize);
-						status = WdfCollectionAdd(fileContext->Events, evtMemory);
-						if (NT_SUCCESS(status))
-						{
-							WdfIoQueueRetrieveNextRequest(fileContext->Queue, &request);
-							if (request != NULL)
-							{
-								status = WdfRequestRetrieveOutputMemory(request, &output);
-								if (NT_SUCCESS(status))
-								{
-									status = WdfMemoryCopyFromBuffer(output, 0, memContext, sizeof(*memContext));
-									if (NT_SUCCESS(status) && IrpInfo->BufferSize == 0)
-									{
-										WdfCollectionRemove(fileContext->Events, evtMemory);
-										WdfObjectDelete(evtMemory);
-									}
-								}
-								WdfRequestCompleteWithInformation(request, status, sizeof(*memContext));
-							}
-						}
-						else
-							WdfObjectDelete(evtMemory);
-					}
-				}
-				__finally
-				{
-					WdfWaitLockRelease(fileContext->EventsLock);
-				}
+				accepted = FilterRun(fileContext->Filter, IrpInfo->MajorFunctionCode, Buffer, length);
+				if (accepted == 0)
+					__leave;
+				if (accepted < length)
+					length = accepted;
 			}
+			if (listeners->Items[i].SnapLength < length)
+				length = listeners->Items[i].SnapLength;
+
+			//
+			// A listener keeping direct buffers pending gets the record
+			// written straight into the oldest one.
+			//
+			memContext = ControlDevice_ReserveDirect(fileContext, length, &request);
+			if (memContext != NULL)
+			{
+				memcpy(memContext, IrpInfo, sizeof(*memContext));
+				memContext->DeviceNumber = devContext->Number;
+				memContext->BufferSize = length;
+				if (length != 0)
+					memcpy(memContext + 1, Buffer, length);
+				ControlDevice_CommitDirect(fileContext, request, length);
+				__leave;
+			}
+
+			//
+			// Otherwise the record is built in place in the listener's
+			// ring. What a stalled listener loses once its quota is used
+			// up depends on the policy it set, see
+			// ControlDevice_ReserveEvent.
+			//
+			memContext = ControlDevice_ReserveEvent(fileContext, length);
+			if (memContext != NULL)
+			{
+				memcpy(memContext, IrpInfo, sizeof(*memContext));
+				memContext->DeviceNumber = devContext->Number;
+				memContext->BufferSize = length;
+				if (length != 0)
+					memcpy(memContext + 1, Buffer, length);
+				RingCommit(&fileContext->Events);
+				ControlDevice_CompletePendingRequest(fileContext);
+			}
+			else
+				COUNT_EVENT(devContext, DeliveryDrops, 1);
 		}
 		__finally
 		{
-			WdfWaitLockRelease(devContext->ListenersLock);
+			WdfWaitLockRelease(fileContext->EventsLock);
 		}
 	}
-	__finally
-	{
-		WdfWaitLockRelease(ControlDeviceLock);
-	}
 }
 
 VOID ComPortMonitor_ForwardRequest(_In_ WDFREQUEST Request, _In_ WDFDEVICE Device)
@@ -335,6 +902,7 @@ Passes a request on to the lower driver.
 	{
 		status = WdfRequestGetStatus(Request);
 		KdPrint(("WdfRequestSend failed: 0x%x\n", status));
+		COUNT_EVENT(DeviceGetContext(Device), SendFailures, 1);
 		WdfRequestComplete(Request, status);
 	}
 
@@ -29,18 +29,21 @@ typedef struct _QUEUE_CONTEXT {
 
 WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(QUEUE_CONTEXT, QueueGetContext)
 
-typedef struct _WORKITEM_CONTEXT
+//
+// The record the patterns are run over, passed to ComPortMonitor_EvtMatch.
+//
+typedef struct _MATCH_CONTEXT
 {
 	WDFDEVICE Device;
-	ULONG BufferSize;
-	BYTE MajorFunctionCode;
-	BYTE MinorFunctionCode;
-	USHORT OutputDataOffset;
-	WDFMEMORY data;
+	PMEMORY_CONTEXT Record;
+	ULONG Direction;
 
-} WORKITEM_CONTEXT, *PWORKITEM_CONTEXT;
+} MATCH_CONTEXT, *PMATCH_CONTEXT;
 
-WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(WORKITEM_CONTEXT, WorkItemGetContext)
+NTSTATUS
+ComPortMonitorCaptureInitialize(
+	_In_ WDFDEVICE Device
+	);
 
 NTSTATUS
 ComPortMonitorQueueInitialize(
@@ -52,12 +55,23 @@ ComPortMonitorQueueInitialize(
 //
 EVT_WDF_IO_QUEUE_IO_READ ComPortMonitorEvtIoRead;
 EVT_WDF_REQUEST_COMPLETION_ROUTINE ComPortMonitorCompletionRoutine;
+EVT_WDF_REQUEST_COMPLETION_ROUTINE ComPortMonitorIoctlCompletionRoutine;
 EVT_WDF_WORKITEM ComPortMonitorEvtWorkItem;
+EVT_WDF_TIMER ComPortMonitorEvtCoalesceTimer;
 EVT_WDF_IO_QUEUE_IO_WRITE ComPortMonitorEvtIoWrite;
 EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL ComPortMonitorEvtIoDeviceControl;
 EVT_WDF_IO_QUEUE_IO_STOP ComPortMonitorEvtIoStop;
 
-VOID ComPortMonitor_EvtNotifyListeners(WDFDEVICE EventSource, WDFMEMORY Memory, PMEMORY_CONTEXT IrpInfo);
+VOID ComPortMonitor_CaptureEvent(WDFDEVICE Device, PMEMORY_CONTEXT IrpInfo, PVOID Buffer);
+BOOLEAN ComPortMonitor_CaptureRecord(PDEVICE_CONTEXT DevContext, PMEMORY_CONTEXT IrpInfo, PVOID Buffer);
+BOOLEAN ComPortMonitor_FlushCoalesced(PDEVICE_CONTEXT DevContext);
+VOID ComPortMonitor_SetCoalescing(WDFDEVICE Device, PCOALESCE_CONFIG Config);
+VOID ComPortMonitor_DrainCapture(WDFDEVICE Device);
+BOOLEAN ComPortMonitor_IsSerialEvent(ULONG IoControlCode);
+BOOLEAN ComPortMonitor_DecodeSerialEvent(WDFREQUEST Request, PWDF_REQUEST_COMPLETION_PARAMS Params, PSERIAL_EVENT Event);
+VOID ComPortMonitor_EvtNotifyListeners(WDFDEVICE EventSource, PMEMORY_CONTEXT IrpInfo, PVOID Buffer);
+VOID ComPortMonitor_MatchRecord(WDFDEVICE Device, PMEMORY_CONTEXT IrpInfo, PVOID Buffer);
+MATCH_CALLBACK ComPortMonitor_EvtMatch;
 VOID ComPortMonitor_ForwardRequest(_In_ WDFREQUEST Request, _In_ WDFDEVICE Device);
 
 EXTERN_C_END
@@ -0,0 +1,125 @@
+/*++
+
+Module Name:
+
+    recorder.c
+
+Abstract:
+
+    This file contains the flight recorder.
+
+    The buffer is used as a circle of bytes: a record that reaches the end
+    of the buffer goes on at its start, and is put back together when it
+    is read. Tail is the oldest record, Head where the next one goes.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include <string.h>
+#include "Recorder.h"
+
+static const UCHAR RecorderPadding[RING_RECORD_ALIGNMENT];
+
+static VOID RecorderWrite(PRECORDER Recorder, ULONG Offset, const VOID *Source, ULONG Length)
+{
+	ULONG first = Recorder->Capacity - Offset;
+
+	if (first > Length)
+		first = Length;
+	memcpy(Recorder->Data + Offset, Source, first);
+	memcpy(Recorder->Data, (const UCHAR *)Source + first, Length - first);
+}
+
+static VOID RecorderRead(PRECORDER Recorder, ULONG Offset, PVOID Destination, ULONG Length)
+{
+	ULONG first = Recorder->Capacity - Offset;
+
+	if (first > Length)
+		first = Length;
+	memcpy(Destination, Recorder->Data + Offset, first);
+	memcpy((PUCHAR)Destination + first, Recorder->Data, Length - first);
+}
+
+VOID RecorderInitialize(PRECORDER Recorder, PVOID Buffer, ULONG BufferSize)
+{
+	memset(Recorder, 0, sizeof(*Recorder));
+	Recorder->Data = (PUCHAR)Buffer;
+	Recorder->Capacity = BufferSize & ~(ULONG)(RING_RECORD_ALIGNMENT - 1);
+}
+
+BOOLEAN RecorderAppend(PRECORDER Recorder, const MEMORY_CONTEXT *Record, const VOID *Payload)
+/*++
+
+Routine Description:
+
+    Stores a record, dropping as many of the oldest records as it takes
+    to make room.
+
+Return Value:
+
+    FALSE if the recorder is frozen or the record is larger than the
+    whole buffer.
+
+--*/
+{
+	MEMORY_CONTEXT oldest;
+	ULONG size, offset;
+
+	size = BATCH_RECORD_SIZE(Record->BufferSize);
+	if (Recorder->Frozen || size > Recorder->Capacity)
+		return FALSE;
+
+	while (Recorder->Capacity - Recorder->Used < size)
+	{
+		RecorderRead(Recorder, Recorder->Tail, &oldest, sizeof(oldest));
+		Recorder->Tail = (Recorder->Tail + BATCH_RECORD_SIZE(oldest.BufferSize)) % Recorder->Capacity;
+		Recorder->Used -= BATCH_RECORD_SIZE(oldest.BufferSize);
+		Recorder->Records--;
+	}
+
+	offset = Recorder->Head;
+	RecorderWrite(Recorder, offset, Record, sizeof(*Record));
+	offset = (offset + sizeof(*Record)) % Recorder->Capacity;
+	if (Record->BufferSize != 0)
+		RecorderWrite(Recorder, offset, Payload, Record->BufferSize);
+	offset = (offset + Record->BufferSize) % Recorder->Capacity;
+	RecorderWrite(Recorder, offset, RecorderPadding, size - sizeof(*Record) - Record->BufferSize);
+
+	Recorder->Head = (Recorder->Head + size) % Recorder->Capacity;
+	Recorder->Used += size;
+	Recorder->Records++;
+	return TRUE;
+}
+
+ULONG RecorderDumpSize(PRECORDER Recorder)
+{
+	return sizeof(BATCH_HEADER) + Recorder->Used;
+}
+
+ULONG RecorderDump(PRECORDER Recorder, PVOID Buffer, ULONG Length)
+/*++
+
+Routine Description:
+
+    Copies all stored records, oldest first, behind a BATCH_HEADER. The
+    records stay in the recorder.
+
+Return Value:
+
+    Bytes written, 0 if the buffer is smaller than RecorderDumpSize.
+
+--*/
+{
+	PBATCH_HEADER batch = (PBATCH_HEADER)Buffer;
+
+	if (Length < RecorderDumpSize(Recorder))
+		return 0;
+
+	batch->RecordCount = Recorder->Records;
+	batch->BytesUsed = RecorderDumpSize(Recorder);
+	RecorderRead(Recorder, Recorder->Tail, batch + 1, Recorder->Used);
+	return batch->BytesUsed;
+}
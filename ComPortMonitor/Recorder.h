@@ -0,0 +1,53 @@
+/*++
+
+Module Name:
+
+    recorder.h
+
+Abstract:
+
+    This file contains the flight recorder definitions.
+
+    The recorder keeps the latest records of a port in a fixed buffer,
+    overwriting the oldest ones, until it is frozen. Records are stored
+    in the layout of IOCTL_CPM_READ_BATCH, so a dump is the stored bytes
+    in order behind a BATCH_HEADER. Nothing is allocated after
+    RecorderInitialize.
+
+    Like the ring, the module does not depend on the framework and can
+    be built outside of Windows.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+#include "Ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+typedef struct _RECORDER
+{
+	PUCHAR Data;
+	ULONG Capacity;
+	ULONG Head;
+	ULONG Tail;
+	ULONG Used;
+	ULONG Records;
+	BOOLEAN Frozen;
+
+} RECORDER, *PRECORDER;
+
+VOID RecorderInitialize(PRECORDER Recorder, PVOID Buffer, ULONG BufferSize);
+BOOLEAN RecorderAppend(PRECORDER Recorder, const MEMORY_CONTEXT *Record, const VOID *Payload);
+ULONG RecorderDumpSize(PRECORDER Recorder);
+ULONG RecorderDump(PRECORDER Recorder, PVOID Buffer, ULONG Length);
+
+#ifdef __cplusplus
+}
+#endif
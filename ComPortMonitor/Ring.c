@@ -0,0 +1,287 @@
+/*++
+
+Module Name:
+
+    ring.c
+
+Abstract:
+
+    This file contains the capture ring implementation.
+
+    The producer reserves space for a record, fills the record body in
+    place and commits it, which publishes the new head index. The consumer
+    peeks the oldest record and consumes it, which publishes the new tail
+    index. Neither side takes a lock or allocates memory.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#include "Ring.h"
+
+ULONG RingInitialize(PRING Ring, PVOID Buffer, ULONG BufferSize)
+/*++
+
+Routine Description:
+
+    Lays out the ring header and the largest power-of-two data area that
+    fits into the buffer behind it. Only a buffer of RING_BUFFER_SIZE
+    is used whole, anything else leaves up to half of it unused.
+
+Return Value:
+
+    Capacity of the data area in bytes, 0 if the buffer is too small.
+
+--*/
+{
+	ULONG capacity, available;
+
+	Ring->Header = (PRING_HEADER)Buffer;
+	Ring->Data = (PUCHAR)Buffer + sizeof(RING_HEADER);
+	Ring->Capacity = 0;
+	Ring->Head = 0;
+	Ring->Pending = 0;
+	Ring->Records = 0;
+
+	if (BufferSize < sizeof(RING_HEADER) + RING_RECORD_ALIGNMENT)
+		return 0;
+
+	available = BufferSize - sizeof(RING_HEADER);
+	for (capacity = RING_RECORD_ALIGNMENT; capacity <= available / 2; capacity *= 2)
+		;
+
+	Ring->Capacity = capacity;
+	Ring->Header->Capacity = capacity;
+	Ring->Header->DataOffset = sizeof(RING_HEADER);
+	Ring->Header->Head = 0;
+	Ring->Header->Tail = 0;
+	Ring->Header->TailRecords = 0;
+	return capacity;
+}
+
+ULONG RingAttach(PRING Ring, PVOID Buffer, ULONG BufferSize)
+/*++
+
+Routine Description:
+
+    Attaches the consumer side to a ring laid out by RingInitialize, for
+    example one mapped by IOCTL_CPM_MAP_EVENTS_RING.
+
+Return Value:
+
+    Capacity of the data area in bytes, 0 if the header is not valid.
+
+--*/
+{
+	PRING_HEADER header = (PRING_HEADER)Buffer;
+	ULONG capacity, offset;
+
+	Ring->Header = header;
+	Ring->Data = NULL;
+	Ring->Capacity = 0;
+	Ring->Head = 0;
+	Ring->Pending = 0;
+	Ring->Records = 0;
+
+	if (BufferSize < sizeof(RING_HEADER))
+		return 0;
+
+	capacity = header->Capacity;
+	offset = header->DataOffset;
+	if (capacity < RING_RECORD_ALIGNMENT || (capacity & (capacity - 1)) != 0 ||
+		offset < sizeof(RING_HEADER) || offset > BufferSize || capacity > BufferSize - offset)
+		return 0;
+
+	Ring->Data = (PUCHAR)Buffer + offset;
+	Ring->Capacity = capacity;
+	Ring->Head = RING_LOAD_ACQUIRE(&header->Head);
+	Ring->Pending = Ring->Head;
+	return capacity;
+}
+
+PVOID RingReserve(PRING Ring, ULONG Length)
+/*++
+
+Routine Description:
+
+    Reserves space for a record body of the given length. The body is
+    contiguous and becomes visible to the consumer on RingCommit.
+
+Return Value:
+
+    Pointer to the record body, NULL if the ring is full.
+
+--*/
+{
+	ULONG size, used, offset, remainder;
+	PRING_RECORD record;
+
+	if (Length > Ring->Capacity)
+		return NULL;
+
+	size = RING_RECORD_SIZE(Length);
+	used = Ring->Head - RING_LOAD_ACQUIRE(&Ring->Header->Tail);
+	if (used > Ring->Capacity || size > Ring->Capacity - used)
+		return NULL;
+
+	offset = Ring->Head & (Ring->Capacity - 1);
+	remainder = Ring->Capacity - offset;
+	if (size > remainder)
+	{
+		//
+		// The record does not fit before the end of the buffer, pad the
+		// rest of it and start over from the beginning.
+		//
+		if (remainder > Ring->Capacity - used || size > Ring->Capacity - used - remainder)
+			return NULL;
+
+		record = (PRING_RECORD)(Ring->Data + offset);
+		record->Length = remainder - sizeof(RING_RECORD);
+		record->Flags = RING_RECORD_PADDING;
+		Ring->Head += remainder;
+		offset = 0;
+	}
+
+	record = (PRING_RECORD)(Ring->Data + offset);
+	record->Length = Length;
+	record->Flags = 0;
+	Ring->Pending = Ring->Head + size;
+	return record + 1;
+}
+
+VOID RingCommit(PRING Ring)
+{
+	Ring->Head = Ring->Pending;
+	Ring->Records++;
+	RING_STORE_RELEASE(&Ring->Header->Head, Ring->Head);
+}
+
+PVOID RingPeek(PRING Ring, PULONG Length)
+/*++
+
+Routine Description:
+
+    Returns the body of the oldest committed record, skipping padding.
+
+Return Value:
+
+    Pointer to the record body, NULL if the ring is empty.
+
+--*/
+{
+	ULONG head, tail, offset, size, length;
+	PRING_RECORD record;
+
+	head = RING_LOAD_ACQUIRE(&Ring->Header->Head);
+	tail = Ring->Header->Tail;
+	while (head != tail)
+	{
+		if (head - tail > Ring->Capacity)
+			return NULL;
+
+		offset = tail & (Ring->Capacity - 1);
+		record = (PRING_RECORD)(Ring->Data + offset);
+		length = record->Length;
+		size = RING_RECORD_SIZE(length);
+		if (length > Ring->Capacity || size > Ring->Capacity - offset || size > head - tail)
+			return NULL;
+
+		if ((record->Flags & RING_RECORD_PADDING) == 0)
+		{
+			if (Length != NULL)
+				*Length = length;
+			return record + 1;
+		}
+
+		tail += size;
+		RING_STORE_RELEASE(&Ring->Header->Tail, tail);
+	}
+	return NULL;
+}
+
+VOID RingConsume(PRING Ring)
+/*++
+
+Routine Description:
+
+    Releases the record returned by the preceding RingPeek.
+
+--*/
+{
+	ULONG tail, length;
+
+	if (RingPeek(Ring, &length) == NULL)
+		return;
+
+	tail = Ring->Header->Tail;
+	Ring->Header->TailRecords++;
+	RING_STORE_RELEASE(&Ring->Header->Tail, tail + RING_RECORD_SIZE(length));
+}
+
+VOID RingDiscard(PRING Ring)
+/*++
+
+Routine Description:
+
+    Producer side: drops every committed record and resets the consumer
+    indexes, for when a consumer that could have left anything in the
+    shared header goes away.
+
+--*/
+{
+	Ring->Header->TailRecords = Ring->Records;
+	RING_STORE_RELEASE(&Ring->Header->Tail, Ring->Head);
+}
+
+BOOLEAN RingIsEmpty(PRING Ring)
+{
+	return RingPeek(Ring, NULL) == NULL;
+}
+
+ULONG RingUsed(PRING Ring, PULONG Records)
+/*++
+
+Routine Description:
+
+    Producer side view of the ring occupancy. The consumer indexes are
+    not trusted, values out of range are clamped to a full ring.
+
+Return Value:
+
+    Bytes in use, including record headers and padding.
+
+--*/
+{
+	ULONG used, records;
+
+	used = Ring->Head - RING_LOAD_ACQUIRE(&Ring->Header->Tail);
+	records = Ring->Records - Ring->Header->TailRecords;
+	if (used > Ring->Capacity)
+		used = Ring->Capacity;
+	if (records > Ring->Capacity / RING_RECORD_ALIGNMENT)
+		records = Ring->Capacity / RING_RECORD_ALIGNMENT;
+	if (Records != NULL)
+		*Records = records;
+	return used;
+}
+
+ULONG RingReserveSize(PRING Ring, ULONG Skip, ULONG Length)
+/*++
+
+Routine Description:
+
+    Returns the bytes RingReserve takes for a record body of the given
+    length once the head has moved Skip bytes further, the padding in
+    front of a record that does not fit before the end of the buffer
+    included.
+
+--*/
+{
+	ULONG size, remainder;
+
+	size = RING_RECORD_SIZE(Length);
+	remainder = Ring->Capacity - ((Ring->Head + Skip) & (Ring->Capacity - 1));
+	return size > remainder ? remainder + size : size;
+}
@@ -0,0 +1,104 @@
+/*++
+
+Module Name:
+
+    ring.h
+
+Abstract:
+
+    This file contains the capture ring definitions.
+
+    The ring is a fixed capacity single-producer/single-consumer byte
+    buffer that keeps variable-length records (record header followed by
+    the record body) in place. The layout is defined in public.h. The
+    module does not depend on the framework, so the client uses it to
+    consume a mapped ring and it can also be built outside of Windows.
+
+Environment:
+
+    Kernel-mode Driver Framework, user mode
+
+--*/
+
+#pragma once
+
+#if defined(_KERNEL_MODE)
+
+#include <ntddk.h>
+
+#define RING_LOAD_ACQUIRE(Target)			ReadULongAcquire(Target)
+#define RING_STORE_RELEASE(Target, Value)	WriteULongRelease(Target, Value)
+
+#elif defined(_WIN32)
+
+#include <windows.h>
+
+#define RING_LOAD_ACQUIRE(Target)			ReadULongAcquire(Target)
+#define RING_STORE_RELEASE(Target, Value)	WriteULongRelease(Target, Value)
+
+#else
+
+#include <stddef.h>
+#include <stdint.h>
+
+typedef void VOID, *PVOID;
+typedef uint8_t UCHAR, *PUCHAR;
+typedef uint8_t BYTE;
+typedef uint16_t USHORT, *PUSHORT;
+typedef int32_t LONG;
+typedef uint32_t ULONG, *PULONG;
+typedef uint64_t ULONG64;
+typedef int64_t LONGLONG;
+typedef uint8_t BOOLEAN;
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+#define RING_LOAD_ACQUIRE(Target)			__atomic_load_n(Target, __ATOMIC_ACQUIRE)
+#define RING_STORE_RELEASE(Target, Value)	__atomic_store_n(Target, Value, __ATOMIC_RELEASE)
+
+#endif
+
+#include "Public.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// Private state of one side of the ring. Indexes published through the
+// header are never trusted, the producer works on its own copies.
+//
+typedef struct _RING
+{
+	PRING_HEADER Header;
+	PUCHAR Data;
+	ULONG Capacity;
+	ULONG Head;
+	ULONG Pending;
+	ULONG Records;
+
+} RING, *PRING;
+
+//
+// Size of a buffer that holds the ring header and a data area of the
+// given power-of-two capacity with nothing left over.
+//
+#define RING_BUFFER_SIZE(Capacity)	(sizeof(RING_HEADER) + (Capacity))
+
+ULONG RingInitialize(PRING Ring, PVOID Buffer, ULONG BufferSize);
+ULONG RingAttach(PRING Ring, PVOID Buffer, ULONG BufferSize);
+PVOID RingReserve(PRING Ring, ULONG Length);
+VOID RingCommit(PRING Ring);
+PVOID RingPeek(PRING Ring, PULONG Length);
+VOID RingConsume(PRING Ring);
+VOID RingDiscard(PRING Ring);
+BOOLEAN RingIsEmpty(PRING Ring);
+ULONG RingUsed(PRING Ring, PULONG Records);
+ULONG RingReserveSize(PRING Ring, ULONG Skip, ULONG Length);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,133 @@
+/*++
+
+Module Name:
+
+    decoder.c
+
+Abstract:
+
+    This file contains the frame reassembly shared by the decoders.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "Decoder.h"
+
+#define DECODER_MJ_READ				0x03
+#define DECODER_MJ_WRITE			0x04
+
+VOID DecoderInitialize(PDECODER Decoder, const DECODER_CLASS *Class, LONGLONG Gap, DECODER_CALLBACK *Callback, PVOID Context)
+{
+	ULONG i;
+
+	memset(Decoder, 0, sizeof(*Decoder));
+	Decoder->Class = Class;
+	Decoder->Gap = Gap;
+	Decoder->Callback = Callback;
+	Decoder->Context = Context;
+	for (i = 0; i < DECODER_MAX_PORTS; i++)
+	{
+		Class->Reset(&Decoder->Streams[i][0]);
+		Class->Reset(&Decoder->Streams[i][1]);
+	}
+}
+
+static VOID DecoderComplete(PDECODER Decoder, ULONG DeviceNumber, ULONG Direction, USHORT Flags)
+{
+	PDECODER_STREAM stream = &Decoder->Streams[DeviceNumber][Direction];
+	DECODER_FRAME frame;
+
+	if (stream->Length == 0)
+		return;
+
+	memset(&frame, 0, sizeof(frame));
+	frame.DeviceNumber = DeviceNumber;
+	frame.MajorFunctionCode = Direction != 0 ? DECODER_MJ_WRITE : DECODER_MJ_READ;
+	frame.Protocol = Decoder->Class->Protocol;
+	frame.Flags = Flags;
+	frame.Timestamp = stream->Timestamp;
+	frame.LastTimestamp = stream->LastTimestamp;
+	frame.Length = stream->Length;
+	Decoder->Class->Decode(stream, &frame);
+	Decoder->Callback(Decoder->Context, &frame, stream->Data);
+
+	stream->Length = 0;
+	Decoder->Class->Reset(stream);
+}
+
+VOID DecoderFeed(PDECODER Decoder, const MEMORY_CONTEXT *Record, const UCHAR *Payload)
+/*++
+
+Routine Description:
+
+    Appends the data of a read or write record to the frame of its port
+    and direction. Other records are ignored. The pending frame is
+    completed first if the record starts more than Gap after the frame's
+    last byte. The pending frame of the other direction is completed
+    either way, a half duplex line only turns around between frames.
+
+--*/
+{
+	PDECODER_STREAM stream;
+	ULONG direction, length, chunk;
+	LONGLONG lastTimestamp;
+
+	if (Record->DeviceNumber >= DECODER_MAX_PORTS)
+		return;
+	if (Record->MajorFunctionCode == DECODER_MJ_READ)
+		direction = 0;
+	else if (Record->MajorFunctionCode == DECODER_MJ_WRITE)
+		direction = 1;
+	else
+		return;
+
+	lastTimestamp = Record->HeaderSize >= MEMORY_CONTEXT_VERSION_3_SIZE ? Record->LastTimestamp : Record->Timestamp;
+	DecoderComplete(Decoder, Record->DeviceNumber, direction ^ 1, 0);
+
+	stream = &Decoder->Streams[Record->DeviceNumber][direction];
+	if (stream->Length != 0 && Record->Timestamp - stream->LastTimestamp > Decoder->Gap)
+		DecoderComplete(Decoder, Record->DeviceNumber, direction, 0);
+
+	for (length = Record->BufferSize; length != 0; length -= chunk, Payload += chunk)
+	{
+		if (stream->Length == DECODER_MAX_FRAME)
+			DecoderComplete(Decoder, Record->DeviceNumber, direction, DECODER_FRAME_OVERRUN);
+		if (stream->Length == 0)
+			stream->Timestamp = Record->Timestamp;
+
+		chunk = DECODER_MAX_FRAME - stream->Length;
+		if (chunk > length)
+			chunk = length;
+		memcpy(stream->Data + stream->Length, Payload, chunk);
+		Decoder->Class->Append(stream, stream->Data + stream->Length, chunk);
+		stream->Length += chunk;
+		stream->LastTimestamp = lastTimestamp;
+	}
+}
+
+VOID DecoderFlush(PDECODER Decoder, LONGLONG Timestamp)
+/*++
+
+Routine Description:
+
+    Completes the frames that have been silent for longer than Gap at
+    Timestamp. Called periodically while capturing and with MAXLONGLONG
+    at the end of the capture.
+
+--*/
+{
+	ULONG i, direction;
+
+	for (i = 0; i < DECODER_MAX_PORTS; i++)
+	{
+		for (direction = 0; direction < 2; direction++)
+		{
+			if (Decoder->Streams[i][direction].Length != 0 && Timestamp - Decoder->Streams[i][direction].LastTimestamp > Decoder->Gap)
+				DecoderComplete(Decoder, i, direction, 0);
+		}
+	}
+}
@@ -0,0 +1,134 @@
+/*++
+
+Module Name:
+
+    decoder.h
+
+Abstract:
+
+    This file contains the protocol decoder definitions.
+
+    The decoder is fed the read and write records of the capture, in
+    order, and cuts the byte stream of every port and direction into
+    frames at gaps longer than the configured one. It also cuts a frame
+    when the port's other direction starts talking. Bytes are
+    appended to the frame as they come and the decoder class sees each
+    byte once, so a frame that arrives a byte per record costs the same
+    as one that arrives in a single record. Complete frames are handed to
+    the callback as typed DECODER_FRAME records.
+
+    Decoder classes are plugged in through DECODER_CLASS and add their
+    fields to DECODER_FRAME::Parameters.
+
+    Like the ring, the module does not depend on the framework and can
+    be built outside of Windows.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include "Ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define DECODER_MAX_PORTS			256
+#define DECODER_MAX_FRAME			256
+
+#define DECODER_PROTOCOL_MODBUS_RTU	1
+
+#define DECODER_FRAME_CRC_OK		0x0001	// check sum matches
+#define DECODER_FRAME_PARSED		0x0002	// protocol fields are valid
+#define DECODER_FRAME_OVERRUN		0x0004	// frame was cut at DECODER_MAX_FRAME
+
+//
+// Modbus RTU frame. Writes of the monitored application are decoded as
+// requests, reads as responses. Quantity is the written value for the
+// single coil and register functions. Data and DataLength point at the
+// register or coil bytes of the frame.
+//
+typedef struct _MODBUS_FRAME
+{
+	BYTE Slave;
+	BYTE Function;
+	BYTE Exception;
+	BYTE ByteCount;
+	USHORT Address;
+	USHORT Quantity;
+	ULONG DataOffset;
+	ULONG DataLength;
+} MODBUS_FRAME, *PMODBUS_FRAME;
+
+typedef struct _DECODER_FRAME
+{
+	ULONG DeviceNumber;
+	BYTE MajorFunctionCode;
+	BYTE Protocol;
+	USHORT Flags;
+	LONGLONG Timestamp;
+	LONGLONG LastTimestamp;
+	ULONG Length;
+	union
+	{
+		MODBUS_FRAME Modbus;
+	} Parameters;
+} DECODER_FRAME, *PDECODER_FRAME;
+
+typedef struct _DECODER_STREAM
+{
+	LONGLONG Timestamp;
+	LONGLONG LastTimestamp;
+	ULONG Length;
+	ULONG State;
+	UCHAR Data[DECODER_MAX_FRAME];
+
+} DECODER_STREAM, *PDECODER_STREAM;
+
+//
+// Reset prepares State for a new frame, Append updates it with Length
+// bytes just appended at Data, Decode fills the protocol fields of a
+// complete frame.
+//
+typedef struct _DECODER_CLASS
+{
+	BYTE Protocol;
+	VOID (*Reset)(PDECODER_STREAM Stream);
+	VOID (*Append)(PDECODER_STREAM Stream, const UCHAR *Data, ULONG Length);
+	VOID (*Decode)(const DECODER_STREAM *Stream, PDECODER_FRAME Frame);
+
+} DECODER_CLASS, *PDECODER_CLASS;
+
+typedef VOID DECODER_CALLBACK(PVOID Context, const DECODER_FRAME *Frame, const UCHAR *Data);
+
+//
+// The decoder keeps a stream per port and direction, about 140 KB, and
+// is allocated by the caller. Gap is in the units of the record
+// timestamps.
+//
+typedef struct _DECODER
+{
+	const DECODER_CLASS *Class;
+	LONGLONG Gap;
+	DECODER_CALLBACK *Callback;
+	PVOID Context;
+	DECODER_STREAM Streams[DECODER_MAX_PORTS][2];
+
+} DECODER, *PDECODER;
+
+VOID DecoderInitialize(PDECODER Decoder, const DECODER_CLASS *Class, LONGLONG Gap, DECODER_CALLBACK *Callback, PVOID Context);
+VOID DecoderFeed(PDECODER Decoder, const MEMORY_CONTEXT *Record, const UCHAR *Payload);
+VOID DecoderFlush(PDECODER Decoder, LONGLONG Timestamp);
+
+extern const DECODER_CLASS ModbusRtuDecoder;
+
+USHORT ModbusCrc16(USHORT Crc, const UCHAR *Data, ULONG Length);
+LONGLONG ModbusRtuGap(ULONG BaudRate, LONGLONG Frequency);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,268 @@
+/*++
+
+Module Name:
+
+    index.c
+
+Abstract:
+
+    This file contains the capture index writer and the range query.
+
+    The writer is fed the interface description and packet blocks the
+    client appends to the capture and hands back an entry each time a
+    block of the index is complete. The query never copies a
+    record, the payload pointers it returns point into the capture.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "Index.h"
+
+static BOOLEAN IndexHasPort(PINDEX_QUERY Query, const INDEX_ENTRY *Entry)
+{
+	ULONG i;
+
+	if (Query->Port == INDEX_PORT_ANY)
+		return TRUE;
+	for (i = 0; i < PCAPNG_MAX_INTERFACES / 64; i++)
+	{
+		if ((Entry->Ports[i] & Query->Interfaces[i]) != 0)
+			return TRUE;
+	}
+	return FALSE;
+}
+
+VOID IndexWriterInitialize(PINDEX_WRITER Writer, ULONG BlockBytes)
+{
+	memset(Writer, 0, sizeof(*Writer));
+	Writer->BlockBytes = BlockBytes != 0 ? BlockBytes : 1;
+}
+
+BOOLEAN IndexWriterInterface(PINDEX_WRITER Writer, ULONG InterfaceId, ULONG Port, UCHAR TsResol)
+/*++
+
+Routine Description:
+
+    Adds the interface description block of Port written with
+    InterfaceId. The table is kept for the whole capture, an interface
+    described again, in a later section, takes its new values.
+
+Return Value:
+
+    FALSE if the ID is past PCAPNG_MAX_INTERFACES.
+
+--*/
+{
+	if (InterfaceId >= PCAPNG_MAX_INTERFACES)
+		return FALSE;
+
+	Writer->Interfaces[InterfaceId].Port = Port;
+	Writer->Interfaces[InterfaceId].TsResol = TsResol;
+	if (InterfaceId >= Writer->InterfaceCount)
+		Writer->InterfaceCount = InterfaceId + 1;
+	return TRUE;
+}
+
+BOOLEAN IndexWriterAdd(PINDEX_WRITER Writer, ULONG64 Offset, ULONG InterfaceId, const MEMORY_CONTEXT *Record, PINDEX_ENTRY Entry)
+/*++
+
+Routine Description:
+
+    Adds the packet block of Record written at Offset with InterfaceId.
+    Record->Timestamp is in nanoseconds, as in the records PcapngNextBlock
+    returns.
+
+Return Value:
+
+    TRUE if the block started a new entry, Entry then receives the
+    previous one to be appended to the index.
+
+--*/
+{
+	BOOLEAN completed = FALSE;
+	ULONG64 timestamp = Record->Timestamp > 0 ? (ULONG64)Record->Timestamp : 0;
+
+	if (Writer->Open && Offset - Writer->Current.Offset >= Writer->BlockBytes)
+	{
+		*Entry = Writer->Current;
+		Writer->Open = FALSE;
+		Writer->EntryCount++;
+		completed = TRUE;
+	}
+
+	if (!Writer->Open)
+	{
+		memset(&Writer->Current, 0, sizeof(Writer->Current));
+		Writer->Current.Offset = Offset;
+		Writer->Current.MinTimestamp = timestamp;
+		Writer->Open = TRUE;
+	}
+
+	if (timestamp < Writer->Current.MinTimestamp)
+		Writer->Current.MinTimestamp = timestamp;
+	if (timestamp > Writer->MaxTimestamp)
+		Writer->MaxTimestamp = timestamp;
+	Writer->Current.MaxTimestamp = Writer->MaxTimestamp;
+	if (InterfaceId < PCAPNG_MAX_INTERFACES)
+		Writer->Current.Ports[InterfaceId / 64] |= (ULONG64)1 << (InterfaceId % 64);
+	return completed;
+}
+
+BOOLEAN IndexWriterFlush(PINDEX_WRITER Writer, PINDEX_ENTRY Entry)
+/*++
+
+Routine Description:
+
+    Hands back the last, incomplete entry when the capture is closed.
+
+--*/
+{
+	if (!Writer->Open)
+		return FALSE;
+
+	*Entry = Writer->Current;
+	Writer->Open = FALSE;
+	Writer->EntryCount++;
+	return TRUE;
+}
+
+VOID IndexWriterHeader(PINDEX_WRITER Writer, PINDEX_HEADER Header)
+/*++
+
+Routine Description:
+
+    Fills in the header of the index for the entries handed back so far.
+
+--*/
+{
+	memset(Header, 0, sizeof(*Header));
+	Header->Magic = INDEX_MAGIC;
+	Header->Version = INDEX_VERSION;
+	Header->BlockBytes = Writer->BlockBytes;
+	Header->InterfaceCount = Writer->InterfaceCount;
+	Header->EntryCount = Writer->EntryCount;
+}
+
+BOOLEAN IndexQueryStart(PINDEX_QUERY Query, const VOID *Index, ULONG64 IndexLength, const VOID *Capture, ULONG64 CaptureLength, ULONG64 From, ULONG64 To, ULONG Port)
+/*++
+
+Routine Description:
+
+    Starts a query of the records of Port, or of every port with
+    INDEX_PORT_ANY, with timestamps from From to To inclusive. The reader
+    takes the interfaces from the table of the index, so the interface
+    descriptions in the capture are not needed. The first entry that may
+    hold a record of the range is found by binary search on MaxTimestamp.
+
+Return Value:
+
+    FALSE if the index does not match the capture.
+
+--*/
+{
+	const INDEX_HEADER *header = (const INDEX_HEADER *)Index;
+	const INDEX_INTERFACE *interfaces;
+	ULONG64 low, high, middle;
+	ULONG i;
+
+	memset(Query, 0, sizeof(*Query));
+	if (IndexLength < sizeof(*header) || header->Magic != INDEX_MAGIC || header->Version != INDEX_VERSION)
+		return FALSE;
+	if (header->EntryCount > (IndexLength - sizeof(*header)) / sizeof(INDEX_ENTRY))
+		return FALSE;
+	if (header->InterfaceCount > PCAPNG_MAX_INTERFACES || header->InterfaceCount > (IndexLength - sizeof(*header) - header->EntryCount * sizeof(INDEX_ENTRY)) / sizeof(INDEX_INTERFACE))
+		return FALSE;
+
+	Query->Entries = (const INDEX_ENTRY *)(header + 1);
+	Query->EntryCount = header->EntryCount;
+	Query->Capture = (const UCHAR *)Capture;
+	Query->CaptureLength = CaptureLength;
+	Query->From = From;
+	Query->To = To;
+	Query->Port = Port;
+	PcapngReaderInitialize(&Query->Reader);
+
+	interfaces = (const INDEX_INTERFACE *)(Query->Entries + Query->EntryCount);
+	Query->Reader.Fixed = TRUE;
+	Query->Reader.InterfaceCount = header->InterfaceCount;
+	for (i = 0; i < header->InterfaceCount; i++)
+	{
+		Query->Reader.Port[i] = interfaces[i].Port;
+		Query->Reader.TsResol[i] = interfaces[i].TsResol;
+		if (interfaces[i].Port == Port)
+			Query->Interfaces[i / 64] |= (ULONG64)1 << (i % 64);
+	}
+
+	low = 0;
+	high = Query->EntryCount;
+	while (low < high)
+	{
+		middle = low + (high - low) / 2;
+		if (Query->Entries[middle].MaxTimestamp < From)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	Query->Entry = low;
+	return TRUE;
+}
+
+BOOLEAN IndexQueryNext(PINDEX_QUERY Query, PMEMORY_CONTEXT Record, const UCHAR **Payload)
+/*++
+
+Routine Description:
+
+    Returns the next record of the query. Entries without the port are
+    skipped without touching the capture, the query ends at the first
+    entry that starts past the range. Records are expected in capture
+    order, out of order records are only found within one entry.
+
+Return Value:
+
+    FALSE when there are no more records.
+
+--*/
+{
+	const INDEX_ENTRY *entry;
+	ULONG64 end, length;
+	ULONG size;
+
+	while (Query->Entry < Query->EntryCount)
+	{
+		entry = &Query->Entries[Query->Entry];
+		if (entry->MinTimestamp > Query->To)
+			break;
+
+		end = Query->Entry + 1 < Query->EntryCount ? Query->Entries[Query->Entry + 1].Offset : Query->CaptureLength;
+		if (end > Query->CaptureLength)
+			end = Query->CaptureLength;
+		if (Query->Offset < entry->Offset)
+			Query->Offset = entry->Offset;
+		if (Query->Offset >= end || !IndexHasPort(Query, entry))
+		{
+			Query->Entry++;
+			continue;
+		}
+
+		length = Query->CaptureLength - Query->Offset;
+		size = PcapngNextBlock(&Query->Reader, Query->Capture + Query->Offset, length > 0xFFFFFFFF ? 0xFFFFFFFF : (ULONG)length, Record, Payload);
+		if (size == 0 || size == PCAPNG_INVALID)
+			break;
+		Query->Offset += size;
+
+		if (Record->HeaderSize == 0)
+			continue;
+		if (Query->Port != INDEX_PORT_ANY && Record->DeviceNumber != Query->Port)
+			continue;
+		if ((ULONG64)Record->Timestamp < Query->From || (ULONG64)Record->Timestamp > Query->To)
+			continue;
+		return TRUE;
+	}
+
+	Query->Entry = Query->EntryCount;
+	return FALSE;
+}
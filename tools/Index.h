@@ -0,0 +1,123 @@
+/*++
+
+Module Name:
+
+    index.h
+
+Abstract:
+
+    This file contains the capture index definitions.
+
+    The index is a sidecar file of a pcapng capture written by the client
+    (see pcapng.h). It splits the capture into blocks of about BlockBytes
+    and keeps one INDEX_ENTRY per block: where the block starts, the
+    range of its timestamps and the set of ports it has records of. A
+    query finds the first block of a time range by binary search and
+    walks only the blocks that may hold records of the port. The index
+    also keeps the interface table of the capture, the port and the
+    timestamp resolution of every interface ID, so a query can start
+    anywhere in the capture whatever interfaces were described before
+    that point. Both files are expected to be mapped by the caller,
+    records come back as pointers into the mapped capture.
+
+    Like the ring, the module does not depend on the framework and can
+    be built outside of Windows.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include "Pcapng.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define INDEX_MAGIC				0x494D5043	// 'CPMI'
+#define INDEX_VERSION			2
+#define INDEX_PORT_ANY			0xFFFFFFFF
+
+//
+// The index file is INDEX_HEADER followed by EntryCount entries and then
+// InterfaceCount interfaces. Entries follow the capture, Offset only
+// grows. MaxTimestamp is the largest timestamp up to the end of the
+// block, so it only grows as well even if records are slightly out of
+// order. Timestamps are in nanoseconds as returned by PcapngNextBlock.
+// Ports has a bit per interface ID.
+//
+typedef struct _INDEX_HEADER
+{
+	ULONG Magic;
+	ULONG Version;
+	ULONG BlockBytes;
+	ULONG InterfaceCount;
+	ULONG64 EntryCount;
+} INDEX_HEADER, *PINDEX_HEADER;
+
+typedef struct _INDEX_ENTRY
+{
+	ULONG64 Offset;
+	ULONG64 MinTimestamp;
+	ULONG64 MaxTimestamp;
+	ULONG64 Ports[PCAPNG_MAX_INTERFACES / 64];
+} INDEX_ENTRY, *PINDEX_ENTRY;
+
+//
+// Port is the device number of the interface, TsResol its if_tsresol.
+//
+typedef struct _INDEX_INTERFACE
+{
+	ULONG Port;
+	UCHAR TsResol;
+	UCHAR Reserved[3];
+} INDEX_INTERFACE, *PINDEX_INTERFACE;
+
+//
+// The writer collects the interface table as the capture is written.
+// The client appends the entries it gets to the index and finishes the
+// file with the InterfaceCount entries of Interfaces and the header
+// from IndexWriterHeader.
+//
+typedef struct _INDEX_WRITER
+{
+	INDEX_ENTRY Current;
+	ULONG BlockBytes;
+	ULONG64 MaxTimestamp;
+	ULONG64 EntryCount;
+	BOOLEAN Open;
+	ULONG InterfaceCount;
+	INDEX_INTERFACE Interfaces[PCAPNG_MAX_INTERFACES];
+
+} INDEX_WRITER, *PINDEX_WRITER;
+
+typedef struct _INDEX_QUERY
+{
+	const INDEX_ENTRY *Entries;
+	ULONG64 EntryCount;
+	ULONG64 Entry;
+	const UCHAR *Capture;
+	ULONG64 CaptureLength;
+	ULONG64 Offset;
+	ULONG64 From;
+	ULONG64 To;
+	ULONG Port;
+	ULONG64 Interfaces[PCAPNG_MAX_INTERFACES / 64];
+	PCAPNG_READER Reader;
+
+} INDEX_QUERY, *PINDEX_QUERY;
+
+VOID IndexWriterInitialize(PINDEX_WRITER Writer, ULONG BlockBytes);
+BOOLEAN IndexWriterInterface(PINDEX_WRITER Writer, ULONG InterfaceId, ULONG Port, UCHAR TsResol);
+BOOLEAN IndexWriterAdd(PINDEX_WRITER Writer, ULONG64 Offset, ULONG InterfaceId, const MEMORY_CONTEXT *Record, PINDEX_ENTRY Entry);
+BOOLEAN IndexWriterFlush(PINDEX_WRITER Writer, PINDEX_ENTRY Entry);
+VOID IndexWriterHeader(PINDEX_WRITER Writer, PINDEX_HEADER Header);
+BOOLEAN IndexQueryStart(PINDEX_QUERY Query, const VOID *Index, ULONG64 IndexLength, const VOID *Capture, ULONG64 CaptureLength, ULONG64 From, ULONG64 To, ULONG Port);
+BOOLEAN IndexQueryNext(PINDEX_QUERY Query, PMEMORY_CONTEXT Record, const UCHAR **Payload);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,403 @@
+/*++
+
+Module Name:
+
+    lz.c
+
+Abstract:
+
+    This file contains the block compressor and decompressor.
+
+    The output is an LZ4 block: sequences of literals and a match of at
+    least 4 bytes at most 64 KB back, the last 5 bytes always literals.
+    The compressor is greedy with a single hash probe per position, on
+    the next 5 bytes, and skips faster the longer it finds no match.
+    Matches are extended 8 bytes at a time, literals and matches are
+    copied in 8 byte steps where both buffers leave room for it. The
+    decompressor checks every length against both buffers.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "Lz.h"
+
+#define LZ_MIN_MATCH			4
+#define LZ_LAST_LITERALS		5
+#define LZ_MATCH_LIMIT			12
+#define LZ_MAX_OFFSET			65535
+#define LZ_SKIP_TRIGGER			6
+#define LZ_COPY					8
+
+#if defined(__GNUC__) && defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+#define LZ_COUNT_WORDS
+#endif
+
+static ULONG LzRead32(const UCHAR *Buffer)
+{
+	ULONG value;
+
+	memcpy(&value, Buffer, sizeof(value));
+	return value;
+}
+
+static ULONG64 LzRead64(const UCHAR *Buffer)
+{
+	ULONG64 value;
+
+	memcpy(&value, Buffer, sizeof(value));
+	return value;
+}
+
+static ULONG LzHash(const UCHAR *Buffer)
+{
+	ULONG64 value = LzRead64(Buffer);
+
+	//
+	// The 5 bytes at the position, whatever the byte order.
+	//
+#if defined(__BYTE_ORDER__) && __BYTE_ORDER__ == __ORDER_BIG_ENDIAN__
+	value >>= 24;
+#else
+	value <<= 24;
+#endif
+	return (ULONG)((value * 889523592379ULL) >> (64 - LZ_HASH_BITS));
+}
+
+static ULONG LzCount(const UCHAR *Position, const UCHAR *Match, const UCHAR *Limit)
+/*++
+
+Return Value:
+
+    Number of bytes the match and the position have in common, up to
+    Limit.
+
+--*/
+{
+	const UCHAR *start = Position;
+#ifdef LZ_COUNT_WORDS
+	ULONG64 difference;
+
+	while (Limit - Position >= LZ_COPY)
+	{
+		difference = LzRead64(Match) ^ LzRead64(Position);
+		if (difference != 0)
+			return (ULONG)(Position - start) + __builtin_ctzll(difference) / 8;
+		Position += LZ_COPY;
+		Match += LZ_COPY;
+	}
+#endif
+	while (Position < Limit && *Position == *Match)
+	{
+		Position++;
+		Match++;
+	}
+	return (ULONG)(Position - start);
+}
+
+static VOID LzWildCopy(PUCHAR Destination, const UCHAR *Source, ULONG Length)
+/*++
+
+Routine Description:
+
+    Copies in 8 byte steps, up to 7 bytes past the end of both buffers.
+    The source may overlap the destination if it is at least 8 bytes
+    behind it.
+
+--*/
+{
+	PUCHAR end = Destination + Length;
+
+	do
+	{
+		memcpy(Destination, Source, LZ_COPY);
+		Destination += LZ_COPY;
+		Source += LZ_COPY;
+	} while (Destination < end);
+}
+
+static PUCHAR LzPutLength(PUCHAR Buffer, ULONG Length)
+{
+	for (; Length >= 255; Length -= 255)
+		*Buffer++ = 255;
+	*Buffer++ = (UCHAR)Length;
+	return Buffer;
+}
+
+static PUCHAR LzPutLiterals(PUCHAR Buffer, const UCHAR *Literals, ULONG Length, ULONG MatchLength)
+{
+	PUCHAR token = Buffer++;
+
+	*token = (UCHAR)((Length >= 15 ? 15 : Length) << 4);
+	if (Length >= 15)
+		Buffer = LzPutLength(Buffer, Length - 15);
+
+	//
+	// Literals followed by a match have the match and the last literals
+	// of the source after them, and LZ_BOUND leaves room in the output.
+	//
+	if (MatchLength != 0 && Length != 0)
+		LzWildCopy(Buffer, Literals, Length);
+	else
+		memcpy(Buffer, Literals, Length);
+	Buffer += Length;
+
+	if (MatchLength != 0)
+	{
+		MatchLength -= LZ_MIN_MATCH;
+		*token |= (UCHAR)(MatchLength >= 15 ? 15 : MatchLength);
+	}
+	return Buffer;
+}
+
+ULONG LzCompress(PLZ_STATE State, const VOID *Source, ULONG SourceLength, PVOID Destination, ULONG DestinationLength)
+/*++
+
+Routine Description:
+
+    Compresses the buffer into an independent block. State is only
+    scratch space, positions it holds from earlier blocks are ignored.
+
+Return Value:
+
+    Size of the block, 0 if the destination is smaller than
+    LZ_BOUND(SourceLength).
+
+--*/
+{
+	const UCHAR *source = (const UCHAR *)Source, *end = source + SourceLength;
+	const UCHAR *position = source, *anchor = source, *match, *limit, *matchLimit;
+	PUCHAR output = (PUCHAR)Destination;
+	ULONG hash, stored, base, length, searches;
+
+	if (DestinationLength < LZ_BOUND(SourceLength))
+		return 0;
+
+	if (State->Base > LZ_INVALID - SourceLength)
+	{
+		memset(State->Table, 0, sizeof(State->Table));
+		State->Base = 1;
+	}
+	base = State->Base;
+	State->Base += SourceLength;
+
+	if (SourceLength > LZ_MATCH_LIMIT)
+	{
+		limit = end - LZ_MATCH_LIMIT;
+		matchLimit = end - LZ_LAST_LITERALS;
+		while (position < limit)
+		{
+			//
+			// Every 64 positions without a match the step grows by one.
+			//
+			for (searches = 1 << LZ_SKIP_TRIGGER;; position += searches++ >> LZ_SKIP_TRIGGER)
+			{
+				if (position >= limit)
+					goto Last;
+
+				hash = LzHash(position);
+				stored = State->Table[hash];
+				State->Table[hash] = base + (ULONG)(position - source);
+				if (stored < base)
+					continue;
+
+				match = source + (stored - base);
+				if (match < position && position - match <= LZ_MAX_OFFSET && LzRead32(match) == LzRead32(position))
+					break;
+			}
+
+			while (position > anchor && match > source && position[-1] == match[-1])
+			{
+				position--;
+				match--;
+			}
+			length = LZ_MIN_MATCH + LzCount(position + LZ_MIN_MATCH, match + LZ_MIN_MATCH, matchLimit);
+
+			output = LzPutLiterals(output, anchor, (ULONG)(position - anchor), length);
+			output[0] = (UCHAR)(position - match);
+			output[1] = (UCHAR)((position - match) >> 8);
+			output += 2;
+			if (length - LZ_MIN_MATCH >= 15)
+				output = LzPutLength(output, length - LZ_MIN_MATCH - 15);
+
+			position += length;
+			anchor = position;
+
+			//
+			// The position two bytes back often starts the next repeat.
+			//
+			if (position < limit)
+				State->Table[LzHash(position - 2)] = base + (ULONG)(position - 2 - source);
+		}
+	}
+
+Last:
+	output = LzPutLiterals(output, anchor, (ULONG)(end - anchor), 0);
+	return (ULONG)(output - (PUCHAR)Destination);
+}
+
+static BOOLEAN LzGetLength(const UCHAR **Buffer, const UCHAR *End, PULONG Length)
+{
+	UCHAR value;
+
+	do
+	{
+		if (*Buffer >= End || *Length > LZ_INVALID - 255)
+			return FALSE;
+		value = *(*Buffer)++;
+		*Length += value;
+	} while (value == 255);
+	return TRUE;
+}
+
+ULONG LzDecompress(const VOID *Source, ULONG SourceLength, PVOID Destination, ULONG DestinationLength)
+/*++
+
+Return Value:
+
+    Size of the decompressed data, LZ_INVALID if the block is corrupt or
+    does not fit into the destination.
+
+--*/
+{
+	const UCHAR *input = (const UCHAR *)Source, *end = input + SourceLength, *match;
+	PUCHAR output = (PUCHAR)Destination, outputEnd = output + DestinationLength;
+	ULONG length, offset;
+	UCHAR token;
+
+	for (;;)
+	{
+		if (input >= end)
+			return LZ_INVALID;
+		token = *input++;
+
+		length = token >> 4;
+		if (length == 15 && !LzGetLength(&input, end, &length))
+			return LZ_INVALID;
+		if (length > (ULONG)(end - input) || length > (ULONG)(outputEnd - output))
+			return LZ_INVALID;
+		if (length != 0 && (ULONG)(end - input) - length >= LZ_COPY && (ULONG)(outputEnd - output) - length >= LZ_COPY)
+			LzWildCopy(output, input, length);
+		else
+			memcpy(output, input, length);
+		input += length;
+		output += length;
+		if (input == end)
+			break;
+
+		if (end - input < 2)
+			return LZ_INVALID;
+		offset = input[0] | (ULONG)input[1] << 8;
+		input += 2;
+		if (offset == 0 || offset > (ULONG)(output - (PUCHAR)Destination))
+			return LZ_INVALID;
+
+		length = token & 15;
+		if (length == 15 && !LzGetLength(&input, end, &length))
+			return LZ_INVALID;
+		length += LZ_MIN_MATCH;
+		if (length > (ULONG)(outputEnd - output))
+			return LZ_INVALID;
+
+		match = output - offset;
+		if (offset >= LZ_COPY && (ULONG)(outputEnd - output) - length >= LZ_COPY)
+		{
+			LzWildCopy(output, match, length);
+			output += length;
+		}
+		else if (offset >= length)
+		{
+			memcpy(output, match, length);
+			output += length;
+		}
+		else
+		{
+			while (length-- != 0)
+				*output++ = *match++;
+		}
+	}
+	return (ULONG)(output - (PUCHAR)Destination);
+}
+
+ULONG LzStoreBlock(PLZ_STATE State, const VOID *Source, ULONG SourceLength, PVOID Destination, ULONG DestinationLength)
+/*++
+
+Routine Description:
+
+    Writes a block of the compressed file: compressed if that saves
+    space, as is otherwise. The caller records the result as StoredSize.
+
+Return Value:
+
+    Size of the stored block, 0 if the destination is smaller than
+    LZ_BOUND(SourceLength).
+
+--*/
+{
+	ULONG size;
+
+	size = LzCompress(State, Source, SourceLength, Destination, DestinationLength);
+	if (size == 0 || size < SourceLength)
+		return size;
+
+	memcpy(Destination, Source, SourceLength);
+	return SourceLength;
+}
+
+ULONG64 LzFindBlock(const LZ_BLOCK *Blocks, ULONG64 BlockCount, ULONG64 RawOffset)
+/*++
+
+Return Value:
+
+    Index of the block holding the capture offset, BlockCount if none.
+
+--*/
+{
+	ULONG64 low = 0, high = BlockCount, middle;
+
+	while (low < high)
+	{
+		middle = low + (high - low) / 2;
+		if (Blocks[middle].RawOffset + Blocks[middle].RawSize <= RawOffset)
+			low = middle + 1;
+		else
+			high = middle;
+	}
+	if (low < BlockCount && Blocks[low].RawOffset > RawOffset)
+		return BlockCount;
+	return low;
+}
+
+ULONG LzLoadBlock(const LZ_BLOCK *Block, const VOID *Stored, ULONG64 StoredLength, PVOID Destination, ULONG DestinationLength)
+/*++
+
+Routine Description:
+
+    Decodes one block of the compressed file into the destination.
+
+Return Value:
+
+    RawSize of the block, LZ_INVALID if the block is corrupt or does not
+    fit into the destination.
+
+--*/
+{
+	const UCHAR *data;
+
+	if (Block->StoredOffset > StoredLength || Block->StoredSize > StoredLength - Block->StoredOffset || Block->RawSize > DestinationLength)
+		return LZ_INVALID;
+
+	data = (const UCHAR *)Stored + Block->StoredOffset;
+	if (Block->StoredSize == Block->RawSize)
+	{
+		memcpy(Destination, data, Block->RawSize);
+		return Block->RawSize;
+	}
+
+	if (LzDecompress(data, Block->StoredSize, Destination, Block->RawSize) != Block->RawSize)
+		return LZ_INVALID;
+	return Block->RawSize;
+}
@@ -0,0 +1,89 @@
+/*++
+
+Module Name:
+
+    lz.h
+
+Abstract:
+
+    This file contains the block compression definitions.
+
+    A compressed capture is the capture cut into blocks of BlockSize
+    bytes, each compressed on its own in the LZ4 block format, so any
+    block can be decoded without the others and on any thread. The block
+    directory is a sidecar file of LZ_DIRECTORY_HEADER followed by one
+    LZ_BLOCK per block; a reader looks up the block of a capture offset,
+    for example one taken from the index (see index.h), and decodes only
+    that block.
+
+    Like the ring, the module does not depend on the framework and can
+    be built outside of Windows.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include "Ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define LZ_MAGIC				0x5A4D5043	// 'CPMZ'
+#define LZ_VERSION				1
+#define LZ_HASH_BITS			12
+#define LZ_INVALID				0xFFFFFFFF
+
+//
+// Size of the output buffer LzCompress needs for Length bytes of input
+//
+#define LZ_BOUND(Length)		((Length) + (Length) / 255 + 16)
+
+//
+// Scratch space of the compressor, zeroed before its first use. Table
+// holds Base plus the position of a block, Base moves past every block
+// compressed, so the table does not have to be cleared between blocks.
+//
+typedef struct _LZ_STATE
+{
+	ULONG Table[1 << LZ_HASH_BITS];
+	ULONG Base;
+
+} LZ_STATE, *PLZ_STATE;
+
+//
+// RawOffset and RawSize are the position of the block in the capture,
+// StoredOffset and StoredSize its position in the compressed file. A
+// block with StoredSize equal to RawSize did not compress and is stored
+// as is.
+//
+typedef struct _LZ_DIRECTORY_HEADER
+{
+	ULONG Magic;
+	ULONG Version;
+	ULONG BlockSize;
+	ULONG Reserved;
+	ULONG64 BlockCount;
+} LZ_DIRECTORY_HEADER, *PLZ_DIRECTORY_HEADER;
+
+typedef struct _LZ_BLOCK
+{
+	ULONG64 RawOffset;
+	ULONG64 StoredOffset;
+	ULONG RawSize;
+	ULONG StoredSize;
+} LZ_BLOCK, *PLZ_BLOCK;
+
+ULONG LzCompress(PLZ_STATE State, const VOID *Source, ULONG SourceLength, PVOID Destination, ULONG DestinationLength);
+ULONG LzDecompress(const VOID *Source, ULONG SourceLength, PVOID Destination, ULONG DestinationLength);
+ULONG LzStoreBlock(PLZ_STATE State, const VOID *Source, ULONG SourceLength, PVOID Destination, ULONG DestinationLength);
+ULONG64 LzFindBlock(const LZ_BLOCK *Blocks, ULONG64 BlockCount, ULONG64 RawOffset);
+ULONG LzLoadBlock(const LZ_BLOCK *Block, const VOID *Stored, ULONG64 StoredLength, PVOID Destination, ULONG DestinationLength);
+
+#ifdef __cplusplus
+}
+#endif
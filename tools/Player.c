@@ -0,0 +1,376 @@
+/*++
+
+Module Name:
+
+    player.c
+
+Abstract:
+
+    This file contains the capture player.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include "Player.h"
+
+#define PLAYER_TABLE_SIZE			(PLAYER_MAX_PORTS * 2)
+#define PLAYER_SLAVE				0x80000000
+#define PLAYER_POLL_RECORDS			64
+
+static ULONG PlayerHash(ULONG DeviceNumber)
+{
+	return (ULONG)((DeviceNumber * 2654435761u) % PLAYER_TABLE_SIZE);
+}
+
+static PPLAYER_PORT PlayerFind(PPLAYER Player, ULONG DeviceNumber)
+{
+	ULONG slot;
+
+	for (slot = PlayerHash(DeviceNumber); Player->Table[slot] != 0; slot = (slot + 1) % PLAYER_TABLE_SIZE)
+	{
+		if (Player->Ports[Player->Table[slot] - 1].DeviceNumber == DeviceNumber)
+			return &Player->Ports[Player->Table[slot] - 1];
+	}
+	return NULL;
+}
+
+BOOLEAN PlayerInitialize(PPLAYER Player, ULONG Play, BOOLEAN Drain)
+{
+	struct epoll_event event;
+
+	memset(Player, 0, sizeof(*Player));
+	Player->Play = Play;
+	Player->Drain = Drain;
+	Player->Epoll = epoll_create1(EPOLL_CLOEXEC);
+	Player->Timer = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+	if (Player->Epoll < 0 || Player->Timer < 0)
+	{
+		PlayerClose(Player);
+		return FALSE;
+	}
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = 0;
+	if (epoll_ctl(Player->Epoll, EPOLL_CTL_ADD, Player->Timer, &event) != 0)
+	{
+		PlayerClose(Player);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+PPLAYER_PORT PlayerOpenPort(PPLAYER Player, ULONG DeviceNumber)
+/*++
+
+Routine Description:
+
+    Opens the pty pair of a port. The player keeps the slave open too, so
+    the master does not hang up while no program has the port open, and
+    puts it into raw mode, so the data goes through unchanged and is not
+    echoed back.
+
+Return Value:
+
+    The port, NULL with errno set if it could not be opened.
+
+--*/
+{
+	PPLAYER_PORT port;
+	struct termios settings;
+	struct epoll_event event;
+	ULONG slot;
+
+	port = PlayerFind(Player, DeviceNumber);
+	if (port != NULL)
+		return port;
+	if (Player->PortCount == PLAYER_MAX_PORTS)
+	{
+		errno = EMFILE;
+		return NULL;
+	}
+
+	port = &Player->Ports[Player->PortCount];
+	memset(port, 0, sizeof(*port));
+	port->DeviceNumber = DeviceNumber;
+	port->Slave = -1;
+	port->Master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (port->Master < 0)
+		return NULL;
+	if (grantpt(port->Master) != 0 || unlockpt(port->Master) != 0 || ptsname_r(port->Master, port->Name, sizeof(port->Name)) != 0)
+		goto Error;
+
+	port->Slave = open(port->Name, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (port->Slave < 0 || tcgetattr(port->Slave, &settings) != 0)
+		goto Error;
+	cfmakeraw(&settings);
+	if (tcsetattr(port->Slave, TCSANOW, &settings) != 0)
+		goto Error;
+
+	port->Pending = malloc(PLAYER_PENDING);
+	if (port->Pending == NULL)
+		goto Error;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = Player->PortCount + 1;
+	if (epoll_ctl(Player->Epoll, EPOLL_CTL_ADD, port->Master, &event) != 0)
+		goto Error;
+	if (Player->Drain)
+	{
+		event.data.u32 = (Player->PortCount + 1) | PLAYER_SLAVE;
+		if (epoll_ctl(Player->Epoll, EPOLL_CTL_ADD, port->Slave, &event) != 0)
+			goto Error;
+	}
+
+	for (slot = PlayerHash(DeviceNumber); Player->Table[slot] != 0; slot = (slot + 1) % PLAYER_TABLE_SIZE)
+		;
+	Player->Table[slot] = (USHORT)(Player->PortCount + 1);
+	Player->PortCount++;
+	return port;
+
+Error:
+	free(port->Pending);
+	if (port->Slave >= 0)
+		close(port->Slave);
+	close(port->Master);
+	return NULL;
+}
+
+BOOLEAN PlayerOpenPorts(PPLAYER Player, const VOID *Data, ULONG64 Length)
+/*++
+
+Routine Description:
+
+    Opens a port for every port with records to play in the batch file.
+
+--*/
+{
+	TOOLS_BATCH_READER reader;
+	const MEMORY_CONTEXT *record;
+	const UCHAR *payload;
+
+	ToolsBatchReaderInitialize(&reader, Data, Length);
+	while (ToolsNextRecord(&reader, &record, &payload))
+	{
+		if (!ReplayWanted(record) || record->MajorFunctionCode != Player->Play)
+			continue;
+		if (PlayerOpenPort(Player, record->DeviceNumber) == NULL)
+			return FALSE;
+	}
+	return TRUE;
+}
+
+static VOID PlayerWatch(PPLAYER Player, PPLAYER_PORT Port, BOOLEAN Output)
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = Output ? EPOLLIN | EPOLLOUT : EPOLLIN;
+	event.data.u32 = (ULONG)(Port - Player->Ports) + 1;
+	epoll_ctl(Player->Epoll, EPOLL_CTL_MOD, Port->Master, &event);
+}
+
+static VOID PlayerFlush(PPLAYER Player, PPLAYER_PORT Port)
+{
+	ssize_t written;
+
+	written = write(Port->Master, Port->Pending, Port->PendingLength);
+	if (written <= 0)
+		return;
+
+	Port->Written += (ULONG64)written;
+	Port->PendingLength -= (ULONG)written;
+	memmove(Port->Pending, Port->Pending + written, Port->PendingLength);
+	if (Port->PendingLength == 0)
+		PlayerWatch(Player, Port, FALSE);
+}
+
+static VOID PlayerWrite(PPLAYER Player, PPLAYER_PORT Port, const UCHAR *Data, ULONG Length)
+/*++
+
+Routine Description:
+
+    Writes to the master, what the pty does not take now is kept pending
+    and written when the master becomes writable again.
+
+--*/
+{
+	ssize_t written = 0;
+
+	if (Port->PendingLength == 0)
+	{
+		written = write(Port->Master, Data, Length);
+		if (written < 0)
+			written = 0;
+		Port->Written += (ULONG64)written;
+		if ((ULONG)written == Length)
+			return;
+		PlayerWatch(Player, Port, TRUE);
+	}
+
+	Data += written;
+	Length -= (ULONG)written;
+	if (Length > PLAYER_PENDING - Port->PendingLength)
+	{
+		Port->Dropped += Length;
+		return;
+	}
+	memcpy(Port->Pending + Port->PendingLength, Data, Length);
+	Port->PendingLength += Length;
+}
+
+static VOID PlayerPoll(PPLAYER Player, int Timeout)
+/*++
+
+Routine Description:
+
+    Waits for the timer or the ports, for Timeout milliseconds, -1 for
+    as long as it takes, and serves what is ready.
+
+--*/
+{
+	struct epoll_event events[64];
+	UCHAR buffer[4096];
+	PPLAYER_PORT port;
+	ULONG64 expirations;
+	ssize_t size;
+	int count, i;
+
+	count = epoll_wait(Player->Epoll, events, sizeof(events) / sizeof(events[0]), Timeout);
+	for (i = 0; i < count; i++)
+	{
+		if (events[i].data.u32 == 0)
+		{
+			//
+			// The timer only wakes the loop up, the caller checks the
+			// due time.
+			//
+			while (read(Player->Timer, &expirations, sizeof(expirations)) > 0)
+				;
+			continue;
+		}
+
+		port = &Player->Ports[(events[i].data.u32 & ~PLAYER_SLAVE) - 1];
+		if (events[i].data.u32 & PLAYER_SLAVE)
+		{
+			while ((size = read(port->Slave, buffer, sizeof(buffer))) > 0)
+				port->Drained += (ULONG64)size;
+			continue;
+		}
+		if (events[i].events & EPOLLIN)
+		{
+			while ((size = read(port->Master, buffer, sizeof(buffer))) > 0)
+				port->Received += (ULONG64)size;
+		}
+		if ((events[i].events & EPOLLOUT) && port->PendingLength != 0)
+			PlayerFlush(Player, port);
+	}
+}
+
+BOOLEAN PlayerRun(PPLAYER Player, const VOID *Data, ULONG64 Length, LONGLONG CaptureFrequency, ULONG Speed, LONGLONG Tolerance)
+/*++
+
+Routine Description:
+
+    Plays the batch file into the open ports, records of other ports are
+    skipped. Player->Replay.Stats has the timing error and the amount
+    played when it returns. Data still pending at the end is given a
+    second to drain.
+
+Return Value:
+
+    FALSE if the timer could not be set.
+
+--*/
+{
+	TOOLS_BATCH_READER reader;
+	const MEMORY_CONTEXT *record;
+	const UCHAR *payload;
+	struct itimerspec timer;
+	PPLAYER_PORT port;
+	LONGLONG now, due;
+	ULONG64 played = 0;
+	ULONG i;
+	BOOLEAN pending;
+
+	ReplayInitialize(&Player->Replay, CaptureFrequency, 1000000000, Speed, Tolerance);
+	Player->Armed = 0;
+	ToolsBatchReaderInitialize(&reader, Data, Length);
+	while (ToolsNextRecord(&reader, &record, &payload))
+	{
+		if (!ReplayWanted(record) || record->MajorFunctionCode != Player->Play)
+			continue;
+		port = PlayerFind(Player, record->DeviceNumber);
+		if (port == NULL)
+			continue;
+
+		now = ToolsNow();
+		due = ReplayDue(&Player->Replay, record, now);
+		while (due > now)
+		{
+			if (Player->Armed != due)
+			{
+				memset(&timer, 0, sizeof(timer));
+				timer.it_value.tv_sec = due / 1000000000;
+				timer.it_value.tv_nsec = due % 1000000000;
+				if (timerfd_settime(Player->Timer, TFD_TIMER_ABSTIME, &timer, NULL) != 0)
+					return FALSE;
+				Player->Armed = due;
+			}
+			PlayerPoll(Player, -1);
+			now = ToolsNow();
+		}
+
+		PlayerWrite(Player, port, payload, record->BufferSize);
+		ReplayDone(&Player->Replay, record, due, ToolsNow());
+
+		//
+		// Records due at once, at the fastest speed or after a stall,
+		// do not wait for the timer, the ports are served every few of
+		// them still.
+		//
+		if (++played % PLAYER_POLL_RECORDS == 0)
+			PlayerPoll(Player, 0);
+	}
+
+	due = ToolsNow() + 1000000000;
+	do
+	{
+		PlayerPoll(Player, 10);
+		for (i = 0, pending = FALSE; i < Player->PortCount; i++)
+			pending |= Player->Ports[i].PendingLength != 0;
+	} while (pending && ToolsNow() < due);
+	PlayerPoll(Player, 0);
+	return TRUE;
+}
+
+VOID PlayerClose(PPLAYER Player)
+{
+	ULONG i;
+
+	for (i = 0; i < Player->PortCount; i++)
+	{
+		close(Player->Ports[i].Master);
+		close(Player->Ports[i].Slave);
+		free(Player->Ports[i].Pending);
+	}
+	Player->PortCount = 0;
+	if (Player->Timer >= 0)
+		close(Player->Timer);
+	if (Player->Epoll >= 0)
+		close(Player->Epoll);
+	Player->Timer = Player->Epoll = -1;
+}
@@ -0,0 +1,88 @@
+/*++
+
+Module Name:
+
+    player.h
+
+Abstract:
+
+    This file contains the capture player definitions.
+
+    The player replays a batch file (see tools.h) into pseudo terminals,
+    one pty pair per port of the capture, on one thread: the replay
+    scheduler (see replay.h) gives the due time of every record, a single
+    timerfd sleeps until it and one epoll set waits for the timer and all
+    the ports at once. A program opens the slave side of a port as it
+    would open the serial port and reads what the device sent, or the
+    player plays the application side to it.
+
+    A port that does not take its data keeps it pending, up to
+    PLAYER_PENDING bytes, while the others go on at their pace, past that
+    the data is dropped and counted.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#pragma once
+
+#include "Tools.h"
+#include "Replay.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PLAYER_MAX_PORTS		1024
+#define PLAYER_PENDING			(64 * 1024)
+
+//
+// Which side of the capture is played into the ports.
+//
+#define PLAYER_PLAY_READS		0x03	// what the device sent
+#define PLAYER_PLAY_WRITES		0x04	// what the application sent
+
+typedef struct _PLAYER_PORT
+{
+	ULONG DeviceNumber;
+	int Master;
+	int Slave;
+	char Name[64];
+	ULONG64 Written;
+	ULONG64 Received;			// read off the master, what the program wrote
+	ULONG64 Drained;			// read off the slave by the player itself
+	ULONG64 Dropped;
+	ULONG PendingLength;
+	PUCHAR Pending;
+
+} PLAYER_PORT, *PPLAYER_PORT;
+
+//
+// Drain makes the player read the slaves itself, for a replay without a
+// program on the other side, benchmarks for example.
+//
+typedef struct _PLAYER
+{
+	int Epoll;
+	int Timer;
+	ULONG Play;
+	BOOLEAN Drain;
+	LONGLONG Armed;
+	ULONG PortCount;
+	PLAYER_PORT Ports[PLAYER_MAX_PORTS];
+	USHORT Table[PLAYER_MAX_PORTS * 2];		// ports by DeviceNumber, 0 is free
+	REPLAY Replay;
+
+} PLAYER, *PPLAYER;
+
+BOOLEAN PlayerInitialize(PPLAYER Player, ULONG Play, BOOLEAN Drain);
+PPLAYER_PORT PlayerOpenPort(PPLAYER Player, ULONG DeviceNumber);
+BOOLEAN PlayerOpenPorts(PPLAYER Player, const VOID *Data, ULONG64 Length);
+BOOLEAN PlayerRun(PPLAYER Player, const VOID *Data, ULONG64 Length, LONGLONG CaptureFrequency, ULONG Speed, LONGLONG Tolerance);
+VOID PlayerClose(PPLAYER Player);
+
+#ifdef __cplusplus
+}
+#endif
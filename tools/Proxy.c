@@ -0,0 +1,349 @@
+/*++
+
+Module Name:
+
+    proxy.c
+
+Abstract:
+
+    This file contains the pty capture proxy.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#define _GNU_SOURCE
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include <sys/epoll.h>
+#include "Proxy.h"
+
+#define PROXY_MJ_READ				0x03
+#define PROXY_MJ_WRITE				0x04
+#define PROXY_SPLICE_FLAGS			(SPLICE_F_NONBLOCK | SPLICE_F_MOVE)
+
+static BOOLEAN ProxyPipe(int Pipe[2])
+{
+	if (pipe2(Pipe, O_NONBLOCK | O_CLOEXEC) != 0)
+		return FALSE;
+	fcntl(Pipe[0], F_SETPIPE_SZ, PROXY_PIPE_SIZE);
+	return TRUE;
+}
+
+static VOID ProxyClosePipe(int Pipe[2])
+{
+	if (Pipe[0] >= 0)
+		close(Pipe[0]);
+	if (Pipe[1] >= 0)
+		close(Pipe[1]);
+	Pipe[0] = Pipe[1] = -1;
+}
+
+static BOOLEAN ProxyOpenPath(PPROXY Proxy, PPROXY_PATH Path, int From, int To, BYTE MajorFunctionCode)
+{
+	Path->From = From;
+	Path->To = To;
+	Path->MajorFunctionCode = MajorFunctionCode;
+	if ((Proxy->Flags & PROXY_COPY) || Proxy->Capture != NULL)
+	{
+		Path->Buffer = malloc(PROXY_PIPE_SIZE);
+		if (Path->Buffer == NULL)
+			return FALSE;
+	}
+	if (Proxy->Flags & PROXY_COPY)
+		return TRUE;
+	if (!ProxyPipe(Path->Pipe))
+		return FALSE;
+	return Proxy->Capture == NULL || ProxyPipe(Path->Tap);
+}
+
+static VOID ProxyWatch(PPROXY Proxy)
+/*++
+
+Routine Description:
+
+    Waits for input on a side only while the direction out of it has
+    nothing in flight, and for the side to become writable only while
+    the direction into it has.
+
+--*/
+{
+	struct epoll_event event;
+
+	memset(&event, 0, sizeof(event));
+	event.events = (Proxy->Paths[PROXY_READ].InFlight == 0 ? EPOLLIN : 0) | (Proxy->Paths[PROXY_WRITE].InFlight != 0 ? EPOLLOUT : 0);
+	event.data.u32 = PROXY_READ;
+	epoll_ctl(Proxy->Epoll, EPOLL_CTL_MOD, Proxy->Device, &event);
+
+	event.events = (Proxy->Paths[PROXY_WRITE].InFlight == 0 ? EPOLLIN : 0) | (Proxy->Paths[PROXY_READ].InFlight != 0 ? EPOLLOUT : 0);
+	event.data.u32 = PROXY_WRITE;
+	epoll_ctl(Proxy->Epoll, EPOLL_CTL_MOD, Proxy->Master, &event);
+}
+
+BOOLEAN ProxyOpen(PPROXY Proxy, int Device, ULONG DeviceNumber, ULONG Flags, PTOOLS_BATCH_WRITER Capture, ULONG SnapLength)
+/*++
+
+Routine Description:
+
+    Opens the pty pair the application is given instead of Device, an
+    open tty, and the pipes between them. The proxy keeps the slave open
+    too, so the master does not hang up while the application has not
+    opened it yet or has closed it, and puts it into raw mode. The
+    application sets the line up as it needs, the settings of Device
+    are the caller's. Records go to Capture, if not NULL, their payload
+    cut to SnapLength bytes.
+
+Return Value:
+
+    FALSE with errno set if the proxy could not be opened.
+
+--*/
+{
+	struct termios settings;
+	struct epoll_event event;
+	int error;
+
+	memset(Proxy, 0, sizeof(*Proxy));
+	Proxy->Device = Device;
+	Proxy->DeviceNumber = DeviceNumber;
+	Proxy->Flags = Flags;
+	Proxy->Capture = Capture;
+	Proxy->SnapLength = SnapLength;
+	Proxy->Slave = Proxy->Null = -1;
+	Proxy->Paths[PROXY_READ].Pipe[0] = Proxy->Paths[PROXY_READ].Pipe[1] = -1;
+	Proxy->Paths[PROXY_READ].Tap[0] = Proxy->Paths[PROXY_READ].Tap[1] = -1;
+	Proxy->Paths[PROXY_WRITE].Pipe[0] = Proxy->Paths[PROXY_WRITE].Pipe[1] = -1;
+	Proxy->Paths[PROXY_WRITE].Tap[0] = Proxy->Paths[PROXY_WRITE].Tap[1] = -1;
+	Proxy->Epoll = epoll_create1(EPOLL_CLOEXEC);
+	Proxy->Master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (Proxy->Epoll < 0 || Proxy->Master < 0)
+		goto Error;
+	if (grantpt(Proxy->Master) != 0 || unlockpt(Proxy->Master) != 0 || ptsname_r(Proxy->Master, Proxy->Name, sizeof(Proxy->Name)) != 0)
+		goto Error;
+
+	Proxy->Slave = open(Proxy->Name, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (Proxy->Slave < 0 || tcgetattr(Proxy->Slave, &settings) != 0)
+		goto Error;
+	cfmakeraw(&settings);
+	if (tcsetattr(Proxy->Slave, TCSANOW, &settings) != 0)
+		goto Error;
+	if (fcntl(Device, F_SETFL, fcntl(Device, F_GETFL) | O_NONBLOCK) != 0)
+		goto Error;
+
+	//
+	// What goes past the snap length is spliced away.
+	//
+	if (Capture != NULL && !(Flags & PROXY_COPY))
+	{
+		Proxy->Null = open("/dev/null", O_WRONLY | O_CLOEXEC);
+		if (Proxy->Null < 0)
+			goto Error;
+	}
+	if (!ProxyOpenPath(Proxy, &Proxy->Paths[PROXY_READ], Device, Proxy->Master, PROXY_MJ_READ) ||
+		!ProxyOpenPath(Proxy, &Proxy->Paths[PROXY_WRITE], Proxy->Master, Device, PROXY_MJ_WRITE))
+		goto Error;
+
+	memset(&event, 0, sizeof(event));
+	event.events = EPOLLIN;
+	event.data.u32 = PROXY_READ;
+	if (epoll_ctl(Proxy->Epoll, EPOLL_CTL_ADD, Device, &event) != 0)
+		goto Error;
+	event.data.u32 = PROXY_WRITE;
+	if (epoll_ctl(Proxy->Epoll, EPOLL_CTL_ADD, Proxy->Master, &event) != 0)
+		goto Error;
+	return TRUE;
+
+Error:
+	error = errno;
+	ProxyClose(Proxy);
+	errno = error;
+	return FALSE;
+}
+
+static VOID ProxyRecord(PPROXY Proxy, PPROXY_PATH Path, LONGLONG Timestamp, const UCHAR *Data, ULONG Length, ULONG Captured)
+{
+	MEMORY_CONTEXT record;
+
+	memset(&record, 0, sizeof(record));
+	record.DeviceNumber = Proxy->DeviceNumber;
+	record.BufferSize = Captured;
+	record.MajorFunctionCode = Path->MajorFunctionCode;
+	record.HeaderSize = sizeof(record);
+	if (Path->MajorFunctionCode == PROXY_MJ_WRITE)
+		record.OutputDataOffset = Length;
+	record.Timestamp = Timestamp;
+	record.LastTimestamp = Timestamp;
+	ToolsBatchWrite(Proxy->Capture, &record, Data);
+	Path->Records++;
+}
+
+static BOOLEAN ProxyFlush(PPROXY_PATH Path, ULONG Flags)
+/*++
+
+Routine Description:
+
+    Writes what is in flight to the other side, as much as it takes.
+
+Return Value:
+
+    FALSE with errno set if the side failed.
+
+--*/
+{
+	ssize_t written;
+
+	if (Flags & PROXY_COPY)
+		written = write(Path->To, Path->Buffer + Path->Offset, Path->InFlight);
+	else
+		written = splice(Path->Pipe[0], NULL, Path->To, NULL, Path->InFlight, PROXY_SPLICE_FLAGS);
+	if (written < 0)
+		return errno == EAGAIN;
+
+	Path->Offset += (ULONG)written;
+	Path->InFlight -= (ULONG)written;
+	return TRUE;
+}
+
+static BOOLEAN ProxyMove(PPROXY Proxy, PPROXY_PATH Path)
+/*++
+
+Routine Description:
+
+    Takes what the side has to give, up to a pipe full, passes it on and
+    records it. The timestamp is that of the data becoming available to
+    the proxy, the capture is written after the data was passed on, so
+    it adds nothing to the latency.
+
+Return Value:
+
+    FALSE with errno set if a side failed or the tty hung up.
+
+--*/
+{
+	LONGLONG timestamp;
+	ssize_t size, tapped = 0;
+	ULONG captured;
+
+	timestamp = ToolsNow() / (1000000000 / PROXY_FREQUENCY);
+	if (Proxy->Flags & PROXY_COPY)
+		size = read(Path->From, Path->Buffer, PROXY_PIPE_SIZE);
+	else
+		size = splice(Path->From, NULL, Path->Pipe[1], NULL, PROXY_PIPE_SIZE, PROXY_SPLICE_FLAGS);
+	if (size <= 0)
+	{
+		if (size < 0 && errno == EAGAIN)
+			return TRUE;
+		if (size == 0)
+			errno = ENXIO;
+		return FALSE;
+	}
+
+	//
+	// The pipe was empty, so the tee is of the data just taken.
+	//
+	if (Proxy->Capture != NULL && !(Proxy->Flags & PROXY_COPY))
+	{
+		tapped = tee(Path->Pipe[0], Path->Tap[1], (size_t)size, SPLICE_F_NONBLOCK);
+		if (tapped < 0)
+			tapped = 0;
+	}
+
+	Path->InFlight = (ULONG)size;
+	Path->Offset = 0;
+	Path->Bytes += (ULONG64)size;
+	if (!ProxyFlush(Path, Proxy->Flags))
+		return FALSE;
+	if (Proxy->Capture == NULL)
+		return TRUE;
+
+	captured = (ULONG)size < Proxy->SnapLength ? (ULONG)size : Proxy->SnapLength;
+	if (!(Proxy->Flags & PROXY_COPY))
+	{
+		if (captured > (ULONG)tapped)
+			captured = (ULONG)tapped;
+		if (captured != 0 && read(Path->Tap[0], Path->Buffer, captured) != (ssize_t)captured)
+			captured = 0;
+		if ((ULONG)tapped > captured)
+			splice(Path->Tap[0], NULL, Proxy->Null, NULL, (ULONG)tapped - captured, SPLICE_F_NONBLOCK);
+	}
+	ProxyRecord(Proxy, Path, timestamp, Path->Buffer, (ULONG)size, captured);
+	return TRUE;
+}
+
+BOOLEAN ProxyPoll(PPROXY Proxy, int Timeout)
+/*++
+
+Routine Description:
+
+    Waits up to Timeout milliseconds, -1 for as long as it takes, for
+    either side and moves what is ready. A signal ends the wait early.
+
+Return Value:
+
+    FALSE with errno set if a side failed or the tty hung up.
+
+--*/
+{
+	struct epoll_event events[2];
+	PPROXY_PATH in, out;
+	ULONG inFlight[2];
+	int count, i;
+
+	count = epoll_wait(Proxy->Epoll, events, 2, Timeout);
+	if (count < 0)
+		return errno == EINTR;
+
+	inFlight[PROXY_READ] = Proxy->Paths[PROXY_READ].InFlight;
+	inFlight[PROXY_WRITE] = Proxy->Paths[PROXY_WRITE].InFlight;
+	for (i = 0; i < count; i++)
+	{
+		//
+		// A side is the source of the path of its own index and the
+		// destination of the other.
+		//
+		in = &Proxy->Paths[events[i].data.u32];
+		out = &Proxy->Paths[events[i].data.u32 ^ 1];
+		if ((events[i].events & EPOLLOUT) && out->InFlight != 0 && !ProxyFlush(out, Proxy->Flags))
+			return FALSE;
+		if ((events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR)) && in->InFlight == 0 && !ProxyMove(Proxy, in))
+			return FALSE;
+		if ((events[i].events & (EPOLLHUP | EPOLLERR)) && in->InFlight != 0)
+		{
+			errno = ENXIO;
+			return FALSE;
+		}
+	}
+
+	if ((inFlight[PROXY_READ] == 0) != (Proxy->Paths[PROXY_READ].InFlight == 0) ||
+		(inFlight[PROXY_WRITE] == 0) != (Proxy->Paths[PROXY_WRITE].InFlight == 0))
+		ProxyWatch(Proxy);
+	return TRUE;
+}
+
+VOID ProxyClose(PPROXY Proxy)
+{
+	ULONG i;
+
+	for (i = 0; i < 2; i++)
+	{
+		ProxyClosePipe(Proxy->Paths[i].Pipe);
+		ProxyClosePipe(Proxy->Paths[i].Tap);
+		free(Proxy->Paths[i].Buffer);
+		Proxy->Paths[i].Buffer = NULL;
+	}
+	if (Proxy->Null >= 0)
+		close(Proxy->Null);
+	if (Proxy->Slave >= 0)
+		close(Proxy->Slave);
+	if (Proxy->Master >= 0)
+		close(Proxy->Master);
+	if (Proxy->Epoll >= 0)
+		close(Proxy->Epoll);
+	Proxy->Null = Proxy->Slave = Proxy->Master = Proxy->Epoll = -1;
+}
@@ -0,0 +1,91 @@
+/*++
+
+Module Name:
+
+    proxy.h
+
+Abstract:
+
+    This file contains the pty capture proxy definitions.
+
+    The proxy is the Linux counterpart of the filter driver: it sits
+    between an application and a tty, real or virtual, and records what
+    goes through as the driver does, MEMORY_CONTEXT records of the device
+    number, the major code, the size and the payload, into a batch file
+    (see tools.h) that the other tools take as they take a capture of the
+    driver. The application opens the slave of a pty pair instead of the
+    tty, the proxy moves the data between the master and the tty.
+
+    The data goes from one side to the other through a pipe with splice,
+    without passing through the proxy's memory, and is written on before
+    it is recorded. Only what the capture keeps, up to SnapLength bytes
+    of every read, is copied out of a tee of the pipe. A side that does
+    not take its data stops the proxy reading from the other, as the
+    serial line would.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#pragma once
+
+#include "Tools.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define PROXY_FREQUENCY			10000000	// timestamps in 100 ns ticks
+#define PROXY_PIPE_SIZE			(64 * 1024)
+
+//
+// The directions, by the major code of their records.
+//
+#define PROXY_READ				0			// from the tty to the application
+#define PROXY_WRITE				1			// from the application to the tty
+
+//
+// Flags.
+//
+#define PROXY_COPY				0x0001		// read and write instead of splice
+
+typedef struct _PROXY_PATH
+{
+	int From;
+	int To;
+	int Pipe[2];				// data on its way from From to To
+	int Tap[2];					// a tee of Pipe, for the capture
+	ULONG InFlight;				// bytes read from From and not yet written to To
+	ULONG Offset;				// of the bytes in flight in Buffer, PROXY_COPY
+	PUCHAR Buffer;
+	BYTE MajorFunctionCode;
+	ULONG64 Bytes;
+	ULONG64 Records;
+
+} PROXY_PATH, *PPROXY_PATH;
+
+typedef struct _PROXY
+{
+	int Epoll;
+	int Device;
+	int Master;
+	int Slave;
+	int Null;
+	char Name[64];
+	ULONG DeviceNumber;
+	ULONG Flags;
+	ULONG SnapLength;
+	PTOOLS_BATCH_WRITER Capture;
+	PROXY_PATH Paths[2];
+
+} PROXY, *PPROXY;
+
+BOOLEAN ProxyOpen(PPROXY Proxy, int Device, ULONG DeviceNumber, ULONG Flags, PTOOLS_BATCH_WRITER Capture, ULONG SnapLength);
+BOOLEAN ProxyPoll(PPROXY Proxy, int Timeout);
+VOID ProxyClose(PPROXY Proxy);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,122 @@
+/*++
+
+Module Name:
+
+    replay.c
+
+Abstract:
+
+    This file contains the capture replay scheduler.
+
+    The first record wanted anchors the capture to the replayer's clock.
+    Every later record is due at the anchor plus its distance from the
+    first one, scaled by the speed and converted to the replayer's clock.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <string.h>
+#include "Replay.h"
+
+#define REPLAY_MJ_READ				0x03
+#define REPLAY_MJ_WRITE				0x04
+
+static LONGLONG ReplayScale(LONGLONG Value, LONGLONG Multiplier, LONGLONG Divisor)
+/*++
+
+Routine Description:
+
+    Returns Value * Multiplier / Divisor without overflowing for the
+    distances of week long captures between nanosecond clocks.
+
+--*/
+{
+	return Value / Divisor * Multiplier + Value % Divisor * Multiplier / Divisor;
+}
+
+VOID ReplayInitialize(PREPLAY Replay, LONGLONG CaptureFrequency, LONGLONG ClockFrequency, ULONG Speed, LONGLONG Tolerance)
+{
+	memset(Replay, 0, sizeof(*Replay));
+	Replay->CaptureFrequency = CaptureFrequency;
+	Replay->ClockFrequency = ClockFrequency;
+	Replay->Speed = Speed;
+	Replay->Tolerance = Tolerance;
+}
+
+BOOLEAN ReplayWanted(const MEMORY_CONTEXT *Record)
+/*++
+
+Routine Description:
+
+    Only the data is replayed: writes of the monitored application and
+    reads of what the device sent it.
+
+--*/
+{
+	return (Record->MajorFunctionCode == REPLAY_MJ_READ || Record->MajorFunctionCode == REPLAY_MJ_WRITE) && Record->BufferSize != 0;
+}
+
+LONGLONG ReplayDue(PREPLAY Replay, const MEMORY_CONTEXT *Record, LONGLONG Now)
+/*++
+
+Routine Description:
+
+    Returns the time on the replayer's clock the record has to be written
+    at. Now anchors the replay at the first call.
+
+    Records of different ports may come slightly out of time order, as
+    the driver drains every port on its own. The due time never goes
+    back, so the replayer keeps a single timer moving forward.
+
+--*/
+{
+	LONGLONG distance, due;
+
+	if (!Replay->Started)
+	{
+		Replay->Started = TRUE;
+		Replay->Start = Now;
+		Replay->FirstTimestamp = Record->Timestamp;
+		Replay->LastDue = Now;
+	}
+
+	if (Replay->Speed == REPLAY_SPEED_FASTEST)
+		return Replay->Start;
+
+	distance = Record->Timestamp - Replay->FirstTimestamp;
+	if (distance < 0)
+		distance = 0;
+	distance = ReplayScale(distance, REPLAY_SPEED_ORIGINAL, Replay->Speed);
+	due = Replay->Start + ReplayScale(distance, Replay->ClockFrequency, Replay->CaptureFrequency);
+	if (due < Replay->LastDue)
+		due = Replay->LastDue;
+	Replay->LastDue = due;
+	return due;
+}
+
+VOID ReplayDone(PREPLAY Replay, const MEMORY_CONTEXT *Record, LONGLONG Due, LONGLONG Now)
+/*++
+
+Routine Description:
+
+    Accounts for a record written at Now. A write replayed as fast as
+    possible is never late.
+
+--*/
+{
+	LONGLONG error = Replay->Speed == REPLAY_SPEED_FASTEST ? 0 : Now - Due;
+
+	if (error < 0)
+		error = 0;
+	Replay->Stats.Records++;
+	Replay->Stats.Bytes += Record->BufferSize;
+	Replay->Stats.Elapsed = Now - Replay->Start;
+	Replay->Stats.ErrorSum += error;
+	if (error > Replay->Stats.ErrorMax)
+		Replay->Stats.ErrorMax = error;
+	if (error > Replay->Tolerance)
+		Replay->Stats.Late++;
+}
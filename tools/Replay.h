@@ -0,0 +1,76 @@
+/*++
+
+Module Name:
+
+    replay.h
+
+Abstract:
+
+    This file contains the capture replay scheduler definitions.
+
+    The scheduler turns the timestamps of captured records into the times
+    a replayer has to write them, on its own clock, at the original pace,
+    scaled, or as fast as possible. It keeps no per-port state and is fed
+    the records of all ports in capture order, so one thread with one
+    timer can replay any number of ports: it sleeps until the due time of
+    the next record, writes it to the port and reports when it did. The
+    scheduler sums up how late the writes were and how much was written.
+
+    Like the ring, the module does not depend on the framework and can
+    be built outside of Windows.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include "Ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define REPLAY_SPEED_ORIGINAL		100		// percent of the original pace
+#define REPLAY_SPEED_FASTEST		0		// every record is due at once
+
+typedef struct _REPLAY_STATS
+{
+	ULONG64 Records;
+	ULONG64 Bytes;
+	LONGLONG Elapsed;			// clock ticks from the start to the last write
+	LONGLONG ErrorSum;			// clock ticks the writes were late, summed up
+	LONGLONG ErrorMax;
+	ULONG64 Late;				// writes later than the tolerance
+
+} REPLAY_STATS, *PREPLAY_STATS;
+
+//
+// CaptureFrequency is that of IOCTL_CPM_GET_TIMESTAMP_FREQUENCY on the
+// capturing machine, ClockFrequency that of the replayer's clock, for
+// example 1000000000 for CLOCK_MONOTONIC in nanoseconds.
+//
+typedef struct _REPLAY
+{
+	LONGLONG CaptureFrequency;
+	LONGLONG ClockFrequency;
+	ULONG Speed;
+	LONGLONG Tolerance;
+	BOOLEAN Started;
+	LONGLONG Start;
+	LONGLONG FirstTimestamp;
+	LONGLONG LastDue;
+	REPLAY_STATS Stats;
+
+} REPLAY, *PREPLAY;
+
+VOID ReplayInitialize(PREPLAY Replay, LONGLONG CaptureFrequency, LONGLONG ClockFrequency, ULONG Speed, LONGLONG Tolerance);
+BOOLEAN ReplayWanted(const MEMORY_CONTEXT *Record);
+LONGLONG ReplayDue(PREPLAY Replay, const MEMORY_CONTEXT *Record, LONGLONG Now);
+VOID ReplayDone(PREPLAY Replay, const MEMORY_CONTEXT *Record, LONGLONG Due, LONGLONG Now);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,235 @@
+/*++
+
+Module Name:
+
+    synth.c
+
+Abstract:
+
+    This file contains the synthetic traffic generator.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <string.h>
+#include "Synth.h"
+#include "Decoder.h"
+
+#define SYNTH_MJ_READ				0x03
+#define SYNTH_MJ_WRITE				0x04
+
+#define SYNTH_PHASE_REQUEST			0
+#define SYNTH_PHASE_RESPONSE		1
+
+static ULONG SynthRandom(PSYNTH Synth)
+{
+	Synth->Random ^= Synth->Random << 13;
+	Synth->Random ^= Synth->Random >> 7;
+	Synth->Random ^= Synth->Random << 17;
+	return (ULONG)(Synth->Random >> 16);
+}
+
+static ULONG SynthFrame(PUCHAR Frame, ULONG Length)
+{
+	USHORT crc;
+
+	crc = ModbusCrc16(0xFFFF, Frame, Length);
+	Frame[Length] = (UCHAR)crc;
+	Frame[Length + 1] = (UCHAR)(crc >> 8);
+	return Length + 2;
+}
+
+static VOID SynthRequest(PSYNTH Synth, PSYNTH_PORT Port)
+/*++
+
+Routine Description:
+
+    Builds the next poll of the port, read holding registers of the next
+    slave, and the response it gets, with register values that change
+    slowly as measurements do.
+
+--*/
+{
+	ULONG i, count;
+
+	Port->Slave = (BYTE)(Port->Slave % 8 + 1);
+	count = 2 + SynthRandom(Synth) % 16;
+	Port->Frame[0] = Port->Slave;
+	Port->Frame[1] = 0x03;
+	Port->Frame[2] = 0x00;
+	Port->Frame[3] = 0x10;
+	Port->Frame[4] = 0x00;
+	Port->Frame[5] = (UCHAR)count;
+	Port->Length = SynthFrame(Port->Frame, 6);
+
+	Port->Frame[Port->Length + 0] = Port->Slave;
+	Port->Frame[Port->Length + 1] = 0x03;
+	Port->Frame[Port->Length + 2] = (UCHAR)(count * 2);
+	for (i = 0; i < count; i++)
+	{
+		Port->Frame[Port->Length + 3 + i * 2] = (UCHAR)(i == 0 ? SynthRandom(Synth) % 4 : 0);
+		Port->Frame[Port->Length + 4 + i * 2] = (UCHAR)(0x40 + i * 3 + SynthRandom(Synth) % 3);
+	}
+	Port->Left = SynthFrame(Port->Frame + Port->Length, 3 + count * 2);
+	Port->Offset = 0;
+}
+
+static ULONG SynthSentence(char *Sentence, ULONG Length)
+{
+	ULONG i;
+	UCHAR checksum = 0;
+
+	for (i = 1; i < Length; i++)
+		checksum ^= (UCHAR)Sentence[i];
+	return Length + (ULONG)sprintf(Sentence + Length, "*%02X\r\n", checksum);
+}
+
+static VOID SynthSentences(PSYNTH Synth, PSYNTH_PORT Port)
+/*++
+
+Routine Description:
+
+    Builds the sentences of the next second of the port, a fix that
+    wanders a few meters around where the receiver stands.
+
+--*/
+{
+	char *frame = (char *)Port->Frame;
+	ULONG length, time;
+	LONG latitude, longitude;
+
+	Port->Latitude += (LONG)(SynthRandom(Synth) % 5) - 2;
+	Port->Longitude += (LONG)(SynthRandom(Synth) % 5) - 2;
+	latitude = 55300000 + Port->Latitude;
+	longitude = 37360000 + Port->Longitude;
+	time = (43200 + Port->Second) % 86400;
+	time = time / 3600 * 10000 + time / 60 % 60 * 100 + time % 60;
+
+	length = (ULONG)sprintf(frame, "$GPGGA,%06lu.00,%02ld%02ld.%04ld,N,%03ld%02ld.%04ld,E,1,%02lu,0.9,%lu.%lu,M,14.5,M,,",
+		(unsigned long)time, (long)(latitude / 1000000), (long)(latitude / 10000 % 100), (long)(latitude % 10000),
+		(long)(longitude / 1000000), (long)(longitude / 10000 % 100), (long)(longitude % 10000),
+		(unsigned long)(7 + SynthRandom(Synth) % 3), (unsigned long)(150 + SynthRandom(Synth) % 3), (unsigned long)(SynthRandom(Synth) % 10));
+	length = SynthSentence(frame, length);
+	Port->Length = length;
+	length = (ULONG)sprintf(frame + length, "$GPRMC,%06lu.00,A,%02ld%02ld.%04ld,N,%03ld%02ld.%04ld,E,0.%02lu,%lu.%02lu,170426,,,A",
+		(unsigned long)time, (long)(latitude / 1000000), (long)(latitude / 10000 % 100), (long)(latitude % 10000),
+		(long)(longitude / 1000000), (long)(longitude / 10000 % 100), (long)(longitude % 10000),
+		(unsigned long)(SynthRandom(Synth) % 20), (unsigned long)(SynthRandom(Synth) % 360), (unsigned long)(SynthRandom(Synth) % 100));
+	Port->Left = Port->Length + SynthSentence(frame + Port->Length, length);
+	Port->Length = 0;
+	Port->Offset = 0;
+}
+
+static VOID SynthSiftDown(PSYNTH Synth, ULONG Index)
+{
+	ULONG child;
+	USHORT port = Synth->Heap[Index];
+
+	for (;;)
+	{
+		child = Index * 2 + 1;
+		if (child >= Synth->PortCount)
+			break;
+		if (child + 1 < Synth->PortCount && Synth->Ports[Synth->Heap[child + 1]].Clock < Synth->Ports[Synth->Heap[child]].Clock)
+			child++;
+		if (Synth->Ports[Synth->Heap[child]].Clock >= Synth->Ports[port].Clock)
+			break;
+		Synth->Heap[Index] = Synth->Heap[child];
+		Index = child;
+	}
+	Synth->Heap[Index] = port;
+}
+
+VOID SynthInitialize(PSYNTH Synth, ULONG Protocol, ULONG PortCount, LONGLONG Frequency, ULONG64 Seed)
+{
+	ULONG i;
+
+	memset(Synth, 0, sizeof(*Synth));
+	Synth->PortCount = PortCount < 1 ? 1 : PortCount > SYNTH_MAX_PORTS ? SYNTH_MAX_PORTS : PortCount;
+	Synth->Random = Seed != 0 ? Seed : 1;
+	Synth->Protocol = Protocol;
+	Synth->Frequency = Frequency;
+	Synth->ByteTicks = Frequency * 10 / (Protocol == SYNTH_NMEA ? SYNTH_NMEA_BAUD_RATE : SYNTH_BAUD_RATE);
+	for (i = 0; i < Synth->PortCount; i++)
+	{
+		Synth->Ports[i].Start = (LONGLONG)(SynthRandom(Synth) % 1000) * Synth->ByteTicks % Frequency;
+		Synth->Ports[i].Clock = Frequency + Synth->Ports[i].Start;
+		Synth->Ports[i].Second = 1;
+		Synth->Ports[i].Slave = (BYTE)i;
+		Synth->Heap[i] = (USHORT)i;
+	}
+	for (i = Synth->PortCount / 2; i-- != 0; )
+		SynthSiftDown(Synth, i);
+}
+
+VOID SynthNext(PSYNTH Synth, PMEMORY_CONTEXT Record, PUCHAR Payload)
+/*++
+
+Routine Description:
+
+    Produces the next record, of the port with the earliest clock.
+    Payload receives up to SYNTH_MAX_PAYLOAD bytes.
+
+--*/
+{
+	PSYNTH_PORT port;
+	ULONG number, length;
+
+	number = Synth->Heap[0];
+	port = &Synth->Ports[number];
+
+	memset(Record, 0, sizeof(*Record));
+	Record->DeviceNumber = number * SYNTH_PORT_STRIDE;
+	Record->HeaderSize = sizeof(*Record);
+	Record->Timestamp = port->Clock;
+	Record->LastTimestamp = port->Clock;
+	if (port->Phase == SYNTH_PHASE_REQUEST && Synth->Protocol == SYNTH_NMEA)
+	{
+		SynthSentences(Synth, port);
+		port->Phase = SYNTH_PHASE_RESPONSE;
+	}
+	if (port->Phase == SYNTH_PHASE_REQUEST)
+	{
+		SynthRequest(Synth, port);
+		memcpy(Payload, port->Frame, port->Length);
+		Record->MajorFunctionCode = SYNTH_MJ_WRITE;
+		Record->BufferSize = port->Length;
+		Record->OutputDataOffset = port->Length;
+		port->Offset = port->Length;
+		port->Phase = SYNTH_PHASE_RESPONSE;
+		port->Clock += Synth->ByteTicks * (port->Length + 4);
+	}
+	else
+	{
+		//
+		// The UART hands the response out in chunks of its FIFO
+		// threshold or whatever came before the read timed out.
+		//
+		length = 1 + SynthRandom(Synth) % 14;
+		if (length > port->Left)
+			length = port->Left;
+		memcpy(Payload, port->Frame + port->Offset, length);
+		Record->MajorFunctionCode = SYNTH_MJ_READ;
+		Record->BufferSize = length;
+		port->Offset += length;
+		port->Left -= length;
+		port->Clock += Synth->ByteTicks * length;
+		if (port->Left == 0)
+		{
+			//
+			// The master waits a few milliseconds between polls, the
+			// receiver sends at the same point of every second.
+			//
+			port->Phase = SYNTH_PHASE_REQUEST;
+			if (Synth->Protocol == SYNTH_NMEA)
+				port->Clock = ++port->Second * Synth->Frequency + port->Start;
+			else
+				port->Clock += Synth->Frequency / 1000 * (1 + SynthRandom(Synth) % 4);
+		}
+	}
+	SynthSiftDown(Synth, 0);
+}
@@ -0,0 +1,78 @@
+/*++
+
+Module Name:
+
+    synth.h
+
+Abstract:
+
+    This file contains the synthetic traffic definitions.
+
+    The generator stands in for a capture of real ports, for the tools to
+    be tried and measured without the driver. With SYNTH_MODBUS every
+    port is a Modbus RTU master polling its slaves at SYNTH_BAUD_RATE:
+    the request is one write, the response comes back as a few reads of
+    the sizes a UART hands out. With SYNTH_NMEA every port is a GPS
+    receiver sending GGA and RMC sentences once a second at
+    SYNTH_NMEA_BAUD_RATE, read the same way. Records carry the timestamps the traffic would have at
+    that baud rate and are produced in timestamp order, as the driver
+    would capture them, and the port numbers are sparse as on a machine
+    where ports come and go.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include "Ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define SYNTH_MAX_PORTS			1024
+#define SYNTH_MAX_PAYLOAD		256
+#define SYNTH_BAUD_RATE			115200
+#define SYNTH_NMEA_BAUD_RATE	9600
+#define SYNTH_PORT_STRIDE		7		// port numbers are 0, 7, 14...
+
+#define SYNTH_MODBUS			0
+#define SYNTH_NMEA				1
+
+typedef struct _SYNTH_PORT
+{
+	LONGLONG Clock;
+	ULONG Phase;
+	ULONG Left;
+	BYTE Slave;
+	UCHAR Frame[SYNTH_MAX_PAYLOAD];
+	ULONG Length;
+	ULONG Offset;
+	LONGLONG Start;
+	ULONG Second;
+	LONG Latitude;
+	LONG Longitude;
+
+} SYNTH_PORT, *PSYNTH_PORT;
+
+typedef struct _SYNTH
+{
+	ULONG Protocol;
+	ULONG PortCount;
+	ULONG64 Random;
+	LONGLONG Frequency;
+	LONGLONG ByteTicks;
+	SYNTH_PORT Ports[SYNTH_MAX_PORTS];
+	USHORT Heap[SYNTH_MAX_PORTS];		// ports by Clock, earliest first
+
+} SYNTH, *PSYNTH;
+
+VOID SynthInitialize(PSYNTH Synth, ULONG Protocol, ULONG PortCount, LONGLONG Frequency, ULONG64 Seed);
+VOID SynthNext(PSYNTH Synth, PMEMORY_CONTEXT Record, PUCHAR Payload);
+
+#ifdef __cplusplus
+}
+#endif
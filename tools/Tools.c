@@ -0,0 +1,304 @@
+/*++
+
+Module Name:
+
+    tools.c
+
+Abstract:
+
+    This file contains the file handling shared by the user-mode tools.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "Tools.h"
+
+LONGLONG ToolsNow(VOID)
+/*++
+
+Routine Description:
+
+    Returns CLOCK_MONOTONIC in nanoseconds.
+
+--*/
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (LONGLONG)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+BOOLEAN ToolsOutputOpen(PTOOLS_OUTPUT Output, const char *Path)
+{
+	memset(Output, 0, sizeof(*Output));
+	Output->Buffer = malloc(TOOLS_OUTPUT_BUFFER);
+	if (Output->Buffer == NULL)
+		return FALSE;
+
+	Output->File = open(Path, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+	if (Output->File < 0)
+	{
+		free(Output->Buffer);
+		return FALSE;
+	}
+	return TRUE;
+}
+
+static VOID ToolsOutputFlush(PTOOLS_OUTPUT Output)
+{
+	ULONG offset = 0;
+	ssize_t written;
+
+	while (offset < Output->Used && !Output->Failed)
+	{
+		written = write(Output->File, Output->Buffer + offset, Output->Used - offset);
+		if (written <= 0)
+			Output->Failed = TRUE;
+		else
+			offset += (ULONG)written;
+	}
+	Output->Used = 0;
+}
+
+PVOID ToolsOutputReserve(PTOOLS_OUTPUT Output, ULONG Length)
+/*++
+
+Routine Description:
+
+    Returns room for Length bytes at the end of the buffer, to be built
+    in place and committed with ToolsOutputCommit.
+
+Return Value:
+
+    NULL if Length is larger than the buffer.
+
+--*/
+{
+	if (Length > TOOLS_OUTPUT_BUFFER)
+		return NULL;
+	if (Length > TOOLS_OUTPUT_BUFFER - Output->Used)
+		ToolsOutputFlush(Output);
+	return Output->Buffer + Output->Used;
+}
+
+VOID ToolsOutputCommit(PTOOLS_OUTPUT Output, ULONG Length)
+{
+	Output->Used += Length;
+	Output->Written += Length;
+}
+
+VOID ToolsOutputWrite(PTOOLS_OUTPUT Output, const VOID *Data, ULONG Length)
+{
+	PVOID buffer;
+	ssize_t written;
+
+	buffer = ToolsOutputReserve(Output, Length);
+	if (buffer != NULL)
+	{
+		memcpy(buffer, Data, Length);
+		ToolsOutputCommit(Output, Length);
+		return;
+	}
+
+	//
+	// Larger than the buffer, written as is.
+	//
+	ToolsOutputFlush(Output);
+	while (Length != 0 && !Output->Failed)
+	{
+		written = write(Output->File, Data, Length);
+		if (written <= 0)
+			Output->Failed = TRUE;
+		else
+		{
+			Data = (const UCHAR *)Data + written;
+			Length -= (ULONG)written;
+			Output->Written += (ULONG64)written;
+		}
+	}
+}
+
+BOOLEAN ToolsOutputClose(PTOOLS_OUTPUT Output)
+/*++
+
+Return Value:
+
+    FALSE if anything failed to be written.
+
+--*/
+{
+	ToolsOutputFlush(Output);
+	if (close(Output->File) != 0)
+		Output->Failed = TRUE;
+	free(Output->Buffer);
+	return !Output->Failed;
+}
+
+BOOLEAN ToolsMapFile(PTOOLS_MAPPING Mapping, const char *Path)
+/*++
+
+Routine Description:
+
+    Maps a whole file for reading. An empty file maps to no data.
+
+--*/
+{
+	struct stat status;
+	void *data;
+	int file;
+
+	Mapping->Data = NULL;
+	Mapping->Length = 0;
+	file = open(Path, O_RDONLY);
+	if (file < 0)
+		return FALSE;
+
+	if (fstat(file, &status) != 0)
+	{
+		close(file);
+		return FALSE;
+	}
+	if (status.st_size != 0)
+	{
+		data = mmap(NULL, (size_t)status.st_size, PROT_READ, MAP_SHARED, file, 0);
+		if (data == MAP_FAILED)
+		{
+			close(file);
+			return FALSE;
+		}
+		Mapping->Data = data;
+		Mapping->Length = (ULONG64)status.st_size;
+	}
+	close(file);
+	return TRUE;
+}
+
+VOID ToolsUnmapFile(PTOOLS_MAPPING Mapping)
+{
+	if (Mapping->Data != NULL)
+		munmap((void *)Mapping->Data, (size_t)Mapping->Length);
+	Mapping->Data = NULL;
+	Mapping->Length = 0;
+}
+
+VOID ToolsBatchReaderInitialize(PTOOLS_BATCH_READER Reader, const VOID *Data, ULONG64 Length)
+{
+	memset(Reader, 0, sizeof(*Reader));
+	Reader->Data = (const UCHAR *)Data;
+	Reader->Length = Length;
+}
+
+BOOLEAN ToolsNextRecord(PTOOLS_BATCH_READER Reader, const MEMORY_CONTEXT **Record, const UCHAR **Payload)
+/*++
+
+Routine Description:
+
+    Returns the next record of a batch file. The records point into the
+    mapped file.
+
+Return Value:
+
+    FALSE at the end of the file, or at the first batch or record that
+    does not fit into what is left of it.
+
+--*/
+{
+	BATCH_HEADER header;
+	const MEMORY_CONTEXT *record;
+	ULONG64 size;
+
+	while (Reader->Left == 0)
+	{
+		Reader->Offset = Reader->BatchEnd;
+		if (Reader->Length - Reader->Offset < sizeof(header))
+			return FALSE;
+
+		memcpy(&header, Reader->Data + Reader->Offset, sizeof(header));
+		if (header.BytesUsed < sizeof(header) || header.BytesUsed > Reader->Length - Reader->Offset)
+			return FALSE;
+
+		Reader->BatchEnd = Reader->Offset + header.BytesUsed;
+		Reader->Offset += sizeof(header);
+		Reader->Left = header.RecordCount;
+	}
+
+	if (Reader->BatchEnd - Reader->Offset < sizeof(MEMORY_CONTEXT))
+		return FALSE;
+
+	record = (const MEMORY_CONTEXT *)(Reader->Data + Reader->Offset);
+	size = BATCH_RECORD_SIZE((ULONG64)record->BufferSize);
+	if (size > Reader->BatchEnd - Reader->Offset)
+		return FALSE;
+
+	*Record = record;
+	*Payload = (const UCHAR *)(record + 1);
+	Reader->Offset += size;
+	Reader->Left--;
+	return TRUE;
+}
+
+VOID ToolsBatchWriterInitialize(PTOOLS_BATCH_WRITER Writer, PTOOLS_OUTPUT Output)
+{
+	PBATCH_HEADER header = (PBATCH_HEADER)Writer->Batch;
+
+	Writer->Output = Output;
+	header->RecordCount = 0;
+	header->BytesUsed = sizeof(*header);
+}
+
+VOID ToolsBatchFlush(PTOOLS_BATCH_WRITER Writer)
+{
+	PBATCH_HEADER header = (PBATCH_HEADER)Writer->Batch;
+
+	if (header->RecordCount != 0)
+		ToolsOutputWrite(Writer->Output, Writer->Batch, header->BytesUsed);
+	header->RecordCount = 0;
+	header->BytesUsed = sizeof(*header);
+}
+
+VOID ToolsBatchWrite(PTOOLS_BATCH_WRITER Writer, const MEMORY_CONTEXT *Record, const VOID *Payload)
+/*++
+
+Routine Description:
+
+    Appends a record as IOCTL_CPM_READ_BATCH lays it out. A record too
+    long for a batch of its own size gets a batch of its own.
+
+--*/
+{
+	PBATCH_HEADER header = (PBATCH_HEADER)Writer->Batch;
+	BATCH_HEADER single;
+	ULONG size;
+	static const UCHAR zero[RING_RECORD_ALIGNMENT];
+
+	size = BATCH_RECORD_SIZE(Record->BufferSize);
+	if (size > TOOLS_BATCH_BYTES - header->BytesUsed)
+		ToolsBatchFlush(Writer);
+
+	if (size > TOOLS_BATCH_BYTES - header->BytesUsed)
+	{
+		single.RecordCount = 1;
+		single.BytesUsed = sizeof(single) + size;
+		ToolsOutputWrite(Writer->Output, &single, sizeof(single));
+		ToolsOutputWrite(Writer->Output, Record, sizeof(*Record));
+		ToolsOutputWrite(Writer->Output, Payload, Record->BufferSize);
+		ToolsOutputWrite(Writer->Output, zero, size - sizeof(*Record) - Record->BufferSize);
+		return;
+	}
+
+	memcpy(Writer->Batch + header->BytesUsed, Record, sizeof(*Record));
+	memcpy(Writer->Batch + header->BytesUsed + sizeof(*Record), Payload, Record->BufferSize);
+	memset(Writer->Batch + header->BytesUsed + sizeof(*Record) + Record->BufferSize, 0, size - sizeof(*Record) - Record->BufferSize);
+	header->BytesUsed += size;
+	header->RecordCount++;
+}
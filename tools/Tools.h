@@ -0,0 +1,102 @@
+/*++
+
+Module Name:
+
+    tools.h
+
+Abstract:
+
+    This file contains the definitions shared by the user-mode tools.
+
+    The tools work on captures saved by a client as the output buffers of
+    IOCTL_CPM_READ_BATCH, one after the other: BATCH_HEADER followed by
+    RecordCount records. Such a file is mapped whole and walked in place.
+    Files are written through a large buffer, so a capture of many
+    gigabytes takes few system calls.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include "Ring.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+//
+// What windows.h would give the tools on Windows.
+//
+#ifndef MAXLONGLONG
+#define MAXLONGLONG					0x7FFFFFFFFFFFFFFFLL
+#endif
+#ifndef UNREFERENCED_PARAMETER
+#define UNREFERENCED_PARAMETER(P)	((void)(P))
+#endif
+
+#define TOOLS_OUTPUT_BUFFER		(4 * 1024 * 1024)
+
+typedef struct _TOOLS_OUTPUT
+{
+	int File;
+	PUCHAR Buffer;
+	ULONG Used;
+	ULONG64 Written;
+	BOOLEAN Failed;
+
+} TOOLS_OUTPUT, *PTOOLS_OUTPUT;
+
+typedef struct _TOOLS_MAPPING
+{
+	const UCHAR *Data;
+	ULONG64 Length;
+
+} TOOLS_MAPPING, *PTOOLS_MAPPING;
+
+//
+// Position in a batch file, see ToolsNextRecord.
+//
+typedef struct _TOOLS_BATCH_READER
+{
+	const UCHAR *Data;
+	ULONG64 Length;
+	ULONG64 Offset;
+	ULONG64 BatchEnd;
+	ULONG Left;
+
+} TOOLS_BATCH_READER, *PTOOLS_BATCH_READER;
+
+//
+// A batch file being written, records are collected into batches of up
+// to TOOLS_BATCH_BYTES.
+//
+#define TOOLS_BATCH_BYTES		(64 * 1024)
+
+typedef struct _TOOLS_BATCH_WRITER
+{
+	PTOOLS_OUTPUT Output;
+	UCHAR Batch[TOOLS_BATCH_BYTES];
+
+} TOOLS_BATCH_WRITER, *PTOOLS_BATCH_WRITER;
+
+LONGLONG ToolsNow(VOID);
+BOOLEAN ToolsOutputOpen(PTOOLS_OUTPUT Output, const char *Path);
+VOID ToolsOutputWrite(PTOOLS_OUTPUT Output, const VOID *Data, ULONG Length);
+PVOID ToolsOutputReserve(PTOOLS_OUTPUT Output, ULONG Length);
+VOID ToolsOutputCommit(PTOOLS_OUTPUT Output, ULONG Length);
+BOOLEAN ToolsOutputClose(PTOOLS_OUTPUT Output);
+BOOLEAN ToolsMapFile(PTOOLS_MAPPING Mapping, const char *Path);
+VOID ToolsUnmapFile(PTOOLS_MAPPING Mapping);
+VOID ToolsBatchReaderInitialize(PTOOLS_BATCH_READER Reader, const VOID *Data, ULONG64 Length);
+BOOLEAN ToolsNextRecord(PTOOLS_BATCH_READER Reader, const MEMORY_CONTEXT **Record, const UCHAR **Payload);
+VOID ToolsBatchWriterInitialize(PTOOLS_BATCH_WRITER Writer, PTOOLS_OUTPUT Output);
+VOID ToolsBatchWrite(PTOOLS_BATCH_WRITER Writer, const MEMORY_CONTEXT *Record, const VOID *Payload);
+VOID ToolsBatchFlush(PTOOLS_BATCH_WRITER Writer);
+
+#ifdef __cplusplus
+}
+#endif
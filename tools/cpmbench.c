@@ -0,0 +1,1381 @@
+/*++
+
+Module Name:
+
+    cpmbench.c
+
+Abstract:
+
+    This file contains the benchmarks of the capture modules.
+
+        cpmbench index [RECORDS [PORTS]]
+        cpmbench lz [RECORDS [PORTS]]
+        cpmbench decoder [RECORDS [PORTS]]
+        cpmbench filter [RECORDS]
+        cpmbench match [BYTES]
+        cpmbench replay [SECONDS]
+        cpmbench proxy [MESSAGES]
+        cpmbench ring [EVENTS]
+
+    index measures range queries through the index against a walk of
+    the whole capture, for captures of RECORDS / 16, RECORDS / 4 and
+    RECORDS synthetic records, and checks that both find the same
+    records. lz measures the compression ratio and the compression and
+    decompression throughput of pcapng captures of Modbus and of NMEA
+    traffic for a few block sizes, and checks that every block decodes
+    back to the capture. decoder measures the Modbus RTU decoder fed the
+    records of a capture, in megabytes of data and frames a second, and
+    checks that every frame it cut is one the traffic had. filter
+    measures the nanoseconds a capture filter program takes per record,
+    for programs of a few typical shapes. match measures the pattern
+    automaton with 1 to 1000 patterns against a memmem pass per pattern
+    over the same data, in one piece and record by record, and checks
+    that the automaton and memmem in one piece find the same number of
+    matches. replay plays SECONDS of Modbus traffic of 16 to
+    1024 ports into pty pairs at the original pace and as fast as
+    possible, and reports the timing error, the throughput and the CPU
+    time of the player, which gives the ports one core can replay.
+    proxy sends MESSAGES messages of a few sizes back and forth through
+    the pty capture proxy, with read and write, with splice and with
+    splice and a capture, and directly through a pty pair, and reports
+    the round trip times, the latency the proxy adds each way and the
+    throughput of a stream through it. ring delivers EVENTS records of
+    1 to 512 bytes of payload to a listener through the capture ring and
+    through a collection of one allocation per record, and reports the
+    events a second and the nanoseconds per event of both.
+
+    Every benchmark but proxy runs on synthetic traffic, see synth.h,
+    built in memory ahead of the measurement, on one thread. The proxy
+    runs on a thread of its own, as it runs in a process of its own.
+
+Environment:
+
+    User mode
+
+--*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <termios.h>
+#include "Tools.h"
+#include "Pcapng.h"
+#include "Index.h"
+#include "Lz.h"
+#include "Decoder.h"
+#include "Filter.h"
+#include "Match.h"
+#include "Player.h"
+#include "Proxy.h"
+#include "Synth.h"
+
+#define CPMBENCH_FREQUENCY			10000000
+#define CPMBENCH_MJ_WRITE			0x04
+#define CPMBENCH_QUERIES			1000
+#define CPMBENCH_SCANS				5
+#define CPMBENCH_STREAM				(16 * 1024 * 1024)
+#define CPMBENCH_BURST				64
+
+//
+// A pcapng capture built in memory with its index.
+//
+typedef struct _CPMBENCH_CAPTURE
+{
+	PUCHAR Data;
+	ULONG64 Length;
+	PINDEX_HEADER Index;
+	ULONG64 IndexLength;
+	ULONG Ports;
+	LONGLONG First;
+	LONGLONG Last;
+
+} CPMBENCH_CAPTURE, *PCPMBENCH_CAPTURE;
+
+//
+// A proxy running on a thread of its own.
+//
+typedef struct _CPMBENCH_PROXY
+{
+	PROXY Proxy;
+	pthread_t Thread;
+	volatile BOOLEAN Stop;
+	BOOLEAN Failed;
+
+} CPMBENCH_PROXY, *PCPMBENCH_PROXY;
+
+static int Usage(VOID)
+{
+	fprintf(stderr,
+		"usage: cpmbench index [RECORDS [PORTS]]\n"
+		"       cpmbench lz [RECORDS [PORTS]]\n"
+		"       cpmbench decoder [RECORDS [PORTS]]\n"
+		"       cpmbench filter [RECORDS]\n"
+		"       cpmbench match [BYTES]\n"
+		"       cpmbench replay [SECONDS]\n"
+		"       cpmbench proxy [MESSAGES]\n"
+		"       cpmbench ring [EVENTS]\n");
+	return 2;
+}
+
+static ULONG64 Random(ULONG64 *State)
+{
+	*State ^= *State << 13;
+	*State ^= *State >> 7;
+	*State ^= *State << 17;
+	return *State;
+}
+
+static BOOLEAN CaptureBuild(PCPMBENCH_CAPTURE Capture, ULONG Protocol, ULONG64 Records, ULONG Ports)
+/*++
+
+Routine Description:
+
+    Builds the capture as the export of cpmpcap would write it and
+    indexes it with the default block size of cpmpcap index.
+
+--*/
+{
+	static SYNTH synth;
+	static PCAPNG_INTERFACES interfaces;
+	static INDEX_WRITER writer;
+	MEMORY_CONTEXT record, packet;
+	UCHAR payload[SYNTH_MAX_PAYLOAD];
+	ULONG64 i, allocated, entries = 0;
+	PINDEX_ENTRY entry;
+	ULONG id, size;
+	BOOLEAN added;
+
+	memset(Capture, 0, sizeof(*Capture));
+	allocated = Records * PCAPNG_PACKET_SIZE(SYNTH_MAX_PAYLOAD) / 4 + 65536;
+	Capture->Data = malloc(allocated);
+	Capture->Index = malloc(sizeof(INDEX_HEADER) + (allocated / 65536 + 1) * sizeof(INDEX_ENTRY) + sizeof(writer.Interfaces));
+	if (Capture->Data == NULL || Capture->Index == NULL)
+		return FALSE;
+
+	SynthInitialize(&synth, Protocol, Ports, CPMBENCH_FREQUENCY, 1);
+	PcapngInterfacesInitialize(&interfaces);
+	IndexWriterInitialize(&writer, 65536);
+	entry = (PINDEX_ENTRY)(Capture->Index + 1);
+	Capture->Length = PcapngSectionHeader(Capture->Data, 28);
+	for (i = 0; i < Records; i++)
+	{
+		SynthNext(&synth, &record, payload);
+		if (allocated - Capture->Length < 256 + PCAPNG_PACKET_SIZE(SYNTH_MAX_PAYLOAD))
+			return FALSE;
+
+		id = PcapngInterfaceId(&interfaces, record.DeviceNumber, &added);
+		if (id == PCAPNG_INVALID)
+			continue;
+		if (added)
+		{
+			Capture->Length += PcapngInterface(Capture->Data + Capture->Length, 256, NULL, record.DeviceNumber, 0);
+			IndexWriterInterface(&writer, id, record.DeviceNumber, PCAPNG_TSRESOL);
+		}
+
+		packet = record;
+		packet.DeviceNumber = id;
+		packet.Timestamp = (LONGLONG)PcapngTimestamp(record.Timestamp, CPMBENCH_FREQUENCY);
+		size = PcapngPacket(Capture->Data + Capture->Length, PCAPNG_PACKET_SIZE(record.BufferSize), &packet, payload, (ULONG64)packet.Timestamp, 0);
+		if (IndexWriterAdd(&writer, Capture->Length, id, &packet, &entry[entries]))
+			entries++;
+		Capture->Length += size;
+
+		if (i == 0)
+			Capture->First = packet.Timestamp;
+		Capture->Last = packet.Timestamp;
+	}
+	if (IndexWriterFlush(&writer, &entry[entries]))
+		entries++;
+
+	IndexWriterHeader(&writer, Capture->Index);
+	memcpy(&entry[entries], writer.Interfaces, writer.InterfaceCount * sizeof(writer.Interfaces[0]));
+	Capture->IndexLength = sizeof(INDEX_HEADER) + entries * sizeof(INDEX_ENTRY) + writer.InterfaceCount * sizeof(writer.Interfaces[0]);
+	Capture->Ports = interfaces.Count;
+	return TRUE;
+}
+
+static ULONG64 CaptureScan(PCPMBENCH_CAPTURE Capture, ULONG64 From, ULONG64 To, ULONG Port)
+/*++
+
+Routine Description:
+
+    Counts the records of the range by walking the whole capture, as a
+    client without the index would.
+
+--*/
+{
+	static PCAPNG_READER reader;
+	MEMORY_CONTEXT record;
+	const UCHAR *payload;
+	ULONG64 offset, length, records = 0;
+	ULONG size;
+
+	PcapngReaderInitialize(&reader);
+	for (offset = 0; offset < Capture->Length; offset += size)
+	{
+		length = Capture->Length - offset;
+		size = PcapngNextBlock(&reader, Capture->Data + offset, length > 0xFFFFFFFF ? 0xFFFFFFFF : (ULONG)length, &record, &payload);
+		if (size == 0 || size == PCAPNG_INVALID)
+			break;
+		if (record.HeaderSize != 0 && record.DeviceNumber == Port && (ULONG64)record.Timestamp >= From && (ULONG64)record.Timestamp <= To)
+			records++;
+	}
+	return records;
+}
+
+static int BenchIndex(ULONG64 Records, ULONG Ports)
+/*++
+
+Routine Description:
+
+    Queries a random port over a random window of 10 milliseconds, the
+    time of a couple of polls, and over a window of a second.
+
+--*/
+{
+	static INDEX_QUERY query;
+	static const LONGLONG windows[] = { 10000000, 1000000000 };
+	CPMBENCH_CAPTURE capture;
+	MEMORY_CONTEXT record;
+	const UCHAR *payload;
+	ULONG64 records, found, expected, seed = 1, from, port;
+	ULONG size, w, i;
+	LONGLONG start, elapsed, scan;
+
+	printf("%10s %10s %8s %12s %12s %12s %10s\n", "records", "MB", "entries", "window ms", "query us", "scan ms", "records");
+	for (size = 0; size < 3; size++)
+	{
+		records = size == 0 ? Records / 16 : size == 1 ? Records / 4 : Records;
+		if (!CaptureBuild(&capture, SYNTH_MODBUS, records, Ports))
+		{
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+
+		for (w = 0; w < sizeof(windows) / sizeof(windows[0]); w++)
+		{
+			//
+			// The same queries go through the index and then, a few of
+			// them, through the scan to compare the counts.
+			//
+			found = 0;
+			start = ToolsNow();
+			for (i = 0; i < CPMBENCH_QUERIES; i++)
+			{
+				port = Random(&seed) % capture.Ports * SYNTH_PORT_STRIDE;
+				from = capture.First + Random(&seed) % (ULONG64)(capture.Last - capture.First + 1);
+				if (!IndexQueryStart(&query, capture.Index, capture.IndexLength, capture.Data, capture.Length, from, from + windows[w], (ULONG)port))
+				{
+					fprintf(stderr, "index does not match the capture\n");
+					return 1;
+				}
+				while (IndexQueryNext(&query, &record, &payload))
+					found++;
+			}
+			elapsed = ToolsNow() - start;
+
+			seed = 1 + w + size;
+			expected = 0;
+			found = 0;
+			scan = 0;
+			for (i = 0; i < CPMBENCH_SCANS; i++)
+			{
+				port = Random(&seed) % capture.Ports * SYNTH_PORT_STRIDE;
+				from = capture.First + Random(&seed) % (ULONG64)(capture.Last - capture.First + 1);
+				IndexQueryStart(&query, capture.Index, capture.IndexLength, capture.Data, capture.Length, from, from + windows[w], (ULONG)port);
+				while (IndexQueryNext(&query, &record, &payload))
+					found++;
+				start = ToolsNow();
+				expected += CaptureScan(&capture, from, from + windows[w], (ULONG)port);
+				scan += ToolsNow() - start;
+			}
+			if (found != expected)
+			{
+				fprintf(stderr, "index found %llu records, scan %llu\n", (unsigned long long)found, (unsigned long long)expected);
+				return 1;
+			}
+
+			printf("%10llu %10.1f %8llu %12.0f %12.1f %12.1f %10.1f\n", (unsigned long long)records, capture.Length / 1e6,
+				(unsigned long long)capture.Index->EntryCount, windows[w] / 1e6, elapsed / 1e3 / CPMBENCH_QUERIES,
+				scan / 1e6 / CPMBENCH_SCANS, (double)expected / CPMBENCH_SCANS);
+		}
+		free(capture.Data);
+		free(capture.Index);
+	}
+	return 0;
+}
+
+static int BenchLz(ULONG64 Records, ULONG Ports)
+/*++
+
+Routine Description:
+
+    Compresses the whole capture block by block as a compressed file is
+    written, then loads every block back through the directory.
+
+--*/
+{
+	static LZ_STATE state;
+	static const ULONG blockSizes[] = { 16 * 1024, 64 * 1024, 1024 * 1024 };
+	static const char *protocols[] = { "modbus", "nmea" };
+	CPMBENCH_CAPTURE capture;
+	PLZ_BLOCK blocks;
+	PUCHAR stored, raw;
+	ULONG64 offset, storedLength, count, b;
+	ULONG protocol, s, size;
+	LONGLONG start, compress, decompress;
+
+	printf("%8s %10s %10s %8s %12s %12s\n", "traffic", "MB", "block KB", "ratio", "comp MB/s", "decomp MB/s");
+	for (protocol = SYNTH_MODBUS; protocol <= SYNTH_NMEA; protocol++)
+	{
+		if (!CaptureBuild(&capture, protocol, Records, Ports))
+		{
+			fprintf(stderr, "out of memory\n");
+			return 1;
+		}
+		for (s = 0; s < sizeof(blockSizes) / sizeof(blockSizes[0]); s++)
+		{
+			count = (capture.Length + blockSizes[s] - 1) / blockSizes[s];
+			blocks = malloc(count * sizeof(*blocks));
+			stored = malloc(count * LZ_BOUND(blockSizes[s]));
+			raw = malloc(capture.Length);
+			if (blocks == NULL || stored == NULL || raw == NULL)
+			{
+				fprintf(stderr, "out of memory\n");
+				return 1;
+			}
+
+			storedLength = 0;
+			start = ToolsNow();
+			for (b = 0, offset = 0; offset < capture.Length; b++, offset += size)
+			{
+				size = capture.Length - offset < blockSizes[s] ? (ULONG)(capture.Length - offset) : blockSizes[s];
+				blocks[b].RawOffset = offset;
+				blocks[b].RawSize = size;
+				blocks[b].StoredOffset = storedLength;
+				blocks[b].StoredSize = LzStoreBlock(&state, capture.Data + offset, size, stored + storedLength, LZ_BOUND(blockSizes[s]));
+				storedLength += blocks[b].StoredSize;
+			}
+			compress = ToolsNow() - start;
+
+			start = ToolsNow();
+			for (b = 0; b < count; b++)
+			{
+				if (LzLoadBlock(&blocks[b], stored, storedLength, raw + blocks[b].RawOffset, blocks[b].RawSize) == LZ_INVALID)
+					break;
+			}
+			decompress = ToolsNow() - start;
+			if (b != count || memcmp(raw, capture.Data, capture.Length) != 0)
+			{
+				fprintf(stderr, "block %llu does not decode back to the capture\n", (unsigned long long)b);
+				return 1;
+			}
+
+			printf("%8s %10.1f %10lu %8.2f %12.0f %12.0f\n", protocols[protocol], capture.Length / 1e6,
+				(unsigned long)(blockSizes[s] / 1024), (double)capture.Length / storedLength,
+				capture.Length * 1e3 / compress, capture.Length * 1e3 / decompress);
+			free(blocks);
+			free(stored);
+			free(raw);
+		}
+		free(capture.Data);
+		free(capture.Index);
+	}
+	return 0;
+}
+
+typedef struct _CPMBENCH_FRAMES
+{
+	ULONG64 Frames;
+	ULONG64 Parsed;
+	ULONG64 Bytes;
+
+} CPMBENCH_FRAMES, *PCPMBENCH_FRAMES;
+
+static VOID CountFrame(PVOID Context, const DECODER_FRAME *Frame, const UCHAR *Data)
+{
+	PCPMBENCH_FRAMES frames = (PCPMBENCH_FRAMES)Context;
+
+	UNREFERENCED_PARAMETER(Data);
+
+	frames->Frames++;
+	frames->Bytes += Frame->Length;
+	if ((Frame->Flags & (DECODER_FRAME_CRC_OK | DECODER_FRAME_PARSED)) == (DECODER_FRAME_CRC_OK | DECODER_FRAME_PARSED))
+		frames->Parsed++;
+}
+
+static int BenchDecoder(ULONG64 Records, ULONG Ports)
+/*++
+
+Routine Description:
+
+    Lays the records out in memory as IOCTL_CPM_READ_BATCH returns them
+    and feeds them to the decoder in a row, as a client draining the
+    driver does. Every poll of the traffic is a request and a response
+    frame, so the frames of the polls started must all come out parsed
+    but for the responses still on the line at the end.
+
+--*/
+{
+	static SYNTH synth;
+	static DECODER decoder;
+	CPMBENCH_FRAMES frames;
+	MEMORY_CONTEXT record;
+	const MEMORY_CONTEXT *next;
+	PUCHAR batch;
+	ULONG64 i, offset, length, polls = 0, data = 0;
+	ULONG round;
+	LONGLONG start, elapsed = 0;
+
+	if (Ports * SYNTH_PORT_STRIDE > DECODER_MAX_PORTS)
+	{
+		fprintf(stderr, "at most %u ports\n", (DECODER_MAX_PORTS - 1) / SYNTH_PORT_STRIDE + 1);
+		return 1;
+	}
+
+	batch = malloc(Records * BATCH_RECORD_SIZE(SYNTH_MAX_PAYLOAD));
+	if (batch == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	SynthInitialize(&synth, SYNTH_MODBUS, Ports, CPMBENCH_FREQUENCY, 1);
+	for (i = 0, length = 0; i < Records; i++)
+	{
+		SynthNext(&synth, &record, batch + length + sizeof(record));
+		memcpy(batch + length, &record, sizeof(record));
+		length += BATCH_RECORD_SIZE(record.BufferSize);
+		data += record.BufferSize;
+		if (record.MajorFunctionCode == CPMBENCH_MJ_WRITE)
+			polls++;
+	}
+
+	//
+	// The best of a few rounds, the first one also warms the caches up.
+	//
+	for (round = 0; round < 5; round++)
+	{
+		memset(&frames, 0, sizeof(frames));
+		DecoderInitialize(&decoder, &ModbusRtuDecoder, ModbusRtuGap(SYNTH_BAUD_RATE, CPMBENCH_FREQUENCY), CountFrame, &frames);
+		start = ToolsNow();
+		for (offset = 0; offset < length; offset += BATCH_RECORD_SIZE(next->BufferSize))
+		{
+			next = (const MEMORY_CONTEXT *)(batch + offset);
+			DecoderFeed(&decoder, next, (const UCHAR *)(next + 1));
+		}
+		DecoderFlush(&decoder, MAXLONGLONG);
+		if (round == 0 || ToolsNow() - start < elapsed)
+			elapsed = ToolsNow() - start;
+	}
+	free(batch);
+
+	if (frames.Frames > polls * 2 || frames.Parsed < polls * 2 - Ports)
+	{
+		fprintf(stderr, "%llu polls, %llu frames, %llu parsed\n", (unsigned long long)polls,
+			(unsigned long long)frames.Frames, (unsigned long long)frames.Parsed);
+		return 1;
+	}
+	printf("%llu records, %llu bytes of data, %llu frames, %llu parsed\n", (unsigned long long)Records,
+		(unsigned long long)data, (unsigned long long)frames.Frames, (unsigned long long)frames.Parsed);
+	printf("%.1f MB/s of data, %.1f M records/s, %.1f M frames/s on one core\n", data * 1e3 / elapsed,
+		Records * 1e3 / elapsed, frames.Frames * 1e3 / elapsed);
+	return 0;
+}
+
+//
+// Filter programs: everything, the requests of slave 5 with function 3
+// (read holding registers), and records of any of 8 slaves cut to their
+// first 16 bytes.
+//
+static const FILTER_INSN FilterAll[] =
+{
+	{ FILTER_RET, 0, 0, 0xFFFFFFFF },
+};
+
+static const FILTER_INSN FilterSlave[] =
+{
+	{ FILTER_LD_MAJOR, 0, 0, 0 },
+	{ FILTER_JEQ, 0, 3, CPMBENCH_MJ_WRITE },
+	{ FILTER_LD_HALF, 0, 0, 0 },
+	{ FILTER_JEQ, 0, 1, 0x0503 },
+	{ FILTER_RET, 0, 0, 0xFFFFFFFF },
+	{ FILTER_RET, 0, 0, 0 },
+};
+
+static const FILTER_INSN FilterSlaves[] =
+{
+	{ FILTER_LD_BYTE, 0, 0, 0 },
+	{ FILTER_JEQ, 8, 0, 1 },
+	{ FILTER_JEQ, 7, 0, 2 },
+	{ FILTER_JEQ, 6, 0, 3 },
+	{ FILTER_JEQ, 5, 0, 4 },
+	{ FILTER_JEQ, 4, 0, 5 },
+	{ FILTER_JEQ, 3, 0, 6 },
+	{ FILTER_JEQ, 2, 0, 7 },
+	{ FILTER_JEQ, 1, 0, 8 },
+	{ FILTER_RET, 0, 0, 0 },
+	{ FILTER_RET, 0, 0, 16 },
+};
+
+static int BenchFilter(ULONG64 Records)
+/*++
+
+Routine Description:
+
+    Runs every program over the same records, laid out in memory, the
+    way the driver runs it for a listener before copying a record. The
+    walk of the records without a program is measured too and taken off
+    for the time of the filter alone.
+
+--*/
+{
+	static SYNTH synth;
+	static const struct
+	{
+		const char *Name;
+		const FILTER_INSN *Program;
+		ULONG Count;
+	} programs[] =
+	{
+		{ "all", FilterAll, sizeof(FilterAll) / sizeof(FilterAll[0]) },
+		{ "slave", FilterSlave, sizeof(FilterSlave) / sizeof(FilterSlave[0]) },
+		{ "slaves", FilterSlaves, sizeof(FilterSlaves) / sizeof(FilterSlaves[0]) },
+	};
+	MEMORY_CONTEXT record;
+	const MEMORY_CONTEXT *next;
+	PUCHAR batch;
+	ULONG64 i, offset, length, accepted;
+	volatile ULONG64 sink;
+	ULONG p, round;
+	LONGLONG start, elapsed, empty = 0;
+
+	batch = malloc(Records * BATCH_RECORD_SIZE(SYNTH_MAX_PAYLOAD));
+	if (batch == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	SynthInitialize(&synth, SYNTH_MODBUS, 8, CPMBENCH_FREQUENCY, 1);
+	for (i = 0, length = 0; i < Records; i++)
+	{
+		SynthNext(&synth, &record, batch + length + sizeof(record));
+		memcpy(batch + length, &record, sizeof(record));
+		length += BATCH_RECORD_SIZE(record.BufferSize);
+	}
+
+	for (round = 0; round < 5; round++)
+	{
+		accepted = 0;
+		start = ToolsNow();
+		for (offset = 0; offset < length; offset += BATCH_RECORD_SIZE(next->BufferSize))
+		{
+			next = (const MEMORY_CONTEXT *)(batch + offset);
+			accepted += next->BufferSize;
+		}
+		sink = accepted;
+		elapsed = ToolsNow() - start;
+		if (round == 0 || elapsed < empty)
+			empty = elapsed;
+	}
+
+	printf("%8s %8s %10s %10s %10s\n", "program", "insns", "accepted", "ns/record", "ns/filter");
+	for (p = 0; p < sizeof(programs) / sizeof(programs[0]); p++)
+	{
+		if (!FilterVerify(programs[p].Program, programs[p].Count))
+		{
+			fprintf(stderr, "program %s does not verify\n", programs[p].Name);
+			free(batch);
+			return 1;
+		}
+		for (round = 0; round < 5; round++)
+		{
+			accepted = 0;
+			start = ToolsNow();
+			for (offset = 0; offset < length; offset += BATCH_RECORD_SIZE(next->BufferSize))
+			{
+				next = (const MEMORY_CONTEXT *)(batch + offset);
+				if (FilterRun(programs[p].Program, next->MajorFunctionCode, (const UCHAR *)(next + 1), next->BufferSize) != 0)
+					accepted++;
+			}
+			sink = accepted;
+			if (round == 0 || ToolsNow() - start < elapsed)
+				elapsed = ToolsNow() - start;
+		}
+		printf("%8s %8lu %10llu %10.1f %10.1f\n", programs[p].Name, (unsigned long)programs[p].Count,
+			(unsigned long long)accepted, (double)elapsed / Records, elapsed > empty ? (double)(elapsed - empty) / Records : 0.0);
+	}
+	(VOID)sink;
+	free(batch);
+	return 0;
+}
+
+static VOID CountMatch(PVOID Context, ULONG Pattern, ULONG Offset)
+{
+	UNREFERENCED_PARAMETER(Pattern);
+	UNREFERENCED_PARAMETER(Offset);
+
+	++*(ULONG64 *)Context;
+}
+
+static int BenchMatch(ULONG64 Bytes)
+/*++
+
+Routine Description:
+
+    Searches NMEA traffic, whose text gives the patterns something to
+    find. Half of the patterns are cut out of the data, the other half
+    are made of the same characters and mostly do not occur. The
+    automaton is run record by record carrying its state, as the drain
+    loop runs it. memmem runs on the data of all records in one piece,
+    which the drain loop never has, and on each record alone, which
+    misses the matches across records.
+
+--*/
+{
+	static SYNTH synth;
+	static const ULONG counts[] = { 1, 4, 10, 100, 1000 };
+	static const char alphabet[] = "0123456789,.$GPRMCA*NE";
+	MEMORY_CONTEXT record;
+	PUCHAR data, patterns, buffer, pattern;
+	PULONG lengths;
+	PMATCH_AUTOMATON automaton;
+	ULONG64 i, length = 0, records = 0, seed = 1, matches, expected, separate;
+	const UCHAR *found, *end;
+	ULONG c, p, size, offset;
+	USHORT state, patternLength;
+	LONGLONG start, run, search, perRecord;
+
+	data = malloc(Bytes + SYNTH_MAX_PAYLOAD);
+	lengths = malloc((Bytes + 1) * sizeof(*lengths));
+	patterns = malloc(1000 * MATCH_PATTERN_SIZE(12));
+	if (data == NULL || lengths == NULL || patterns == NULL)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	SynthInitialize(&synth, SYNTH_NMEA, 8, CPMBENCH_FREQUENCY, 1);
+	while (length < Bytes)
+	{
+		SynthNext(&synth, &record, data + length);
+		lengths[records++] = record.BufferSize;
+		length += record.BufferSize;
+	}
+
+	printf("%8s %8s %10s %12s %12s %10s %12s %10s\n", "patterns", "states", "matches", "match MB/s", "memmem MB/s", "speedup",
+		"record MB/s", "found");
+	for (c = 0; c < sizeof(counts) / sizeof(counts[0]); c++)
+	{
+		for (p = 0, offset = 0; p < counts[c]; p++, offset += MATCH_PATTERN_SIZE(patternLength))
+		{
+			pattern = patterns + offset;
+			patternLength = (USHORT)(6 + Random(&seed) % 7);
+			memcpy(pattern, &patternLength, sizeof(patternLength));
+			memset(pattern + 2, 0, 2);
+			if (p % 2 == 0)
+				memcpy(pattern + 4, data + Random(&seed) % (length - patternLength), patternLength);
+			else
+			{
+				for (i = 0; i < patternLength; i++)
+					pattern[4 + i] = (UCHAR)alphabet[Random(&seed) % (sizeof(alphabet) - 1)];
+			}
+		}
+
+		size = MatchSize(patterns, offset);
+		buffer = malloc(size);
+		automaton = size != 0 && buffer != NULL ? MatchCompile(buffer, size, patterns, offset) : NULL;
+		if (automaton == NULL)
+		{
+			fprintf(stderr, "%lu patterns do not compile\n", (unsigned long)counts[c]);
+			return 1;
+		}
+
+		matches = 0;
+		state = 0;
+		start = ToolsNow();
+		for (i = 0, found = data; i < records; found += lengths[i++])
+			state = MatchRun(automaton, state, found, lengths[i], CountMatch, &matches);
+		run = ToolsNow() - start;
+
+		expected = 0;
+		end = data + length;
+		start = ToolsNow();
+		for (p = 0, offset = 0; p < counts[c]; p++, offset += MATCH_PATTERN_SIZE(patternLength))
+		{
+			pattern = patterns + offset;
+			memcpy(&patternLength, pattern, sizeof(patternLength));
+			for (found = data; (found = memmem(found, (size_t)(end - found), pattern + 4, patternLength)) != NULL; found++)
+				expected++;
+		}
+		search = ToolsNow() - start;
+
+		separate = 0;
+		start = ToolsNow();
+		for (i = 0, found = data; i < records; found += lengths[i++])
+		{
+			for (p = 0, offset = 0; p < counts[c]; p++, offset += MATCH_PATTERN_SIZE(patternLength))
+			{
+				pattern = patterns + offset;
+				memcpy(&patternLength, pattern, sizeof(patternLength));
+				for (end = found; (end = memmem(end, (size_t)(found + lengths[i] - end), pattern + 4, patternLength)) != NULL; end++)
+					separate++;
+			}
+		}
+		perRecord = ToolsNow() - start;
+
+		if (matches != expected)
+		{
+			fprintf(stderr, "automaton found %llu matches, memmem %llu\n", (unsigned long long)matches, (unsigned long long)expected);
+			return 1;
+		}
+		printf("%8lu %8lu %10llu %12.0f %12.0f %10.1f %12.1f %9.0f%%\n", (unsigned long)counts[c], (unsigned long)automaton->StateCount,
+			(unsigned long long)matches, length * 1e3 / run, length * 1e3 / search, (double)search / run,
+			length * 1e3 / perRecord, 100.0 * separate / expected);
+		free(buffer);
+	}
+	free(data);
+	free(lengths);
+	free(patterns);
+	return 0;
+}
+
+static LONGLONG ThreadTime(VOID)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &now);
+	return (LONGLONG)now.tv_sec * 1000000000 + now.tv_nsec;
+}
+
+static BOOLEAN ReplayExact(VOID)
+/*++
+
+Routine Description:
+
+    A record a week and a tick into a capture of a 10 MHz counter is due
+    exactly a week and 100 nanoseconds after the first one.
+
+--*/
+{
+	REPLAY replay;
+	MEMORY_CONTEXT record;
+
+	memset(&record, 0, sizeof(record));
+	record.MajorFunctionCode = CPMBENCH_MJ_WRITE;
+	record.BufferSize = 1;
+	record.Timestamp = 123456789;
+	ReplayInitialize(&replay, CPMBENCH_FREQUENCY, 1000000000, REPLAY_SPEED_ORIGINAL, 0);
+	if (ReplayDue(&replay, &record, 1000) != 1000)
+		return FALSE;
+	record.Timestamp += 7LL * 86400 * CPMBENCH_FREQUENCY + 1;
+	return ReplayDue(&replay, &record, 2000) == 1000 + 7LL * 86400 * 1000000000 + 100;
+}
+
+static int BenchReplay(ULONG Seconds)
+/*++
+
+Routine Description:
+
+    The player drains the slaves itself, in the same thread, so its CPU
+    time covers both sides of the ptys. The capture is written to a
+    temporary file and mapped as cpmreplay maps it.
+
+    The ports a core can replay come from the run as fast as possible:
+    SECONDS of traffic of every port over the time it took to play. The
+    pty layer pushes the data to the slave in a kernel worker, so the
+    wall time is used and not the CPU time of the player, and the
+    benchmark is meant to be run with nothing else busy.
+
+--*/
+{
+	static SYNTH synth;
+	static PLAYER player;
+	static TOOLS_BATCH_WRITER writer;
+	static const ULONG ports[] = { 16, 64, 256, 1024 };
+	static const ULONG speeds[] = { REPLAY_SPEED_ORIGINAL, REPLAY_SPEED_FASTEST };
+	char path[] = "/tmp/cpmbenchXXXXXX";
+	TOOLS_OUTPUT output;
+	TOOLS_MAPPING capture;
+	MEMORY_CONTEXT record;
+	UCHAR payload[SYNTH_MAX_PAYLOAD];
+	PREPLAY_STATS stats;
+	ULONG64 drained, dropped;
+	ULONG p, s, i;
+	char perCore[16];
+	LONGLONG start, cpu;
+	int file;
+
+	if (!ReplayExact())
+	{
+		fprintf(stderr, "a week into the capture is not due a week after its start\n");
+		return 1;
+	}
+
+	printf("%6s %6s %9s %10s %10s %10s %8s %6s %10s\n", "ports", "speed", "records", "MB/s", "late us", "max us", "late", "cpu %", "ports/core");
+	for (p = 0; p < sizeof(ports) / sizeof(ports[0]); p++)
+	{
+		file = mkstemp(path);
+		if (file < 0 || !ToolsOutputOpen(&output, path))
+		{
+			perror(path);
+			return 1;
+		}
+		close(file);
+
+		SynthInitialize(&synth, SYNTH_MODBUS, ports[p], CPMBENCH_FREQUENCY, 1);
+		ToolsBatchWriterInitialize(&writer, &output);
+		do
+		{
+			SynthNext(&synth, &record, payload);
+			ToolsBatchWrite(&writer, &record, payload);
+		} while (record.Timestamp < (LONGLONG)(Seconds + 1) * CPMBENCH_FREQUENCY);
+		ToolsBatchFlush(&writer);
+		if (!ToolsOutputClose(&output) || !ToolsMapFile(&capture, path))
+		{
+			perror(path);
+			unlink(path);
+			return 1;
+		}
+		unlink(path);
+
+		for (s = 0; s < sizeof(speeds) / sizeof(speeds[0]); s++)
+		{
+			if (!PlayerInitialize(&player, PLAYER_PLAY_READS, TRUE) || !PlayerOpenPorts(&player, capture.Data, capture.Length))
+			{
+				perror("pty");
+				PlayerClose(&player);
+				ToolsUnmapFile(&capture);
+				return 1;
+			}
+
+			start = ToolsNow();
+			cpu = ThreadTime();
+			PlayerRun(&player, capture.Data, capture.Length, CPMBENCH_FREQUENCY, speeds[s], 1000000);
+			cpu = ThreadTime() - cpu;
+			start = ToolsNow() - start;
+
+			stats = &player.Replay.Stats;
+			for (i = 0, drained = 0, dropped = 0; i < player.PortCount; i++)
+			{
+				drained += player.Ports[i].Drained;
+				dropped += player.Ports[i].Dropped;
+			}
+			if (drained + dropped != stats->Bytes)
+			{
+				fprintf(stderr, "%llu bytes played, %llu came out of the ptys\n", (unsigned long long)stats->Bytes, (unsigned long long)drained);
+				PlayerClose(&player);
+				ToolsUnmapFile(&capture);
+				return 1;
+			}
+
+			strcpy(perCore, "-");
+			if (speeds[s] == REPLAY_SPEED_FASTEST)
+				snprintf(perCore, sizeof(perCore), "%.0f", player.PortCount * (Seconds * 1e9) / start);
+			printf("%6lu %6s %9llu %10.2f %10.1f %10.1f %8llu %6.1f %10s\n", (unsigned long)player.PortCount,
+				speeds[s] == REPLAY_SPEED_FASTEST ? "max" : "1x", (unsigned long long)stats->Records,
+				stats->Bytes * 1e3 / start, stats->Records != 0 ? stats->ErrorSum / 1e3 / stats->Records : 0.0,
+				stats->ErrorMax / 1e3, (unsigned long long)stats->Late, cpu * 100.0 / start, perCore);
+			PlayerClose(&player);
+		}
+		ToolsUnmapFile(&capture);
+		strcpy(path, "/tmp/cpmbenchXXXXXX");
+	}
+	return 0;
+}
+
+static int OpenPty(char *Name, size_t NameLength)
+{
+	int master;
+
+	master = posix_openpt(O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (master < 0)
+		return -1;
+	if (grantpt(master) != 0 || unlockpt(master) != 0 || ptsname_r(master, Name, NameLength) != 0)
+	{
+		close(master);
+		return -1;
+	}
+	return master;
+}
+
+static int OpenRaw(const char *Name)
+{
+	struct termios settings;
+	int tty;
+
+	tty = open(Name, O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (tty < 0)
+		return -1;
+	if (tcgetattr(tty, &settings) != 0)
+	{
+		close(tty);
+		return -1;
+	}
+	cfmakeraw(&settings);
+	if (tcsetattr(tty, TCSANOW, &settings) != 0)
+	{
+		close(tty);
+		return -1;
+	}
+	return tty;
+}
+
+static BOOLEAN Send(int From, int To, const UCHAR *Data, ULONG Length, PUCHAR Buffer)
+/*++
+
+Routine Description:
+
+    Writes Data to From and reads it back from To, both as the ttys
+    take it, and checks that it came through unchanged.
+
+Return Value:
+
+    FALSE if it did not come through within a second of the last byte
+    that did, or came through changed.
+
+--*/
+{
+	struct pollfd fds[2];
+	ULONG sent = 0, received = 0;
+	ssize_t size;
+
+	while (received < Length)
+	{
+		fds[0].fd = From;
+		fds[0].events = sent < Length ? POLLOUT : 0;
+		fds[1].fd = To;
+		fds[1].events = POLLIN;
+		if (poll(fds, 2, 1000) <= 0)
+			return FALSE;
+		if ((fds[0].revents & POLLOUT) && (size = write(From, Data + sent, Length - sent)) > 0)
+			sent += (ULONG)size;
+		if ((fds[1].revents & POLLIN) && (size = read(To, Buffer + received, Length - received)) > 0)
+			received += (ULONG)size;
+	}
+	return memcmp(Buffer, Data, Length) == 0;
+}
+
+static VOID *ProxyThread(VOID *Context)
+{
+	PCPMBENCH_PROXY proxy = (PCPMBENCH_PROXY)Context;
+
+	while (!proxy->Stop)
+	{
+		if (!ProxyPoll(&proxy->Proxy, 10))
+		{
+			proxy->Failed = TRUE;
+			break;
+		}
+	}
+	return NULL;
+}
+
+static int CompareTimes(const VOID *Left, const VOID *Right)
+{
+	LONGLONG left = *(const LONGLONG *)Left, right = *(const LONGLONG *)Right;
+
+	return left < right ? -1 : left > right;
+}
+
+static BOOLEAN ProxyCaptured(const char *Path, PPROXY Proxy)
+/*++
+
+Routine Description:
+
+    The capture has every byte the proxy passed on, in records of its
+    device in the order of their timestamps.
+
+--*/
+{
+	TOOLS_MAPPING capture;
+	TOOLS_BATCH_READER reader;
+	const MEMORY_CONTEXT *record;
+	const UCHAR *payload;
+	ULONG64 bytes[2] = { 0, 0 };
+	LONGLONG last = 0;
+	BOOLEAN ordered = TRUE;
+
+	if (!ToolsMapFile(&capture, Path))
+		return FALSE;
+	ToolsBatchReaderInitialize(&reader, capture.Data, capture.Length);
+	while (ToolsNextRecord(&reader, &record, &payload))
+	{
+		ordered &= record->DeviceNumber == Proxy->DeviceNumber && record->Timestamp >= last;
+		last = record->Timestamp;
+		bytes[record->MajorFunctionCode == CPMBENCH_MJ_WRITE ? PROXY_WRITE : PROXY_READ] += record->BufferSize;
+	}
+	ToolsUnmapFile(&capture);
+	return ordered && bytes[PROXY_READ] == Proxy->Paths[PROXY_READ].Bytes && bytes[PROXY_WRITE] == Proxy->Paths[PROXY_WRITE].Bytes;
+}
+
+static int BenchProxy(ULONG Messages)
+/*++
+
+Routine Description:
+
+    The application and the device are both played by the main thread,
+    a message goes from the application to the device and back, and a
+    stream of CPMBENCH_STREAM bytes from the application to the device.
+    Directly they talk through one pty pair, the device on its master.
+    Through the proxy the device is on the slave of that pair and the
+    application on the slave of the proxy's own, so the proxy adds a pty
+    pair and itself each way, which is what it adds in front of a real
+    tty too.
+
+--*/
+{
+	static CPMBENCH_PROXY proxy;
+	static TOOLS_BATCH_WRITER writer;
+	static const ULONG sizes[] = { 1, 64, 1024 };
+	static const struct
+	{
+		const char *Name;
+		BOOLEAN Proxy;
+		ULONG Flags;
+		BOOLEAN Capture;
+	} paths[] =
+	{
+		{ "direct", FALSE, 0, FALSE },
+		{ "copy", TRUE, PROXY_COPY, FALSE },
+		{ "splice", TRUE, 0, FALSE },
+		{ "capture", TRUE, 0, TRUE },
+	};
+	char path[] = "/tmp/cpmbenchXXXXXX";
+	char name[64];
+	TOOLS_OUTPUT output;
+	PUCHAR data = NULL, buffer = NULL;
+	LONGLONG *times = NULL, start, direct[sizeof(sizes) / sizeof(sizes[0])];
+	ULONG p, s, i;
+	BOOLEAN passed;
+	int tty = -1, device = -1, application = -1, file, result = 1;
+
+	data = malloc(CPMBENCH_STREAM);
+	buffer = malloc(CPMBENCH_STREAM);
+	times = malloc((Messages != 0 ? Messages : 1) * sizeof(*times));
+	if (data == NULL || buffer == NULL || times == NULL || Messages == 0)
+		goto Exit;
+	for (i = 0; i < CPMBENCH_STREAM; i++)
+		data[i] = (UCHAR)(i * 7 + i / 251);
+
+	printf("%8s %6s %11s %11s %11s %10s\n", "path", "bytes", "rtt med us", "rtt p99 us", "added us", "MB/s");
+	for (p = 0; p < sizeof(paths) / sizeof(paths[0]); p++)
+	{
+		tty = OpenPty(name, sizeof(name));
+		if (tty < 0)
+		{
+			perror("pty");
+			goto Exit;
+		}
+		if (!paths[p].Proxy)
+		{
+			device = tty;
+			tty = -1;
+			application = OpenRaw(name);
+		}
+		else
+		{
+			device = OpenRaw(name);
+			if (device < 0)
+			{
+				perror(name);
+				goto Exit;
+			}
+			if (paths[p].Capture)
+			{
+				file = mkstemp(path);
+				if (file < 0 || !ToolsOutputOpen(&output, path))
+				{
+					perror(path);
+					goto Exit;
+				}
+				close(file);
+				ToolsBatchWriterInitialize(&writer, &output);
+			}
+			memset(&proxy, 0, sizeof(proxy));
+			if (!ProxyOpen(&proxy.Proxy, tty, 1, paths[p].Flags, paths[p].Capture ? &writer : NULL, PROXY_PIPE_SIZE))
+			{
+				perror("proxy");
+				goto Exit;
+			}
+			application = OpenRaw(proxy.Proxy.Name);
+			if (application >= 0 && pthread_create(&proxy.Thread, NULL, ProxyThread, &proxy) != 0)
+			{
+				close(application);
+				application = -1;
+			}
+			if (application < 0)
+				ProxyClose(&proxy.Proxy);
+		}
+		if (application < 0)
+		{
+			perror("pty");
+			goto Exit;
+		}
+
+		passed = TRUE;
+		for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]) && passed; s++)
+		{
+			for (i = 0; i < Messages; i++)
+			{
+				start = ToolsNow();
+				if (!Send(application, device, data + i % 256, sizes[s], buffer) || !Send(device, application, data + i % 256, sizes[s], buffer))
+				{
+					fprintf(stderr, "%s: a message of %lu bytes did not come through\n", paths[p].Name, (unsigned long)sizes[s]);
+					passed = FALSE;
+					break;
+				}
+				times[i] = ToolsNow() - start;
+			}
+			if (!passed)
+				break;
+			qsort(times, Messages, sizeof(*times), CompareTimes);
+			if (!paths[p].Proxy)
+				direct[s] = times[Messages / 2];
+			printf("%8s %6lu %11.1f %11.1f %11.1f %10s\n", paths[p].Name, (unsigned long)sizes[s], times[Messages / 2] / 1e3,
+				times[Messages * 99 / 100] / 1e3, paths[p].Proxy ? (times[Messages / 2] - direct[s]) / 2e3 : 0.0, "-");
+		}
+
+		if (passed)
+		{
+			start = ToolsNow();
+			passed = Send(application, device, data, CPMBENCH_STREAM, buffer);
+			if (passed)
+				printf("%8s %6s %11s %11s %11s %10.1f\n", paths[p].Name, "stream", "-", "-", "-", CPMBENCH_STREAM * 1e3 / (ToolsNow() - start));
+			else
+				fprintf(stderr, "%s: the stream did not come through\n", paths[p].Name);
+		}
+
+		if (paths[p].Proxy)
+		{
+			proxy.Stop = TRUE;
+			pthread_join(proxy.Thread, NULL);
+			if (proxy.Failed)
+			{
+				fprintf(stderr, "%s: the proxy failed\n", paths[p].Name);
+				passed = FALSE;
+			}
+			if (passed && proxy.Proxy.Paths[PROXY_WRITE].Bytes != (ULONG64)Messages * (1 + 64 + 1024) + CPMBENCH_STREAM)
+			{
+				fprintf(stderr, "%s: %llu bytes passed on\n", paths[p].Name, (unsigned long long)proxy.Proxy.Paths[PROXY_WRITE].Bytes);
+				passed = FALSE;
+			}
+			ProxyClose(&proxy.Proxy);
+			if (paths[p].Capture)
+			{
+				ToolsBatchFlush(&writer);
+				if (!ToolsOutputClose(&output) || (passed && !ProxyCaptured(path, &proxy.Proxy)))
+				{
+					fprintf(stderr, "%s: the capture does not have what was passed on\n", paths[p].Name);
+					passed = FALSE;
+				}
+				unlink(path);
+				strcpy(path, "/tmp/cpmbenchXXXXXX");
+			}
+		}
+
+		close(application);
+		close(device);
+		if (tty >= 0)
+			close(tty);
+		application = device = tty = -1;
+		if (!passed)
+			goto Exit;
+	}
+	result = 0;
+
+Exit:
+	if (application >= 0)
+		close(application);
+	if (device >= 0)
+		close(device);
+	if (tty >= 0)
+		close(tty);
+	free(times);
+	free(buffer);
+	free(data);
+	return result;
+}
+
+//
+// An event as the collection delivery kept it: the memory object with
+// the record and its payload, and the collection entry pointing at it.
+//
+typedef struct _CPMBENCH_ENTRY
+{
+	struct _CPMBENCH_ENTRY *Next;
+	PMEMORY_CONTEXT Object;
+
+} CPMBENCH_ENTRY, *PCPMBENCH_ENTRY;
+
+static int BenchRing(ULONG64 Events)
+/*++
+
+Routine Description:
+
+    Delivers Events records of a few payload sizes to one listener
+    through the capture ring and through the collection of memory
+    objects the ring replaced, and reads them back out. The collection
+    path makes the two allocations per record WdfMemoryCreate and
+    WdfCollectionAdd make and frees them when the record is read. Both
+    paths take the listener lock per record on both sides, as the notify
+    path and the two-call read did, and run in bursts of
+    CPMBENCH_BURST records, so the numbers are the delivery cost alone.
+
+--*/
+{
+	static const ULONG sizes[] = { 1, 8, 64, 512 };
+	static UCHAR payload[512], output[sizeof(MEMORY_CONTEXT) + 512];
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	PVOID buffer;
+	RING ring;
+	PMEMORY_CONTEXT record;
+	PCPMBENCH_ENTRY head, *tail, entry;
+	ULONG64 i, done, seed = 1, delivered[2];
+	ULONG s, b, length;
+	LONGLONG start, elapsed[2] = { 0, 0 };
+	int round;
+
+	buffer = malloc(RING_BUFFER_SIZE(1024 * 1024));
+	if (buffer == NULL || RingInitialize(&ring, buffer, RING_BUFFER_SIZE(1024 * 1024)) == 0)
+	{
+		fprintf(stderr, "out of memory\n");
+		return 1;
+	}
+	for (i = 0; i < sizeof(payload); i++)
+		payload[i] = (UCHAR)Random(&seed);
+
+	printf("%8s %12s %10s %12s %10s %10s\n", "payload", "ring ev/s", "ring ns", "coll ev/s", "coll ns", "speedup");
+	for (s = 0; s < sizeof(sizes) / sizeof(sizes[0]); s++)
+	{
+		for (round = 0; round < CPMBENCH_SCANS; round++)
+		{
+			delivered[0] = 0;
+			start = ToolsNow();
+			for (done = 0; done < Events; done += CPMBENCH_BURST)
+			{
+				for (b = 0; b < CPMBENCH_BURST; b++)
+				{
+					pthread_mutex_lock(&lock);
+					record = RingReserve(&ring, sizeof(*record) + sizes[s]);
+					if (record != NULL)
+					{
+						memset(record, 0, sizeof(*record));
+						record->BufferSize = sizes[s];
+						record->MajorFunctionCode = CPMBENCH_MJ_WRITE;
+						memcpy(record + 1, payload, sizes[s]);
+						RingCommit(&ring);
+					}
+					pthread_mutex_unlock(&lock);
+				}
+				for (;;)
+				{
+					pthread_mutex_lock(&lock);
+					record = RingPeek(&ring, &length);
+					if (record != NULL)
+					{
+						memcpy(output, record, length);
+						RingConsume(&ring);
+					}
+					pthread_mutex_unlock(&lock);
+					if (record == NULL)
+						break;
+					delivered[0] += ((PMEMORY_CONTEXT)output)->BufferSize;
+				}
+			}
+			if (round == 0 || ToolsNow() - start < elapsed[0])
+				elapsed[0] = ToolsNow() - start;
+
+			delivered[1] = 0;
+			head = NULL;
+			tail = &head;
+			start = ToolsNow();
+			for (done = 0; done < Events; done += CPMBENCH_BURST)
+			{
+				for (b = 0; b < CPMBENCH_BURST; b++)
+				{
+					pthread_mutex_lock(&lock);
+					record = malloc(sizeof(*record) + sizes[s]);
+					entry = malloc(sizeof(*entry));
+					if (record != NULL && entry != NULL)
+					{
+						memset(record, 0, sizeof(*record));
+						record->BufferSize = sizes[s];
+						record->MajorFunctionCode = CPMBENCH_MJ_WRITE;
+						memcpy(record + 1, payload, sizes[s]);
+						entry->Next = NULL;
+						entry->Object = record;
+						*tail = entry;
+						tail = &entry->Next;
+					}
+					else
+					{
+						free(record);
+						free(entry);
+					}
+					pthread_mutex_unlock(&lock);
+				}
+				for (;;)
+				{
+					pthread_mutex_lock(&lock);
+					entry = head;
+					if (entry != NULL)
+					{
+						head = entry->Next;
+						if (head == NULL)
+							tail = &head;
+						record = entry->Object;
+						memcpy(output, record, sizeof(*record) + record->BufferSize);
+					}
+					pthread_mutex_unlock(&lock);
+					if (entry == NULL)
+						break;
+					free(entry->Object);
+					free(entry);
+					delivered[1] += ((PMEMORY_CONTEXT)output)->BufferSize;
+				}
+			}
+			if (round == 0 || ToolsNow() - start < elapsed[1])
+				elapsed[1] = ToolsNow() - start;
+
+			if (delivered[0] != delivered[1] || delivered[0] < Events * sizes[s])
+			{
+				fprintf(stderr, "ring delivered %llu bytes, collection %llu\n", (unsigned long long)delivered[0], (unsigned long long)delivered[1]);
+				return 1;
+			}
+		}
+		printf("%8lu %12.0f %10.1f %12.0f %10.1f %10.1f\n", (unsigned long)sizes[s],
+			done * 1e9 / elapsed[0], (double)elapsed[0] / done, done * 1e9 / elapsed[1], (double)elapsed[1] / done,
+			(double)elapsed[1] / elapsed[0]);
+	}
+	free(buffer);
+	return 0;
+}
+
+int main(int argc, char **argv)
+{
+	if (argc < 2)
+		return Usage();
+
+	if (strcmp(argv[1], "index") == 0 && argc <= 4)
+		return BenchIndex(argc > 2 ? strtoull(argv[2], NULL, 0) : 4000000, argc > 3 ? (ULONG)strtoul(argv[3], NULL, 0) : 64);
+	if (strcmp(argv[1], "lz") == 0 && argc <= 4)
+		return BenchLz(argc > 2 ? strtoull(argv[2], NULL, 0) : 2000000, argc > 3 ? (ULONG)strtoul(argv[3], NULL, 0) : 64);
+	if (strcmp(argv[1], "decoder") == 0 && argc <= 4)
+		return BenchDecoder(argc > 2 ? strtoull(argv[2], NULL, 0) : 4000000, argc > 3 ? (ULONG)strtoul(argv[3], NULL, 0) : 32);
+	if (strcmp(argv[1], "filter") == 0 && argc <= 3)
+		return BenchFilter(argc > 2 ? strtoull(argv[2], NULL, 0) : 4000000);
+	if (strcmp(argv[1], "match") == 0 && argc <= 3)
+		return BenchMatch(argc > 2 ? strtoull(argv[2], NULL, 0) : 16 * 1024 * 1024);
+	if (strcmp(argv[1], "replay") == 0 && argc <= 3)
+		return BenchReplay(argc > 2 ? (ULONG)strtoul(argv[2], NULL, 0) : 5);
+	if (strcmp(argv[1], "proxy") == 0 && argc <= 3)
+		return BenchProxy(argc > 2 ? (ULONG)strtoul(argv[2], NULL, 0) : 10000);
+	if (strcmp(argv[1], "ring") == 0 && argc <= 3)
+		return BenchRing(argc > 2 ? strtoull(argv[2], NULL, 0) : 4000000);
+	return Usage();
+}
@@ -0,0 +1,439 @@
+/*++
+
+Module Name:
+
+    cpmpcap.c
+
+Abstract:
+
+    This file contains the capture conversion tool.
+
+        cpmpcap synth OUTPUT PORTS RECORDS
+        cpmpcap export [-f FREQUENCY] INPUT OUTPUT
+        cpmpcap import [-f FREQUENCY] INPUT OUTPUT
+        cpmpcap index CAPTURE INDEX [BLOCKBYTES]
+        cpmpcap query [-f FREQUENCY] CAPTURE INDEX FROM TO PORT|any OUTPUT
+
+    synth writes a batch file of synthetic traffic, see synth.h. export
+    turns a batch file into pcapng, one interface per port in the order
+    the ports first appear, and import turns pcapng back into a batch
+    file. index writes the index of a pcapng capture, see index.h, and
+    query writes the records of a port from FROM to TO nanoseconds of
+    capture time into a batch file, reading the mapped capture through
+    the index. FREQUENCY is that of IOCTL_CPM_GET_TIMESTAMP_FREQUENCY on
+    the capturing machine, the timestamps of batch files are in its
+    ticks.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "Tools.h"
+#include "Pcapng.h"
+#include "Index.h"
+#include "Synth.h"
+
+#define CPMPCAP_FREQUENCY			10000000
+#define CPMPCAP_MJ_READ				0x03
+#define CPMPCAP_MJ_WRITE			0x04
+#define CPMPCAP_BLOCK_BYTES			(1024 * 1024)
+
+static int Usage(VOID)
+{
+	fprintf(stderr,
+		"usage: cpmpcap synth OUTPUT PORTS RECORDS\n"
+		"       cpmpcap export [-f FREQUENCY] INPUT OUTPUT\n"
+		"       cpmpcap import [-f FREQUENCY] INPUT OUTPUT\n"
+		"       cpmpcap index CAPTURE INDEX [BLOCKBYTES]\n"
+		"       cpmpcap query [-f FREQUENCY] CAPTURE INDEX FROM TO PORT|any OUTPUT\n");
+	return 2;
+}
+
+static VOID Report(const char *Action, ULONG64 Records, ULONG64 Bytes, LONGLONG Elapsed)
+{
+	fprintf(stderr, "%s %llu records, %llu bytes in %.3f s, %.1f MB/s\n", Action,
+		(unsigned long long)Records, (unsigned long long)Bytes, Elapsed / 1e9,
+		Elapsed > 0 ? Bytes * 1e3 / Elapsed : 0.0);
+}
+
+static int Synth(const char *Path, ULONG Ports, ULONG64 Records)
+{
+	static SYNTH synth;
+	static TOOLS_BATCH_WRITER writer;
+	TOOLS_OUTPUT output;
+	MEMORY_CONTEXT record;
+	UCHAR payload[SYNTH_MAX_PAYLOAD];
+	ULONG64 i;
+
+	if (!ToolsOutputOpen(&output, Path))
+	{
+		perror(Path);
+		return 1;
+	}
+
+	SynthInitialize(&synth, SYNTH_MODBUS, Ports, CPMPCAP_FREQUENCY, 1);
+	ToolsBatchWriterInitialize(&writer, &output);
+	for (i = 0; i < Records; i++)
+	{
+		SynthNext(&synth, &record, payload);
+		ToolsBatchWrite(&writer, &record, payload);
+	}
+	ToolsBatchFlush(&writer);
+	if (!ToolsOutputClose(&output))
+	{
+		perror(Path);
+		return 1;
+	}
+	return 0;
+}
+
+static int Export(const char *InputPath, const char *OutputPath, LONGLONG Frequency)
+/*++
+
+Routine Description:
+
+    Writes the packet blocks straight into the output buffer. A port gets
+    its interface description block ahead of its first packet, ports past
+    PCAPNG_MAX_INTERFACES are left out and counted.
+
+--*/
+{
+	static PCAPNG_INTERFACES interfaces;
+	TOOLS_MAPPING input;
+	TOOLS_OUTPUT output;
+	TOOLS_BATCH_READER reader;
+	const MEMORY_CONTEXT *record;
+	const UCHAR *payload;
+	const LOSS_INFO *loss;
+	MEMORY_CONTEXT packet;
+	PVOID block;
+	ULONG size, id;
+	ULONG64 records = 0, skipped = 0, drops = 0;
+	BOOLEAN added;
+	LONGLONG start;
+
+	if (!ToolsMapFile(&input, InputPath))
+	{
+		perror(InputPath);
+		return 1;
+	}
+	if (!ToolsOutputOpen(&output, OutputPath))
+	{
+		perror(OutputPath);
+		ToolsUnmapFile(&input);
+		return 1;
+	}
+
+	start = ToolsNow();
+	PcapngInterfacesInitialize(&interfaces);
+	block = ToolsOutputReserve(&output, 28);
+	ToolsOutputCommit(&output, PcapngSectionHeader(block, 28));
+
+	ToolsBatchReaderInitialize(&reader, input.Data, input.Length);
+	while (ToolsNextRecord(&reader, &record, &payload))
+	{
+		if (record->DeviceNumber == LOSS_RECORD_DEVICE && record->MajorFunctionCode == LOSS_RECORD_FUNCTION)
+		{
+			loss = (const LOSS_INFO *)payload;
+			drops += loss->Records;
+			continue;
+		}
+		if (record->MajorFunctionCode != CPMPCAP_MJ_READ && record->MajorFunctionCode != CPMPCAP_MJ_WRITE)
+			continue;
+
+		id = PcapngInterfaceId(&interfaces, record->DeviceNumber, &added);
+		if (id == PCAPNG_INVALID)
+		{
+			skipped++;
+			continue;
+		}
+		if (added)
+		{
+			block = ToolsOutputReserve(&output, 256);
+			ToolsOutputCommit(&output, PcapngInterface(block, 256, NULL, record->DeviceNumber, 0));
+		}
+
+		packet = *record;
+		packet.DeviceNumber = id;
+		size = PCAPNG_PACKET_SIZE(record->BufferSize);
+		block = ToolsOutputReserve(&output, size);
+		if (block == NULL)
+		{
+			skipped++;
+			continue;
+		}
+		ToolsOutputCommit(&output, PcapngPacket(block, size, &packet, payload, PcapngTimestamp(record->Timestamp, Frequency), drops));
+		drops = 0;
+		records++;
+	}
+	Report("exported", records, output.Written, ToolsNow() - start);
+	if (skipped != 0)
+		fprintf(stderr, "%llu records of ports past the first %u left out\n", (unsigned long long)skipped, PCAPNG_MAX_INTERFACES);
+
+	ToolsUnmapFile(&input);
+	if (!ToolsOutputClose(&output))
+	{
+		perror(OutputPath);
+		return 1;
+	}
+	return 0;
+}
+
+static LONGLONG Ticks(LONGLONG Nanoseconds, LONGLONG Frequency)
+{
+	return Nanoseconds / 1000000000 * Frequency + Nanoseconds % 1000000000 * Frequency / 1000000000;
+}
+
+static int Import(const char *InputPath, const char *OutputPath, LONGLONG Frequency)
+{
+	static PCAPNG_READER pcapng;
+	static TOOLS_BATCH_WRITER writer;
+	TOOLS_MAPPING input;
+	TOOLS_OUTPUT output;
+	MEMORY_CONTEXT record;
+	const UCHAR *payload;
+	ULONG64 offset, length, records = 0;
+	ULONG size;
+	LONGLONG start;
+
+	if (!ToolsMapFile(&input, InputPath))
+	{
+		perror(InputPath);
+		return 1;
+	}
+	if (!ToolsOutputOpen(&output, OutputPath))
+	{
+		perror(OutputPath);
+		ToolsUnmapFile(&input);
+		return 1;
+	}
+
+	start = ToolsNow();
+	PcapngReaderInitialize(&pcapng);
+	ToolsBatchWriterInitialize(&writer, &output);
+	for (offset = 0; offset < input.Length; offset += size)
+	{
+		length = input.Length - offset;
+		size = PcapngNextBlock(&pcapng, input.Data + offset, length > 0xFFFFFFFF ? 0xFFFFFFFF : (ULONG)length, &record, &payload);
+		if (size == 0 || size == PCAPNG_INVALID)
+		{
+			fprintf(stderr, "%s: not a capture at offset %llu\n", InputPath, (unsigned long long)offset);
+			break;
+		}
+		if (record.HeaderSize == 0)
+			continue;
+
+		record.Timestamp = Ticks(record.Timestamp, Frequency);
+		record.LastTimestamp = record.Timestamp;
+		ToolsBatchWrite(&writer, &record, payload);
+		records++;
+	}
+	ToolsBatchFlush(&writer);
+	Report("imported", records, input.Length, ToolsNow() - start);
+
+	ToolsUnmapFile(&input);
+	if (!ToolsOutputClose(&output))
+	{
+		perror(OutputPath);
+		return 1;
+	}
+	return 0;
+}
+
+static int Index(const char *CapturePath, const char *IndexPath, ULONG BlockBytes)
+/*++
+
+Routine Description:
+
+    Walks the capture and feeds its interface descriptions and packet
+    blocks to the index writer. The entries are collected in memory, an
+    entry stands for BlockBytes of the capture.
+
+--*/
+{
+	static PCAPNG_READER pcapng;
+	static INDEX_WRITER writer;
+	TOOLS_MAPPING input;
+	TOOLS_OUTPUT output;
+	INDEX_HEADER header;
+	PINDEX_ENTRY entries = NULL, grown;
+	ULONG64 offset, length, count = 0, allocated = 0, records = 0;
+	MEMORY_CONTEXT record;
+	const UCHAR *payload;
+	ULONG size, interfaces = 0;
+	LONGLONG start;
+	int result = 1;
+
+	if (!ToolsMapFile(&input, CapturePath))
+	{
+		perror(CapturePath);
+		return 1;
+	}
+
+	start = ToolsNow();
+	PcapngReaderInitialize(&pcapng);
+	IndexWriterInitialize(&writer, BlockBytes);
+	for (offset = 0; offset < input.Length; offset += size)
+	{
+		length = input.Length - offset;
+		size = PcapngNextBlock(&pcapng, input.Data + offset, length > 0xFFFFFFFF ? 0xFFFFFFFF : (ULONG)length, &record, &payload);
+		if (size == 0 || size == PCAPNG_INVALID)
+		{
+			fprintf(stderr, "%s: not a capture at offset %llu\n", CapturePath, (unsigned long long)offset);
+			goto Exit;
+		}
+
+		if (pcapng.InterfaceCount < interfaces)
+			interfaces = 0;
+		for (; interfaces < pcapng.InterfaceCount; interfaces++)
+			IndexWriterInterface(&writer, interfaces, pcapng.Port[interfaces], pcapng.TsResol[interfaces]);
+		if (record.HeaderSize == 0)
+			continue;
+
+		if (count == allocated)
+		{
+			allocated = allocated != 0 ? allocated * 2 : 1024;
+			grown = realloc(entries, allocated * sizeof(*entries));
+			if (grown == NULL)
+			{
+				fprintf(stderr, "out of memory\n");
+				goto Exit;
+			}
+			entries = grown;
+		}
+		if (IndexWriterAdd(&writer, offset, pcapng.Interface, &record, &entries[count]))
+			count++;
+		records++;
+	}
+	if (count == allocated)
+	{
+		grown = realloc(entries, (allocated + 1) * sizeof(*entries));
+		if (grown == NULL)
+		{
+			fprintf(stderr, "out of memory\n");
+			goto Exit;
+		}
+		entries = grown;
+	}
+	if (IndexWriterFlush(&writer, &entries[count]))
+		count++;
+
+	if (!ToolsOutputOpen(&output, IndexPath))
+	{
+		perror(IndexPath);
+		goto Exit;
+	}
+	IndexWriterHeader(&writer, &header);
+	ToolsOutputWrite(&output, &header, sizeof(header));
+	ToolsOutputWrite(&output, entries, (ULONG)(count * sizeof(*entries)));
+	ToolsOutputWrite(&output, writer.Interfaces, writer.InterfaceCount * sizeof(writer.Interfaces[0]));
+	if (!ToolsOutputClose(&output))
+	{
+		perror(IndexPath);
+		goto Exit;
+	}
+	Report("indexed", records, input.Length, ToolsNow() - start);
+	result = 0;
+
+Exit:
+	free(entries);
+	ToolsUnmapFile(&input);
+	return result;
+}
+
+static int Query(const char *CapturePath, const char *IndexPath, ULONG64 From, ULONG64 To, ULONG Port, const char *OutputPath, LONGLONG Frequency)
+{
+	static INDEX_QUERY query;
+	static TOOLS_BATCH_WRITER writer;
+	TOOLS_MAPPING capture, index;
+	TOOLS_OUTPUT output;
+	MEMORY_CONTEXT record;
+	const UCHAR *payload;
+	ULONG64 records = 0, bytes = 0;
+	LONGLONG start;
+	int result = 1;
+
+	if (!ToolsMapFile(&capture, CapturePath))
+	{
+		perror(CapturePath);
+		return 1;
+	}
+	if (!ToolsMapFile(&index, IndexPath))
+	{
+		perror(IndexPath);
+		ToolsUnmapFile(&capture);
+		return 1;
+	}
+	if (!ToolsOutputOpen(&output, OutputPath))
+	{
+		perror(OutputPath);
+		goto Exit;
+	}
+
+	start = ToolsNow();
+	if (!IndexQueryStart(&query, index.Data, index.Length, capture.Data, capture.Length, From, To, Port))
+		fprintf(stderr, "%s: not an index of %s\n", IndexPath, CapturePath);
+	else
+	{
+		ToolsBatchWriterInitialize(&writer, &output);
+		while (IndexQueryNext(&query, &record, &payload))
+		{
+			record.Timestamp = Ticks(record.Timestamp, Frequency);
+			record.LastTimestamp = record.Timestamp;
+			ToolsBatchWrite(&writer, &record, payload);
+			records++;
+			bytes += record.BufferSize;
+		}
+		ToolsBatchFlush(&writer);
+		fprintf(stderr, "%llu records, %llu bytes of data in %.3f ms\n", (unsigned long long)records,
+			(unsigned long long)bytes, (ToolsNow() - start) / 1e6);
+		result = 0;
+	}
+	if (!ToolsOutputClose(&output))
+	{
+		perror(OutputPath);
+		result = 1;
+	}
+
+Exit:
+	ToolsUnmapFile(&index);
+	ToolsUnmapFile(&capture);
+	return result;
+}
+
+int main(int argc, char **argv)
+{
+	LONGLONG frequency = CPMPCAP_FREQUENCY;
+	int first = 2;
+
+	if (argc < 2)
+		return Usage();
+
+	if (argc > 3 && strcmp(argv[2], "-f") == 0)
+	{
+		frequency = strtoll(argv[3], NULL, 0);
+		if (frequency <= 0)
+			return Usage();
+		first = 4;
+	}
+
+	if (strcmp(argv[1], "synth") == 0 && argc == 5)
+		return Synth(argv[2], (ULONG)strtoul(argv[3], NULL, 0), strtoull(argv[4], NULL, 0));
+	if (strcmp(argv[1], "index") == 0 && (argc == 4 || argc == 5))
+		return Index(argv[2], argv[3], argc == 5 ? (ULONG)strtoul(argv[4], NULL, 0) : CPMPCAP_BLOCK_BYTES);
+	if (strcmp(argv[1], "query") == 0 && argc - first == 6)
+		return Query(argv[first], argv[first + 1], strtoull(argv[first + 2], NULL, 0), strtoull(argv[first + 3], NULL, 0),
+			strcmp(argv[first + 4], "any") == 0 ? INDEX_PORT_ANY : (ULONG)strtoul(argv[first + 4], NULL, 0), argv[first + 5], frequency);
+	if (argc - first != 2)
+		return Usage();
+	if (strcmp(argv[1], "export") == 0)
+		return Export(argv[first], argv[first + 1], frequency);
+	if (strcmp(argv[1], "import") == 0)
+		return Import(argv[first], argv[first + 1], frequency);
+	return Usage();
+}
@@ -0,0 +1,190 @@
+/*++
+
+Module Name:
+
+    cpmproxy.c
+
+Abstract:
+
+    This file contains the pty capture proxy tool.
+
+        cpmproxy [-n NUMBER] [-o OUTPUT] [-s SNAPLENGTH] [-b BAUD] [-c] [-l LINK] DEVICE
+
+    Opens the tty DEVICE and a pty pair in front of it, prints the slave
+    for the application to open instead of DEVICE, links it as LINK with
+    -l, and passes the data both ways until interrupted. With -o what
+    goes through is recorded into the batch file OUTPUT as the records
+    of device NUMBER (0 by default), payloads cut to SNAPLENGTH bytes,
+    with timestamps in PROXY_FREQUENCY ticks, so cpmpcap export takes it
+    with its default frequency. -b sets DEVICE to BAUD 8N1 raw, otherwise
+    its line settings are left as they are: those the application sets
+    on the slave are not passed on. -c moves the data with read and
+    write instead of splice.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <signal.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <termios.h>
+#include "Proxy.h"
+
+static volatile sig_atomic_t Stop;
+
+static int Usage(VOID)
+{
+	fprintf(stderr, "usage: cpmproxy [-n NUMBER] [-o OUTPUT] [-s SNAPLENGTH] [-b BAUD] [-c] [-l LINK] DEVICE\n");
+	return 2;
+}
+
+static VOID Interrupt(int Signal)
+{
+	UNREFERENCED_PARAMETER(Signal);
+	Stop = 1;
+}
+
+static BOOLEAN SetLine(int Device, ULONG Baud)
+{
+	static const struct
+	{
+		ULONG Baud;
+		speed_t Speed;
+	} speeds[] =
+	{
+		{ 1200, B1200 }, { 2400, B2400 }, { 4800, B4800 }, { 9600, B9600 },
+		{ 19200, B19200 }, { 38400, B38400 }, { 57600, B57600 },
+		{ 115200, B115200 }, { 230400, B230400 }, { 460800, B460800 },
+		{ 921600, B921600 },
+	};
+	struct termios settings;
+	ULONG i;
+
+	for (i = 0; i < sizeof(speeds) / sizeof(speeds[0]) && speeds[i].Baud != Baud; i++)
+		;
+	if (i == sizeof(speeds) / sizeof(speeds[0]) || tcgetattr(Device, &settings) != 0)
+		return FALSE;
+	cfmakeraw(&settings);
+	settings.c_cflag |= CLOCAL | CREAD;
+	cfsetispeed(&settings, speeds[i].Speed);
+	cfsetospeed(&settings, speeds[i].Speed);
+	return tcsetattr(Device, TCSANOW, &settings) == 0;
+}
+
+int main(int argc, char **argv)
+{
+	static PROXY proxy;
+	static TOOLS_BATCH_WRITER writer;
+	TOOLS_OUTPUT output;
+	struct sigaction action;
+	const char *path = NULL, *link = NULL;
+	ULONG number = 0, snapLength = PROXY_PIPE_SIZE, baud = 0, flags = 0;
+	int device, option, result = 0;
+
+	while ((option = getopt(argc, argv, "n:o:s:b:cl:")) != -1)
+	{
+		switch (option)
+		{
+		case 'n':
+			number = (ULONG)strtoul(optarg, NULL, 0);
+			break;
+		case 'o':
+			path = optarg;
+			break;
+		case 's':
+			snapLength = (ULONG)strtoul(optarg, NULL, 0);
+			break;
+		case 'b':
+			baud = (ULONG)strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			flags |= PROXY_COPY;
+			break;
+		case 'l':
+			link = optarg;
+			break;
+		default:
+			return Usage();
+		}
+	}
+	if (optind != argc - 1)
+		return Usage();
+
+	device = open(argv[optind], O_RDWR | O_NOCTTY | O_NONBLOCK | O_CLOEXEC);
+	if (device < 0)
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	if (baud != 0 && !SetLine(device, baud))
+	{
+		fprintf(stderr, "%s: cannot set %lu baud\n", argv[optind], (unsigned long)baud);
+		close(device);
+		return 1;
+	}
+	if (path != NULL)
+	{
+		if (!ToolsOutputOpen(&output, path))
+		{
+			perror(path);
+			close(device);
+			return 1;
+		}
+		ToolsBatchWriterInitialize(&writer, &output);
+	}
+	if (!ProxyOpen(&proxy, device, number, flags, path != NULL ? &writer : NULL, snapLength))
+	{
+		perror("pty");
+		result = 1;
+		goto Exit;
+	}
+
+	printf("%s: %s\n", argv[optind], proxy.Name);
+	fflush(stdout);
+	if (link != NULL)
+	{
+		unlink(link);
+		if (symlink(proxy.Name, link) != 0)
+			perror(link);
+	}
+
+	memset(&action, 0, sizeof(action));
+	action.sa_handler = Interrupt;
+	sigaction(SIGINT, &action, NULL);
+	sigaction(SIGTERM, &action, NULL);
+	while (!Stop)
+	{
+		if (!ProxyPoll(&proxy, -1))
+		{
+			perror(argv[optind]);
+			result = 1;
+			break;
+		}
+	}
+
+	fprintf(stderr, "%llu bytes read in %llu records, %llu bytes written in %llu records\n",
+		(unsigned long long)proxy.Paths[PROXY_READ].Bytes, (unsigned long long)proxy.Paths[PROXY_READ].Records,
+		(unsigned long long)proxy.Paths[PROXY_WRITE].Bytes, (unsigned long long)proxy.Paths[PROXY_WRITE].Records);
+	if (link != NULL)
+		unlink(link);
+
+Exit:
+	ProxyClose(&proxy);
+	if (path != NULL)
+	{
+		ToolsBatchFlush(&writer);
+		if (!ToolsOutputClose(&output))
+		{
+			perror(path);
+			result = 1;
+		}
+	}
+	close(device);
+	return result;
+}
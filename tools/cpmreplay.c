@@ -0,0 +1,133 @@
+/*++
+
+Module Name:
+
+    cpmreplay.c
+
+Abstract:
+
+    This file contains the capture replay tool.
+
+        cpmreplay [-f FREQUENCY] [-s PERCENT] [-w] [-d SECONDS] [-l DIRECTORY] INPUT
+
+    Opens a pty pair per port of the batch file INPUT, prints the slave
+    of every port, links it as DIRECTORY/cpmN for port N with -l, waits
+    SECONDS (1 by default) for the programs to open them and plays what
+    the devices sent, or with -w what the application sent, at PERCENT of
+    the original pace, 0 for as fast as possible. The timing error and
+    the throughput are reported at the end.
+
+Environment:
+
+    User mode, Linux
+
+--*/
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "Player.h"
+
+#define CPMREPLAY_FREQUENCY			10000000
+#define CPMREPLAY_TOLERANCE			1000000		// a millisecond late
+
+static int Usage(VOID)
+{
+	fprintf(stderr, "usage: cpmreplay [-f FREQUENCY] [-s PERCENT] [-w] [-d SECONDS] [-l DIRECTORY] INPUT\n");
+	return 2;
+}
+
+int main(int argc, char **argv)
+{
+	static PLAYER player;
+	TOOLS_MAPPING input;
+	LONGLONG frequency = CPMREPLAY_FREQUENCY;
+	ULONG speed = REPLAY_SPEED_ORIGINAL, play = PLAYER_PLAY_READS, delay = 1, i;
+	const char *directory = NULL;
+	char link[4096];
+	PREPLAY_STATS stats;
+	ULONG64 received = 0, dropped = 0;
+	int option;
+
+	while ((option = getopt(argc, argv, "f:s:wd:l:")) != -1)
+	{
+		switch (option)
+		{
+		case 'f':
+			frequency = strtoll(optarg, NULL, 0);
+			break;
+		case 's':
+			speed = (ULONG)strtoul(optarg, NULL, 0);
+			break;
+		case 'w':
+			play = PLAYER_PLAY_WRITES;
+			break;
+		case 'd':
+			delay = (ULONG)strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			directory = optarg;
+			break;
+		default:
+			return Usage();
+		}
+	}
+	if (optind != argc - 1 || frequency <= 0)
+		return Usage();
+
+	if (!ToolsMapFile(&input, argv[optind]))
+	{
+		perror(argv[optind]);
+		return 1;
+	}
+	if (!PlayerInitialize(&player, play, FALSE) || !PlayerOpenPorts(&player, input.Data, input.Length))
+	{
+		perror("pty");
+		PlayerClose(&player);
+		ToolsUnmapFile(&input);
+		return 1;
+	}
+
+	for (i = 0; i < player.PortCount; i++)
+	{
+		printf("port %lu: %s\n", (unsigned long)player.Ports[i].DeviceNumber, player.Ports[i].Name);
+		if (directory != NULL)
+		{
+			snprintf(link, sizeof(link), "%s/cpm%lu", directory, (unsigned long)player.Ports[i].DeviceNumber);
+			unlink(link);
+			if (symlink(player.Ports[i].Name, link) != 0)
+				perror(link);
+		}
+	}
+	fflush(stdout);
+	sleep(delay);
+
+	if (!PlayerRun(&player, input.Data, input.Length, frequency, speed, CPMREPLAY_TOLERANCE))
+		perror("timer");
+
+	stats = &player.Replay.Stats;
+	for (i = 0; i < player.PortCount; i++)
+	{
+		received += player.Ports[i].Received;
+		dropped += player.Ports[i].Dropped;
+	}
+	fprintf(stderr, "played %llu records, %llu bytes in %.3f s, %.3f MB/s, %llu bytes dropped, %llu bytes received\n",
+		(unsigned long long)stats->Records, (unsigned long long)stats->Bytes, stats->Elapsed / 1e9,
+		stats->Elapsed > 0 ? stats->Bytes * 1e3 / stats->Elapsed : 0.0, (unsigned long long)dropped, (unsigned long long)received);
+	fprintf(stderr, "late by %.1f us on average, %.1f us at most, %llu records more than %.1f ms late\n",
+		stats->Records != 0 ? stats->ErrorSum / 1e3 / stats->Records : 0.0, stats->ErrorMax / 1e3,
+		(unsigned long long)stats->Late, CPMREPLAY_TOLERANCE / 1e6);
+
+	if (directory != NULL)
+	{
+		for (i = 0; i < player.PortCount; i++)
+		{
+			snprintf(link, sizeof(link), "%s/cpm%lu", directory, (unsigned long)player.Ports[i].DeviceNumber);
+			unlink(link);
+		}
+	}
+	PlayerClose(&player);
+	ToolsUnmapFile(&input);
+	return 0;
+}
@@ -0,0 +1,853 @@
+/*++
+
+Module Name:
+
+    cpmstorm.c
+
+Abstract:
+
+    This file contains the IRP storm benchmark of the driver, built from
+    the driver sources on the framework stand-in, see wdfstub.h.
+
+        cpmstorm [-p PORTS] [-l LISTENERS] [-n IRPS] [-s SIZE|modbus|mixed] [-c MAXBYTES] [-a] [-m read|batch|direct]
+                 [-w WORKERS] [-d PERCENT]
+
+    PORTS filtered ports, each with a thread of its own sending IRPS
+    reads and writes of SIZE bytes in turn, which the lower driver
+    completes at once, and LISTENERS clients of the control device, each
+    attached to every port and taking the records on a thread of its
+    own: one by one with IOCTL_CPM_GET_DATA_INFO and a plain read, the
+    two calls per record clients made before batches, or with
+    IOCTL_CPM_READ_BATCH or IOCTL_CPM_READ_DIRECT.
+    The run ends once every listener has taken every record the driver
+    did not drop, which IOCTL_CPM_GET_STATS tells, and the benchmark
+    checks that the records add up.
+
+    Instead of a size, modbus sends the chunks of a Modbus RTU master
+    polling its slaves: a request of 8 bytes in one write, then a
+    response of 5 to 255 bytes in reads of 1, 4, 8 or 14 bytes, the
+    receive FIFO trigger levels of a 16550 UART. mixed sends runs of 1
+    to 16 reads, then of 1 to 16 writes, of one byte each. MAXBYTES sets
+    IOCTL_CPM_SET_COALESCING on every port with an idle gap of
+    CPMSTORM_IDLE_GAP microseconds. With coalescing the records no longer
+    match the IRPs, so the run ends once the listeners have taken every
+    byte, or once they stop taking any after drops. The listeners
+    check that every record is a read with
+    OutputDataOffset 0 or a write with OutputDataOffset BufferSize,
+    merged or not.
+
+    With -a one more client keeps attaching to every port, detaching and
+    walking the device list while the storm runs, and the benchmark
+    reports the allocations and lookaside hits per such call.
+
+    It reports the records delivered a second and the share of them the
+    driver dropped, in the capture ring of a port or in the ring of a
+    listener, and fails if more than PERCENT of the records, 1 by default,
+    did not reach the listeners. With more port threads than processors
+    the listeners get a smaller share of them the more ports there are,
+    so delivery drops then grow with PORTS even when no lock is
+    contended; capture drops and the lock table tell the driver apart.
+    Then come the IRPs a second, the objects
+    and the pool allocations the driver made per IRP, the bytes it
+    allocated per byte captured, the bytes it allocated at setup and how
+    many of them each listener takes, and for every class of locks the
+    acquisitions per IRP, the contended ones, and the time they were held
+    and waited for. WORKERS is the number of threads running the work
+    items of the driver, the processors by default.
+
+Environment:
+
+    User mode
+
+--*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wchar.h>
+#include <time.h>
+#include <pthread.h>
+#include <unistd.h>
+#include "WdfStub.h"
+#include "Public.h"
+#include "Control.h"
+
+#define CPMSTORM_MAX_PORTS			256
+#define CPMSTORM_MAX_LISTENERS		64
+#define CPMSTORM_BUFFER_SIZE		(64 * 1024)
+#define CPMSTORM_DIRECT_REQUESTS	4
+#define CPMSTORM_DIRECT_LATENCY		1000
+#define CPMSTORM_TIMEOUT			60
+#define CPMSTORM_IDLE_GAP			1000
+#define CPMSTORM_QUIET				0.1
+#define CPMSTORM_MAX_CHUNK			14
+
+typedef enum _STORM_MODE
+{
+	StormRead,
+	StormBatch,
+	StormDirect,
+
+} STORM_MODE;
+
+typedef enum _STORM_CHUNKS
+{
+	StormFixed,
+	StormModbus,
+	StormMixed,
+
+} STORM_CHUNKS;
+
+typedef struct _STORM_PORT
+{
+	WDFDEVICE Device;
+	WDFFILEOBJECT FileObject;
+	ULONG Number;
+	pthread_t Thread;
+	ULONG64 Sent;
+	ULONG64 Failed;
+
+} STORM_PORT, *PSTORM_PORT;
+
+typedef struct _STORM_LISTENER
+{
+	WDFFILEOBJECT FileObject;
+	pthread_t Thread;
+	ULONG64 Records;
+	ULONG64 Bytes;
+	ULONG64 Malformed;
+	ULONG64 Failed;
+
+} STORM_LISTENER, *PSTORM_LISTENER;
+
+typedef struct _STORM_CHURN
+{
+	WDFFILEOBJECT FileObject;
+	pthread_t Thread;
+	ULONG64 Calls;
+	ULONG64 Failed;
+
+} STORM_CHURN, *PSTORM_CHURN;
+
+static WDFDEVICE Control;
+static STORM_PORT Ports[CPMSTORM_MAX_PORTS];
+static STORM_LISTENER Listeners[CPMSTORM_MAX_LISTENERS];
+static STORM_CHURN Churn;
+static ULONG PortCount = 8, ListenerCount = 4, Size = 64, Coalesce;
+static BOOLEAN Churning;
+static ULONG64 Irps = 100000;
+static STORM_MODE Mode = StormBatch;
+static STORM_CHUNKS Chunks = StormFixed;
+static double MaxLoss = 1;
+static volatile int Stop;
+
+static int Usage(VOID)
+{
+	fprintf(stderr, "usage: cpmstorm [-p PORTS] [-l LISTENERS] [-n IRPS] [-s SIZE|modbus|mixed] [-c MAXBYTES] [-a] [-m read|batch|direct]\n"
+		"                [-w WORKERS] [-d PERCENT]\n");
+	return 2;
+}
+
+static ULONG64 Random(ULONG64 *State)
+{
+	*State ^= *State << 13;
+	*State ^= *State >> 7;
+	*State ^= *State << 17;
+	return *State;
+}
+
+static double Now(VOID)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec + now.tv_nsec / 1e9;
+}
+
+static VOID LowerDriver(WDFDEVICE Device, WDFREQUEST Request, PIO_STATUS_BLOCK IoStatus, PVOID Context)
+/*++
+
+Routine Description:
+
+    The serial driver under the filter, it reads and writes all it is
+    asked to at once.
+
+--*/
+{
+	WDF_REQUEST_PARAMETERS params;
+
+	UNREFERENCED_PARAMETER(Device);
+	UNREFERENCED_PARAMETER(Context);
+
+	WDF_REQUEST_PARAMETERS_INIT(&params);
+	WdfRequestGetParameters(Request, &params);
+	IoStatus->Status = STATUS_SUCCESS;
+	if (params.Type == WdfRequestTypeRead)
+		IoStatus->Information = params.Parameters.Read.Length;
+	else if (params.Type == WdfRequestTypeWrite)
+		IoStatus->Information = params.Parameters.Write.Length;
+	else
+		IoStatus->Information = 0;
+}
+
+static NTSTATUS Call(WDFDEVICE Device, WDFREQUEST Request, WDF_REQUEST_TYPE Type, WDFFILEOBJECT FileObject, ULONG IoControlCode,
+	PVOID Input, size_t InputLength, PVOID Output, size_t OutputLength, PULONG_PTR Information)
+{
+	WdfStubRequestInitialize(Request, Type, FileObject, IoControlCode, Input, InputLength, Output, OutputLength);
+	WdfStubRequestSubmit(Device, Request);
+	return WdfStubRequestWait(Request, Information);
+}
+
+static ULONG NextChunk(PULONG64 Seed, ULONG64 Index, PULONG Left, PBOOLEAN Write)
+/*++
+
+Routine Description:
+
+    Picks the direction and the size of the next IRP of a port. Left is
+    what is left of the current Modbus response or run of mixed IRPs.
+
+--*/
+{
+	static const ULONG triggers[] = { 1, 4, 8, 14 };
+	ULONG length;
+
+	switch (Chunks)
+	{
+	case StormModbus:
+		if (*Left == 0)
+		{
+			*Left = 5 + (ULONG)(Random(Seed) % 251);
+			*Write = TRUE;
+			return 8;
+		}
+		length = triggers[Random(Seed) % 4];
+		length = min(length, *Left);
+		*Left -= length;
+		*Write = FALSE;
+		return length;
+	case StormMixed:
+		if (*Left == 0)
+		{
+			*Left = 1 + (ULONG)(Random(Seed) % 16);
+			*Write = !*Write;
+		}
+		--*Left;
+		return 1;
+	default:
+		*Write = Index % 2 == 0;
+		return Size;
+	}
+}
+
+static PVOID Producer(PVOID Parameter)
+{
+	PSTORM_PORT port = Parameter;
+	WDFREQUEST request;
+	PUCHAR data;
+	ULONG64 i, seed = port->Number + 1;
+	ULONG length, left = 0;
+	BOOLEAN write = FALSE;
+
+	data = calloc(1, max(Size, CPMSTORM_MAX_CHUNK));
+	if (data == NULL || !NT_SUCCESS(WdfStubRequestCreate(&request)))
+	{
+		free(data);
+		port->Failed = Irps;
+		return NULL;
+	}
+
+	for (i = 0; i < Irps; i++)
+	{
+		length = NextChunk(&seed, i, &left, &write);
+		memset(data, (int)i, length);
+		if (NT_SUCCESS(Call(port->Device, request, write ? WdfRequestTypeWrite : WdfRequestTypeRead, port->FileObject, 0,
+			data, write ? length : 0, data, write ? 0 : length, NULL)))
+			port->Sent++;
+		else
+			port->Failed++;
+	}
+	WdfStubRequestDelete(request);
+	free(data);
+	return NULL;
+}
+
+static BOOLEAN RecordValid(const MEMORY_CONTEXT *Record)
+{
+	if (Record->MajorFunctionCode == IRP_MJ_READ)
+		return Record->OutputDataOffset == 0;
+	return Record->MajorFunctionCode == IRP_MJ_WRITE && Record->OutputDataOffset == Record->BufferSize;
+}
+
+static VOID CheckBatch(PSTORM_LISTENER Listener, const UCHAR *Buffer, ULONG_PTR Length)
+/*++
+
+Routine Description:
+
+    Counts the records and the bytes of a batch and checks the offsets
+    of every record.
+
+--*/
+{
+	const BATCH_HEADER *header = (const BATCH_HEADER *)Buffer;
+	const MEMORY_CONTEXT *record;
+	ULONG64 bytes = 0, malformed = 0;
+	ULONG_PTR offset = sizeof(*header);
+	ULONG i;
+
+	if (Length < sizeof(*header))
+		return;
+
+	for (i = 0; i < header->RecordCount; i++)
+	{
+		record = (const MEMORY_CONTEXT *)(Buffer + offset);
+		if (Length - offset < sizeof(*record) || Length - offset - sizeof(*record) < record->BufferSize)
+		{
+			malformed++;
+			break;
+		}
+		if (!RecordValid(record))
+			malformed++;
+		bytes += record->BufferSize;
+		offset += BATCH_RECORD_SIZE(record->BufferSize);
+	}
+	__atomic_fetch_add(&Listener->Records, header->RecordCount, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&Listener->Bytes, bytes, __ATOMIC_RELAXED);
+	Listener->Malformed += malformed;
+}
+
+static PVOID Consumer(PVOID Parameter)
+/*++
+
+Routine Description:
+
+    Takes the records of one listener until the run is over. The data
+    info, the batch read or the direct read that finds no record is
+    parked by the driver until records come or the handle is cleaned up.
+
+--*/
+{
+	PSTORM_LISTENER listener = Parameter;
+	READ_DIRECT_CONFIG config;
+	MEMORY_CONTEXT info;
+	WDFREQUEST requests[CPMSTORM_DIRECT_REQUESTS];
+	PUCHAR buffers[CPMSTORM_DIRECT_REQUESTS];
+	ULONG count = Mode == StormDirect ? CPMSTORM_DIRECT_REQUESTS : 1;
+	BOOLEAN submitted = FALSE;
+	ULONG_PTR information;
+	NTSTATUS status;
+	ULONG i;
+
+	memset(requests, 0, sizeof(requests));
+	memset(buffers, 0, sizeof(buffers));
+	for (i = 0; i < count; i++)
+	{
+		buffers[i] = malloc(CPMSTORM_BUFFER_SIZE);
+		if (buffers[i] == NULL || !NT_SUCCESS(WdfStubRequestCreate(&requests[i])))
+		{
+			listener->Failed++;
+			goto Exit;
+		}
+	}
+
+	config.Latency = CPMSTORM_DIRECT_LATENCY;
+	if (Mode == StormDirect)
+	{
+		for (i = 0; i < count; i++)
+		{
+			WdfStubRequestInitialize(requests[i], WdfRequestTypeDeviceControl, listener->FileObject, IOCTL_CPM_READ_DIRECT,
+				&config, sizeof(config), buffers[i], CPMSTORM_BUFFER_SIZE);
+			WdfStubRequestSubmit(Control, requests[i]);
+		}
+		submitted = TRUE;
+	}
+
+	for (i = 0;; i = (i + 1) % count)
+	{
+		switch (Mode)
+		{
+		case StormRead:
+			status = Call(Control, requests[0], WdfRequestTypeDeviceControl, listener->FileObject, IOCTL_CPM_GET_DATA_INFO, NULL, 0,
+				&info, sizeof(info), NULL);
+			if (NT_SUCCESS(status))
+				status = Call(Control, requests[0], WdfRequestTypeRead, listener->FileObject, 0, NULL, 0,
+					buffers[0], CPMSTORM_BUFFER_SIZE, &information);
+			break;
+		case StormBatch:
+			status = Call(Control, requests[0], WdfRequestTypeDeviceControl, listener->FileObject, IOCTL_CPM_READ_BATCH, NULL, 0,
+				buffers[0], CPMSTORM_BUFFER_SIZE, &information);
+			break;
+		default:
+			status = WdfStubRequestWait(requests[i], &information);
+			break;
+		}
+		if (!NT_SUCCESS(status))
+		{
+			if (!Stop)
+				listener->Failed++;
+			goto Exit;
+		}
+
+		if (Mode == StormRead)
+		{
+			if (!RecordValid(&info) || information != info.BufferSize)
+				listener->Malformed++;
+			__atomic_fetch_add(&listener->Records, 1, __ATOMIC_RELAXED);
+			__atomic_fetch_add(&listener->Bytes, information, __ATOMIC_RELAXED);
+		}
+		else
+			CheckBatch(listener, buffers[i], information);
+
+		if (Mode == StormDirect)
+		{
+			WdfStubRequestInitialize(requests[i], WdfRequestTypeDeviceControl, listener->FileObject, IOCTL_CPM_READ_DIRECT,
+				&config, sizeof(config), buffers[i], CPMSTORM_BUFFER_SIZE);
+			WdfStubRequestSubmit(Control, requests[i]);
+		}
+	}
+
+Exit:
+	//
+	// The direct reads still parked were cancelled with the queue, they
+	// are waited for before their requests go.
+	//
+	for (i = 0; i < count; i++)
+	{
+		if (requests[i] != NULL)
+		{
+			if (submitted)
+				WdfStubRequestWait(requests[i], NULL);
+			WdfStubRequestDelete(requests[i]);
+		}
+		free(buffers[i]);
+	}
+	return NULL;
+}
+
+static PVOID Churner(PVOID Parameter)
+/*++
+
+Routine Description:
+
+    Attaches a client to every port and detaches it again, then walks
+    the device list, until the run is over. These are the calls of the
+    control device that still allocate, from the lookaside lists of the
+    driver. The client asks for serial events only, which the storm
+    has none of, so it takes no records from the listeners.
+
+--*/
+{
+	PSTORM_CHURN churn = Parameter;
+	UCHAR info[DEVICEINFO_BUFSIZE];
+	ATTACH_INFO attach;
+	WDFREQUEST request;
+	ULONG code, i;
+
+	if (!NT_SUCCESS(WdfStubRequestCreate(&request)))
+	{
+		churn->Failed++;
+		return NULL;
+	}
+
+	while (!Stop)
+	{
+		for (i = 0; i < PortCount; i++)
+		{
+			attach.DeviceNumber = Ports[i].Number;
+			attach.EventMask = ATTACH_EVENT_DEVICE_CONTROL;
+			attach.SnapLength = ATTACH_SNAP_ALL;
+			if (!NT_SUCCESS(Call(Control, request, WdfRequestTypeDeviceControl, churn->FileObject, IOCTL_CPM_ATTACH_EX,
+				&attach, sizeof(attach), NULL, 0, NULL)) ||
+				!NT_SUCCESS(Call(Control, request, WdfRequestTypeDeviceControl, churn->FileObject, IOCTL_CPM_DETACH_FROM_DEVICE,
+				&attach.DeviceNumber, sizeof(attach.DeviceNumber), NULL, 0, NULL)))
+				churn->Failed++;
+			churn->Calls += 2;
+		}
+
+		//
+		// The walk ends with the call that finds no more devices.
+		//
+		for (code = IOCTL_CPM_GET_DEVICE_FIRST;; code = IOCTL_CPM_GET_DEVICE_NEXT)
+		{
+			churn->Calls++;
+			if (!NT_SUCCESS(Call(Control, request, WdfRequestTypeDeviceControl, churn->FileObject, code, NULL, 0,
+				info, sizeof(info), NULL)))
+				break;
+		}
+	}
+	WdfStubRequestDelete(request);
+	return NULL;
+}
+
+static BOOLEAN GetStats(WDFREQUEST Request, PSTATS_HEADER *Header)
+{
+	static UCHAR buffer[sizeof(STATS_HEADER) + CPMSTORM_MAX_PORTS * sizeof(PORT_STATS)];
+	NTSTATUS status;
+
+	status = Call(Control, Request, WdfRequestTypeDeviceControl, Listeners[0].FileObject, IOCTL_CPM_GET_STATS, NULL, 0,
+		buffer, sizeof(buffer), NULL);
+	*Header = (PSTATS_HEADER)buffer;
+	return NT_SUCCESS(status) && (*Header)->PortCount <= CPMSTORM_MAX_PORTS;
+}
+
+static VOID Report(double Elapsed, ULONG64 Sent, ULONG64 Records, ULONG64 Bytes, PSTATS_HEADER Header, PWDFSTUB_STATS Ports,
+	PWDFSTUB_STATS Setup)
+{
+	WDFSTUB_LOCK_STATS locks[WDFSTUB_MAX_LOCK_CLASSES];
+	WDFSTUB_STATS stats;
+	PPORT_STATS ports = (PPORT_STATS)(Header + 1);
+	ULONG64 requests = 0, captureDrops = 0, deliveryDrops = 0, bytes = 0;
+	ULONG count, i;
+
+	WdfStubGetStats(&stats);
+	count = WdfStubGetLockStats(locks, WDFSTUB_MAX_LOCK_CLASSES);
+	for (i = 0; i < Header->PortCount; i++)
+	{
+		requests += ports[i].Requests[IRP_MJ_READ] + ports[i].Requests[IRP_MJ_WRITE];
+		captureDrops += ports[i].CaptureDrops;
+		deliveryDrops += ports[i].DeliveryDrops;
+		bytes += ports[i].BytesRead + ports[i].BytesWritten;
+	}
+
+	//
+	// A record dropped in the capture ring is lost to every listener, one
+	// dropped in the ring of a listener only to that one.
+	//
+	printf("%lu ports, %lu listeners, %llu IRPs of ", (unsigned long)PortCount, (unsigned long)ListenerCount, (unsigned long long)Sent);
+	if (Chunks == StormModbus)
+		printf("Modbus chunks");
+	else if (Chunks == StormMixed)
+		printf("1 byte in runs");
+	else
+		printf("%lu bytes", (unsigned long)Size);
+	if (Coalesce != 0)
+		printf(" coalesced up to %lu bytes", (unsigned long)Coalesce);
+	printf(" in %.3f s\n", Elapsed);
+
+	//
+	// Merged records are dropped whole, only the bytes tell the share of
+	// the traffic lost.
+	//
+	if (Coalesce == 0)
+	{
+		printf("%.0f records/s delivered, %llu of %llu records\n", Records / Elapsed, (unsigned long long)Records,
+			(unsigned long long)(requests * ListenerCount));
+		printf("%.2f%% capture drops, %.2f%% delivery drops, %.2f%% lost\n",
+			requests != 0 ? 100.0 * captureDrops / requests : 0.0,
+			requests != captureDrops ? 100.0 * deliveryDrops / ((requests - captureDrops) * ListenerCount) : 0.0,
+			requests != 0 ? 100.0 - 100.0 * Records / (requests * ListenerCount) : 0.0);
+	}
+	else
+	{
+		printf("%.0f records/s delivered, %llu records, %.2f IRPs per record\n", Records / Elapsed, (unsigned long long)Records,
+			Records != 0 ? (double)requests * ListenerCount / Records : 0.0);
+		printf("%llu capture drops, %llu delivery drops, %.2f%% of the bytes lost\n", (unsigned long long)captureDrops,
+			(unsigned long long)deliveryDrops, bytes != 0 ? 100.0 - 100.0 * Bytes / (bytes * ListenerCount) : 0.0);
+	}
+	printf("%.0f IRPs/s\n", Sent / Elapsed);
+	printf("%.3f objects, %.3f allocations, %.3f lookaside hits, %.3f work items, %.3f timers per IRP\n",
+		(double)stats.Objects / Sent, (double)stats.Allocations / Sent, (double)stats.LookasideHits / Sent,
+		(double)stats.WorkItems / Sent, (double)stats.Timers / Sent);
+	printf("%.3f bytes allocated per byte captured, %llu bytes allocated at setup, %llu of them per listener\n",
+		bytes != 0 ? (double)stats.AllocatedBytes / bytes : 0.0, (unsigned long long)Setup->AllocatedBytes,
+		(unsigned long long)((Setup->AllocatedBytes - Ports->AllocatedBytes) / ListenerCount));
+	if (Churning)
+		printf("%llu attach, detach and device list calls, %.3f allocations and %.3f lookaside hits per call\n",
+			(unsigned long long)Churn.Calls, Churn.Calls != 0 ? (double)stats.Allocations / Churn.Calls : 0.0,
+			Churn.Calls != 0 ? (double)stats.LookasideHits / Churn.Calls : 0.0);
+	printf("\n");
+
+	printf("%-26s %6s %12s %8s %10s %10s %12s %10s\n", "lock", "locks", "acquired", "per IRP", "contended", "avg ns", "max ns", "wait ms");
+	for (i = 0; i < count; i++)
+	{
+		if (locks[i].Acquisitions == 0)
+			continue;
+
+		printf("%-26s %6lu %12llu %8.3f %9.2f%% %10.0f %12llu %10.1f\n", locks[i].Name, (unsigned long)locks[i].Locks,
+			(unsigned long long)locks[i].Acquisitions, (double)locks[i].Acquisitions / Sent,
+			100.0 * locks[i].Contended / locks[i].Acquisitions, (double)locks[i].HoldTime / locks[i].Acquisitions,
+			(unsigned long long)locks[i].MaxHoldTime, locks[i].WaitTime / 1e6);
+	}
+}
+
+int main(int argc, char **argv)
+{
+	WCHAR name[32];
+	ATTACH_INFO attach;
+	PSTATS_HEADER header;
+	PPORT_STATS stats;
+	COALESCE_CONFIG coalesce;
+	WDFSTUB_STATS ports, setup;
+	WDFREQUEST request = NULL;
+	ULONG64 sent = 0, failed = 0, records, expected = 0, bytes, expectedBytes = 0, drops = 0, last = 0;
+	ULONG workers = (ULONG)sysconf(_SC_NPROCESSORS_ONLN), i, j;
+	double start, changed, elapsed;
+	int option, result = 1;
+	BOOLEAN loaded = FALSE, done;
+
+	while ((option = getopt(argc, argv, "p:l:n:s:c:am:w:d:")) != -1)
+	{
+		switch (option)
+		{
+		case 'p':
+			PortCount = strtoul(optarg, NULL, 0);
+			break;
+		case 'l':
+			ListenerCount = strtoul(optarg, NULL, 0);
+			break;
+		case 'n':
+			Irps = strtoull(optarg, NULL, 0);
+			break;
+		case 's':
+			if (strcmp(optarg, "modbus") == 0)
+				Chunks = StormModbus;
+			else if (strcmp(optarg, "mixed") == 0)
+				Chunks = StormMixed;
+			else
+				Size = strtoul(optarg, NULL, 0);
+			break;
+		case 'c':
+			Coalesce = strtoul(optarg, NULL, 0);
+			break;
+		case 'a':
+			Churning = TRUE;
+			break;
+		case 'm':
+			if (strcmp(optarg, "read") == 0)
+				Mode = StormRead;
+			else if (strcmp(optarg, "batch") == 0)
+				Mode = StormBatch;
+			else if (strcmp(optarg, "direct") == 0)
+				Mode = StormDirect;
+			else
+				return Usage();
+			break;
+		case 'w':
+			workers = strtoul(optarg, NULL, 0);
+			break;
+		case 'd':
+			MaxLoss = strtod(optarg, NULL);
+			break;
+		default:
+			return Usage();
+		}
+	}
+	if (optind != argc || PortCount == 0 || PortCount > CPMSTORM_MAX_PORTS || ListenerCount == 0 ||
+		ListenerCount > CPMSTORM_MAX_LISTENERS || Irps == 0 || Size > CPMSTORM_BUFFER_SIZE / 2 || MaxLoss < 0)
+		return Usage();
+
+	if (!NT_SUCCESS(WdfStubLoad(workers != 0 ? workers : 1)))
+	{
+		fprintf(stderr, "the driver does not load\n");
+		return 1;
+	}
+	loaded = TRUE;
+
+	//
+	// The control device is a root device of its own, the ports are the
+	// serial devices the filter is attached to.
+	//
+	if (!NT_SUCCESS(WdfStubAddDevice(L"Root\\ComPortMonitor", NULL, &Control)) ||
+		!NT_SUCCESS(WdfStubRequestCreate(&request)))
+	{
+		fprintf(stderr, "the control device does not start\n");
+		goto Exit;
+	}
+	for (i = 0; i < PortCount; i++)
+	{
+		swprintf(name, sizeof(name) / sizeof(name[0]), L"\\Device\\Serial%lu", (unsigned long)i);
+		if (!NT_SUCCESS(WdfStubAddDevice(L"ACPI\\PNP0501", name, &Ports[i].Device)) ||
+			!NT_SUCCESS(WdfStubFileOpen(Ports[i].Device, &Ports[i].FileObject)))
+		{
+			fprintf(stderr, "port %lu does not start\n", (unsigned long)i);
+			goto Exit;
+		}
+		WdfStubSetLowerDriver(Ports[i].Device, LowerDriver, NULL);
+	}
+	if (Churning && !NT_SUCCESS(WdfStubFileOpen(Control, &Churn.FileObject)))
+	{
+		fprintf(stderr, "the churning client does not open\n");
+		goto Exit;
+	}
+
+	WdfStubGetStats(&ports);
+	for (i = 0; i < ListenerCount; i++)
+	{
+		if (!NT_SUCCESS(WdfStubFileOpen(Control, &Listeners[i].FileObject)))
+		{
+			fprintf(stderr, "listener %lu does not open\n", (unsigned long)i);
+			goto Exit;
+		}
+	}
+
+	if (!GetStats(request, &header) || header->PortCount != PortCount)
+	{
+		fprintf(stderr, "the control device does not list the ports\n");
+		goto Exit;
+	}
+	stats = (PPORT_STATS)(header + 1);
+	for (i = 0; i < PortCount; i++)
+		Ports[i].Number = stats[i].DeviceNumber;
+
+	for (i = 0; i < ListenerCount; i++)
+	{
+		for (j = 0; j < PortCount; j++)
+		{
+			attach.DeviceNumber = Ports[j].Number;
+			attach.EventMask = ATTACH_EVENT_READ | ATTACH_EVENT_WRITE;
+			attach.SnapLength = ATTACH_SNAP_ALL;
+			if (!NT_SUCCESS(Call(Control, request, WdfRequestTypeDeviceControl, Listeners[i].FileObject, IOCTL_CPM_ATTACH_EX,
+				&attach, sizeof(attach), NULL, 0, NULL)))
+			{
+				fprintf(stderr, "listener %lu does not attach to port %lu\n", (unsigned long)i, (unsigned long)Ports[j].Number);
+				goto Exit;
+			}
+		}
+	}
+
+	for (i = 0; i < PortCount && Coalesce != 0; i++)
+	{
+		coalesce.DeviceNumber = Ports[i].Number;
+		coalesce.MaxBytes = Coalesce;
+		coalesce.IdleGap = CPMSTORM_IDLE_GAP;
+		if (!NT_SUCCESS(Call(Control, request, WdfRequestTypeDeviceControl, Listeners[0].FileObject, IOCTL_CPM_SET_COALESCING,
+			&coalesce, sizeof(coalesce), NULL, 0, NULL)))
+		{
+			fprintf(stderr, "port %lu does not take the coalescing setting\n", (unsigned long)Ports[i].Number);
+			goto Exit;
+		}
+	}
+
+	WdfStubGetStats(&setup);
+	WdfStubResetStats();
+	start = Now();
+	for (i = 0; i < ListenerCount; i++)
+		pthread_create(&Listeners[i].Thread, NULL, Consumer, &Listeners[i]);
+	if (Churning)
+		pthread_create(&Churn.Thread, NULL, Churner, &Churn);
+	for (i = 0; i < PortCount; i++)
+		pthread_create(&Ports[i].Thread, NULL, Producer, &Ports[i]);
+	for (i = 0; i < PortCount; i++)
+	{
+		pthread_join(Ports[i].Thread, NULL);
+		sent += Ports[i].Sent;
+		failed += Ports[i].Failed;
+	}
+
+	//
+	// Once the work items are done every record is in a listener's ring,
+	// or was dropped, and the drops are known.
+	//
+	WdfStubWaitForIdle();
+	if (!GetStats(request, &header))
+	{
+		fprintf(stderr, "the control device does not return the statistics\n");
+		Stop = 1;
+		if (Churning)
+			pthread_join(Churn.Thread, NULL);
+		goto Join;
+	}
+	stats = (PPORT_STATS)(header + 1);
+	for (i = 0; i < header->PortCount; i++)
+	{
+		expected += ListenerCount * (stats[i].Requests[IRP_MJ_READ] + stats[i].Requests[IRP_MJ_WRITE] - stats[i].CaptureDrops) -
+			stats[i].DeliveryDrops;
+		expectedBytes += ListenerCount * (stats[i].BytesRead + stats[i].BytesWritten);
+		drops += stats[i].CaptureDrops + stats[i].DeliveryDrops;
+	}
+
+	//
+	// With coalescing and drops nothing tells how many bytes are still to
+	// come, the run ends once the listeners have taken none for a while.
+	//
+	changed = Now();
+	do
+	{
+		usleep(100);
+		for (i = 0, records = 0, bytes = 0; i < ListenerCount; i++)
+		{
+			records += __atomic_load_n(&Listeners[i].Records, __ATOMIC_RELAXED);
+			bytes += __atomic_load_n(&Listeners[i].Bytes, __ATOMIC_RELAXED);
+		}
+		if (bytes != last)
+		{
+			last = bytes;
+			changed = Now();
+		}
+		if (Coalesce == 0)
+			done = records >= expected;
+		else if (drops == 0)
+			done = bytes >= expectedBytes;
+		else
+			done = Now() - changed >= CPMSTORM_QUIET;
+	} while (!done && Now() - start < CPMSTORM_TIMEOUT);
+	elapsed = changed - start;
+
+	Stop = 1;
+	if (Churning)
+		pthread_join(Churn.Thread, NULL);
+	Report(elapsed, sent, records, bytes, header, &ports, &setup);
+	for (i = 0; i < header->PortCount; i++)
+	{
+		if (stats[i].CaptureDrops != 0 || stats[i].DeliveryDrops != 0)
+			printf("port %lu: %llu capture drops, %llu delivery drops\n", (unsigned long)stats[i].DeviceNumber,
+				(unsigned long long)stats[i].CaptureDrops, (unsigned long long)stats[i].DeliveryDrops);
+	}
+	if (failed != 0 || (Coalesce == 0 && records != expected))
+		fprintf(stderr, "%llu IRPs failed, %llu records delivered of %llu\n", (unsigned long long)failed,
+			(unsigned long long)records, (unsigned long long)expected);
+	else if (Coalesce != 0 && drops == 0 && bytes != expectedBytes)
+		fprintf(stderr, "%llu bytes delivered of %llu\n", (unsigned long long)bytes, (unsigned long long)expectedBytes);
+	else if (100.0 * (expectedBytes - bytes) > MaxLoss * expectedBytes)
+		fprintf(stderr, "%llu of %llu bytes lost, more than %g%%\n", (unsigned long long)(expectedBytes - bytes),
+			(unsigned long long)expectedBytes, MaxLoss);
+	else
+		result = 0;
+
+Join:
+	//
+	// The cleanup of the handles cancels the reads the listeners have
+	// parked, which lets their threads go.
+	//
+	for (i = 0; i < ListenerCount; i++)
+		WdfStubFileCleanup(Listeners[i].FileObject);
+	for (i = 0; i < ListenerCount; i++)
+	{
+		pthread_join(Listeners[i].Thread, NULL);
+		if (Listeners[i].Failed != 0)
+		{
+			fprintf(stderr, "listener %lu: %llu reads failed\n", (unsigned long)i, (unsigned long long)Listeners[i].Failed);
+			result = 1;
+		}
+		if (Listeners[i].Malformed != 0)
+		{
+			fprintf(stderr, "listener %lu: %llu records with wrong offsets\n", (unsigned long)i,
+				(unsigned long long)Listeners[i].Malformed);
+			result = 1;
+		}
+	}
+	if (Churn.Failed != 0)
+	{
+		fprintf(stderr, "%llu attach, detach or device list calls failed\n", (unsigned long long)Churn.Failed);
+		result = 1;
+	}
+
+Exit:
+	if (request != NULL)
+		WdfStubRequestDelete(request);
+	for (i = 0; i < ListenerCount; i++)
+	{
+		if (Listeners[i].FileObject != NULL)
+			WdfStubFileClose(Listeners[i].FileObject);
+	}
+	if (Churn.FileObject != NULL)
+		WdfStubFileClose(Churn.FileObject);
+	for (i = 0; i < PortCount; i++)
+	{
+		if (Ports[i].FileObject != NULL)
+			WdfStubFileClose(Ports[i].FileObject);
+	}
+	if (loaded)
+		WdfStubUnload();
+	return result;
+}
@@ -0,0 +1,2326 @@
+/*++
+
+Module Name:
+
+    wdf.c
+
+Abstract:
+
+    This file contains the user-mode implementation of the framework and
+    NT calls the driver makes, see wdf.h, and the harness around it, see
+    wdfstub.h.
+
+    Every object starts with STUB_OBJECT. Objects are deleted as the
+    framework deletes them: the cleanup callbacks run first, the children
+    before their parent, then the memory of the whole tree is released,
+    so a parent's cleanup can still use the locks it owns. Contexts
+    follow the object in a list, each preceded by a STUB_CONTEXT that
+    leads back to it.
+
+Environment:
+
+    User mode
+
+--*/
+
+#define _GNU_SOURCE
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <wctype.h>
+#include <pthread.h>
+#include <sched.h>
+#include <time.h>
+#include <unistd.h>
+#include "WdfStub.h"
+#include "ntifs.h"
+
+#define STUB_ALIGNMENT			64
+#define STUB_LOOKASIDE_DEPTH	256
+
+typedef enum _STUB_OBJECT_TYPE
+{
+	StubDriver,
+	StubDevice,
+	StubFileObject,
+	StubQueue,
+	StubRequest,
+	StubIoTarget,
+	StubMemory,
+	StubLookaside,
+	StubCollection,
+	StubLock,
+	StubWorkItem,
+	StubTimer,
+
+} STUB_OBJECT_TYPE;
+
+typedef struct _STUB_CONTEXT
+{
+	struct _STUB_CONTEXT *Next;
+	struct _STUB_OBJECT *Object;
+	PCWDF_OBJECT_CONTEXT_TYPE_INFO TypeInfo;
+	PFN_WDF_OBJECT_CONTEXT_CLEANUP EvtCleanupCallback;
+	PFN_WDF_OBJECT_CONTEXT_DESTROY EvtDestroyCallback;
+
+} __attribute__((aligned(16))) STUB_CONTEXT, *PSTUB_CONTEXT;
+
+typedef struct _STUB_OBJECT
+{
+	STUB_OBJECT_TYPE Type;
+	LONG References;
+	BOOLEAN Embedded;			// part of another object, never deleted by itself
+	BOOLEAN Deleted;			// the cleanup ran
+	struct _STUB_OBJECT *Parent;
+	LIST_ENTRY Children;		// newest first
+	LIST_ENTRY Sibling;
+	PSTUB_CONTEXT Contexts;
+	PFN_WDF_OBJECT_CONTEXT_CLEANUP EvtCleanupCallback;
+	PFN_WDF_OBJECT_CONTEXT_DESTROY EvtDestroyCallback;
+
+} STUB_OBJECT, *PSTUB_OBJECT;
+
+typedef struct _STUB_LOCK_CLASS
+{
+	char Name[32];
+	ULONG Locks;
+	ULONG64 Acquisitions;
+	ULONG64 Contended;
+	ULONG64 WaitTime;
+	ULONG64 HoldTime;
+	ULONG64 MaxHoldTime;
+
+} STUB_LOCK_CLASS, *PSTUB_LOCK_CLASS;
+
+typedef struct _STUB_LOCK
+{
+	STUB_OBJECT Header;
+	pthread_mutex_t Mutex;
+	PSTUB_LOCK_CLASS Class;
+	ULONG64 Acquired;
+	KIRQL OldIrql;				// of a spin lock
+
+} STUB_LOCK, *PSTUB_LOCK;
+
+struct WDFWAITLOCK__
+{
+	STUB_LOCK Lock;
+};
+
+struct WDFSPINLOCK__
+{
+	STUB_LOCK Lock;
+};
+
+struct WDFDRIVER__
+{
+	STUB_OBJECT Header;
+	PFN_WDF_DRIVER_DEVICE_ADD EvtDriverDeviceAdd;
+};
+
+struct WDFDEVICE_INIT
+{
+	PCWSTR HardwareId;
+	PCWSTR LowerName;
+	BOOLEAN Filter;
+	BOOLEAN FileObjectConfigured;
+	WDF_FILEOBJECT_CONFIG FileObjectConfig;
+	WDF_OBJECT_ATTRIBUTES FileObjectAttributes;
+	PFN_WDF_IO_IN_CALLER_CONTEXT EvtIoInCallerContext;
+	WDFDEVICE Device;
+};
+
+struct WDFIOTARGET__
+{
+	STUB_OBJECT Header;
+	WDFDEVICE Device;
+};
+
+struct WDFDEVICE__
+{
+	STUB_OBJECT Header;
+	BOOLEAN Filter;
+	WDF_FILEOBJECT_CONFIG FileObjectConfig;
+	WDF_OBJECT_ATTRIBUTES FileObjectAttributes;
+	PFN_WDF_IO_IN_CALLER_CONTEXT EvtIoInCallerContext;
+	WDFQUEUE DefaultQueue;
+	struct WDFIOTARGET__ Target;
+	DEVICE_OBJECT Lower;
+	PFN_WDFSTUB_LOWER_DRIVER LowerDriver;
+	PVOID LowerContext;
+};
+
+struct WDFFILEOBJECT__
+{
+	STUB_OBJECT Header;
+	WDFDEVICE Device;
+	BOOLEAN CleanedUp;
+};
+
+struct WDFQUEUE__
+{
+	STUB_OBJECT Header;
+	WDFDEVICE Device;
+	WDF_IO_QUEUE_CONFIG Config;
+	pthread_mutex_t Lock;		// the list, or the callbacks of a sequential queue
+	LIST_ENTRY Requests;
+	BOOLEAN Purged;
+};
+
+struct WDFMEMORY__
+{
+	STUB_OBJECT Header;
+	PVOID Buffer;
+	size_t Length;
+	WDFLOOKASIDE Lookaside;
+	struct WDFMEMORY__ *Next;	// in the free list of Lookaside
+};
+
+struct WDFLOOKASIDE__
+{
+	STUB_OBJECT Header;
+	size_t BufferSize;
+	pthread_mutex_t Lock;
+	struct WDFMEMORY__ *Free;
+	ULONG FreeCount;
+};
+
+struct WDFCOLLECTION__
+{
+	STUB_OBJECT Header;
+	WDFOBJECT *Items;
+	ULONG Count;
+	ULONG Capacity;
+};
+
+struct WDFWORKITEM__
+{
+	STUB_OBJECT Header;
+	PFN_WDF_WORKITEM EvtWorkItemFunc;
+	LIST_ENTRY Link;
+	BOOLEAN Queued;
+	ULONG Running;
+};
+
+struct WDFTIMER__
+{
+	STUB_OBJECT Header;
+	PFN_WDF_TIMER EvtTimerFunc;
+	LIST_ENTRY Link;
+	ULONG64 Due;
+	BOOLEAN Armed;
+	ULONG Running;
+	KIRQL Irql;
+};
+
+struct WDFREQUEST__
+{
+	STUB_OBJECT Header;
+	WDF_REQUEST_PARAMETERS Parameters;
+	WDFFILEOBJECT FileObject;
+	WDFQUEUE Queue;				// delivered from, or parked in
+	LIST_ENTRY Link;
+	BOOLEAN Parked;
+	struct WDFMEMORY__ Input;
+	struct WDFMEMORY__ Output;
+	PVOID CallerOutput;			// where the system buffer goes back to
+	size_t CallerOutputLength;
+	PVOID SystemBuffer;
+	size_t SystemBufferSize;
+	PFN_WDF_REQUEST_COMPLETION_ROUTINE CompletionRoutine;
+	WDFCONTEXT CompletionContext;
+	IRP Irp;
+	NTSTATUS Status;
+	ULONG_PTR Information;
+	BOOLEAN Completed;
+	pthread_mutex_t Lock;
+	pthread_cond_t Done;
+};
+
+const UNICODE_STRING SDDL_DEVOBJ_SYS_ALL_ADM_RWX_WORLD_RWX_RES_RWX =
+{
+	sizeof(L"D:P(A;;GA;;;SY)(A;;GRGWGX;;;BA)(A;;GRGWGX;;;WD)(A;;GRGWGX;;;RC)") - sizeof(WCHAR),
+	sizeof(L"D:P(A;;GA;;;SY)(A;;GRGWGX;;;BA)(A;;GRGWGX;;;WD)(A;;GRGWGX;;;RC)"),
+	(PWCH)L"D:P(A;;GA;;;SY)(A;;GRGWGX;;;BA)(A;;GRGWGX;;;WD)(A;;GRGWGX;;;RC)"
+};
+
+DRIVER_INITIALIZE DriverEntry;
+
+static DRIVER_OBJECT WdmDriverObject;
+static WDFDRIVER DriverHandle;
+
+//
+// Guards the links between parents and children.
+//
+static pthread_mutex_t ObjectsLock = PTHREAD_MUTEX_INITIALIZER;
+
+static STUB_LOCK_CLASS LockClasses[WDFSTUB_MAX_LOCK_CLASSES];
+static ULONG LockClassCount;
+static pthread_mutex_t LockClassesLock = PTHREAD_MUTEX_INITIALIZER;
+
+static WDFSTUB_STATS StubStats;
+
+//
+// The IRQL of the thread, DISPATCH_LEVEL while it holds a spin lock or
+// runs a timer that is not passive.
+//
+static __thread KIRQL StubIrql;
+
+static pthread_mutex_t WorkLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t WorkReady = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t WorkDone = PTHREAD_COND_INITIALIZER;
+static LIST_ENTRY WorkQueue;
+static ULONG WorkRunning;
+static BOOLEAN WorkStop;
+static pthread_t *WorkerThreads;
+static ULONG WorkerCount;
+
+static pthread_mutex_t TimerLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t TimerChanged;
+static pthread_cond_t TimerDone = PTHREAD_COND_INITIALIZER;
+static LIST_ENTRY TimerQueue;
+static ULONG TimerRunning;
+static BOOLEAN TimerStop;
+static pthread_t TimerThread;
+
+static ULONG ProcessorCount;
+
+static VOID StubDispatch(WDFQUEUE Queue, WDFREQUEST Request);
+
+//
+// Time and memory.
+//
+static ULONG64 StubNow(VOID)
+{
+	struct timespec now;
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (ULONG64)now.tv_sec * 1000000000 + (ULONG64)now.tv_nsec;
+}
+
+static PVOID StubAllocate(size_t Size)
+/*++
+
+Routine Description:
+
+    Allocates zeroed memory for the driver, counted as a pool allocation.
+
+--*/
+{
+	PVOID buffer;
+
+	if (posix_memalign(&buffer, STUB_ALIGNMENT, Size != 0 ? Size : 1) != 0)
+		return NULL;
+
+	memset(buffer, 0, Size);
+	__atomic_fetch_add(&StubStats.Allocations, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&StubStats.AllocatedBytes, Size, __ATOMIC_RELAXED);
+	return buffer;
+}
+
+//
+// Objects.
+//
+static PVOID StubObjectCreate(STUB_OBJECT_TYPE Type, size_t Size, PWDF_OBJECT_ATTRIBUTES Attributes, PVOID DefaultParent)
+/*++
+
+Routine Description:
+
+    Creates an object of the driver with the context and the callbacks of
+    Attributes, under their parent or DefaultParent.
+
+--*/
+{
+	PSTUB_OBJECT object, parent;
+	PSTUB_CONTEXT context;
+	size_t contextSize;
+
+	object = StubAllocate(Size);
+	if (object == NULL)
+		return NULL;
+
+	object->Type = Type;
+	object->References = 1;
+	InitializeListHead(&object->Children);
+	InitializeListHead(&object->Sibling);
+	if (Attributes != NULL)
+	{
+		object->EvtCleanupCallback = Attributes->EvtCleanupCallback;
+		object->EvtDestroyCallback = Attributes->EvtDestroyCallback;
+		if (Attributes->ContextTypeInfo != NULL)
+		{
+			contextSize = Attributes->ContextSizeOverride != 0 ?
+				Attributes->ContextSizeOverride : Attributes->ContextTypeInfo->ContextSize;
+			context = StubAllocate(sizeof(*context) + contextSize);
+			if (context == NULL)
+			{
+				free(object);
+				return NULL;
+			}
+			context->Object = object;
+			context->TypeInfo = Attributes->ContextTypeInfo->UniqueType;
+			object->Contexts = context;
+		}
+	}
+
+	parent = Attributes != NULL && Attributes->ParentObject != NULL ? Attributes->ParentObject : DefaultParent;
+	if (parent != NULL)
+	{
+		pthread_mutex_lock(&ObjectsLock);
+		object->Parent = parent;
+		InsertHeadList(&parent->Children, &object->Sibling);
+		pthread_mutex_unlock(&ObjectsLock);
+	}
+	__atomic_fetch_add(&StubStats.Objects, 1, __ATOMIC_RELAXED);
+	return object;
+}
+
+static VOID StubEmbed(PSTUB_OBJECT Object, STUB_OBJECT_TYPE Type)
+{
+	memset(Object, 0, sizeof(*Object));
+	Object->Type = Type;
+	Object->References = 1;
+	Object->Embedded = TRUE;
+	InitializeListHead(&Object->Children);
+	InitializeListHead(&Object->Sibling);
+}
+
+static VOID StubFreeContexts(PSTUB_OBJECT Object)
+{
+	PSTUB_CONTEXT context, next;
+
+	for (context = Object->Contexts; context != NULL; context = next)
+	{
+		next = context->Next;
+		if (context->EvtDestroyCallback != NULL)
+			context->EvtDestroyCallback(Object);
+		free(context);
+	}
+	Object->Contexts = NULL;
+}
+
+static VOID StubFree(PSTUB_OBJECT Object)
+/*++
+
+Routine Description:
+
+    Releases the memory of an object once its last reference is gone.
+    A lookaside buffer goes back to its list.
+
+--*/
+{
+	WDFMEMORY memory;
+	WDFLOOKASIDE lookaside;
+
+	StubFreeContexts(Object);
+	switch (Object->Type)
+	{
+	case StubQueue:
+		pthread_mutex_destroy(&((WDFQUEUE)Object)->Lock);
+		break;
+	case StubLock:
+		pthread_mutex_destroy(&((PSTUB_LOCK)Object)->Mutex);
+		__atomic_fetch_sub(&((PSTUB_LOCK)Object)->Class->Locks, 1, __ATOMIC_RELAXED);
+		break;
+	case StubCollection:
+		while (((WDFCOLLECTION)Object)->Count != 0)
+			WdfObjectDereference(((WDFCOLLECTION)Object)->Items[--((WDFCOLLECTION)Object)->Count]);
+		free(((WDFCOLLECTION)Object)->Items);
+		break;
+	case StubLookaside:
+		lookaside = (WDFLOOKASIDE)Object;
+		while ((memory = lookaside->Free) != NULL)
+		{
+			lookaside->Free = memory->Next;
+			free(memory->Buffer);
+			free(memory);
+		}
+		pthread_mutex_destroy(&lookaside->Lock);
+		break;
+	case StubMemory:
+		memory = (WDFMEMORY)Object;
+		lookaside = memory->Lookaside;
+		if (lookaside != NULL)
+		{
+			pthread_mutex_lock(&lookaside->Lock);
+			if (lookaside->FreeCount < STUB_LOOKASIDE_DEPTH)
+			{
+				memory->Next = lookaside->Free;
+				lookaside->Free = memory;
+				lookaside->FreeCount++;
+				memory = NULL;
+			}
+			pthread_mutex_unlock(&lookaside->Lock);
+			WdfObjectDereference(lookaside);
+			if (memory == NULL)
+				return;
+		}
+		free(memory->Buffer);
+		break;
+	case StubRequest:
+		free(((WDFREQUEST)Object)->SystemBuffer);
+		pthread_mutex_destroy(&((WDFREQUEST)Object)->Lock);
+		pthread_cond_destroy(&((WDFREQUEST)Object)->Done);
+		break;
+	default:
+		break;
+	}
+	free(Object);
+}
+
+static VOID StubDispose(PSTUB_OBJECT Object)
+/*++
+
+Routine Description:
+
+    Stops what an object being deleted does on its own: a work item or a
+    timer is taken off its queue and waited for, a queue is purged.
+
+--*/
+{
+	WDFWORKITEM workItem;
+	WDFTIMER timer;
+
+	switch (Object->Type)
+	{
+	case StubWorkItem:
+		workItem = (WDFWORKITEM)Object;
+		pthread_mutex_lock(&WorkLock);
+		if (workItem->Queued)
+		{
+			RemoveEntryList(&workItem->Link);
+			workItem->Queued = FALSE;
+		}
+		while (workItem->Running != 0)
+			pthread_cond_wait(&WorkDone, &WorkLock);
+		pthread_mutex_unlock(&WorkLock);
+		break;
+	case StubTimer:
+		timer = (WDFTIMER)Object;
+		WdfTimerStop(timer, TRUE);
+		break;
+	case StubQueue:
+		WdfIoQueuePurgeSynchronously((WDFQUEUE)Object);
+		break;
+	default:
+		break;
+	}
+}
+
+static VOID StubCleanup(PSTUB_OBJECT Object)
+{
+	PLIST_ENTRY entry;
+	PSTUB_OBJECT child;
+	PSTUB_CONTEXT context;
+
+	Object->Deleted = TRUE;
+	for (;;)
+	{
+		child = NULL;
+		pthread_mutex_lock(&ObjectsLock);
+		for (entry = Object->Children.Flink; entry != &Object->Children; entry = entry->Flink)
+		{
+			child = CONTAINING_RECORD(entry, STUB_OBJECT, Sibling);
+			if (!child->Deleted)
+				break;
+			child = NULL;
+		}
+		pthread_mutex_unlock(&ObjectsLock);
+		if (child == NULL)
+			break;
+		StubCleanup(child);
+	}
+
+	StubDispose(Object);
+	if (Object->EvtCleanupCallback != NULL)
+		Object->EvtCleanupCallback(Object);
+	for (context = Object->Contexts; context != NULL; context = context->Next)
+		if (context->EvtCleanupCallback != NULL)
+			context->EvtCleanupCallback(Object);
+}
+
+static VOID StubDestroy(PSTUB_OBJECT Object)
+{
+	PSTUB_OBJECT child;
+
+	for (;;)
+	{
+		pthread_mutex_lock(&ObjectsLock);
+		child = IsListEmpty(&Object->Children) ? NULL : CONTAINING_RECORD(Object->Children.Flink, STUB_OBJECT, Sibling);
+		pthread_mutex_unlock(&ObjectsLock);
+		if (child == NULL)
+			break;
+		StubDestroy(child);
+	}
+
+	if (Object->EvtDestroyCallback != NULL)
+		Object->EvtDestroyCallback(Object);
+	pthread_mutex_lock(&ObjectsLock);
+	RemoveEntryList(&Object->Sibling);
+	InitializeListHead(&Object->Sibling);
+	pthread_mutex_unlock(&ObjectsLock);
+	WdfObjectDereference(Object);
+}
+
+VOID WdfObjectDelete(WDFOBJECT Object)
+{
+	PSTUB_OBJECT object = Object;
+
+	if (object == NULL || object->Embedded || object->Deleted)
+		return;
+
+	StubCleanup(object);
+	StubDestroy(object);
+}
+
+VOID WdfObjectReference(WDFOBJECT Handle)
+{
+	__atomic_fetch_add(&((PSTUB_OBJECT)Handle)->References, 1, __ATOMIC_RELAXED);
+}
+
+VOID WdfObjectDereference(WDFOBJECT Handle)
+{
+	PSTUB_OBJECT object = Handle;
+
+	if (__atomic_sub_fetch(&object->References, 1, __ATOMIC_ACQ_REL) == 0 && !object->Embedded)
+		StubFree(object);
+}
+
+PVOID WdfObjectGetTypedContextWorker(WDFOBJECT Handle, PCWDF_OBJECT_CONTEXT_TYPE_INFO TypeInfo)
+{
+	PSTUB_CONTEXT context;
+
+	for (context = __atomic_load_n(&((PSTUB_OBJECT)Handle)->Contexts, __ATOMIC_ACQUIRE); context != NULL; context = context->Next)
+		if (context->TypeInfo == TypeInfo)
+			return context + 1;
+	return NULL;
+}
+
+WDFOBJECT WdfObjectContextGetObject(PVOID ContextPointer)
+{
+	return ((PSTUB_CONTEXT)ContextPointer - 1)->Object;
+}
+
+NTSTATUS WdfObjectAllocateContext(WDFOBJECT Handle, PWDF_OBJECT_ATTRIBUTES ContextAttributes, PVOID Context)
+{
+	PSTUB_OBJECT object = Handle;
+	PSTUB_CONTEXT context;
+	PVOID existing;
+	size_t contextSize;
+
+	if (ContextAttributes == NULL || ContextAttributes->ContextTypeInfo == NULL)
+		return STATUS_INVALID_PARAMETER;
+
+	existing = WdfObjectGetTypedContextWorker(Handle, ContextAttributes->ContextTypeInfo->UniqueType);
+	if (existing != NULL)
+	{
+		*(PVOID *)Context = existing;
+		return STATUS_OBJECT_NAME_EXISTS;
+	}
+
+	contextSize = ContextAttributes->ContextSizeOverride != 0 ?
+		ContextAttributes->ContextSizeOverride : ContextAttributes->ContextTypeInfo->ContextSize;
+	context = StubAllocate(sizeof(*context) + contextSize);
+	if (context == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	context->Object = object;
+	context->TypeInfo = ContextAttributes->ContextTypeInfo->UniqueType;
+	context->EvtCleanupCallback = ContextAttributes->EvtCleanupCallback;
+	context->EvtDestroyCallback = ContextAttributes->EvtDestroyCallback;
+	pthread_mutex_lock(&ObjectsLock);
+	context->Next = object->Contexts;
+	__atomic_store_n(&object->Contexts, context, __ATOMIC_RELEASE);
+	pthread_mutex_unlock(&ObjectsLock);
+	*(PVOID *)Context = context + 1;
+	return STATUS_SUCCESS;
+}
+
+//
+// Driver and devices.
+//
+NTSTATUS WdfDriverCreate(PDRIVER_OBJECT DriverObject, PCUNICODE_STRING RegistryPath, PWDF_OBJECT_ATTRIBUTES DriverAttributes,
+	PWDF_DRIVER_CONFIG DriverConfig, WDFDRIVER *Driver)
+{
+	WDFDRIVER driver;
+
+	UNREFERENCED_PARAMETER(DriverObject);
+	UNREFERENCED_PARAMETER(RegistryPath);
+
+	driver = StubObjectCreate(StubDriver, sizeof(*driver), DriverAttributes, NULL);
+	if (driver == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	driver->EvtDriverDeviceAdd = DriverConfig->EvtDriverDeviceAdd;
+	DriverHandle = driver;
+	*Driver = driver;
+	return STATUS_SUCCESS;
+}
+
+VOID WdfFdoInitSetFilter(PWDFDEVICE_INIT DeviceInit)
+{
+	DeviceInit->Filter = TRUE;
+}
+
+NTSTATUS WdfFdoInitQueryProperty(PWDFDEVICE_INIT DeviceInit, DEVICE_REGISTRY_PROPERTY DeviceProperty, ULONG BufferLength,
+	PVOID PropertyBuffer, PULONG ResultLength)
+{
+	ULONG length;
+
+	if (DeviceProperty != DevicePropertyHardwareID || DeviceInit->HardwareId == NULL)
+		return STATUS_INVALID_PARAMETER;
+
+	//
+	// A REG_MULTI_SZ of the one ID.
+	//
+	length = (ULONG)((wcslen(DeviceInit->HardwareId) + 2) * sizeof(WCHAR));
+	*ResultLength = length;
+	if (BufferLength < length)
+		return STATUS_BUFFER_TOO_SMALL;
+
+	memset(PropertyBuffer, 0, length);
+	memcpy(PropertyBuffer, DeviceInit->HardwareId, length - 2 * sizeof(WCHAR));
+	return STATUS_SUCCESS;
+}
+
+VOID WdfDeviceInitSetExclusive(PWDFDEVICE_INIT DeviceInit, BOOLEAN IsExclusive)
+{
+	UNREFERENCED_PARAMETER(DeviceInit);
+	UNREFERENCED_PARAMETER(IsExclusive);
+}
+
+NTSTATUS WdfDeviceInitAssignName(PWDFDEVICE_INIT DeviceInit, PCUNICODE_STRING DeviceName)
+{
+	UNREFERENCED_PARAMETER(DeviceInit);
+	UNREFERENCED_PARAMETER(DeviceName);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfDeviceInitAssignSDDLString(PWDFDEVICE_INIT DeviceInit, PCUNICODE_STRING SDDLString)
+{
+	UNREFERENCED_PARAMETER(DeviceInit);
+	UNREFERENCED_PARAMETER(SDDLString);
+	return STATUS_SUCCESS;
+}
+
+VOID WdfDeviceInitSetDeviceType(PWDFDEVICE_INIT DeviceInit, ULONG DeviceType)
+{
+	UNREFERENCED_PARAMETER(DeviceInit);
+	UNREFERENCED_PARAMETER(DeviceType);
+}
+
+VOID WdfDeviceInitSetFileObjectConfig(PWDFDEVICE_INIT DeviceInit, PWDF_FILEOBJECT_CONFIG FileObjectConfig,
+	PWDF_OBJECT_ATTRIBUTES FileObjectAttributes)
+{
+	DeviceInit->FileObjectConfigured = TRUE;
+	DeviceInit->FileObjectConfig = *FileObjectConfig;
+	if (FileObjectAttributes != NULL)
+		DeviceInit->FileObjectAttributes = *FileObjectAttributes;
+	else
+		WDF_OBJECT_ATTRIBUTES_INIT(&DeviceInit->FileObjectAttributes);
+}
+
+VOID WdfDeviceInitSetIoInCallerContextCallback(PWDFDEVICE_INIT DeviceInit, PFN_WDF_IO_IN_CALLER_CONTEXT EvtIoInCallerContext)
+{
+	DeviceInit->EvtIoInCallerContext = EvtIoInCallerContext;
+}
+
+VOID WdfDeviceInitFree(PWDFDEVICE_INIT DeviceInit)
+{
+	//
+	// The harness owns the structure.
+	//
+	UNREFERENCED_PARAMETER(DeviceInit);
+}
+
+NTSTATUS WdfDeviceCreate(PWDFDEVICE_INIT *DeviceInit, PWDF_OBJECT_ATTRIBUTES DeviceAttributes, WDFDEVICE *Device)
+{
+	PWDFDEVICE_INIT init = *DeviceInit;
+	WDFDEVICE device;
+	size_t length;
+
+	device = StubObjectCreate(StubDevice, sizeof(*device), DeviceAttributes, DriverHandle);
+	if (device == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	device->Filter = init->Filter;
+	if (init->FileObjectConfigured)
+	{
+		device->FileObjectConfig = init->FileObjectConfig;
+		device->FileObjectAttributes = init->FileObjectAttributes;
+	}
+	else
+		WDF_OBJECT_ATTRIBUTES_INIT(&device->FileObjectAttributes);
+	device->EvtIoInCallerContext = init->EvtIoInCallerContext;
+	StubEmbed(&device->Target.Header, StubIoTarget);
+	device->Target.Device = device;
+	if (init->LowerName != NULL)
+	{
+		length = wcslen(init->LowerName) * sizeof(WCHAR);
+		device->Lower.Name.Length = (USHORT)length;
+		device->Lower.Name.MaximumLength = (USHORT)(length + sizeof(WCHAR));
+		device->Lower.Name.Buffer = (PWCH)init->LowerName;
+	}
+
+	init->Device = device;
+	*DeviceInit = NULL;
+	*Device = device;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfDeviceCreateSymbolicLink(WDFDEVICE Device, PCUNICODE_STRING SymbolicLinkName)
+{
+	UNREFERENCED_PARAMETER(Device);
+	UNREFERENCED_PARAMETER(SymbolicLinkName);
+	return STATUS_SUCCESS;
+}
+
+VOID WdfControlFinishInitializing(WDFDEVICE Device)
+{
+	UNREFERENCED_PARAMETER(Device);
+}
+
+WDFIOTARGET WdfDeviceGetIoTarget(WDFDEVICE Device)
+{
+	return &Device->Target;
+}
+
+PDEVICE_OBJECT WdfDeviceWdmGetAttachedDevice(WDFDEVICE Device)
+{
+	return &Device->Lower;
+}
+
+NTSTATUS WdfDeviceEnqueueRequest(WDFDEVICE Device, WDFREQUEST Request)
+{
+	if (Device->DefaultQueue == NULL)
+		return STATUS_INVALID_DEVICE_STATE;
+
+	StubDispatch(Device->DefaultQueue, Request);
+	return STATUS_SUCCESS;
+}
+
+WDFDEVICE WdfFileObjectGetDevice(WDFFILEOBJECT FileObject)
+{
+	return FileObject->Device;
+}
+
+//
+// Memory, lookaside lists and collections.
+//
+NTSTATUS WdfMemoryCreate(PWDF_OBJECT_ATTRIBUTES Attributes, POOL_TYPE PoolType, ULONG PoolTag, size_t BufferSize,
+	WDFMEMORY *Memory, PVOID Buffer)
+{
+	WDFMEMORY memory;
+
+	UNREFERENCED_PARAMETER(PoolType);
+	UNREFERENCED_PARAMETER(PoolTag);
+
+	memory = StubObjectCreate(StubMemory, sizeof(*memory), Attributes, DriverHandle);
+	if (memory == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	memory->Buffer = StubAllocate(BufferSize);
+	if (memory->Buffer == NULL)
+	{
+		WdfObjectDelete(memory);
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+	memory->Length = BufferSize;
+	*Memory = memory;
+	if (Buffer != NULL)
+		*(PVOID *)Buffer = memory->Buffer;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfLookasideListCreate(PWDF_OBJECT_ATTRIBUTES LookasideAttributes, size_t BufferSize, POOL_TYPE PoolType,
+	PWDF_OBJECT_ATTRIBUTES MemoryAttributes, ULONG PoolTag, WDFLOOKASIDE *Lookaside)
+{
+	WDFLOOKASIDE lookaside;
+
+	UNREFERENCED_PARAMETER(PoolType);
+	UNREFERENCED_PARAMETER(MemoryAttributes);
+	UNREFERENCED_PARAMETER(PoolTag);
+
+	lookaside = StubObjectCreate(StubLookaside, sizeof(*lookaside), LookasideAttributes, DriverHandle);
+	if (lookaside == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	lookaside->BufferSize = BufferSize;
+	pthread_mutex_init(&lookaside->Lock, NULL);
+	*Lookaside = lookaside;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfMemoryCreateFromLookaside(WDFLOOKASIDE Lookaside, WDFMEMORY *Memory)
+/*++
+
+Routine Description:
+
+    Hands out a buffer of the lookaside list, one returned earlier if
+    there is one. The memory object keeps a reference on the list, a
+    buffer deleted after the list is freed.
+
+--*/
+{
+	WDFMEMORY memory;
+
+	pthread_mutex_lock(&Lookaside->Lock);
+	memory = Lookaside->Free;
+	if (memory != NULL)
+	{
+		Lookaside->Free = memory->Next;
+		Lookaside->FreeCount--;
+	}
+	pthread_mutex_unlock(&Lookaside->Lock);
+
+	if (memory != NULL)
+	{
+		__atomic_fetch_add(&StubStats.LookasideHits, 1, __ATOMIC_RELAXED);
+		__atomic_fetch_add(&StubStats.Objects, 1, __ATOMIC_RELAXED);
+		memset(&memory->Header, 0, sizeof(memory->Header));
+		memory->Header.Type = StubMemory;
+		memory->Header.References = 1;
+		InitializeListHead(&memory->Header.Children);
+		InitializeListHead(&memory->Header.Sibling);
+		memory->Next = NULL;
+	}
+	else
+	{
+		memory = StubObjectCreate(StubMemory, sizeof(*memory), NULL, NULL);
+		if (memory == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES;
+
+		memory->Buffer = StubAllocate(Lookaside->BufferSize);
+		if (memory->Buffer == NULL)
+		{
+			free(memory);
+			return STATUS_INSUFFICIENT_RESOURCES;
+		}
+		memory->Length = Lookaside->BufferSize;
+	}
+	WdfObjectReference(Lookaside);
+	memory->Lookaside = Lookaside;
+	*Memory = memory;
+	return STATUS_SUCCESS;
+}
+
+PVOID WdfMemoryGetBuffer(WDFMEMORY Memory, size_t *BufferSize)
+{
+	if (BufferSize != NULL)
+		*BufferSize = Memory->Length;
+	return Memory->Buffer;
+}
+
+NTSTATUS WdfMemoryCopyFromBuffer(WDFMEMORY DestinationMemory, size_t DestinationOffset, const VOID *Buffer, size_t NumBytesToCopyFrom)
+{
+	if (DestinationOffset > DestinationMemory->Length || NumBytesToCopyFrom > DestinationMemory->Length - DestinationOffset)
+		return STATUS_BUFFER_TOO_SMALL;
+
+	memcpy((PUCHAR)DestinationMemory->Buffer + DestinationOffset, Buffer, NumBytesToCopyFrom);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfMemoryCopyToBuffer(WDFMEMORY SourceMemory, size_t SourceOffset, PVOID Buffer, size_t NumBytesToCopyTo)
+{
+	if (SourceOffset > SourceMemory->Length || NumBytesToCopyTo > SourceMemory->Length - SourceOffset)
+		return STATUS_BUFFER_TOO_SMALL;
+
+	memcpy(Buffer, (PUCHAR)SourceMemory->Buffer + SourceOffset, NumBytesToCopyTo);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfCollectionCreate(PWDF_OBJECT_ATTRIBUTES CollectionAttributes, WDFCOLLECTION *Collection)
+{
+	WDFCOLLECTION collection;
+
+	collection = StubObjectCreate(StubCollection, sizeof(*collection), CollectionAttributes, DriverHandle);
+	if (collection == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	*Collection = collection;
+	return STATUS_SUCCESS;
+}
+
+ULONG WdfCollectionGetCount(WDFCOLLECTION Collection)
+{
+	return Collection->Count;
+}
+
+NTSTATUS WdfCollectionAdd(WDFCOLLECTION Collection, WDFOBJECT Object)
+{
+	WDFOBJECT *items;
+	ULONG capacity;
+
+	if (Collection->Count == Collection->Capacity)
+	{
+		capacity = Collection->Capacity != 0 ? Collection->Capacity * 2 : 8;
+		items = StubAllocate(capacity * sizeof(*items));
+		if (items == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES;
+
+		if (Collection->Count != 0)
+			memcpy(items, Collection->Items, Collection->Count * sizeof(*items));
+		free(Collection->Items);
+		Collection->Items = items;
+		Collection->Capacity = capacity;
+	}
+	WdfObjectReference(Object);
+	Collection->Items[Collection->Count++] = Object;
+	return STATUS_SUCCESS;
+}
+
+VOID WdfCollectionRemove(WDFCOLLECTION Collection, WDFOBJECT Item)
+{
+	ULONG i;
+
+	for (i = 0; i < Collection->Count; i++)
+	{
+		if (Collection->Items[i] == Item)
+		{
+			memmove(&Collection->Items[i], &Collection->Items[i + 1], (Collection->Count - i - 1) * sizeof(WDFOBJECT));
+			Collection->Count--;
+			WdfObjectDereference(Item);
+			return;
+		}
+	}
+}
+
+WDFOBJECT WdfCollectionGetItem(WDFCOLLECTION Collection, ULONG Index)
+{
+	return Index < Collection->Count ? Collection->Items[Index] : NULL;
+}
+
+WDFOBJECT WdfCollectionGetFirstItem(WDFCOLLECTION Collection)
+{
+	return WdfCollectionGetItem(Collection, 0);
+}
+
+//
+// Locks.
+//
+static PSTUB_LOCK StubLockCreate(PWDF_OBJECT_ATTRIBUTES Attributes, const char *Name)
+/*++
+
+Routine Description:
+
+    Creates a lock of the class named after the field or the variable in
+    Name, the expression the driver stores the lock through.
+
+--*/
+{
+	PSTUB_LOCK lock;
+	const char *p;
+	ULONG i;
+
+	for (p = Name; *Name != '\0'; Name++)
+	{
+		if (*Name == '&' || *Name == '.' || *Name == '>')
+			p = Name + 1;
+	}
+
+	lock = StubObjectCreate(StubLock, sizeof(*lock), Attributes, DriverHandle);
+	if (lock == NULL)
+		return NULL;
+
+	pthread_mutex_init(&lock->Mutex, NULL);
+	pthread_mutex_lock(&LockClassesLock);
+	for (i = 0; i < LockClassCount && strcmp(LockClasses[i].Name, p) != 0; i++)
+		;
+	if (i == LockClassCount && LockClassCount < WDFSTUB_MAX_LOCK_CLASSES - 1)
+	{
+		strncpy(LockClasses[i].Name, p, sizeof(LockClasses[i].Name) - 1);
+		LockClassCount++;
+	}
+	else if (i == LockClassCount)
+	{
+		i = WDFSTUB_MAX_LOCK_CLASSES - 1;
+		strcpy(LockClasses[i].Name, "(other)");
+	}
+	lock->Class = &LockClasses[i];
+	lock->Class->Locks++;
+	pthread_mutex_unlock(&LockClassesLock);
+	return lock;
+}
+
+static VOID StubLockAcquire(PSTUB_LOCK Lock)
+{
+	ULONG64 start;
+
+	if (pthread_mutex_trylock(&Lock->Mutex) == 0)
+	{
+		Lock->Acquired = StubNow();
+		return;
+	}
+
+	start = StubNow();
+	pthread_mutex_lock(&Lock->Mutex);
+	Lock->Acquired = StubNow();
+	__atomic_fetch_add(&Lock->Class->Contended, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&Lock->Class->WaitTime, Lock->Acquired - start, __ATOMIC_RELAXED);
+}
+
+static VOID StubLockRelease(PSTUB_LOCK Lock)
+{
+	PSTUB_LOCK_CLASS class = Lock->Class;
+	ULONG64 hold, max;
+
+	hold = StubNow() - Lock->Acquired;
+	pthread_mutex_unlock(&Lock->Mutex);
+
+	__atomic_fetch_add(&class->Acquisitions, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&class->HoldTime, hold, __ATOMIC_RELAXED);
+	max = __atomic_load_n(&class->MaxHoldTime, __ATOMIC_RELAXED);
+	while (hold > max && !__atomic_compare_exchange_n(&class->MaxHoldTime, &max, hold, TRUE, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+		;
+}
+
+NTSTATUS WdfStubWaitLockCreate(PWDF_OBJECT_ATTRIBUTES LockAttributes, WDFWAITLOCK *Lock, const char *Name)
+{
+	*Lock = (WDFWAITLOCK)StubLockCreate(LockAttributes, Name);
+	return *Lock != NULL ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+NTSTATUS WdfWaitLockAcquire(WDFWAITLOCK Lock, PLONGLONG Timeout)
+{
+	//
+	// Only the zero timeout, a try, is told from waiting for good, and
+	// only a try is allowed above PASSIVE_LEVEL.
+	//
+	if ((Timeout == NULL || *Timeout != 0) && StubIrql != PASSIVE_LEVEL)
+	{
+		fprintf(stderr, "wdf: %s waited for at IRQL %u\n", Lock->Lock.Class->Name, StubIrql);
+		abort();
+	}
+	if (Timeout != NULL && *Timeout == 0)
+	{
+		if (pthread_mutex_trylock(&Lock->Lock.Mutex) != 0)
+			return STATUS_TIMEOUT;
+
+		Lock->Lock.Acquired = StubNow();
+		return STATUS_SUCCESS;
+	}
+
+	StubLockAcquire(&Lock->Lock);
+	return STATUS_SUCCESS;
+}
+
+VOID WdfWaitLockRelease(WDFWAITLOCK Lock)
+{
+	StubLockRelease(&Lock->Lock);
+}
+
+NTSTATUS WdfStubSpinLockCreate(PWDF_OBJECT_ATTRIBUTES SpinLockAttributes, WDFSPINLOCK *SpinLock, const char *Name)
+{
+	*SpinLock = (WDFSPINLOCK)StubLockCreate(SpinLockAttributes, Name);
+	return *SpinLock != NULL ? STATUS_SUCCESS : STATUS_INSUFFICIENT_RESOURCES;
+}
+
+VOID WdfSpinLockAcquire(WDFSPINLOCK SpinLock)
+{
+	KIRQL irql = StubIrql;
+
+	StubLockAcquire(&SpinLock->Lock);
+	SpinLock->Lock.OldIrql = irql;
+	StubIrql = DISPATCH_LEVEL;
+}
+
+VOID WdfSpinLockRelease(WDFSPINLOCK SpinLock)
+{
+	StubIrql = SpinLock->Lock.OldIrql;
+	StubLockRelease(&SpinLock->Lock);
+}
+
+//
+// Work items and timers.
+//
+static PVOID StubWorker(PVOID Parameter)
+{
+	WDFWORKITEM workItem;
+
+	UNREFERENCED_PARAMETER(Parameter);
+
+	pthread_mutex_lock(&WorkLock);
+	for (;;)
+	{
+		while (IsListEmpty(&WorkQueue) && !WorkStop)
+			pthread_cond_wait(&WorkReady, &WorkLock);
+		if (IsListEmpty(&WorkQueue))
+			break;
+
+		//
+		// Queued again from here on, even while it runs.
+		//
+		workItem = CONTAINING_RECORD(WorkQueue.Flink, struct WDFWORKITEM__, Link);
+		RemoveEntryList(&workItem->Link);
+		workItem->Queued = FALSE;
+		workItem->Running++;
+		WorkRunning++;
+		pthread_mutex_unlock(&WorkLock);
+
+		workItem->EvtWorkItemFunc(workItem);
+		__atomic_fetch_add(&StubStats.WorkItems, 1, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&WorkLock);
+		workItem->Running--;
+		WorkRunning--;
+		pthread_cond_broadcast(&WorkDone);
+	}
+	pthread_mutex_unlock(&WorkLock);
+	return NULL;
+}
+
+static PVOID StubTimerThread(PVOID Parameter)
+{
+	PLIST_ENTRY entry;
+	WDFTIMER timer, next;
+	ULONG64 now;
+	struct timespec due;
+
+	UNREFERENCED_PARAMETER(Parameter);
+
+	pthread_mutex_lock(&TimerLock);
+	while (!TimerStop)
+	{
+		next = NULL;
+		for (entry = TimerQueue.Flink; entry != &TimerQueue; entry = entry->Flink)
+		{
+			timer = CONTAINING_RECORD(entry, struct WDFTIMER__, Link);
+			if (next == NULL || timer->Due < next->Due)
+				next = timer;
+		}
+		if (next == NULL)
+		{
+			pthread_cond_wait(&TimerChanged, &TimerLock);
+			continue;
+		}
+
+		now = StubNow();
+		if (next->Due > now)
+		{
+			due.tv_sec = (time_t)(next->Due / 1000000000);
+			due.tv_nsec = (long)(next->Due % 1000000000);
+			pthread_cond_timedwait(&TimerChanged, &TimerLock, &due);
+			continue;
+		}
+
+		RemoveEntryList(&next->Link);
+		next->Armed = FALSE;
+		next->Running++;
+		TimerRunning++;
+		pthread_mutex_unlock(&TimerLock);
+
+		StubIrql = next->Irql;
+		next->EvtTimerFunc(next);
+		StubIrql = PASSIVE_LEVEL;
+		__atomic_fetch_add(&StubStats.Timers, 1, __ATOMIC_RELAXED);
+
+		pthread_mutex_lock(&TimerLock);
+		next->Running--;
+		TimerRunning--;
+		pthread_cond_broadcast(&TimerDone);
+	}
+	pthread_mutex_unlock(&TimerLock);
+	return NULL;
+}
+
+NTSTATUS WdfWorkItemCreate(PWDF_WORKITEM_CONFIG Config, PWDF_OBJECT_ATTRIBUTES Attributes, WDFWORKITEM *WorkItem)
+{
+	WDFWORKITEM workItem;
+
+	if (Attributes == NULL || Attributes->ParentObject == NULL)
+		return STATUS_INVALID_PARAMETER;
+
+	workItem = StubObjectCreate(StubWorkItem, sizeof(*workItem), Attributes, NULL);
+	if (workItem == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	workItem->EvtWorkItemFunc = Config->EvtWorkItemFunc;
+	InitializeListHead(&workItem->Link);
+	*WorkItem = workItem;
+	return STATUS_SUCCESS;
+}
+
+VOID WdfWorkItemEnqueue(WDFWORKITEM WorkItem)
+{
+	pthread_mutex_lock(&WorkLock);
+	if (!WorkItem->Queued && !WorkItem->Header.Deleted)
+	{
+		WorkItem->Queued = TRUE;
+		InsertTailList(&WorkQueue, &WorkItem->Link);
+		pthread_cond_signal(&WorkReady);
+	}
+	pthread_mutex_unlock(&WorkLock);
+}
+
+WDFOBJECT WdfWorkItemGetParentObject(WDFWORKITEM WorkItem)
+{
+	return WorkItem->Header.Parent;
+}
+
+NTSTATUS WdfTimerCreate(PWDF_TIMER_CONFIG Config, PWDF_OBJECT_ATTRIBUTES Attributes, WDFTIMER *Timer)
+{
+	WDFTIMER timer;
+
+	if (Attributes == NULL || Attributes->ParentObject == NULL || Config->Period != 0)
+		return STATUS_INVALID_PARAMETER;
+
+	timer = StubObjectCreate(StubTimer, sizeof(*timer), Attributes, NULL);
+	if (timer == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	timer->EvtTimerFunc = Config->EvtTimerFunc;
+	timer->Irql = Attributes->ExecutionLevel == WdfExecutionLevelPassive ? PASSIVE_LEVEL : DISPATCH_LEVEL;
+	InitializeListHead(&timer->Link);
+	*Timer = timer;
+	return STATUS_SUCCESS;
+}
+
+BOOLEAN WdfTimerStart(WDFTIMER Timer, LONGLONG DueTime)
+{
+	BOOLEAN armed;
+
+	//
+	// Relative times are negative, in 100 ns units. An absolute time is
+	// taken as relative as well, the driver does not use them.
+	//
+	if (DueTime < 0)
+		DueTime = -DueTime;
+
+	pthread_mutex_lock(&TimerLock);
+	armed = Timer->Armed;
+	if (!Timer->Header.Deleted)
+	{
+		Timer->Due = StubNow() + (ULONG64)DueTime * 100;
+		if (!armed)
+		{
+			Timer->Armed = TRUE;
+			InsertTailList(&TimerQueue, &Timer->Link);
+		}
+		pthread_cond_signal(&TimerChanged);
+	}
+	pthread_mutex_unlock(&TimerLock);
+	return armed;
+}
+
+BOOLEAN WdfTimerStop(WDFTIMER Timer, BOOLEAN Wait)
+{
+	BOOLEAN armed;
+
+	pthread_mutex_lock(&TimerLock);
+	armed = Timer->Armed;
+	if (armed)
+	{
+		RemoveEntryList(&Timer->Link);
+		Timer->Armed = FALSE;
+	}
+	while (Wait && Timer->Running != 0)
+		pthread_cond_wait(&TimerDone, &TimerLock);
+	pthread_mutex_unlock(&TimerLock);
+	return armed;
+}
+
+WDFOBJECT WdfTimerGetParentObject(WDFTIMER Timer)
+{
+	return Timer->Header.Parent;
+}
+
+//
+// Queues.
+//
+NTSTATUS WdfIoQueueCreate(WDFDEVICE Device, PWDF_IO_QUEUE_CONFIG Config, PWDF_OBJECT_ATTRIBUTES QueueAttributes, WDFQUEUE *Queue)
+{
+	WDFQUEUE queue;
+
+	queue = StubObjectCreate(StubQueue, sizeof(*queue), QueueAttributes, Device);
+	if (queue == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	queue->Device = Device;
+	queue->Config = *Config;
+	pthread_mutex_init(&queue->Lock, NULL);
+	InitializeListHead(&queue->Requests);
+	if (Config->DefaultQueue)
+		Device->DefaultQueue = queue;
+	if (Queue != NULL)
+		*Queue = queue;
+	return STATUS_SUCCESS;
+}
+
+WDFDEVICE WdfIoQueueGetDevice(WDFQUEUE Queue)
+{
+	return Queue->Device;
+}
+
+static VOID StubForward(WDFREQUEST Request, WDFDEVICE Device)
+{
+	WDF_REQUEST_SEND_OPTIONS options;
+
+	WDF_REQUEST_SEND_OPTIONS_INIT(&options, WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET);
+	WdfRequestSend(Request, WdfDeviceGetIoTarget(Device), &options);
+}
+
+static VOID StubDispatch(WDFQUEUE Queue, WDFREQUEST Request)
+/*++
+
+Routine Description:
+
+    Presents a request to the callback of its type. A sequential queue
+    presents one at a time, a request it forwards to another queue counts
+    as done with. Requests of a type without a callback go on to the
+    lower driver from a filter and fail on any other device.
+
+--*/
+{
+	PWDF_IO_QUEUE_CONFIG config = &Queue->Config;
+	PWDF_REQUEST_PARAMETERS params = &Request->Parameters;
+	BOOLEAN presented = TRUE;
+
+	if (config->DispatchType == WdfIoQueueDispatchManual)
+	{
+		if (!NT_SUCCESS(WdfRequestForwardToIoQueue(Request, Queue)))
+			WdfRequestComplete(Request, STATUS_INVALID_DEVICE_STATE);
+		return;
+	}
+
+	Request->Queue = Queue;
+	if (config->DispatchType == WdfIoQueueDispatchSequential)
+		pthread_mutex_lock(&Queue->Lock);
+	switch (params->Type)
+	{
+	case WdfRequestTypeRead:
+		if (config->EvtIoRead != NULL)
+			config->EvtIoRead(Queue, Request, params->Parameters.Read.Length);
+		else
+			presented = FALSE;
+		break;
+	case WdfRequestTypeWrite:
+		if (config->EvtIoWrite != NULL)
+			config->EvtIoWrite(Queue, Request, params->Parameters.Write.Length);
+		else
+			presented = FALSE;
+		break;
+	case WdfRequestTypeDeviceControl:
+		if (config->EvtIoDeviceControl != NULL)
+			config->EvtIoDeviceControl(Queue, Request, params->Parameters.DeviceIoControl.OutputBufferLength,
+				params->Parameters.DeviceIoControl.InputBufferLength, params->Parameters.DeviceIoControl.IoControlCode);
+		else
+			presented = FALSE;
+		break;
+	case WdfRequestTypeDeviceControlInternal:
+		if (config->EvtIoInternalDeviceControl != NULL)
+			config->EvtIoInternalDeviceControl(Queue, Request, params->Parameters.DeviceIoControl.OutputBufferLength,
+				params->Parameters.DeviceIoControl.InputBufferLength, params->Parameters.DeviceIoControl.IoControlCode);
+		else
+			presented = FALSE;
+		break;
+	default:
+		presented = FALSE;
+		break;
+	}
+	if (!presented)
+	{
+		if (config->EvtIoDefault != NULL)
+			config->EvtIoDefault(Queue, Request);
+		else if (Queue->Device->Filter)
+			StubForward(Request, Queue->Device);
+		else
+			WdfRequestComplete(Request, STATUS_INVALID_DEVICE_REQUEST);
+	}
+	if (config->DispatchType == WdfIoQueueDispatchSequential)
+		pthread_mutex_unlock(&Queue->Lock);
+}
+
+NTSTATUS WdfIoQueueRetrieveNextRequest(WDFQUEUE Queue, WDFREQUEST *OutRequest)
+{
+	WDFREQUEST request = NULL;
+
+	pthread_mutex_lock(&Queue->Lock);
+	if (!IsListEmpty(&Queue->Requests))
+	{
+		request = CONTAINING_RECORD(Queue->Requests.Flink, struct WDFREQUEST__, Link);
+		RemoveEntryList(&request->Link);
+		request->Parked = FALSE;
+	}
+	pthread_mutex_unlock(&Queue->Lock);
+
+	*OutRequest = request;
+	return request != NULL ? STATUS_SUCCESS : STATUS_NO_MORE_ENTRIES;
+}
+
+NTSTATUS WdfIoQueueFindRequest(WDFQUEUE Queue, WDFREQUEST FoundRequest, WDFFILEOBJECT FileObject,
+	PWDF_REQUEST_PARAMETERS Parameters, WDFREQUEST *OutRequest)
+{
+	NTSTATUS status = STATUS_NO_MORE_ENTRIES;
+	PLIST_ENTRY entry;
+	WDFREQUEST request;
+
+	*OutRequest = NULL;
+	pthread_mutex_lock(&Queue->Lock);
+	if (FoundRequest != NULL && (!FoundRequest->Parked || FoundRequest->Queue != Queue))
+		status = STATUS_NOT_FOUND;
+	else
+	{
+		entry = FoundRequest != NULL ? FoundRequest->Link.Flink : Queue->Requests.Flink;
+		for (; entry != &Queue->Requests; entry = entry->Flink)
+		{
+			request = CONTAINING_RECORD(entry, struct WDFREQUEST__, Link);
+			if (FileObject == NULL || request->FileObject == FileObject)
+			{
+				if (Parameters != NULL)
+					*Parameters = request->Parameters;
+				WdfObjectReference(request);
+				*OutRequest = request;
+				status = STATUS_SUCCESS;
+				break;
+			}
+		}
+	}
+	pthread_mutex_unlock(&Queue->Lock);
+	return status;
+}
+
+NTSTATUS WdfIoQueueRetrieveFoundRequest(WDFQUEUE Queue, WDFREQUEST FoundRequest, WDFREQUEST *OutRequest)
+{
+	NTSTATUS status = STATUS_NOT_FOUND;
+
+	*OutRequest = NULL;
+	pthread_mutex_lock(&Queue->Lock);
+	if (FoundRequest->Parked && FoundRequest->Queue == Queue)
+	{
+		RemoveEntryList(&FoundRequest->Link);
+		FoundRequest->Parked = FALSE;
+		*OutRequest = FoundRequest;
+		status = STATUS_SUCCESS;
+	}
+	pthread_mutex_unlock(&Queue->Lock);
+	return status;
+}
+
+VOID WdfIoQueuePurgeSynchronously(WDFQUEUE Queue)
+/*++
+
+Routine Description:
+
+    Cancels the requests waiting in the queue. The queue takes no
+    requests afterwards.
+
+--*/
+{
+	LIST_ENTRY purged;
+	WDFREQUEST request;
+
+	InitializeListHead(&purged);
+	pthread_mutex_lock(&Queue->Lock);
+	Queue->Purged = TRUE;
+	while (!IsListEmpty(&Queue->Requests))
+	{
+		request = CONTAINING_RECORD(Queue->Requests.Flink, struct WDFREQUEST__, Link);
+		RemoveEntryList(&request->Link);
+		request->Parked = FALSE;
+		InsertTailList(&purged, &request->Link);
+	}
+	pthread_mutex_unlock(&Queue->Lock);
+
+	while (!IsListEmpty(&purged))
+	{
+		request = CONTAINING_RECORD(purged.Flink, struct WDFREQUEST__, Link);
+		RemoveEntryList(&request->Link);
+		WdfRequestComplete(request, STATUS_CANCELLED);
+	}
+}
+
+//
+// Requests.
+//
+VOID WdfRequestGetParameters(WDFREQUEST Request, PWDF_REQUEST_PARAMETERS Parameters)
+{
+	*Parameters = Request->Parameters;
+}
+
+WDFFILEOBJECT WdfRequestGetFileObject(WDFREQUEST Request)
+{
+	return Request->FileObject;
+}
+
+KPROCESSOR_MODE WdfRequestGetRequestorMode(WDFREQUEST Request)
+{
+	UNREFERENCED_PARAMETER(Request);
+	return UserMode;
+}
+
+PIRP WdfRequestWdmGetIrp(WDFREQUEST Request)
+{
+	return &Request->Irp;
+}
+
+NTSTATUS WdfRequestRetrieveInputBuffer(WDFREQUEST Request, size_t MinimumRequiredLength, PVOID Buffer, size_t *Length)
+{
+	if (Request->Input.Length == 0 || Request->Input.Length < MinimumRequiredLength)
+		return STATUS_BUFFER_TOO_SMALL;
+
+	*(PVOID *)Buffer = Request->Input.Buffer;
+	if (Length != NULL)
+		*Length = Request->Input.Length;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfRequestRetrieveOutputBuffer(WDFREQUEST Request, size_t MinimumRequiredSize, PVOID Buffer, size_t *Length)
+{
+	if (Request->Output.Length == 0 || Request->Output.Length < MinimumRequiredSize)
+		return STATUS_BUFFER_TOO_SMALL;
+
+	*(PVOID *)Buffer = Request->Output.Buffer;
+	if (Length != NULL)
+		*Length = Request->Output.Length;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfRequestRetrieveInputMemory(WDFREQUEST Request, WDFMEMORY *Memory)
+{
+	if (Request->Input.Length == 0)
+		return STATUS_BUFFER_TOO_SMALL;
+
+	*Memory = &Request->Input;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfRequestRetrieveOutputMemory(WDFREQUEST Request, WDFMEMORY *Memory)
+{
+	if (Request->Output.Length == 0)
+		return STATUS_BUFFER_TOO_SMALL;
+
+	*Memory = &Request->Output;
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS WdfRequestForwardToIoQueue(WDFREQUEST Request, WDFQUEUE DestinationQueue)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+
+	pthread_mutex_lock(&DestinationQueue->Lock);
+	if (DestinationQueue->Purged)
+		status = STATUS_INVALID_DEVICE_STATE;
+	else
+	{
+		Request->Queue = DestinationQueue;
+		Request->Parked = TRUE;
+		InsertTailList(&DestinationQueue->Requests, &Request->Link);
+	}
+	pthread_mutex_unlock(&DestinationQueue->Lock);
+	return status;
+}
+
+NTSTATUS WdfRequestRequeue(WDFREQUEST Request)
+{
+	NTSTATUS status = STATUS_SUCCESS;
+	WDFQUEUE queue = Request->Queue;
+
+	if (queue == NULL || queue->Config.DispatchType != WdfIoQueueDispatchManual)
+		return STATUS_INVALID_DEVICE_REQUEST;
+
+	pthread_mutex_lock(&queue->Lock);
+	if (queue->Purged)
+		status = STATUS_INVALID_DEVICE_STATE;
+	else
+	{
+		Request->Parked = TRUE;
+		InsertHeadList(&queue->Requests, &Request->Link);
+	}
+	pthread_mutex_unlock(&queue->Lock);
+	return status;
+}
+
+VOID WdfRequestFormatRequestUsingCurrentType(WDFREQUEST Request)
+{
+	UNREFERENCED_PARAMETER(Request);
+}
+
+VOID WdfRequestSetCompletionRoutine(WDFREQUEST Request, PFN_WDF_REQUEST_COMPLETION_ROUTINE CompletionRoutine,
+	WDFCONTEXT CompletionContext)
+{
+	Request->CompletionRoutine = CompletionRoutine;
+	Request->CompletionContext = CompletionContext;
+}
+
+BOOLEAN WdfRequestSend(WDFREQUEST Request, WDFIOTARGET Target, PWDF_REQUEST_SEND_OPTIONS Options)
+/*++
+
+Routine Description:
+
+    Passes the request to the lower driver of the device and completes it
+    with what that returns, through the completion routine if one was set
+    and the request is not sent and forgotten.
+
+--*/
+{
+	WDFDEVICE device = Target->Device;
+	WDF_REQUEST_COMPLETION_PARAMS params;
+	PFN_WDF_REQUEST_COMPLETION_ROUTINE routine;
+	IO_STATUS_BLOCK ioStatus;
+
+	ioStatus.Status = STATUS_SUCCESS;
+	ioStatus.Information = 0;
+	if (device->LowerDriver != NULL)
+		device->LowerDriver(device, Request, &ioStatus, device->LowerContext);
+	Request->Status = ioStatus.Status;
+	Request->Information = ioStatus.Information;
+
+	routine = Request->CompletionRoutine;
+	Request->CompletionRoutine = NULL;
+	if (routine == NULL || (Options != NULL && (Options->Flags & WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET)))
+	{
+		WdfRequestCompleteWithInformation(Request, ioStatus.Status, ioStatus.Information);
+		return TRUE;
+	}
+
+	/*
+	 * Requests are only ever formatted with their current type, for which
+	 * KMDF fills nothing but the type and the status block; the driver has
+	 * to query the request itself, so Parameters stays zeroed here too.
+	 */
+	memset(&params, 0, sizeof(params));
+	params.Size = sizeof(params);
+	params.Type = Request->Parameters.Type;
+	params.IoStatus = ioStatus;
+	routine(Request, Target, &params, Request->CompletionContext);
+	return TRUE;
+}
+
+NTSTATUS WdfRequestGetStatus(WDFREQUEST Request)
+{
+	return Request->Status;
+}
+
+VOID WdfRequestComplete(WDFREQUEST Request, NTSTATUS Status)
+{
+	WdfRequestCompleteWithInformation(Request, Status, Request->Information);
+}
+
+VOID WdfRequestCompleteWithInformation(WDFREQUEST Request, NTSTATUS Status, ULONG_PTR Information)
+{
+	size_t length;
+
+	Request->Status = Status;
+	Request->Information = Information;
+	if (Request->CallerOutput != NULL && Request->Output.Buffer == Request->SystemBuffer)
+	{
+		length = min(Information, Request->CallerOutputLength);
+		memcpy(Request->CallerOutput, Request->SystemBuffer, length);
+	}
+	__atomic_fetch_add(&StubStats.Completions, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_lock(&Request->Lock);
+	Request->Completed = TRUE;
+	pthread_cond_broadcast(&Request->Done);
+	pthread_mutex_unlock(&Request->Lock);
+}
+
+//
+// NT calls.
+//
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency)
+{
+	LARGE_INTEGER counter;
+
+	if (PerformanceFrequency != NULL)
+		PerformanceFrequency->QuadPart = 10000000;
+	counter.QuadPart = (LONGLONG)(StubNow() / 100);
+	return counter;
+}
+
+KIRQL KeGetCurrentIrql(VOID)
+{
+	return StubIrql;
+}
+
+ULONG KeQueryMaximumProcessorCountEx(USHORT GroupNumber)
+{
+	long count;
+
+	UNREFERENCED_PARAMETER(GroupNumber);
+
+	if (ProcessorCount == 0)
+	{
+		count = sysconf(_SC_NPROCESSORS_CONF);
+		ProcessorCount = count > 0 ? (ULONG)count : 1;
+	}
+	return ProcessorCount;
+}
+
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber)
+{
+	int cpu = sched_getcpu();
+	ULONG count = KeQueryMaximumProcessorCountEx(ALL_PROCESSOR_GROUPS);
+
+	if (cpu < 0)
+		cpu = 0;
+	if (ProcNumber != NULL)
+	{
+		ProcNumber->Group = 0;
+		ProcNumber->Number = (UCHAR)((ULONG)cpu % count);
+		ProcNumber->Reserved = 0;
+	}
+	return (ULONG)cpu % count;
+}
+
+VOID KeStackAttachProcess(PEPROCESS Process, PKAPC_STATE ApcState)
+{
+	ApcState->Process = Process;
+}
+
+VOID KeUnstackDetachProcess(PKAPC_STATE ApcState)
+{
+	UNREFERENCED_PARAMETER(ApcState);
+}
+
+ULONG IoGetRequestorProcessId(PIRP Irp)
+{
+	return Irp->RequestorProcessId;
+}
+
+PDEVICE_OBJECT IoGetLowerDeviceObject(PDEVICE_OBJECT DeviceObject)
+{
+	return DeviceObject->LowerDevice;
+}
+
+PMDL MmAllocatePagesForMdlEx(PHYSICAL_ADDRESS LowAddress, PHYSICAL_ADDRESS HighAddress, PHYSICAL_ADDRESS SkipBytes,
+	SIZE_T TotalBytes, MEMORY_CACHING_TYPE CacheType, ULONG Flags)
+{
+	PMDL mdl;
+
+	UNREFERENCED_PARAMETER(LowAddress);
+	UNREFERENCED_PARAMETER(HighAddress);
+	UNREFERENCED_PARAMETER(SkipBytes);
+	UNREFERENCED_PARAMETER(CacheType);
+	UNREFERENCED_PARAMETER(Flags);
+
+	//
+	// Whole zeroed pages, as the memory manager hands them out.
+	//
+	mdl = StubAllocate(sizeof(*mdl));
+	if (mdl == NULL)
+		return NULL;
+
+	if (posix_memalign(&mdl->StartVa, PAGE_SIZE, ROUND_TO_PAGES(TotalBytes)) != 0)
+	{
+		free(mdl);
+		return NULL;
+	}
+	memset(mdl->StartVa, 0, ROUND_TO_PAGES(TotalBytes));
+	mdl->ByteCount = (ULONG)TotalBytes;
+	__atomic_fetch_add(&StubStats.Allocations, 1, __ATOMIC_RELAXED);
+	__atomic_fetch_add(&StubStats.AllocatedBytes, ROUND_TO_PAGES(TotalBytes), __ATOMIC_RELAXED);
+	return mdl;
+}
+
+VOID MmFreePagesFromMdl(PMDL MemoryDescriptorList)
+{
+	free(MemoryDescriptorList->StartVa);
+	MemoryDescriptorList->StartVa = NULL;
+	MemoryDescriptorList->ByteCount = 0;
+}
+
+VOID ExFreePool(PVOID P)
+{
+	free(P);
+}
+
+PVOID MmMapLockedPagesSpecifyCache(PMDL MemoryDescriptorList, KPROCESSOR_MODE AccessMode, MEMORY_CACHING_TYPE CacheType,
+	PVOID RequestedAddress, ULONG BugCheckOnFailure, ULONG Priority)
+{
+	//
+	// The harness shares the address space of the driver.
+	//
+	UNREFERENCED_PARAMETER(AccessMode);
+	UNREFERENCED_PARAMETER(CacheType);
+	UNREFERENCED_PARAMETER(RequestedAddress);
+	UNREFERENCED_PARAMETER(BugCheckOnFailure);
+	UNREFERENCED_PARAMETER(Priority);
+	return MemoryDescriptorList->StartVa;
+}
+
+VOID MmUnmapLockedPages(PVOID BaseAddress, PMDL MemoryDescriptorList)
+{
+	UNREFERENCED_PARAMETER(BaseAddress);
+	UNREFERENCED_PARAMETER(MemoryDescriptorList);
+}
+
+PEPROCESS PsGetCurrentProcess(VOID)
+{
+	return (PEPROCESS)(ULONG_PTR)getpid();
+}
+
+HANDLE PsGetProcessId(PEPROCESS Process)
+{
+	return (HANDLE)Process;
+}
+
+NTSTATUS PsSetCreateProcessNotifyRoutine(PCREATE_PROCESS_NOTIFY_ROUTINE NotifyRoutine, BOOLEAN Remove)
+{
+	UNREFERENCED_PARAMETER(NotifyRoutine);
+	UNREFERENCED_PARAMETER(Remove);
+	return STATUS_SUCCESS;
+}
+
+NTSTATUS ObQueryNameString(PVOID Object, POBJECT_NAME_INFORMATION ObjectNameInfo, ULONG Length, PULONG ReturnLength)
+{
+	PDEVICE_OBJECT device = Object;
+	ULONG required;
+
+	required = (ULONG)sizeof(*ObjectNameInfo) + device->Name.Length + (ULONG)sizeof(WCHAR);
+	*ReturnLength = required;
+	if (Length < required)
+		return STATUS_INFO_LENGTH_MISMATCH;
+
+	ObjectNameInfo->Name.Buffer = (PWCH)(ObjectNameInfo + 1);
+	ObjectNameInfo->Name.Length = device->Name.Length;
+	ObjectNameInfo->Name.MaximumLength = (USHORT)(device->Name.Length + sizeof(WCHAR));
+	if (device->Name.Length != 0)
+		memcpy(ObjectNameInfo->Name.Buffer, device->Name.Buffer, device->Name.Length);
+	ObjectNameInfo->Name.Buffer[device->Name.Length / sizeof(WCHAR)] = L'\0';
+	return STATUS_SUCCESS;
+}
+
+VOID RtlInitUnicodeString(PUNICODE_STRING Destination, PCWSTR Source)
+{
+	size_t length = Source != NULL ? wcslen(Source) * sizeof(WCHAR) : 0;
+
+	Destination->Length = (USHORT)length;
+	Destination->MaximumLength = Source != NULL ? (USHORT)(length + sizeof(WCHAR)) : 0;
+	Destination->Buffer = (PWCH)Source;
+}
+
+BOOLEAN RtlEqualUnicodeString(PCUNICODE_STRING String1, PCUNICODE_STRING String2, BOOLEAN CaseInSensitive)
+{
+	ULONG i;
+
+	if (String1->Length != String2->Length)
+		return FALSE;
+
+	for (i = 0; i < String1->Length / sizeof(WCHAR); i++)
+	{
+		if (CaseInSensitive ? towupper((wint_t)String1->Buffer[i]) != towupper((wint_t)String2->Buffer[i]) :
+			String1->Buffer[i] != String2->Buffer[i])
+			return FALSE;
+	}
+	return TRUE;
+}
+
+NTSTATUS RtlUnicodeStringToAnsiString(PANSI_STRING Destination, PCUNICODE_STRING Source, BOOLEAN AllocateDestinationString)
+{
+	ULONG i, length = Source->Length / sizeof(WCHAR);
+
+	if (AllocateDestinationString)
+	{
+		Destination->Buffer = StubAllocate(length + 1);
+		if (Destination->Buffer == NULL)
+			return STATUS_INSUFFICIENT_RESOURCES;
+
+		Destination->MaximumLength = (USHORT)(length + 1);
+	}
+	else if (Destination->MaximumLength < length + 1)
+		return STATUS_BUFFER_OVERFLOW;
+
+	for (i = 0; i < length; i++)
+		Destination->Buffer[i] = Source->Buffer[i] < 0x80 ? (CHAR)Source->Buffer[i] : '?';
+	Destination->Buffer[length] = '\0';
+	Destination->Length = (USHORT)length;
+	return STATUS_SUCCESS;
+}
+
+VOID RtlFreeAnsiString(PANSI_STRING AnsiString)
+{
+	free(AnsiString->Buffer);
+	AnsiString->Buffer = NULL;
+}
+
+//
+// The harness.
+//
+NTSTATUS WdfStubLoad(ULONG Workers)
+/*++
+
+Routine Description:
+
+    Starts the worker threads and the timer thread and calls DriverEntry.
+
+--*/
+{
+	UNICODE_STRING registryPath;
+	pthread_condattr_t attributes;
+	NTSTATUS status;
+
+	if (Workers == 0)
+		Workers = 1;
+
+	InitializeListHead(&WorkQueue);
+	InitializeListHead(&TimerQueue);
+	pthread_condattr_init(&attributes);
+	pthread_condattr_setclock(&attributes, CLOCK_MONOTONIC);
+	pthread_cond_init(&TimerChanged, &attributes);
+	pthread_condattr_destroy(&attributes);
+	WorkStop = FALSE;
+	TimerStop = FALSE;
+
+	WorkerThreads = calloc(Workers, sizeof(*WorkerThreads));
+	if (WorkerThreads == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	for (WorkerCount = 0; WorkerCount < Workers; WorkerCount++)
+	{
+		if (pthread_create(&WorkerThreads[WorkerCount], NULL, StubWorker, NULL) != 0)
+			break;
+	}
+	if (WorkerCount == 0 || pthread_create(&TimerThread, NULL, StubTimerThread, NULL) != 0)
+	{
+		TimerThread = 0;
+		WdfStubUnload();
+		return STATUS_INSUFFICIENT_RESOURCES;
+	}
+
+	RtlInitUnicodeString(&registryPath, L"\\Registry\\Machine\\System\\CurrentControlSet\\Services\\ComPortMonitor");
+	status = DriverEntry(&WdmDriverObject, &registryPath);
+	if (!NT_SUCCESS(status))
+		WdfStubUnload();
+	return status;
+}
+
+VOID WdfStubUnload(VOID)
+/*++
+
+Routine Description:
+
+    Deletes the driver object, the devices left with it, and stops the
+    threads. The files opened on the devices must be closed before.
+
+--*/
+{
+	ULONG i;
+
+	if (DriverHandle != NULL)
+	{
+		WdfObjectDelete(DriverHandle);
+		DriverHandle = NULL;
+	}
+
+	pthread_mutex_lock(&WorkLock);
+	WorkStop = TRUE;
+	pthread_cond_broadcast(&WorkReady);
+	pthread_mutex_unlock(&WorkLock);
+	for (i = 0; i < WorkerCount; i++)
+		pthread_join(WorkerThreads[i], NULL);
+	free(WorkerThreads);
+	WorkerThreads = NULL;
+	WorkerCount = 0;
+
+	if (TimerThread != 0)
+	{
+		pthread_mutex_lock(&TimerLock);
+		TimerStop = TRUE;
+		pthread_cond_broadcast(&TimerChanged);
+		pthread_mutex_unlock(&TimerLock);
+		pthread_join(TimerThread, NULL);
+		TimerThread = 0;
+	}
+	pthread_cond_destroy(&TimerChanged);
+}
+
+NTSTATUS WdfStubAddDevice(PCWSTR HardwareId, PCWSTR LowerName, WDFDEVICE *Device)
+{
+	WDFDEVICE_INIT init;
+	NTSTATUS status;
+
+	memset(&init, 0, sizeof(init));
+	init.HardwareId = HardwareId;
+	init.LowerName = LowerName;
+	status = DriverHandle->EvtDriverDeviceAdd(DriverHandle, &init);
+	if (NT_SUCCESS(status) && init.Device == NULL)
+		status = STATUS_UNSUCCESSFUL;
+
+	*Device = NT_SUCCESS(status) ? init.Device : NULL;
+	return status;
+}
+
+VOID WdfStubSetLowerDriver(WDFDEVICE Device, PFN_WDFSTUB_LOWER_DRIVER LowerDriver, PVOID Context)
+{
+	Device->LowerDriver = LowerDriver;
+	Device->LowerContext = Context;
+}
+
+NTSTATUS WdfStubFileOpen(WDFDEVICE Device, WDFFILEOBJECT *FileObject)
+/*++
+
+Routine Description:
+
+    Creates a file object on the device and presents the create request
+    to the driver, as CreateFile does.
+
+--*/
+{
+	WDFFILEOBJECT fileObject;
+	WDFREQUEST request;
+	NTSTATUS status;
+
+	*FileObject = NULL;
+	fileObject = StubObjectCreate(StubFileObject, sizeof(*fileObject), &Device->FileObjectAttributes, Device);
+	if (fileObject == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	fileObject->Device = Device;
+	status = WdfStubRequestCreate(&request);
+	if (!NT_SUCCESS(status))
+	{
+		WdfObjectDelete(fileObject);
+		return status;
+	}
+
+	WdfStubRequestInitialize(request, WdfRequestTypeCreate, fileObject, 0, NULL, 0, NULL, 0);
+	if (Device->FileObjectConfig.EvtDeviceFileCreate != NULL)
+		Device->FileObjectConfig.EvtDeviceFileCreate(Device, request, fileObject);
+	else
+		WdfRequestComplete(request, STATUS_SUCCESS);
+	status = WdfStubRequestWait(request, NULL);
+	WdfStubRequestDelete(request);
+
+	if (!NT_SUCCESS(status))
+	{
+		fileObject->CleanedUp = TRUE;
+		WdfObjectDelete(fileObject);
+		return status;
+	}
+
+	*FileObject = fileObject;
+	return STATUS_SUCCESS;
+}
+
+VOID WdfStubFileCleanup(WDFFILEOBJECT FileObject)
+{
+	PFN_WDF_FILE_CLEANUP cleanup = FileObject->Device->FileObjectConfig.EvtFileCleanup;
+
+	if (FileObject->CleanedUp)
+		return;
+
+	FileObject->CleanedUp = TRUE;
+	if (cleanup != NULL)
+		cleanup(FileObject);
+}
+
+VOID WdfStubFileClose(WDFFILEOBJECT FileObject)
+{
+	PFN_WDF_FILE_CLOSE close = FileObject->Device->FileObjectConfig.EvtFileClose;
+
+	WdfStubFileCleanup(FileObject);
+	if (close != NULL)
+		close(FileObject);
+	WdfObjectDelete(FileObject);
+}
+
+NTSTATUS WdfStubRequestCreate(WDFREQUEST *Request)
+{
+	WDFREQUEST request;
+
+	//
+	// The request is the I/O manager's, not counted against the driver.
+	//
+	request = calloc(1, sizeof(*request));
+	if (request == NULL)
+		return STATUS_INSUFFICIENT_RESOURCES;
+
+	StubEmbed(&request->Header, StubRequest);
+	StubEmbed(&request->Input.Header, StubMemory);
+	StubEmbed(&request->Output.Header, StubMemory);
+	InitializeListHead(&request->Link);
+	pthread_mutex_init(&request->Lock, NULL);
+	pthread_cond_init(&request->Done, NULL);
+	request->Irp.RequestorProcessId = (ULONG)getpid();
+	*Request = request;
+	return STATUS_SUCCESS;
+}
+
+VOID WdfStubRequestDelete(WDFREQUEST Request)
+{
+	StubFreeContexts(&Request->Header);
+	free(Request->SystemBuffer);
+	pthread_mutex_destroy(&Request->Lock);
+	pthread_cond_destroy(&Request->Done);
+	free(Request);
+}
+
+VOID WdfStubRequestInitialize(WDFREQUEST Request, WDF_REQUEST_TYPE Type, WDFFILEOBJECT FileObject, ULONG IoControlCode,
+	PVOID Input, size_t InputLength, PVOID Output, size_t OutputLength)
+/*++
+
+Routine Description:
+
+    Readies the request for a new submission. Reads, writes and buffered
+    controls get the system buffer, a direct control gets the output
+    buffer of the caller as it is.
+
+--*/
+{
+	PWDF_REQUEST_PARAMETERS params = &Request->Parameters;
+	BOOLEAN direct = FALSE;
+	size_t size;
+	PVOID buffer;
+
+	StubFreeContexts(&Request->Header);
+	WDF_REQUEST_PARAMETERS_INIT(params);
+	params->Type = Type;
+	switch (Type)
+	{
+	case WdfRequestTypeRead:
+		params->Parameters.Read.Length = OutputLength;
+		break;
+	case WdfRequestTypeWrite:
+		params->Parameters.Write.Length = InputLength;
+		break;
+	case WdfRequestTypeDeviceControl:
+	case WdfRequestTypeDeviceControlInternal:
+		params->Parameters.DeviceIoControl.IoControlCode = IoControlCode;
+		params->Parameters.DeviceIoControl.InputBufferLength = InputLength;
+		params->Parameters.DeviceIoControl.OutputBufferLength = OutputLength;
+		direct = (IoControlCode & 3) == METHOD_IN_DIRECT || (IoControlCode & 3) == METHOD_OUT_DIRECT;
+		break;
+	default:
+		break;
+	}
+
+	size = max(InputLength, direct ? 0 : OutputLength);
+	if (size > Request->SystemBufferSize)
+	{
+		buffer = realloc(Request->SystemBuffer, size);
+		if (buffer != NULL)
+		{
+			Request->SystemBuffer = buffer;
+			Request->SystemBufferSize = size;
+		}
+	}
+	if (InputLength != 0 && Input != NULL && Request->SystemBufferSize >= InputLength)
+		memcpy(Request->SystemBuffer, Input, InputLength);
+
+	Request->Input.Buffer = Request->SystemBuffer;
+	Request->Input.Length = InputLength;
+	if (direct)
+	{
+		Request->Output.Buffer = Output;
+		Request->CallerOutput = NULL;
+	}
+	else
+	{
+		Request->Output.Buffer = Request->SystemBuffer;
+		Request->CallerOutput = Output;
+	}
+	Request->Output.Length = OutputLength;
+	Request->CallerOutputLength = OutputLength;
+
+	Request->Header.Deleted = FALSE;
+	Request->FileObject = FileObject;
+	Request->Queue = NULL;
+	Request->Parked = FALSE;
+	Request->CompletionRoutine = NULL;
+	Request->CompletionContext = NULL;
+	Request->Status = STATUS_PENDING;
+	Request->Information = 0;
+	Request->Completed = FALSE;
+}
+
+VOID WdfStubRequestSubmit(WDFDEVICE Device, WDFREQUEST Request)
+{
+	if (Device->EvtIoInCallerContext != NULL)
+		Device->EvtIoInCallerContext(Device, Request);
+	else if (Device->DefaultQueue != NULL)
+		StubDispatch(Device->DefaultQueue, Request);
+	else
+		WdfRequestComplete(Request, STATUS_INVALID_DEVICE_REQUEST);
+}
+
+NTSTATUS WdfStubRequestWait(WDFREQUEST Request, PULONG_PTR Information)
+{
+	pthread_mutex_lock(&Request->Lock);
+	while (!Request->Completed)
+		pthread_cond_wait(&Request->Done, &Request->Lock);
+	pthread_mutex_unlock(&Request->Lock);
+
+	if (Information != NULL)
+		*Information = Request->Information;
+	return Request->Status;
+}
+
+VOID WdfStubWaitForIdle(VOID)
+{
+	BOOLEAN idle = FALSE;
+
+	//
+	// A timer may queue work and work may start a timer, both are empty
+	// twice in a row once neither has anything left.
+	//
+	while (!idle)
+	{
+		pthread_mutex_lock(&TimerLock);
+		while (TimerRunning != 0)
+			pthread_cond_wait(&TimerDone, &TimerLock);
+		idle = IsListEmpty(&TimerQueue);
+		pthread_mutex_unlock(&TimerLock);
+
+		pthread_mutex_lock(&WorkLock);
+		while (WorkRunning != 0 || !IsListEmpty(&WorkQueue))
+		{
+			idle = FALSE;
+			pthread_cond_wait(&WorkDone, &WorkLock);
+		}
+		pthread_mutex_unlock(&WorkLock);
+
+		pthread_mutex_lock(&TimerLock);
+		idle = idle && TimerRunning == 0 && IsListEmpty(&TimerQueue);
+		pthread_mutex_unlock(&TimerLock);
+		if (!idle)
+			usleep(1000);
+	}
+}
+
+VOID WdfStubGetStats(PWDFSTUB_STATS Stats)
+{
+	Stats->Objects = __atomic_load_n(&StubStats.Objects, __ATOMIC_RELAXED);
+	Stats->Allocations = __atomic_load_n(&StubStats.Allocations, __ATOMIC_RELAXED);
+	Stats->AllocatedBytes = __atomic_load_n(&StubStats.AllocatedBytes, __ATOMIC_RELAXED);
+	Stats->LookasideHits = __atomic_load_n(&StubStats.LookasideHits, __ATOMIC_RELAXED);
+	Stats->WorkItems = __atomic_load_n(&StubStats.WorkItems, __ATOMIC_RELAXED);
+	Stats->Timers = __atomic_load_n(&StubStats.Timers, __ATOMIC_RELAXED);
+	Stats->Completions = __atomic_load_n(&StubStats.Completions, __ATOMIC_RELAXED);
+}
+
+ULONG WdfStubGetLockStats(PWDFSTUB_LOCK_STATS Stats, ULONG Count)
+{
+	ULONG i;
+
+	pthread_mutex_lock(&LockClassesLock);
+	for (i = 0; i < LockClassCount && i < Count; i++)
+	{
+		Stats[i].Name = LockClasses[i].Name;
+		Stats[i].Locks = LockClasses[i].Locks;
+		Stats[i].Acquisitions = __atomic_load_n(&LockClasses[i].Acquisitions, __ATOMIC_RELAXED);
+		Stats[i].Contended = __atomic_load_n(&LockClasses[i].Contended, __ATOMIC_RELAXED);
+		Stats[i].WaitTime = __atomic_load_n(&LockClasses[i].WaitTime, __ATOMIC_RELAXED);
+		Stats[i].HoldTime = __atomic_load_n(&LockClasses[i].HoldTime, __ATOMIC_RELAXED);
+		Stats[i].MaxHoldTime = __atomic_load_n(&LockClasses[i].MaxHoldTime, __ATOMIC_RELAXED);
+	}
+	pthread_mutex_unlock(&LockClassesLock);
+	return i;
+}
+
+VOID WdfStubResetStats(VOID)
+{
+	ULONG i;
+
+	memset(&StubStats, 0, sizeof(StubStats));
+	pthread_mutex_lock(&LockClassesLock);
+	for (i = 0; i < LockClassCount; i++)
+	{
+		LockClasses[i].Acquisitions = 0;
+		LockClasses[i].Contended = 0;
+		LockClasses[i].WaitTime = 0;
+		LockClasses[i].HoldTime = 0;
+		LockClasses[i].MaxHoldTime = 0;
+	}
+	pthread_mutex_unlock(&LockClassesLock);
+}
@@ -0,0 +1,109 @@
+/*++
+
+Module Name:
+
+    wdfstub.h
+
+Abstract:
+
+    This file contains the harness definitions of the framework stand-in,
+    the part of wdf.c that plays the system around the driver: loading it,
+    adding devices, opening and closing files on them, submitting requests
+    and playing the lower driver the filter sends them to.
+
+    Requests belong to the harness and are reused, every submission gets
+    them as a new IRP would, without the contexts the driver allocated on
+    the previous one. A request with METHOD_BUFFERED gets one system
+    buffer for its input and its output, as the I/O manager gives it.
+    The lower driver is called in line from WdfRequestSend and completes
+    the request by returning, so a read takes the completion routine of
+    the filter on the thread that submitted it, as one completed at once
+    by the serial driver does.
+
+    Work items run on a pool of worker threads, timers on a thread of
+    their own. The stand-in counts what the driver makes it do: objects
+    created, pool allocations, lookaside buffers reused, and for every
+    class of locks, named after the field the driver keeps them in, the
+    acquisitions, the contended ones, and the time spent waiting for and
+    holding them.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include "wdf.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+#define WDFSTUB_MAX_LOCK_CLASSES	32
+
+typedef VOID EVT_WDFSTUB_LOWER_DRIVER(WDFDEVICE Device, WDFREQUEST Request, PIO_STATUS_BLOCK IoStatus, PVOID Context);
+typedef EVT_WDFSTUB_LOWER_DRIVER *PFN_WDFSTUB_LOWER_DRIVER;
+
+typedef struct _WDFSTUB_STATS
+{
+	ULONG64 Objects;			// created by the driver
+	ULONG64 Allocations;		// pool allocations made for the driver
+	ULONG64 AllocatedBytes;		// their size
+	ULONG64 LookasideHits;		// lookaside buffers handed out again
+	ULONG64 WorkItems;			// work item callbacks run
+	ULONG64 Timers;				// timer callbacks run
+	ULONG64 Completions;		// requests completed
+
+} WDFSTUB_STATS, *PWDFSTUB_STATS;
+
+typedef struct _WDFSTUB_LOCK_STATS
+{
+	const char *Name;
+	ULONG Locks;				// lock objects of the class
+	ULONG64 Acquisitions;
+	ULONG64 Contended;			// acquisitions that had to wait
+	ULONG64 WaitTime;			// in ns
+	ULONG64 HoldTime;			// in ns
+	ULONG64 MaxHoldTime;		// in ns
+
+} WDFSTUB_LOCK_STATS, *PWDFSTUB_LOCK_STATS;
+
+//
+// The driver.
+//
+NTSTATUS WdfStubLoad(ULONG Workers);
+VOID WdfStubUnload(VOID);
+NTSTATUS WdfStubAddDevice(PCWSTR HardwareId, PCWSTR LowerName, WDFDEVICE *Device);
+VOID WdfStubSetLowerDriver(WDFDEVICE Device, PFN_WDFSTUB_LOWER_DRIVER LowerDriver, PVOID Context);
+
+//
+// Files and requests.
+//
+NTSTATUS WdfStubFileOpen(WDFDEVICE Device, WDFFILEOBJECT *FileObject);
+VOID WdfStubFileCleanup(WDFFILEOBJECT FileObject);
+VOID WdfStubFileClose(WDFFILEOBJECT FileObject);
+
+NTSTATUS WdfStubRequestCreate(WDFREQUEST *Request);
+VOID WdfStubRequestDelete(WDFREQUEST Request);
+VOID WdfStubRequestInitialize(WDFREQUEST Request, WDF_REQUEST_TYPE Type, WDFFILEOBJECT FileObject, ULONG IoControlCode,
+	PVOID Input, size_t InputLength, PVOID Output, size_t OutputLength);
+VOID WdfStubRequestSubmit(WDFDEVICE Device, WDFREQUEST Request);
+NTSTATUS WdfStubRequestWait(WDFREQUEST Request, PULONG_PTR Information);
+
+//
+// Returns once no work item and no timer is queued or running.
+//
+VOID WdfStubWaitForIdle(VOID);
+
+//
+// Statistics.
+//
+VOID WdfStubGetStats(PWDFSTUB_STATS Stats);
+ULONG WdfStubGetLockStats(PWDFSTUB_LOCK_STATS Stats, ULONG Count);
+VOID WdfStubResetStats(VOID);
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,17 @@
+/*++
+
+Module Name:
+
+    control.h
+
+Abstract:
+
+    The driver includes Control.h by this name, which only Windows finds.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "../../ComPortMonitor/Control.h"
@@ -0,0 +1,17 @@
+/*++
+
+Module Name:
+
+    device.h
+
+Abstract:
+
+    The driver includes Device.h by this name, which only Windows finds.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "../../ComPortMonitor/Device.h"
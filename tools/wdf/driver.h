@@ -0,0 +1,17 @@
+/*++
+
+Module Name:
+
+    driver.h
+
+Abstract:
+
+    The driver includes Driver.h by this name, which only Windows finds.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "../../ComPortMonitor/Driver.h"
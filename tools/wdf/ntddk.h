@@ -0,0 +1,418 @@
+/*++
+
+Module Name:
+
+    ntddk.h
+
+Abstract:
+
+    This file contains the user-mode stand-ins of the NT definitions the
+    driver uses, so Driver.c, Device.c, Queue.c and Control.c build
+    unmodified on any POSIX system, see wdf.h. Types keep their Windows
+    sizes, ULONG is 32 bits wide. The calls are implemented in wdf.c.
+
+    Structured exception handling is reduced to what the driver relies
+    on: a __finally block runs after its __try block is left by falling
+    off its end or by __leave, and an __except block never runs. Leaving
+    a __try block by return or goto skips its __finally block here, the
+    driver does not do that.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include <stddef.h>
+#include <stdint.h>
+#include <string.h>
+#include <wchar.h>
+
+typedef void VOID, *PVOID;
+typedef char CHAR, *PCHAR;
+typedef uint8_t UCHAR, *PUCHAR;
+typedef uint8_t BYTE;
+typedef int16_t SHORT;
+typedef uint16_t USHORT, *PUSHORT;
+typedef int32_t LONG, *PLONG;
+typedef uint32_t ULONG, *PULONG;
+typedef int64_t LONG64, *PLONG64;
+typedef uint64_t ULONG64, *PULONG64;
+typedef int64_t LONGLONG, *PLONGLONG;
+typedef uint64_t ULONGLONG;
+typedef uintptr_t ULONG_PTR, *PULONG_PTR;
+typedef size_t SIZE_T;
+typedef uint8_t BOOLEAN, *PBOOLEAN;
+typedef LONG NTSTATUS;
+typedef PVOID HANDLE;
+typedef wchar_t WCHAR, *PWCH, *PWSTR;
+typedef const wchar_t *PCWSTR;
+
+#ifndef TRUE
+#define TRUE 1
+#define FALSE 0
+#endif
+
+typedef union _LARGE_INTEGER
+{
+	struct
+	{
+		ULONG LowPart;
+		LONG HighPart;
+	};
+	LONGLONG QuadPart;
+
+} LARGE_INTEGER, *PLARGE_INTEGER;
+
+//
+// Annotations and declarations.
+//
+#define _In_
+#define _In_opt_
+#define _Out_
+#define _Out_opt_
+#define _Inout_
+#define _Inout_opt_
+
+#ifdef __cplusplus
+#define EXTERN_C			extern "C"
+#define EXTERN_C_START		extern "C" {
+#define EXTERN_C_END		}
+#else
+#define EXTERN_C			extern
+#define EXTERN_C_START
+#define EXTERN_C_END
+#endif
+
+#define FORCEINLINE			static inline __attribute__((always_inline))
+#define DECLSPEC_CACHEALIGN	__attribute__((aligned(64)))
+#define C_ASSERT(e)			_Static_assert(e, #e)
+#define ANYSIZE_ARRAY		1
+#define FIELD_OFFSET(Type, Field)	((LONG)offsetof(Type, Field))
+#define CONTAINING_RECORD(Address, Type, Field)	((Type *)((PUCHAR)(Address) - offsetof(Type, Field)))
+#define UNREFERENCED_PARAMETER(P)	((void)(P))
+
+#define MAXUSHORT			0xFFFF
+#define MAXULONG			0xFFFFFFFFUL
+#define MAXLONGLONG			0x7FFFFFFFFFFFFFFFLL
+
+#ifndef min
+#define min(a, b)			(((a) < (b)) ? (a) : (b))
+#define max(a, b)			(((a) > (b)) ? (a) : (b))
+#endif
+
+#define PAGED_CODE()
+#define KdPrint(Arguments)
+#define KdBreakPoint()
+
+#define __try				do
+#define __leave				break
+#define __finally			while (0);
+#define __except(Filter)	while (0); if (0)
+#define EXCEPTION_EXECUTE_HANDLER	1
+
+//
+// Status values.
+//
+#define NT_SUCCESS(Status)					((NTSTATUS)(Status) >= 0)
+
+#define STATUS_SUCCESS						((NTSTATUS)0x00000000L)
+#define STATUS_TIMEOUT						((NTSTATUS)0x00000102L)
+#define STATUS_PENDING						((NTSTATUS)0x00000103L)
+#define STATUS_OBJECT_NAME_EXISTS			((NTSTATUS)0x40000000L)
+#define STATUS_BUFFER_OVERFLOW				((NTSTATUS)0x80000005L)
+#define STATUS_NO_MORE_ENTRIES				((NTSTATUS)0x8000001AL)
+#define STATUS_UNSUCCESSFUL					((NTSTATUS)0xC0000001L)
+#define STATUS_NOT_IMPLEMENTED				((NTSTATUS)0xC0000002L)
+#define STATUS_INFO_LENGTH_MISMATCH			((NTSTATUS)0xC0000004L)
+#define STATUS_INVALID_PARAMETER			((NTSTATUS)0xC000000DL)
+#define STATUS_INVALID_DEVICE_REQUEST		((NTSTATUS)0xC0000010L)
+#define STATUS_BUFFER_TOO_SMALL				((NTSTATUS)0xC0000023L)
+#define STATUS_INSUFFICIENT_RESOURCES		((NTSTATUS)0xC000009AL)
+#define STATUS_NOT_SUPPORTED				((NTSTATUS)0xC00000BBL)
+#define STATUS_CANCELLED					((NTSTATUS)0xC0000120L)
+#define STATUS_INVALID_DEVICE_STATE			((NTSTATUS)0xC0000184L)
+#define STATUS_NOT_FOUND					((NTSTATUS)0xC0000225L)
+#define STATUS_DEVICE_DOES_NOT_EXIST		((NTSTATUS)0xC00000C0L)
+#define STATUS_ALREADY_REGISTERED			((NTSTATUS)0xC0000718L)
+
+//
+// Doubly linked lists.
+//
+typedef struct _LIST_ENTRY
+{
+	struct _LIST_ENTRY *Flink;
+	struct _LIST_ENTRY *Blink;
+
+} LIST_ENTRY, *PLIST_ENTRY;
+
+FORCEINLINE VOID InitializeListHead(PLIST_ENTRY ListHead)
+{
+	ListHead->Flink = ListHead->Blink = ListHead;
+}
+
+FORCEINLINE BOOLEAN IsListEmpty(const LIST_ENTRY *ListHead)
+{
+	return ListHead->Flink == ListHead;
+}
+
+FORCEINLINE VOID InsertTailList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+	Entry->Flink = ListHead;
+	Entry->Blink = ListHead->Blink;
+	ListHead->Blink->Flink = Entry;
+	ListHead->Blink = Entry;
+}
+
+FORCEINLINE VOID InsertHeadList(PLIST_ENTRY ListHead, PLIST_ENTRY Entry)
+{
+	Entry->Flink = ListHead->Flink;
+	Entry->Blink = ListHead;
+	ListHead->Flink->Blink = Entry;
+	ListHead->Flink = Entry;
+}
+
+FORCEINLINE BOOLEAN RemoveEntryList(PLIST_ENTRY Entry)
+{
+	PLIST_ENTRY flink = Entry->Flink, blink = Entry->Blink;
+
+	blink->Flink = flink;
+	flink->Blink = blink;
+	return flink == blink;
+}
+
+//
+// Interlocked operations and ordered accesses.
+//
+FORCEINLINE LONG InterlockedExchange(LONG volatile *Target, LONG Value)
+{
+	return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG InterlockedIncrement(LONG volatile *Target)
+{
+	return __atomic_add_fetch(Target, 1, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG InterlockedDecrement(LONG volatile *Target)
+{
+	return __atomic_sub_fetch(Target, 1, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG64 InterlockedExchangeAddNoFence64(LONG64 volatile *Target, LONG64 Value)
+{
+	return __atomic_fetch_add(Target, Value, __ATOMIC_RELAXED);
+}
+
+FORCEINLINE PVOID InterlockedExchangePointer(PVOID volatile *Target, PVOID Value)
+{
+	return __atomic_exchange_n(Target, Value, __ATOMIC_SEQ_CST);
+}
+
+FORCEINLINE LONG64 ReadNoFence64(LONG64 const volatile *Source)
+{
+	return __atomic_load_n(Source, __ATOMIC_RELAXED);
+}
+
+FORCEINLINE ULONG ReadULongAcquire(ULONG const volatile *Source)
+{
+	return __atomic_load_n(Source, __ATOMIC_ACQUIRE);
+}
+
+FORCEINLINE VOID WriteULongRelease(ULONG volatile *Destination, ULONG Value)
+{
+	__atomic_store_n(Destination, Value, __ATOMIC_RELEASE);
+}
+
+//
+// Strings.
+//
+typedef struct _UNICODE_STRING
+{
+	USHORT Length;
+	USHORT MaximumLength;
+	PWCH Buffer;
+
+} UNICODE_STRING, *PUNICODE_STRING;
+
+typedef const UNICODE_STRING *PCUNICODE_STRING;
+
+typedef struct _ANSI_STRING
+{
+	USHORT Length;
+	USHORT MaximumLength;
+	PCHAR Buffer;
+
+} ANSI_STRING, *PANSI_STRING;
+
+#define DECLARE_CONST_UNICODE_STRING(Name, String) \
+	const WCHAR Name ## _buffer[] = String; \
+	const UNICODE_STRING Name = { sizeof(String) - sizeof(WCHAR), sizeof(String), (PWCH)Name ## _buffer }
+
+#define RtlZeroMemory(Destination, Length)			memset((Destination), 0, (Length))
+#define RtlCopyMemory(Destination, Source, Length)	memcpy((Destination), (Source), (Length))
+
+VOID RtlInitUnicodeString(PUNICODE_STRING Destination, PCWSTR Source);
+BOOLEAN RtlEqualUnicodeString(PCUNICODE_STRING String1, PCUNICODE_STRING String2, BOOLEAN CaseInSensitive);
+NTSTATUS RtlUnicodeStringToAnsiString(PANSI_STRING Destination, PCUNICODE_STRING Source, BOOLEAN AllocateDestinationString);
+VOID RtlFreeAnsiString(PANSI_STRING AnsiString);
+
+//
+// I/O requests.
+//
+#define IRP_MJ_CREATE					0x00
+#define IRP_MJ_CLOSE					0x02
+#define IRP_MJ_READ						0x03
+#define IRP_MJ_WRITE					0x04
+#define IRP_MJ_DEVICE_CONTROL			0x0e
+#define IRP_MJ_INTERNAL_DEVICE_CONTROL	0x0f
+#define IRP_MJ_CLEANUP					0x12
+#define IRP_MJ_MAXIMUM_FUNCTION			0x1b
+
+#define CTL_CODE(DeviceType, Function, Method, Access) \
+	(((DeviceType) << 16) | ((Access) << 14) | ((Function) << 2) | (Method))
+
+#define METHOD_BUFFERED					0
+#define METHOD_IN_DIRECT				1
+#define METHOD_OUT_DIRECT				2
+#define METHOD_NEITHER					3
+
+#define FILE_ANY_ACCESS					0
+
+#define FILE_DEVICE_SERIAL_PORT			0x0000001b
+#define FILE_DEVICE_UNKNOWN				0x00000022
+
+typedef enum _POOL_TYPE
+{
+	NonPagedPool,
+	PagedPool,
+
+} POOL_TYPE;
+
+typedef UCHAR KIRQL, *PKIRQL;
+
+#define PASSIVE_LEVEL	0
+#define APC_LEVEL		1
+#define DISPATCH_LEVEL	2
+
+typedef enum _MODE
+{
+	KernelMode,
+	UserMode,
+
+} KPROCESSOR_MODE;
+
+typedef struct _DRIVER_OBJECT
+{
+	PVOID DriverExtension;
+
+} DRIVER_OBJECT, *PDRIVER_OBJECT;
+
+typedef struct _DEVICE_OBJECT
+{
+	UNICODE_STRING Name;
+	struct _DEVICE_OBJECT *LowerDevice;
+
+} DEVICE_OBJECT, *PDEVICE_OBJECT;
+
+typedef struct _IO_STATUS_BLOCK
+{
+	NTSTATUS Status;
+	ULONG_PTR Information;
+
+} IO_STATUS_BLOCK, *PIO_STATUS_BLOCK;
+
+typedef struct _IRP
+{
+	ULONG RequestorProcessId;
+
+} IRP, *PIRP;
+
+typedef struct _MDL
+{
+	PVOID StartVa;
+	ULONG ByteCount;
+
+} MDL, *PMDL;
+
+typedef struct _EPROCESS *PEPROCESS;
+
+typedef struct _KAPC_STATE
+{
+	PEPROCESS Process;
+
+} KAPC_STATE, *PKAPC_STATE;
+
+typedef struct _PROCESSOR_NUMBER
+{
+	USHORT Group;
+	UCHAR Number;
+	UCHAR Reserved;
+
+} PROCESSOR_NUMBER, *PPROCESSOR_NUMBER;
+
+#define ALL_PROCESSOR_GROUPS			0xffff
+
+typedef enum _DEVICE_REGISTRY_PROPERTY
+{
+	DevicePropertyDeviceDescription,
+	DevicePropertyHardwareID,
+
+} DEVICE_REGISTRY_PROPERTY;
+
+typedef enum _MEMORY_CACHING_TYPE
+{
+	MmNonCached,
+	MmCached,
+
+} MEMORY_CACHING_TYPE;
+
+typedef enum _MM_PAGE_PRIORITY
+{
+	LowPagePriority,
+	NormalPagePriority = 16,
+	HighPagePriority = 32,
+
+} MM_PAGE_PRIORITY;
+
+#define MdlMappingNoExecute				0x40000000
+
+#define PAGE_SIZE						4096
+#define ROUND_TO_PAGES(Size)			(((ULONG_PTR)(Size) + PAGE_SIZE - 1) & ~(ULONG_PTR)(PAGE_SIZE - 1))
+
+typedef LARGE_INTEGER PHYSICAL_ADDRESS;
+
+#define MM_ALLOCATE_FULLY_REQUIRED		0x00000004
+
+typedef NTSTATUS DRIVER_INITIALIZE(PDRIVER_OBJECT DriverObject, PUNICODE_STRING RegistryPath);
+typedef VOID (*PCREATE_PROCESS_NOTIFY_ROUTINE)(HANDLE ParentId, HANDLE ProcessId, BOOLEAN Create);
+
+LARGE_INTEGER KeQueryPerformanceCounter(PLARGE_INTEGER PerformanceFrequency);
+ULONG KeQueryMaximumProcessorCountEx(USHORT GroupNumber);
+ULONG KeGetCurrentProcessorNumberEx(PPROCESSOR_NUMBER ProcNumber);
+KIRQL KeGetCurrentIrql(VOID);
+VOID KeStackAttachProcess(PEPROCESS Process, PKAPC_STATE ApcState);
+VOID KeUnstackDetachProcess(PKAPC_STATE ApcState);
+
+ULONG IoGetRequestorProcessId(PIRP Irp);
+PDEVICE_OBJECT IoGetLowerDeviceObject(PDEVICE_OBJECT DeviceObject);
+
+PMDL MmAllocatePagesForMdlEx(PHYSICAL_ADDRESS LowAddress, PHYSICAL_ADDRESS HighAddress, PHYSICAL_ADDRESS SkipBytes,
+	SIZE_T TotalBytes, MEMORY_CACHING_TYPE CacheType, ULONG Flags);
+VOID MmFreePagesFromMdl(PMDL MemoryDescriptorList);
+VOID ExFreePool(PVOID P);
+PVOID MmMapLockedPagesSpecifyCache(PMDL MemoryDescriptorList, KPROCESSOR_MODE AccessMode, MEMORY_CACHING_TYPE CacheType,
+	PVOID RequestedAddress, ULONG BugCheckOnFailure, ULONG Priority);
+VOID MmUnmapLockedPages(PVOID BaseAddress, PMDL MemoryDescriptorList);
+
+#define MmGetSystemAddressForMdlSafe(Mdl, Priority) \
+	MmMapLockedPagesSpecifyCache(Mdl, KernelMode, MmCached, NULL, FALSE, Priority)
+
+PEPROCESS PsGetCurrentProcess(VOID);
+HANDLE PsGetProcessId(PEPROCESS Process);
+NTSTATUS PsSetCreateProcessNotifyRoutine(PCREATE_PROCESS_NOTIFY_ROUTINE NotifyRoutine, BOOLEAN Remove);
+
+#define ObReferenceObject(Object)		((void)(Object))
+#define ObDereferenceObject(Object)		((void)(Object))
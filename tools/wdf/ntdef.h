@@ -0,0 +1,19 @@
+/*++
+
+Module Name:
+
+    ntdef.h
+
+Abstract:
+
+    The definitions the driver takes from this header are in ntddk.h.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include "ntddk.h"
@@ -0,0 +1,28 @@
+/*++
+
+Module Name:
+
+    ntifs.h
+
+Abstract:
+
+    This file contains the user-mode stand-ins of the object manager
+    definitions the driver uses on top of ntddk.h.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include "ntddk.h"
+
+typedef struct _OBJECT_NAME_INFORMATION
+{
+	UNICODE_STRING Name;
+
+} OBJECT_NAME_INFORMATION, *POBJECT_NAME_INFORMATION;
+
+NTSTATUS ObQueryNameString(PVOID Object, POBJECT_NAME_INFORMATION ObjectNameInfo, ULONG Length, PULONG ReturnLength);
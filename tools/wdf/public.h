@@ -0,0 +1,17 @@
+/*++
+
+Module Name:
+
+    public.h
+
+Abstract:
+
+    The driver includes Public.h by this name, which only Windows finds.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "../../ComPortMonitor/Public.h"
@@ -0,0 +1,17 @@
+/*++
+
+Module Name:
+
+    queue.h
+
+Abstract:
+
+    The driver includes Queue.h by this name, which only Windows finds.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "../../ComPortMonitor/Queue.h"
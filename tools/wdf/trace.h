@@ -0,0 +1,17 @@
+/*++
+
+Module Name:
+
+    trace.h
+
+Abstract:
+
+    The driver includes Trace.h by this name, which only Windows finds.
+
+Environment:
+
+    User mode
+
+--*/
+
+#include "../../ComPortMonitor/Trace.h"
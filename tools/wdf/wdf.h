@@ -0,0 +1,519 @@
+/*++
+
+Module Name:
+
+    wdf.h
+
+Abstract:
+
+    This file contains the user-mode stand-ins of the framework
+    definitions the driver uses. Together with ntddk.h they let the
+    driver build unmodified outside of the WDK, against wdf.c, which
+    implements the objects as far as the driver and the harness of
+    wdfstub.h drive them: parent and child objects with typed contexts,
+    memory and lookaside lists, collections, wait locks and spin locks,
+    work items and timers run by threads of their own, manual and
+    dispatching I/O queues, requests, and I/O targets that hand the
+    requests to a lower driver played by the harness.
+
+    Handles are pointers to the objects of wdf.c. Buffer pointers are
+    returned through PVOID, not PVOID *, as the driver passes the address
+    of typed pointers, which the compiler of the WDK accepts.
+
+    WdfWaitLockCreate and WdfSpinLockCreate name the lock after the
+    expression it is stored through, the harness reports the hold times
+    by that name.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include "ntddk.h"
+
+typedef PVOID WDFOBJECT;
+typedef PVOID WDFCONTEXT;
+
+#define WDF_DECLARE_HANDLE(Name)	typedef struct Name ## __ *Name
+
+WDF_DECLARE_HANDLE(WDFDRIVER);
+WDF_DECLARE_HANDLE(WDFDEVICE);
+WDF_DECLARE_HANDLE(WDFFILEOBJECT);
+WDF_DECLARE_HANDLE(WDFQUEUE);
+WDF_DECLARE_HANDLE(WDFREQUEST);
+WDF_DECLARE_HANDLE(WDFIOTARGET);
+WDF_DECLARE_HANDLE(WDFMEMORY);
+WDF_DECLARE_HANDLE(WDFLOOKASIDE);
+WDF_DECLARE_HANDLE(WDFCOLLECTION);
+WDF_DECLARE_HANDLE(WDFWAITLOCK);
+WDF_DECLARE_HANDLE(WDFSPINLOCK);
+WDF_DECLARE_HANDLE(WDFWORKITEM);
+WDF_DECLARE_HANDLE(WDFTIMER);
+
+typedef struct WDFDEVICE_INIT WDFDEVICE_INIT, *PWDFDEVICE_INIT;
+
+#define WDF_NO_HANDLE				NULL
+#define WDF_NO_OBJECT_ATTRIBUTES	NULL
+#define WDF_NO_EVENT_CALLBACK		NULL
+#define WDF_NO_SEND_OPTIONS			NULL
+
+#define WDF_REL_TIMEOUT_IN_US(Time)	(-(LONGLONG)(Time) * 10)
+#define WDF_REL_TIMEOUT_IN_MS(Time)	(-(LONGLONG)(Time) * 10000)
+
+typedef enum _WDF_TRI_STATE
+{
+	WdfFalse,
+	WdfTrue,
+	WdfUseDefault,
+
+} WDF_TRI_STATE;
+
+typedef enum _WDF_EXECUTION_LEVEL
+{
+	WdfExecutionLevelInvalid,
+	WdfExecutionLevelInheritFromParent,
+	WdfExecutionLevelPassive,
+	WdfExecutionLevelDispatch,
+
+} WDF_EXECUTION_LEVEL;
+
+typedef enum _WDF_SYNCHRONIZATION_SCOPE
+{
+	WdfSynchronizationScopeInvalid,
+	WdfSynchronizationScopeInheritFromParent,
+	WdfSynchronizationScopeDevice,
+	WdfSynchronizationScopeQueue,
+	WdfSynchronizationScopeNone,
+
+} WDF_SYNCHRONIZATION_SCOPE;
+
+//
+// Objects and their contexts.
+//
+typedef VOID EVT_WDF_OBJECT_CONTEXT_CLEANUP(WDFOBJECT Object);
+typedef EVT_WDF_OBJECT_CONTEXT_CLEANUP *PFN_WDF_OBJECT_CONTEXT_CLEANUP;
+typedef VOID EVT_WDF_OBJECT_CONTEXT_DESTROY(WDFOBJECT Object);
+typedef EVT_WDF_OBJECT_CONTEXT_DESTROY *PFN_WDF_OBJECT_CONTEXT_DESTROY;
+
+typedef struct _WDF_OBJECT_CONTEXT_TYPE_INFO
+{
+	ULONG Size;
+	const char *ContextName;
+	size_t ContextSize;
+	const struct _WDF_OBJECT_CONTEXT_TYPE_INFO *UniqueType;
+	PVOID EvtDriverGetUniqueContextType;
+
+} WDF_OBJECT_CONTEXT_TYPE_INFO, *PWDF_OBJECT_CONTEXT_TYPE_INFO;
+
+typedef const WDF_OBJECT_CONTEXT_TYPE_INFO *PCWDF_OBJECT_CONTEXT_TYPE_INFO;
+
+typedef struct _WDF_OBJECT_ATTRIBUTES
+{
+	ULONG Size;
+	PFN_WDF_OBJECT_CONTEXT_CLEANUP EvtCleanupCallback;
+	PFN_WDF_OBJECT_CONTEXT_DESTROY EvtDestroyCallback;
+	WDF_EXECUTION_LEVEL ExecutionLevel;
+	WDF_SYNCHRONIZATION_SCOPE SynchronizationScope;
+	WDFOBJECT ParentObject;
+	size_t ContextSizeOverride;
+	PCWDF_OBJECT_CONTEXT_TYPE_INFO ContextTypeInfo;
+
+} WDF_OBJECT_ATTRIBUTES, *PWDF_OBJECT_ATTRIBUTES;
+
+FORCEINLINE VOID WDF_OBJECT_ATTRIBUTES_INIT(PWDF_OBJECT_ATTRIBUTES Attributes)
+{
+	RtlZeroMemory(Attributes, sizeof(*Attributes));
+	Attributes->Size = sizeof(*Attributes);
+	Attributes->ExecutionLevel = WdfExecutionLevelInheritFromParent;
+	Attributes->SynchronizationScope = WdfSynchronizationScopeInheritFromParent;
+}
+
+//
+// The type information is shared by every file declaring the context
+// type, as __declspec(selectany) shares it on Windows.
+//
+#define WDF_GET_CONTEXT_TYPE_INFO(ContextType)	(_WDF_ ## ContextType ## _TYPE_INFO.UniqueType)
+
+#define WDF_DECLARE_CONTEXT_TYPE_WITH_NAME(ContextType, CastingFunction) \
+	__attribute__((weak)) const WDF_OBJECT_CONTEXT_TYPE_INFO _WDF_ ## ContextType ## _TYPE_INFO = \
+		{ sizeof(WDF_OBJECT_CONTEXT_TYPE_INFO), #ContextType, sizeof(ContextType), &_WDF_ ## ContextType ## _TYPE_INFO, NULL }; \
+	static inline ContextType *CastingFunction(WDFOBJECT Handle) \
+	{ \
+		return (ContextType *)WdfObjectGetTypedContextWorker(Handle, WDF_GET_CONTEXT_TYPE_INFO(ContextType)); \
+	}
+
+#define WDF_OBJECT_ATTRIBUTES_INIT_CONTEXT_TYPE(Attributes, ContextType) \
+	(WDF_OBJECT_ATTRIBUTES_INIT(Attributes), (Attributes)->ContextTypeInfo = WDF_GET_CONTEXT_TYPE_INFO(ContextType))
+
+PVOID WdfObjectGetTypedContextWorker(WDFOBJECT Handle, PCWDF_OBJECT_CONTEXT_TYPE_INFO TypeInfo);
+WDFOBJECT WdfObjectContextGetObject(PVOID ContextPointer);
+NTSTATUS WdfObjectAllocateContext(WDFOBJECT Handle, PWDF_OBJECT_ATTRIBUTES ContextAttributes, PVOID Context);
+VOID WdfObjectReference(WDFOBJECT Handle);
+VOID WdfObjectDereference(WDFOBJECT Handle);
+VOID WdfObjectDelete(WDFOBJECT Object);
+
+//
+// Driver and devices.
+//
+typedef NTSTATUS EVT_WDF_DRIVER_DEVICE_ADD(WDFDRIVER Driver, PWDFDEVICE_INIT DeviceInit);
+typedef EVT_WDF_DRIVER_DEVICE_ADD *PFN_WDF_DRIVER_DEVICE_ADD;
+typedef VOID EVT_WDF_DEVICE_FILE_CREATE(WDFDEVICE Device, WDFREQUEST Request, WDFFILEOBJECT FileObject);
+typedef EVT_WDF_DEVICE_FILE_CREATE *PFN_WDF_DEVICE_FILE_CREATE;
+typedef VOID EVT_WDF_FILE_CLOSE(WDFFILEOBJECT FileObject);
+typedef EVT_WDF_FILE_CLOSE *PFN_WDF_FILE_CLOSE;
+typedef VOID EVT_WDF_FILE_CLEANUP(WDFFILEOBJECT FileObject);
+typedef EVT_WDF_FILE_CLEANUP *PFN_WDF_FILE_CLEANUP;
+typedef VOID EVT_WDF_IO_IN_CALLER_CONTEXT(WDFDEVICE Device, WDFREQUEST Request);
+typedef EVT_WDF_IO_IN_CALLER_CONTEXT *PFN_WDF_IO_IN_CALLER_CONTEXT;
+
+typedef struct _WDF_DRIVER_CONFIG
+{
+	ULONG Size;
+	PFN_WDF_DRIVER_DEVICE_ADD EvtDriverDeviceAdd;
+	PVOID EvtDriverUnload;
+	ULONG DriverInitFlags;
+	ULONG DriverPoolTag;
+
+} WDF_DRIVER_CONFIG, *PWDF_DRIVER_CONFIG;
+
+FORCEINLINE VOID WDF_DRIVER_CONFIG_INIT(PWDF_DRIVER_CONFIG Config, PFN_WDF_DRIVER_DEVICE_ADD EvtDriverDeviceAdd)
+{
+	RtlZeroMemory(Config, sizeof(*Config));
+	Config->Size = sizeof(*Config);
+	Config->EvtDriverDeviceAdd = EvtDriverDeviceAdd;
+}
+
+typedef enum _WDF_FILEOBJECT_CLASS
+{
+	WdfFileObjectInvalid,
+	WdfFileObjectNotRequired,
+	WdfFileObjectWdfCanUseFsContext,
+	WdfFileObjectWdfCanUseFsContext2,
+	WdfFileObjectWdfCannotUseFsContexts,
+
+} WDF_FILEOBJECT_CLASS;
+
+typedef struct _WDF_FILEOBJECT_CONFIG
+{
+	ULONG Size;
+	PFN_WDF_DEVICE_FILE_CREATE EvtDeviceFileCreate;
+	PFN_WDF_FILE_CLOSE EvtFileClose;
+	PFN_WDF_FILE_CLEANUP EvtFileCleanup;
+	WDF_TRI_STATE AutoForwardCleanupClose;
+	WDF_FILEOBJECT_CLASS FileObjectClass;
+
+} WDF_FILEOBJECT_CONFIG, *PWDF_FILEOBJECT_CONFIG;
+
+FORCEINLINE VOID WDF_FILEOBJECT_CONFIG_INIT(PWDF_FILEOBJECT_CONFIG Config, PFN_WDF_DEVICE_FILE_CREATE EvtDeviceFileCreate,
+	PFN_WDF_FILE_CLOSE EvtFileClose, PFN_WDF_FILE_CLEANUP EvtFileCleanup)
+{
+	RtlZeroMemory(Config, sizeof(*Config));
+	Config->Size = sizeof(*Config);
+	Config->EvtDeviceFileCreate = EvtDeviceFileCreate;
+	Config->EvtFileClose = EvtFileClose;
+	Config->EvtFileCleanup = EvtFileCleanup;
+	Config->AutoForwardCleanupClose = WdfUseDefault;
+	Config->FileObjectClass = WdfFileObjectWdfCannotUseFsContexts;
+}
+
+extern const UNICODE_STRING SDDL_DEVOBJ_SYS_ALL_ADM_RWX_WORLD_RWX_RES_RWX;
+
+NTSTATUS WdfDriverCreate(PDRIVER_OBJECT DriverObject, PCUNICODE_STRING RegistryPath, PWDF_OBJECT_ATTRIBUTES DriverAttributes,
+	PWDF_DRIVER_CONFIG DriverConfig, WDFDRIVER *Driver);
+
+VOID WdfFdoInitSetFilter(PWDFDEVICE_INIT DeviceInit);
+NTSTATUS WdfFdoInitQueryProperty(PWDFDEVICE_INIT DeviceInit, DEVICE_REGISTRY_PROPERTY DeviceProperty, ULONG BufferLength,
+	PVOID PropertyBuffer, PULONG ResultLength);
+VOID WdfDeviceInitSetExclusive(PWDFDEVICE_INIT DeviceInit, BOOLEAN IsExclusive);
+NTSTATUS WdfDeviceInitAssignName(PWDFDEVICE_INIT DeviceInit, PCUNICODE_STRING DeviceName);
+NTSTATUS WdfDeviceInitAssignSDDLString(PWDFDEVICE_INIT DeviceInit, PCUNICODE_STRING SDDLString);
+VOID WdfDeviceInitSetDeviceType(PWDFDEVICE_INIT DeviceInit, ULONG DeviceType);
+VOID WdfDeviceInitSetFileObjectConfig(PWDFDEVICE_INIT DeviceInit, PWDF_FILEOBJECT_CONFIG FileObjectConfig,
+	PWDF_OBJECT_ATTRIBUTES FileObjectAttributes);
+VOID WdfDeviceInitSetIoInCallerContextCallback(PWDFDEVICE_INIT DeviceInit, PFN_WDF_IO_IN_CALLER_CONTEXT EvtIoInCallerContext);
+VOID WdfDeviceInitFree(PWDFDEVICE_INIT DeviceInit);
+
+NTSTATUS WdfDeviceCreate(PWDFDEVICE_INIT *DeviceInit, PWDF_OBJECT_ATTRIBUTES DeviceAttributes, WDFDEVICE *Device);
+NTSTATUS WdfDeviceCreateSymbolicLink(WDFDEVICE Device, PCUNICODE_STRING SymbolicLinkName);
+VOID WdfControlFinishInitializing(WDFDEVICE Device);
+WDFIOTARGET WdfDeviceGetIoTarget(WDFDEVICE Device);
+PDEVICE_OBJECT WdfDeviceWdmGetAttachedDevice(WDFDEVICE Device);
+NTSTATUS WdfDeviceEnqueueRequest(WDFDEVICE Device, WDFREQUEST Request);
+WDFDEVICE WdfFileObjectGetDevice(WDFFILEOBJECT FileObject);
+
+//
+// Memory, lookaside lists and collections.
+//
+NTSTATUS WdfMemoryCreate(PWDF_OBJECT_ATTRIBUTES Attributes, POOL_TYPE PoolType, ULONG PoolTag, size_t BufferSize,
+	WDFMEMORY *Memory, PVOID Buffer);
+NTSTATUS WdfLookasideListCreate(PWDF_OBJECT_ATTRIBUTES LookasideAttributes, size_t BufferSize, POOL_TYPE PoolType,
+	PWDF_OBJECT_ATTRIBUTES MemoryAttributes, ULONG PoolTag, WDFLOOKASIDE *Lookaside);
+NTSTATUS WdfMemoryCreateFromLookaside(WDFLOOKASIDE Lookaside, WDFMEMORY *Memory);
+PVOID WdfMemoryGetBuffer(WDFMEMORY Memory, size_t *BufferSize);
+NTSTATUS WdfMemoryCopyFromBuffer(WDFMEMORY DestinationMemory, size_t DestinationOffset, const VOID *Buffer, size_t NumBytesToCopyFrom);
+NTSTATUS WdfMemoryCopyToBuffer(WDFMEMORY SourceMemory, size_t SourceOffset, PVOID Buffer, size_t NumBytesToCopyTo);
+
+NTSTATUS WdfCollectionCreate(PWDF_OBJECT_ATTRIBUTES CollectionAttributes, WDFCOLLECTION *Collection);
+ULONG WdfCollectionGetCount(WDFCOLLECTION Collection);
+NTSTATUS WdfCollectionAdd(WDFCOLLECTION Collection, WDFOBJECT Object);
+VOID WdfCollectionRemove(WDFCOLLECTION Collection, WDFOBJECT Item);
+WDFOBJECT WdfCollectionGetItem(WDFCOLLECTION Collection, ULONG Index);
+WDFOBJECT WdfCollectionGetFirstItem(WDFCOLLECTION Collection);
+
+//
+// Locks.
+//
+#define WdfWaitLockCreate(LockAttributes, Lock)	WdfStubWaitLockCreate(LockAttributes, Lock, #Lock)
+#define WdfSpinLockCreate(SpinLockAttributes, SpinLock)	WdfStubSpinLockCreate(SpinLockAttributes, SpinLock, #SpinLock)
+
+NTSTATUS WdfStubWaitLockCreate(PWDF_OBJECT_ATTRIBUTES LockAttributes, WDFWAITLOCK *Lock, const char *Name);
+NTSTATUS WdfWaitLockAcquire(WDFWAITLOCK Lock, PLONGLONG Timeout);
+VOID WdfWaitLockRelease(WDFWAITLOCK Lock);
+NTSTATUS WdfStubSpinLockCreate(PWDF_OBJECT_ATTRIBUTES SpinLockAttributes, WDFSPINLOCK *SpinLock, const char *Name);
+VOID WdfSpinLockAcquire(WDFSPINLOCK SpinLock);
+VOID WdfSpinLockRelease(WDFSPINLOCK SpinLock);
+
+//
+// Work items and timers.
+//
+typedef VOID EVT_WDF_WORKITEM(WDFWORKITEM WorkItem);
+typedef EVT_WDF_WORKITEM *PFN_WDF_WORKITEM;
+typedef VOID EVT_WDF_TIMER(WDFTIMER Timer);
+typedef EVT_WDF_TIMER *PFN_WDF_TIMER;
+
+typedef struct _WDF_WORKITEM_CONFIG
+{
+	ULONG Size;
+	PFN_WDF_WORKITEM EvtWorkItemFunc;
+	BOOLEAN AutomaticSerialization;
+
+} WDF_WORKITEM_CONFIG, *PWDF_WORKITEM_CONFIG;
+
+FORCEINLINE VOID WDF_WORKITEM_CONFIG_INIT(PWDF_WORKITEM_CONFIG Config, PFN_WDF_WORKITEM EvtWorkItemFunc)
+{
+	RtlZeroMemory(Config, sizeof(*Config));
+	Config->Size = sizeof(*Config);
+	Config->EvtWorkItemFunc = EvtWorkItemFunc;
+	Config->AutomaticSerialization = TRUE;
+}
+
+typedef struct _WDF_TIMER_CONFIG
+{
+	ULONG Size;
+	PFN_WDF_TIMER EvtTimerFunc;
+	ULONG Period;
+	BOOLEAN AutomaticSerialization;
+	ULONG TolerableDelay;
+
+} WDF_TIMER_CONFIG, *PWDF_TIMER_CONFIG;
+
+FORCEINLINE VOID WDF_TIMER_CONFIG_INIT(PWDF_TIMER_CONFIG Config, PFN_WDF_TIMER EvtTimerFunc)
+{
+	RtlZeroMemory(Config, sizeof(*Config));
+	Config->Size = sizeof(*Config);
+	Config->EvtTimerFunc = EvtTimerFunc;
+	Config->AutomaticSerialization = TRUE;
+}
+
+NTSTATUS WdfWorkItemCreate(PWDF_WORKITEM_CONFIG Config, PWDF_OBJECT_ATTRIBUTES Attributes, WDFWORKITEM *WorkItem);
+VOID WdfWorkItemEnqueue(WDFWORKITEM WorkItem);
+WDFOBJECT WdfWorkItemGetParentObject(WDFWORKITEM WorkItem);
+NTSTATUS WdfTimerCreate(PWDF_TIMER_CONFIG Config, PWDF_OBJECT_ATTRIBUTES Attributes, WDFTIMER *Timer);
+BOOLEAN WdfTimerStart(WDFTIMER Timer, LONGLONG DueTime);
+BOOLEAN WdfTimerStop(WDFTIMER Timer, BOOLEAN Wait);
+WDFOBJECT WdfTimerGetParentObject(WDFTIMER Timer);
+
+//
+// Requests and queues.
+//
+typedef enum _WDF_REQUEST_TYPE
+{
+	WdfRequestTypeCreate = IRP_MJ_CREATE,
+	WdfRequestTypeClose = IRP_MJ_CLOSE,
+	WdfRequestTypeRead = IRP_MJ_READ,
+	WdfRequestTypeWrite = IRP_MJ_WRITE,
+	WdfRequestTypeDeviceControl = IRP_MJ_DEVICE_CONTROL,
+	WdfRequestTypeDeviceControlInternal = IRP_MJ_INTERNAL_DEVICE_CONTROL,
+	WdfRequestTypeCleanup = IRP_MJ_CLEANUP,
+
+} WDF_REQUEST_TYPE;
+
+typedef struct _WDF_REQUEST_PARAMETERS
+{
+	USHORT Size;
+	UCHAR MinorFunction;
+	WDF_REQUEST_TYPE Type;
+	union
+	{
+		struct
+		{
+			size_t Length;
+			ULONG Key;
+			LONGLONG DeviceOffset;
+		} Read;
+		struct
+		{
+			size_t Length;
+			ULONG Key;
+			LONGLONG DeviceOffset;
+		} Write;
+		struct
+		{
+			size_t OutputBufferLength;
+			size_t InputBufferLength;
+			ULONG IoControlCode;
+			PVOID Type3InputBuffer;
+		} DeviceIoControl;
+	} Parameters;
+
+} WDF_REQUEST_PARAMETERS, *PWDF_REQUEST_PARAMETERS;
+
+FORCEINLINE VOID WDF_REQUEST_PARAMETERS_INIT(PWDF_REQUEST_PARAMETERS Parameters)
+{
+	RtlZeroMemory(Parameters, sizeof(*Parameters));
+	Parameters->Size = sizeof(*Parameters);
+}
+
+typedef struct _WDF_REQUEST_COMPLETION_PARAMS
+{
+	ULONG Size;
+	WDF_REQUEST_TYPE Type;
+	IO_STATUS_BLOCK IoStatus;
+	union
+	{
+		struct
+		{
+			WDFMEMORY Buffer;
+			size_t Length;
+			size_t Offset;
+		} Write;
+		struct
+		{
+			WDFMEMORY Buffer;
+			size_t Length;
+			size_t Offset;
+		} Read;
+		struct
+		{
+			ULONG IoControlCode;
+			struct
+			{
+				WDFMEMORY Buffer;
+				size_t Offset;
+			} Input;
+			struct
+			{
+				WDFMEMORY Buffer;
+				size_t Offset;
+				size_t Length;
+			} Output;
+		} Ioctl;
+	} Parameters;
+
+} WDF_REQUEST_COMPLETION_PARAMS, *PWDF_REQUEST_COMPLETION_PARAMS;
+
+typedef VOID EVT_WDF_REQUEST_COMPLETION_ROUTINE(WDFREQUEST Request, WDFIOTARGET Target, PWDF_REQUEST_COMPLETION_PARAMS Params,
+	WDFCONTEXT Context);
+typedef EVT_WDF_REQUEST_COMPLETION_ROUTINE *PFN_WDF_REQUEST_COMPLETION_ROUTINE;
+
+#define WDF_REQUEST_SEND_OPTION_TIMEOUT				0x00000001
+#define WDF_REQUEST_SEND_OPTION_SYNCHRONOUS			0x00000002
+#define WDF_REQUEST_SEND_OPTION_IGNORE_TARGET_STATE	0x00000004
+#define WDF_REQUEST_SEND_OPTION_SEND_AND_FORGET		0x00000008
+
+typedef struct _WDF_REQUEST_SEND_OPTIONS
+{
+	ULONG Size;
+	ULONG Flags;
+	LONGLONG Timeout;
+
+} WDF_REQUEST_SEND_OPTIONS, *PWDF_REQUEST_SEND_OPTIONS;
+
+FORCEINLINE VOID WDF_REQUEST_SEND_OPTIONS_INIT(PWDF_REQUEST_SEND_OPTIONS Options, ULONG Flags)
+{
+	RtlZeroMemory(Options, sizeof(*Options));
+	Options->Size = sizeof(*Options);
+	Options->Flags = Flags;
+}
+
+typedef VOID EVT_WDF_IO_QUEUE_IO_DEFAULT(WDFQUEUE Queue, WDFREQUEST Request);
+typedef EVT_WDF_IO_QUEUE_IO_DEFAULT *PFN_WDF_IO_QUEUE_IO_DEFAULT;
+typedef VOID EVT_WDF_IO_QUEUE_IO_READ(WDFQUEUE Queue, WDFREQUEST Request, size_t Length);
+typedef EVT_WDF_IO_QUEUE_IO_READ *PFN_WDF_IO_QUEUE_IO_READ;
+typedef VOID EVT_WDF_IO_QUEUE_IO_WRITE(WDFQUEUE Queue, WDFREQUEST Request, size_t Length);
+typedef EVT_WDF_IO_QUEUE_IO_WRITE *PFN_WDF_IO_QUEUE_IO_WRITE;
+typedef VOID EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL(WDFQUEUE Queue, WDFREQUEST Request, size_t OutputBufferLength,
+	size_t InputBufferLength, ULONG IoControlCode);
+typedef EVT_WDF_IO_QUEUE_IO_DEVICE_CONTROL *PFN_WDF_IO_QUEUE_IO_DEVICE_CONTROL;
+typedef VOID EVT_WDF_IO_QUEUE_IO_STOP(WDFQUEUE Queue, WDFREQUEST Request, ULONG ActionFlags);
+typedef EVT_WDF_IO_QUEUE_IO_STOP *PFN_WDF_IO_QUEUE_IO_STOP;
+
+typedef ULONG WDF_REQUEST_STOP_ACTION_FLAGS;
+
+typedef enum _WDF_IO_QUEUE_DISPATCH_TYPE
+{
+	WdfIoQueueDispatchInvalid,
+	WdfIoQueueDispatchSequential,
+	WdfIoQueueDispatchParallel,
+	WdfIoQueueDispatchManual,
+
+} WDF_IO_QUEUE_DISPATCH_TYPE;
+
+typedef struct _WDF_IO_QUEUE_CONFIG
+{
+	ULONG Size;
+	WDF_IO_QUEUE_DISPATCH_TYPE DispatchType;
+	WDF_TRI_STATE PowerManaged;
+	BOOLEAN AllowZeroLengthRequests;
+	BOOLEAN DefaultQueue;
+	PFN_WDF_IO_QUEUE_IO_DEFAULT EvtIoDefault;
+	PFN_WDF_IO_QUEUE_IO_READ EvtIoRead;
+	PFN_WDF_IO_QUEUE_IO_WRITE EvtIoWrite;
+	PFN_WDF_IO_QUEUE_IO_DEVICE_CONTROL EvtIoDeviceControl;
+	PFN_WDF_IO_QUEUE_IO_DEVICE_CONTROL EvtIoInternalDeviceControl;
+	PFN_WDF_IO_QUEUE_IO_STOP EvtIoStop;
+
+} WDF_IO_QUEUE_CONFIG, *PWDF_IO_QUEUE_CONFIG;
+
+FORCEINLINE VOID WDF_IO_QUEUE_CONFIG_INIT(PWDF_IO_QUEUE_CONFIG Config, WDF_IO_QUEUE_DISPATCH_TYPE DispatchType)
+{
+	RtlZeroMemory(Config, sizeof(*Config));
+	Config->Size = sizeof(*Config);
+	Config->PowerManaged = WdfUseDefault;
+	Config->DispatchType = DispatchType;
+}
+
+FORCEINLINE VOID WDF_IO_QUEUE_CONFIG_INIT_DEFAULT_QUEUE(PWDF_IO_QUEUE_CONFIG Config, WDF_IO_QUEUE_DISPATCH_TYPE DispatchType)
+{
+	WDF_IO_QUEUE_CONFIG_INIT(Config, DispatchType);
+	Config->DefaultQueue = TRUE;
+}
+
+NTSTATUS WdfIoQueueCreate(WDFDEVICE Device, PWDF_IO_QUEUE_CONFIG Config, PWDF_OBJECT_ATTRIBUTES QueueAttributes, WDFQUEUE *Queue);
+WDFDEVICE WdfIoQueueGetDevice(WDFQUEUE Queue);
+NTSTATUS WdfIoQueueRetrieveNextRequest(WDFQUEUE Queue, WDFREQUEST *OutRequest);
+NTSTATUS WdfIoQueueFindRequest(WDFQUEUE Queue, WDFREQUEST FoundRequest, WDFFILEOBJECT FileObject,
+	PWDF_REQUEST_PARAMETERS Parameters, WDFREQUEST *OutRequest);
+NTSTATUS WdfIoQueueRetrieveFoundRequest(WDFQUEUE Queue, WDFREQUEST FoundRequest, WDFREQUEST *OutRequest);
+VOID WdfIoQueuePurgeSynchronously(WDFQUEUE Queue);
+
+VOID WdfRequestGetParameters(WDFREQUEST Request, PWDF_REQUEST_PARAMETERS Parameters);
+WDFFILEOBJECT WdfRequestGetFileObject(WDFREQUEST Request);
+KPROCESSOR_MODE WdfRequestGetRequestorMode(WDFREQUEST Request);
+PIRP WdfRequestWdmGetIrp(WDFREQUEST Request);
+NTSTATUS WdfRequestRetrieveInputBuffer(WDFREQUEST Request, size_t MinimumRequiredLength, PVOID Buffer, size_t *Length);
+NTSTATUS WdfRequestRetrieveOutputBuffer(WDFREQUEST Request, size_t MinimumRequiredSize, PVOID Buffer, size_t *Length);
+NTSTATUS WdfRequestRetrieveInputMemory(WDFREQUEST Request, WDFMEMORY *Memory);
+NTSTATUS WdfRequestRetrieveOutputMemory(WDFREQUEST Request, WDFMEMORY *Memory);
+NTSTATUS WdfRequestForwardToIoQueue(WDFREQUEST Request, WDFQUEUE DestinationQueue);
+NTSTATUS WdfRequestRequeue(WDFREQUEST Request);
+VOID WdfRequestFormatRequestUsingCurrentType(WDFREQUEST Request);
+VOID WdfRequestSetCompletionRoutine(WDFREQUEST Request, PFN_WDF_REQUEST_COMPLETION_ROUTINE CompletionRoutine,
+	WDFCONTEXT CompletionContext);
+BOOLEAN WdfRequestSend(WDFREQUEST Request, WDFIOTARGET Target, PWDF_REQUEST_SEND_OPTIONS Options);
+NTSTATUS WdfRequestGetStatus(WDFREQUEST Request);
+VOID WdfRequestComplete(WDFREQUEST Request, NTSTATUS Status);
+VOID WdfRequestCompleteWithInformation(WDFREQUEST Request, NTSTATUS Status, ULONG_PTR Information);
@@ -0,0 +1,19 @@
+/*++
+
+Module Name:
+
+    wdfstatus.h
+
+Abstract:
+
+    The definitions the driver takes from this header are in wdf.h.
+
+Environment:
+
+    User mode
+
+--*/
+
+#pragma once
+
+#include "wdf.h"